@@ -19,6 +19,7 @@
 
 #include <cassert>
 #include <cmath>
+#include <stdint.h>
 
 #if defined (FFTCONVOLVER_USE_SSE)
   #include <xmmintrin.h>
@@ -98,9 +99,28 @@ bool FFTConvolver::init(size_t blockSize, const Sample* ir, size_t irLen)
     return true;
   }
   
-  _blockSize = NextPowerOf2(blockSize);
+  blockSize = NextPowerOf2(blockSize);
+  prepare(blockSize, static_cast<size_t>(::ceil(static_cast<float>(irLen) / static_cast<float>(blockSize))));
+
+  // Prepare IR
+  for (size_t i=0; i<_segCount; ++i)
+  {
+    SplitComplex* segment = _segmentsIR[i];
+    const size_t remaining = irLen - (i * _blockSize);
+    const size_t sizeCopy = (remaining >= _blockSize) ? _blockSize : remaining;
+    CopyAndPad(_fftBuffer, &ir[i*_blockSize], sizeCopy);
+    _fft.fft(_fftBuffer.data(), segment->re(), segment->im());
+  }
+  
+  return true;
+}
+
+
+void FFTConvolver::prepare(size_t blockSize, size_t segCount)
+{
+  _blockSize = blockSize;
   _segSize = 2 * _blockSize;
-  _segCount = static_cast<size_t>(::ceil(static_cast<float>(irLen) / static_cast<float>(_blockSize)));
+  _segCount = segCount;
   _fftComplexSize = audiofft::AudioFFT::ComplexSize(_segSize);
   
   // FFT
@@ -111,17 +131,7 @@ bool FFTConvolver::init(size_t blockSize, const Sample* ir, size_t irLen)
   for (size_t i=0; i<_segCount; ++i)
   {
     _segments.push_back(new SplitComplex(_fftComplexSize));    
-  }
-  
-  // Prepare IR
-  for (size_t i=0; i<_segCount; ++i)
-  {
-    SplitComplex* segment = new SplitComplex(_fftComplexSize);
-    const size_t remaining = irLen - (i * _blockSize);
-    const size_t sizeCopy = (remaining >= _blockSize) ? _blockSize : remaining;
-    CopyAndPad(_fftBuffer, &ir[i*_blockSize], sizeCopy);
-    _fft.fft(_fftBuffer.data(), segment->re(), segment->im());
-    _segmentsIR.push_back(segment);
+    _segmentsIR.push_back(new SplitComplex(_fftComplexSize));
   }
   
   // Prepare convolution buffers  
@@ -135,8 +145,68 @@ bool FFTConvolver::init(size_t blockSize, const Sample* ir, size_t irLen)
 
   // Reset current position
   _current = 0;
-  
-  return true;
+}
+
+
+// The saved form is the block size and the segment count, as 64-bit numbers,
+// followed by the real and then the imaginary parts of each IR segment's spectrum.
+size_t FFTConvolver::saveIr(unsigned char* dest) const
+{
+  const uint64_t header[2] = { _blockSize, _segCount };
+  const size_t segmentBytes = _fftComplexSize * sizeof(Sample);
+  const size_t len = sizeof(header) + 2 * _segCount * segmentBytes;
+  if (dest)
+  {
+    ::memcpy(dest, header, sizeof(header));
+    dest += sizeof(header);
+    for (size_t i=0; i<_segCount; ++i)
+    {
+      ::memcpy(dest, _segmentsIR[i]->re(), segmentBytes);
+      dest += segmentBytes;
+      ::memcpy(dest, _segmentsIR[i]->im(), segmentBytes);
+      dest += segmentBytes;
+    }
+  }
+  return len;
+}
+
+
+size_t FFTConvolver::loadIr(const unsigned char* src, size_t len)
+{
+  reset();
+
+  uint64_t header[2];
+  if (len < sizeof(header))
+  {
+    return 0;
+  }
+  ::memcpy(header, src, sizeof(header));
+  const size_t blockSize = static_cast<size_t>(header[0]);
+  const size_t segCount = static_cast<size_t>(header[1]);
+  if (segCount == 0)
+  {
+    return sizeof(header);
+  }
+  if (blockSize == 0 || blockSize != NextPowerOf2(blockSize) || blockSize > (1 << 24))
+  {
+    return 0;
+  }
+  const size_t segmentBytes = audiofft::AudioFFT::ComplexSize(2 * blockSize) * sizeof(Sample);
+  if (segCount > (len - sizeof(header)) / (2 * segmentBytes))
+  {
+    return 0;
+  }
+
+  prepare(blockSize, segCount);
+  src += sizeof(header);
+  for (size_t i=0; i<_segCount; ++i)
+  {
+    ::memcpy(_segmentsIR[i]->re(), src, segmentBytes);
+    src += segmentBytes;
+    ::memcpy(_segmentsIR[i]->im(), src, segmentBytes);
+    src += segmentBytes;
+  }
+  return sizeof(header) + 2 * _segCount * segmentBytes;
 }
 
 
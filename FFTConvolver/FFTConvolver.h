@@ -73,8 +73,25 @@ public:
   * @brief Resets the convolver and discards the set impulse response
   */
   void reset();
-  
+
+  /**
+  * @brief Saves the partitioned impulse response spectrum, so that it can be restored without FFTs
+  * @param dest Where to save it, or NULL to just find out how many bytes are needed
+  * @return The number of bytes needed
+  */
+  size_t saveIr(unsigned char* dest) const;
+
+  /**
+  * @brief Initializes the convolver from an impulse response spectrum saved by saveIr()
+  * @param src The saved impulse response spectrum
+  * @param len The number of bytes available at src
+  * @return The number of bytes used, or 0 if the data is not valid
+  */
+  size_t loadIr(const unsigned char* src, size_t len);
+
 private:
+  void prepare(size_t blockSize, size_t segCount);
+
   size_t _blockSize;
   size_t _segSize;
   size_t _segCount;
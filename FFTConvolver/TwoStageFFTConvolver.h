@@ -0,0 +1,140 @@
+// ==================================================================================
+// Copyright (c) 2012 HiFi-LoFi
+//
+// This is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// ==================================================================================
+
+#ifndef _FFTCONVOLVER_TWOSTAGEFFTCONVOLVER_H
+#define _FFTCONVOLVER_TWOSTAGEFFTCONVOLVER_H
+
+#include "FFTConvolver.h"
+#include "Utilities.h"
+
+
+namespace fftconvolver
+{
+
+/**
+* @class TwoStageFFTConvolver
+* @brief FFT convolver using two different block sizes
+*
+* The 2-stage convolver consists internally of 3 convolvers:
+*
+* - Head convolver: Processes the first segment of the impulse response
+*   (as long as the tail block size) with the head block size, so the
+*   latency is that of the head block size.
+*
+* - Tail convolver 0: Processes the second segment of the impulse response
+*   (again as long as the tail block size) with the head block size.
+*
+* - Tail convolver: Processes the rest of the impulse response with the
+*   large tail block size. Its result is only needed one tail block later,
+*   so it is computed once per tail block and may run in a background
+*   thread, see startBackgroundProcessing() and waitForBackgroundProcessing().
+*
+* Because the expensive large FFTs are done once per tail block instead of
+* once per call, the cost of long impulse responses is far lower than with
+* a uniformly partitioned FFTConvolver using the small block size.
+*/
+class TwoStageFFTConvolver
+{
+public:
+  TwoStageFFTConvolver();
+  virtual ~TwoStageFFTConvolver();
+
+  /**
+  * @brief Initialization the convolver
+  * @param headBlockSize The head block size
+  * @param tailBlockSize the tail block size
+  * @param ir The impulse response
+  * @param irLen Length of the impulse response in samples
+  * @return true: Success - false: Failed
+  */
+  bool init(size_t headBlockSize, size_t tailBlockSize, const Sample* ir, size_t irLen);
+
+  /**
+  * @brief Convolves the the given input samples and immediately outputs the result
+  * @param input The input samples
+  * @param output The convolution result
+  * @param len Number of input/output samples
+  */
+  void process(const Sample* input, Sample* output, size_t len);
+
+  /**
+  * @brief Resets the convolver and discards the set impulse response
+  */
+  void reset();
+
+  /**
+  * @brief Saves the partitioned impulse response spectra, so that they can be restored without FFTs
+  * @param dest Where to save them, or NULL to just find out how many bytes are needed
+  * @return The number of bytes needed
+  */
+  size_t saveIr(unsigned char* dest) const;
+
+  /**
+  * @brief Initializes the convolver from impulse response spectra saved by saveIr()
+  * @param src The saved impulse response spectra
+  * @param len The number of bytes available at src
+  * @return The number of bytes used, or 0 if the data is not valid
+  */
+  size_t loadIr(const unsigned char* src, size_t len);
+
+protected:
+  /**
+  * @brief Method called by the convolver if work for background processing is available
+  *
+  * The default implementation just calls doBackgroundProcessing() to perform the "bulk"
+  * convolution. However, if you want to do background processing in a separate thread
+  * you should override this method and call doBackgroundProcessing() in this thread.
+  */
+  virtual void startBackgroundProcessing();
+
+  /**
+  * @brief Called by the convolver if it expects the result of its previous call to startBackgroundProcessing()
+  *
+  * After returning from this method, all background processing has to be completed.
+  */
+  virtual void waitForBackgroundProcessing();
+
+  /**
+  * @brief Actually performs the background processing work
+  */
+  void doBackgroundProcessing();
+
+private:
+  void prepare(bool hasTail0, bool hasTail);
+
+  size_t _headBlockSize;
+  size_t _tailBlockSize;
+  FFTConvolver _headConvolver;
+  FFTConvolver _tailConvolver0;
+  SampleBuffer _tailOutput0;
+  SampleBuffer _tailPrecalculated0;
+  FFTConvolver _tailConvolver;
+  SampleBuffer _tailOutput;
+  SampleBuffer _tailPrecalculated;
+  SampleBuffer _tailInput;
+  size_t _tailInputFill;
+  size_t _precalculatedPos;
+  SampleBuffer _backgroundProcessingInput;
+
+  // Prevent uncontrolled usage
+  TwoStageFFTConvolver(const TwoStageFFTConvolver&);
+  TwoStageFFTConvolver& operator=(const TwoStageFFTConvolver&);
+};
+
+} // End of namespace fftconvolver
+
+#endif // Header guard
@@ -31,6 +31,26 @@ bool SSEEnabled()
 }
 
 
+bool AVXEnabled()
+{
+#if defined(FFTCONVOLVER_USE_AVX)
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+bool NEONEnabled()
+{
+#if defined(FFTCONVOLVER_USE_NEON)
+  return true;
+#else
+  return false;
+#endif
+}
+
+
 void Sum(Sample* FFTCONVOLVER_RESTRICT result,
          const Sample* FFTCONVOLVER_RESTRICT a,
          const Sample* FFTCONVOLVER_RESTRICT b,
@@ -67,7 +87,58 @@ void ComplexMultiplyAccumulate(Sample* FFTCONVOLVER_RESTRICT re,
                                const Sample* FFTCONVOLVER_RESTRICT imB,
                                const size_t len)
 {
-#if defined(FFTCONVOLVER_USE_SSE)
+#if defined(FFTCONVOLVER_USE_AVX)
+  const size_t end8 = 8 * (len / 8);
+  for (size_t i=0; i<end8; i+=8)
+  {
+    const __m256 ra = _mm256_load_ps(&reA[i]);
+    const __m256 rb = _mm256_load_ps(&reB[i]);
+    const __m256 ia = _mm256_load_ps(&imA[i]);
+    const __m256 ib = _mm256_load_ps(&imB[i]);
+    __m256 real = _mm256_load_ps(&re[i]);
+    __m256 imag = _mm256_load_ps(&im[i]);
+#if defined(__FMA__)
+    real = _mm256_fmadd_ps(ra, rb, real);
+    real = _mm256_fnmadd_ps(ia, ib, real);
+    imag = _mm256_fmadd_ps(ra, ib, imag);
+    imag = _mm256_fmadd_ps(ia, rb, imag);
+#else
+    real = _mm256_add_ps(real, _mm256_mul_ps(ra, rb));
+    real = _mm256_sub_ps(real, _mm256_mul_ps(ia, ib));
+    imag = _mm256_add_ps(imag, _mm256_mul_ps(ra, ib));
+    imag = _mm256_add_ps(imag, _mm256_mul_ps(ia, rb));
+#endif
+    _mm256_store_ps(&re[i], real);
+    _mm256_store_ps(&im[i], imag);
+  }
+  for (size_t i=end8; i<len; ++i)
+  {
+    re[i] += reA[i] * reB[i] - imA[i] * imB[i];
+    im[i] += reA[i] * imB[i] + imA[i] * reB[i];
+  }
+#elif defined(FFTCONVOLVER_USE_NEON)
+  const size_t end4 = 4 * (len / 4);
+  for (size_t i=0; i<end4; i+=4)
+  {
+    const float32x4_t ra = vld1q_f32(&reA[i]);
+    const float32x4_t rb = vld1q_f32(&reB[i]);
+    const float32x4_t ia = vld1q_f32(&imA[i]);
+    const float32x4_t ib = vld1q_f32(&imB[i]);
+    float32x4_t real = vld1q_f32(&re[i]);
+    float32x4_t imag = vld1q_f32(&im[i]);
+    real = vmlaq_f32(real, ra, rb);
+    real = vmlsq_f32(real, ia, ib);
+    imag = vmlaq_f32(imag, ra, ib);
+    imag = vmlaq_f32(imag, ia, rb);
+    vst1q_f32(&re[i], real);
+    vst1q_f32(&im[i], imag);
+  }
+  for (size_t i=end4; i<len; ++i)
+  {
+    re[i] += reA[i] * reB[i] - imA[i] * imB[i];
+    im[i] += reA[i] * imB[i] + imA[i] * reB[i];
+  }
+#elif defined(FFTCONVOLVER_USE_SSE)
   const size_t end4 = 4 * (len / 4);
   for (size_t i=0; i<end4; i+=4)
   {
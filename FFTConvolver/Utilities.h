@@ -35,8 +35,31 @@ namespace fftconvolver
 #endif
 
 
-#if defined (FFTCONVOLVER_USE_SSE)
+#if defined(__AVX__)
+  #if defined(FFTCONVOLVER_USE_SSE) && !defined(FFTCONVOLVER_USE_AVX) && !defined(FFTCONVOLVER_DONT_USE_AVX)
+    #define FFTCONVOLVER_USE_AVX
+  #endif
+#endif
+
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #if !defined(FFTCONVOLVER_USE_NEON) && !defined(FFTCONVOLVER_DONT_USE_NEON)
+    #define FFTCONVOLVER_USE_NEON
+  #endif
+#endif
+
+
+#if defined (FFTCONVOLVER_USE_AVX)
+  #include <immintrin.h>
+  #define FFTCONVOLVER_ALIGNMENT 32
+#elif defined (FFTCONVOLVER_USE_SSE)
   #include <xmmintrin.h>
+  #define FFTCONVOLVER_ALIGNMENT 16
+#endif
+
+
+#if defined (FFTCONVOLVER_USE_NEON)
+  #include <arm_neon.h>
 #endif
 
 
@@ -54,9 +77,23 @@ namespace fftconvolver
 bool SSEEnabled();
 
 
+/**
+* @brief Returns whether AVX optimization for the convolver is enabled
+* @return true: Enabled - false: Disabled
+*/
+bool AVXEnabled();
+
+
+/**
+* @brief Returns whether NEON optimization for the convolver is enabled
+* @return true: Enabled - false: Disabled
+*/
+bool NEONEnabled();
+
+
 /**
 * @class Buffer
-* @brief Simple buffer implementation (uses 16-byte alignment if SSE optimization is enabled)
+* @brief Simple buffer implementation (uses 16-byte alignment if SSE optimization is enabled, 32-byte with AVX)
 */
 template<typename T>
 class Buffer
@@ -154,7 +191,7 @@ private:
   T* allocate(size_t size)
   {
 #if defined(FFTCONVOLVER_USE_SSE)
-    return static_cast<T*>(_mm_malloc(size * sizeof(T), 16));
+    return static_cast<T*>(_mm_malloc(size * sizeof(T), FFTCONVOLVER_ALIGNMENT));
 #else
     return new T[size];
 #endif
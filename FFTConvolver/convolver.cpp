@@ -1,67 +1,754 @@
-
-
 #include "convolver.h"
 #include <sndfile.h>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "FFTConvolver.h"
+#include "TwoStageFFTConvolver.h"
 #include "Utilities.h"
 extern "C" {
 #include "../common.h"
 }
 
+#ifdef HAVE_LIBSSL
+#include <openssl/md5.h>
+#endif
+
+#ifdef HAVE_LIBMBEDTLS
+#include <mbedtls/md5.h>
+#endif
+
+#ifdef HAVE_LIBPOLARSSL
+#include <polarssl/md5.h>
+#endif
+
+#ifdef HAVE_LIBSOXR
+#include <soxr.h>
+#endif
+
+
+// the rate of the audio reaching the convolver, i.e. the output rate -- impulse responses at other
+// rates are resampled to it
+static int convolver_rate = 44100;
+
+// the uniform engine's partition size -- rounded up to 512 samples internally
+static const size_t uniform_block_size = 352;
+
+// the two-stage engine's partition sizes
+static const size_t head_block_size = 256;
+static const size_t tail_block_size = 4096;
+
+// below this length, the uniform engine is cheaper -- the cost of the two-stage engine's head
+// partitions outweighs what its tail partitions save
+static const size_t two_stage_min_length = 49152;
+
+// the number of packets over which the cost of convolution is averaged for the log
+static const int timing_report_interval = 1000;
 
-static fftconvolver::FFTConvolver convolver_l;
-static fftconvolver::FFTConvolver convolver_r;
+// identifies a file of impulse response spectra -- change it when the layout changes
+static const char ir_cache_magic[8] = "SPSIRC1";
 
 
-void convolver_init(const char* filename, int max_length)
+// A two-stage convolver that computes its tail in a thread of its own, so that the large tail FFTs
+// don't land on the packet that happens to complete a tail block.
+// The thread is started when it's first needed rather than at initialisation.
+class ThreadedTwoStageFFTConvolver : public fftconvolver::TwoStageFFTConvolver
 {
-  SF_INFO info;
-  assert(filename);
-  SNDFILE* file = sf_open(filename, SFM_READ, &info);
-  assert(file);
-  
-  if (info.samplerate != 44100)
-    die("Impulse file \"%s\" sample rate is %d Hz. Only 44100 Hz is supported", filename, info.samplerate);
-  
-  if (info.channels != 1 && info.channels != 2)
-    die("Impulse file \"%s\" contains %d channels. Only 1 or 2 is supported.", filename, info.channels);
-  
-  const size_t size = info.frames > max_length ? max_length : info.frames;
-  float buffer[size*info.channels];
-  
-  size_t l = sf_readf_float(file, buffer, size);
-  assert(l == size);
-  
-  if (info.channels == 1) {
-    convolver_l.init(352, buffer, size);
-    convolver_r.init(352, buffer, size);
+public:
+  ThreadedTwoStageFFTConvolver() :
+    _thread(),
+    _mutex(),
+    _condition(),
+    _pending(false),
+    _stopping(false),
+    _backgroundTime(0)
+  {
+  }
+
+  virtual ~ThreadedTwoStageFFTConvolver()
+  {
+    if (_thread.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+      }
+      _condition.notify_all();
+      _thread.join();
+    }
+  }
+
+  // the time spent in the background thread since the last call, in 32.32 fixed point seconds
+  uint64_t takeBackgroundTime()
+  {
+    return _backgroundTime.exchange(0);
+  }
+
+protected:
+  virtual void startBackgroundProcessing()
+  {
+    if (!_thread.joinable())
+      _thread = std::thread(&ThreadedTwoStageFFTConvolver::run, this);
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _pending = true;
+    }
+    _condition.notify_all();
+  }
+
+  virtual void waitForBackgroundProcessing()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _condition.wait(lock, [this] { return !_pending; });
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+      _condition.wait(lock, [this] { return _pending || _stopping; });
+      if (_stopping)
+        break;
+      lock.unlock();
+      uint64_t time_before = get_absolute_time_in_fp();
+      doBackgroundProcessing();
+      _backgroundTime += get_absolute_time_in_fp() - time_before;
+      lock.lock();
+      _pending = false;
+      _condition.notify_all();
+    }
+  }
+
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  bool _pending;
+  bool _stopping;
+  std::atomic<uint64_t> _backgroundTime;
+};
+
+
+// One path through the convolver, from an input channel to an output channel
+struct convolver_path
+{
+  fftconvolver::FFTConvolver uniform;
+  ThreadedTwoStageFFTConvolver two_stage;
+  fftconvolver::SampleBuffer samples;
+};
+
+// A loaded impulse response. A mono or stereo IR has two paths, L->L and R->R.
+// A true stereo IR has four, L->L, L->R, R->L and R->R, in the order of its channels.
+struct convolver_set
+{
+  int path_count;
+  int two_stage;
+  size_t ir_length;
+  convolver_path paths[4];
+};
+
+
+// the parameters the impulse response is loaded with, kept for reloading it
+static std::string ir_filename;
+static std::string ir_cache_directory;
+static int ir_max_length;
+static int ir_engine;
+static float ir_gain_db;
+static time_t ir_mtime;
+static off_t ir_size;
+
+// the set in use, only touched by the player thread once initialised
+static convolver_set* current_set = NULL;
+// a newly-loaded set being switched in. It's run alongside the current set until it has taken in
+// as much input as its impulse response is long, so that its output has its full tail by the time
+// it's crossfaded in. It stays here until the switch is complete.
+static std::atomic<convolver_set*> pending_set(NULL);
+// the number of frames the pending set has taken in
+static size_t pending_frames = 0;
+// a set which has been switched out, waiting to be deleted off the player thread
+static std::atomic<convolver_set*> retired_set(NULL);
+// the input, kept while switching sets
+static fftconvolver::SampleBuffer crossfade_buffer;
+
+static int use_parallel_channels = 0;
+
+static uint64_t process_time = 0;
+static uint64_t max_packet_time = 0;
+static int packets_timed = 0;
+
+
+static void convolver_path_process(const convolver_set* set, convolver_path* path, size_t frames)
+{
+  if (set->two_stage)
+    path->two_stage.process(path->samples.data(), path->samples.data(), frames);
+  else
+    path->uniform.process(path->samples.data(), path->samples.data(), frames);
+}
+
+// convolve the paths which feed one output channel, leaving the result in that channel's path
+static void convolver_set_process_output(convolver_set* set, int output, size_t frames)
+{
+  convolver_path_process(set, &set->paths[output], frames);
+  if (set->path_count == 4) {
+    convolver_path_process(set, &set->paths[output + 2], frames);
+    fftconvolver::Sum(set->paths[output].samples.data(), set->paths[output].samples.data(),
+                      set->paths[output + 2].samples.data(), frames);
+  }
+}
+
+
+// Convolves the right channel on a thread of its own while the caller convolves the left.
+// As with the two-stage convolver's tail, the thread is started on first use.
+class ChannelWorker
+{
+public:
+  ChannelWorker() :
+    _thread(),
+    _mutex(),
+    _condition(),
+    _set(NULL),
+    _frames(0),
+    _pending(false),
+    _stopping(false)
+  {
+  }
+
+  ~ChannelWorker()
+  {
+    if (_thread.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+      }
+      _condition.notify_all();
+      _thread.join();
+    }
+  }
+
+  void start(convolver_set* set, size_t frames)
+  {
+    if (!_thread.joinable())
+      _thread = std::thread(&ChannelWorker::run, this);
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _set = set;
+      _frames = frames;
+      _pending = true;
+    }
+    _condition.notify_all();
+  }
+
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _condition.wait(lock, [this] { return !_pending; });
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+      _condition.wait(lock, [this] { return _pending || _stopping; });
+      if (_stopping)
+        break;
+      lock.unlock();
+      convolver_set_process_output(_set, 1, _frames);
+      lock.lock();
+      _pending = false;
+      _condition.notify_all();
+    }
+  }
+
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  convolver_set* _set;
+  size_t _frames;
+  bool _pending;
+  bool _stopping;
+};
+
+static ChannelWorker right_channel_worker;
+
+
+static void convolver_set_process(convolver_set* set, float* data, size_t frames)
+{
+  size_t i;
+  int p;
+  for (p=0; p<set->path_count; ++p)
+    if (set->paths[p].samples.size() < frames)
+      set->paths[p].samples.resize(frames);
+
+  // deinterleave, giving each path its input channel
+  for (p=0; p<set->path_count; ++p)
+  {
+    const int input = (set->path_count == 4) ? (p / 2) : p;
+    float* samples = set->paths[p].samples.data();
+    for (i=0; i<frames; ++i)
+      samples[i] = data[2*i+input];
+  }
+
+  if (use_parallel_channels) {
+    right_channel_worker.start(set, frames);
+    convolver_set_process_output(set, 0, frames);
+    right_channel_worker.wait();
   } else {
-    // deinterleave
-    float buffer_l[size];
-    float buffer_r[size];
-    
-    int i;
-    for (i=0; i<size; ++i)
+    convolver_set_process_output(set, 0, frames);
+    convolver_set_process_output(set, 1, frames);
+  }
+
+  // interleave
+  const float* left = set->paths[0].samples.data();
+  const float* right = set->paths[1].samples.data();
+  for (i=0; i<frames; ++i)
+  {
+    data[2*i+0] = left[i];
+    data[2*i+1] = right[i];
+  }
+}
+
+
+// the MD5 hash of the IR file and the parameters it's loaded with, as hex, for naming its cache file
+static std::string convolver_cache_key(const std::vector<unsigned char>& file_contents)
+{
+  const int params[] = { convolver_rate, ir_max_length, ir_engine, (int)uniform_block_size,
+                         (int)head_block_size, (int)tail_block_size, (int)two_stage_min_length };
+  unsigned char digest[16];
+
+#ifdef HAVE_LIBSSL
+  MD5_CTX ctx;
+  MD5_Init(&ctx);
+  MD5_Update(&ctx, file_contents.data(), file_contents.size());
+  MD5_Update(&ctx, params, sizeof(params));
+  MD5_Update(&ctx, &ir_gain_db, sizeof(ir_gain_db));
+  MD5_Update(&ctx, ir_cache_magic, sizeof(ir_cache_magic));
+  MD5_Final(digest, &ctx);
+#endif
+
+#ifdef HAVE_LIBMBEDTLS
+  mbedtls_md5_context tctx;
+  mbedtls_md5_starts(&tctx);
+  mbedtls_md5_update(&tctx, file_contents.data(), file_contents.size());
+  mbedtls_md5_update(&tctx, (const unsigned char*)params, sizeof(params));
+  mbedtls_md5_update(&tctx, (const unsigned char*)&ir_gain_db, sizeof(ir_gain_db));
+  mbedtls_md5_update(&tctx, (const unsigned char*)ir_cache_magic, sizeof(ir_cache_magic));
+  mbedtls_md5_finish(&tctx, digest);
+#endif
+
+#ifdef HAVE_LIBPOLARSSL
+  md5_context tctx;
+  md5_starts(&tctx);
+  md5_update(&tctx, file_contents.data(), file_contents.size());
+  md5_update(&tctx, (const unsigned char*)params, sizeof(params));
+  md5_update(&tctx, (const unsigned char*)&ir_gain_db, sizeof(ir_gain_db));
+  md5_update(&tctx, (const unsigned char*)ir_cache_magic, sizeof(ir_cache_magic));
+  md5_finish(&tctx, digest);
+#endif
+
+  char hex[33];
+  int i;
+  for (i=0; i<16; ++i)
+    snprintf(hex + 2*i, 3, "%02x", digest[i]);
+  return std::string(hex);
+}
+
+
+// The cache file holds the magic string, the path count, whether the engine is two-stage and the
+// IR length, followed by each path's saved convolver, preceded by its length in bytes.
+static convolver_set* convolver_cache_load(const std::string& cache_path)
+{
+  int fd = open(cache_path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat sb;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &sb) == 0 && sb.st_size > 0)
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  const unsigned char* p = static_cast<const unsigned char*>(map);
+  size_t remaining = sb.st_size;
+  convolver_set* set = new convolver_set();
+  uint32_t counts[2];
+  uint64_t length;
+  const size_t header_size = sizeof(ir_cache_magic) + sizeof(counts) + sizeof(length);
+  int ok = (remaining >= header_size) && (memcmp(p, ir_cache_magic, sizeof(ir_cache_magic)) == 0);
+  if (ok) {
+    memcpy(counts, p + sizeof(ir_cache_magic), sizeof(counts));
+    memcpy(&length, p + sizeof(ir_cache_magic) + sizeof(counts), sizeof(length));
+    p += header_size;
+    remaining -= header_size;
+    set->path_count = counts[0];
+    set->two_stage = counts[1];
+    set->ir_length = length;
+    ok = (set->path_count == 2 || set->path_count == 4);
+  }
+  int i;
+  for (i=0; ok && i<set->path_count; ++i)
+  {
+    uint64_t bytes;
+    ok = remaining >= sizeof(bytes);
+    if (ok) {
+      memcpy(&bytes, p, sizeof(bytes));
+      p += sizeof(bytes);
+      remaining -= sizeof(bytes);
+      ok = (bytes <= remaining) &&
+           ((set->two_stage ? set->paths[i].two_stage.loadIr(p, bytes) : set->paths[i].uniform.loadIr(p, bytes)) == bytes);
+      p += bytes;
+      remaining -= bytes;
+    }
+  }
+  munmap(map, sb.st_size);
+  if (!ok) {
+    debug(1, "Ignoring invalid impulse response cache file \"%s\".", cache_path.c_str());
+    delete set;
+    return NULL;
+  }
+  return set;
+}
+
+static void convolver_cache_save(const std::string& cache_path, const convolver_set* set)
+{
+  uint32_t counts[2] = { (uint32_t)set->path_count, (uint32_t)set->two_stage };
+  uint64_t length = set->ir_length;
+  size_t total = sizeof(ir_cache_magic) + sizeof(counts) + sizeof(length);
+  int i;
+  for (i=0; i<set->path_count; ++i)
+    total += sizeof(uint64_t) + (set->two_stage ? set->paths[i].two_stage.saveIr(NULL) : set->paths[i].uniform.saveIr(NULL));
+
+  std::vector<unsigned char> contents(total);
+  unsigned char* p = contents.data();
+  memcpy(p, ir_cache_magic, sizeof(ir_cache_magic));
+  p += sizeof(ir_cache_magic);
+  memcpy(p, counts, sizeof(counts));
+  p += sizeof(counts);
+  memcpy(p, &length, sizeof(length));
+  p += sizeof(length);
+  for (i=0; i<set->path_count; ++i)
+  {
+    uint64_t bytes = set->two_stage ? set->paths[i].two_stage.saveIr(p + sizeof(bytes)) : set->paths[i].uniform.saveIr(p + sizeof(bytes));
+    memcpy(p, &bytes, sizeof(bytes));
+    p += sizeof(bytes) + bytes;
+  }
+
+  // write to a temporary file and rename it, so a partly-written cache file is never read
+  std::string temp_path = cache_path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  int ok = (f != NULL) && (fwrite(contents.data(), 1, total, f) == total);
+  if (f)
+    ok = (fclose(f) == 0) && ok;
+  if (ok)
+    ok = (rename(temp_path.c_str(), cache_path.c_str()) == 0);
+  if (!ok) {
+    debug(1, "Could not save impulse response cache file \"%s\": \"%s\".", cache_path.c_str(), strerror(errno));
+    unlink(temp_path.c_str());
+  }
+}
+
+
+// resample interleaved impulse response channels, scaling them to keep the filter's gain
+static std::vector<float> convolver_resample(const std::vector<float>& in, size_t frames, int channels, int in_rate, size_t* out_frames)
+{
+  const double ratio = (double)convolver_rate / in_rate;
+  *out_frames = (size_t)ceil(frames * ratio);
+  std::vector<float> out(*out_frames * channels);
+  size_t n;
+
+#ifdef HAVE_LIBSOXR
+  soxr_quality_spec_t quality = soxr_quality_spec(SOXR_VHQ, 0);
+  size_t odone = 0;
+  soxr_error_t error = soxr_oneshot(in_rate, convolver_rate, channels, in.data(), frames, NULL,
+                                    out.data(), *out_frames, &odone, NULL, &quality, NULL);
+  if (error)
+    die("soxr error while resampling the impulse response: %s", soxr_strerror(error));
+  *out_frames = odone;
+#else
+  // windowed sinc interpolation, band-limited to the lower of the two rates
+  const double cutoff = ratio < 1.0 ? ratio : 1.0;
+  const int half_width = (int)ceil(32 / cutoff);
+  for (n=0; n<*out_frames; ++n)
+  {
+    const double t = n / ratio;
+    const long centre = (long)floor(t);
+    long k;
+    for (k=centre-half_width+1; k<=centre+half_width; ++k)
     {
-      buffer_l[i] = buffer[2*i+0];
-      buffer_r[i] = buffer[2*i+1];
+      if (k < 0 || k >= (long)frames)
+        continue;
+      const double x = t - k;
+      const double u = x / half_width;
+      if (u <= -1.0 || u >= 1.0)
+        continue;
+      const double window = 0.42 + 0.5 * cos(M_PI * u) + 0.08 * cos(2 * M_PI * u);
+      const double sinc = (x == 0.0) ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+      const float weight = cutoff * sinc * window;
+      int c;
+      for (c=0; c<channels; ++c)
+        out[n*channels+c] += in[k*channels+c] * weight;
+    }
+  }
+#endif
+
+  // a filter's gain is the sum of its taps, and resampling changes the number of taps
+  const float scale = 1.0 / ratio;
+  for (n=0; n<*out_frames * channels; ++n)
+    out[n] *= scale;
+  return out;
+}
+
+
+// load the impulse response file, from the cache if possible, reporting any problem with warn()
+static convolver_set* convolver_load(void)
+{
+  const char* filename = ir_filename.c_str();
+  std::string cache_path;
+  if (!ir_cache_directory.empty()) {
+    std::vector<unsigned char> contents;
+    FILE* f = fopen(filename, "rb");
+    if (f) {
+      unsigned char chunk[65536];
+      size_t l;
+      while ((l = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        contents.insert(contents.end(), chunk, chunk + l);
+      fclose(f);
+      cache_path = ir_cache_directory + "/" + convolver_cache_key(contents) + ".irc";
+      convolver_set* set = convolver_cache_load(cache_path);
+      if (set) {
+        debug(1, "IR initialized from the cache \"%s\" for \"%s\" with %d paths and %zu samples, using the %s convolution engine", cache_path.c_str(), filename, set->path_count, set->ir_length, set->two_stage ? "two-stage" : "uniform");
+        return set;
+      }
     }
-    
-    convolver_l.init(352, buffer_l, size);
-    convolver_r.init(352, buffer_r, size);
   }
-  
-  debug(1, "IR initialized from \"%s\" with %d channels and %d samples", filename, info.channels, size);
-  
+
+  SF_INFO info;
+  SNDFILE* file = sf_open(filename, SFM_READ, &info);
+  if (file == NULL) {
+    warn("Could not open impulse file \"%s\": %s", filename, sf_strerror(NULL));
+    return NULL;
+  }
+
+  if (info.channels != 1 && info.channels != 2 && info.channels != 4) {
+    warn("Impulse file \"%s\" contains %d channels. Only 1, 2 or 4 (true stereo) are supported.", filename, info.channels);
+    sf_close(file);
+    return NULL;
+  }
+
+  // read just enough to give the maximum length after resampling
+  const double ratio = (double)convolver_rate / info.samplerate;
+  size_t size = (size_t)ceil(ir_max_length / ratio) + 1;
+  if (size > (size_t)info.frames)
+    size = info.frames;
+  std::vector<float> buffer(size * info.channels);
+  size = sf_readf_float(file, buffer.data(), size);
   sf_close(file);
+
+  if (info.samplerate != convolver_rate) {
+    size_t resampled_size;
+    buffer = convolver_resample(buffer, size, info.channels, info.samplerate, &resampled_size);
+    size = resampled_size;
+  }
+  if (size > (size_t)ir_max_length)
+    size = ir_max_length;
+
+  // apply the gain to the impulse response, so it's part of every partition's spectrum and costs
+  // nothing at run time
+  const float gain = pow(10.0, ir_gain_db / 20.0);
+  size_t i;
+  for (i=0; i<size*info.channels; ++i)
+    buffer[i] *= gain;
+
+  convolver_set* set = new convolver_set();
+  set->path_count = (info.channels == 4) ? 4 : 2;
+  if (ir_engine == CE_auto)
+    set->two_stage = (size >= two_stage_min_length);
+  else
+    set->two_stage = (ir_engine == CE_two_stage);
+  set->ir_length = size;
+
+  std::vector<float> ir(size);
+  int p;
+  for (p=0; p<set->path_count; ++p)
+  {
+    // a mono impulse response is used for both paths
+    const int channel = (info.channels == 1) ? 0 : p;
+    for (i=0; i<size; ++i)
+      ir[i] = buffer[i*info.channels+channel];
+    if (set->two_stage)
+      set->paths[p].two_stage.init(head_block_size, tail_block_size, ir.data(), size);
+    else
+      set->paths[p].uniform.init(uniform_block_size, ir.data(), size);
+  }
+
+  debug(1, "IR initialized from \"%s\" with %d channels at %d Hz and %zu samples, using the %s convolution engine", filename, info.channels, info.samplerate, size, set->two_stage ? "two-stage" : "uniform");
+
+  if (!cache_path.empty())
+    convolver_cache_save(cache_path, set);
+  return set;
 }
 
-void convolver_process_l(float* data, int length)
+
+// Loads changed impulse responses in the background
+class IrLoader
+{
+public:
+  IrLoader() : _thread(), _done(false) {}
+
+  ~IrLoader()
+  {
+    if (_thread.joinable())
+      _thread.join();
+  }
+
+  // returns false if a load is still in progress
+  bool idle()
+  {
+    if (_thread.joinable()) {
+      if (!_done)
+        return false;
+      _thread.join();
+    }
+    return true;
+  }
+
+  void start()
+  {
+    _done = false;
+    _thread = std::thread([this] {
+      convolver_set* set = convolver_load();
+      if (set)
+        pending_set.store(set);
+      _done = true;
+    });
+  }
+
+private:
+  std::thread _thread;
+  std::atomic<bool> _done;
+};
+
+static IrLoader ir_loader;
+// reloads may be asked for by more than one RTSP conversation at once
+static std::mutex reload_mutex;
+
+
+void convolver_init(const char* filename, int rate, int max_length, int engine, float gain_db, int parallel, const char* cache_directory)
 {
-  convolver_l.process(data, data, length);
+  assert(filename);
+  convolver_rate = rate;
+  ir_filename = filename;
+  ir_cache_directory = cache_directory ? cache_directory : "";
+  ir_max_length = max_length;
+  ir_engine = engine;
+  ir_gain_db = gain_db;
+  use_parallel_channels = parallel;
+
+  if (!ir_cache_directory.empty() && mkdir(cache_directory, 0755) != 0 && errno != EEXIST) {
+    warn("Could not create the impulse response cache directory \"%s\": \"%s\". The cache will not be used.", cache_directory, strerror(errno));
+    ir_cache_directory.clear();
+  }
+
+  struct stat sb;
+  if (stat(filename, &sb) == 0) {
+    ir_mtime = sb.st_mtime;
+    ir_size = sb.st_size;
+  }
+
+  current_set = convolver_load();
+  if (current_set == NULL)
+    die("Could not load the impulse response from \"%s\".", filename);
+
+  debug(1, "Convolution will use %s arithmetic%s.", fftconvolver::AVXEnabled() ? "AVX" : fftconvolver::NEONEnabled() ? "NEON" : fftconvolver::SSEEnabled() ? "SSE" : "scalar", use_parallel_channels ? ", with both channels in parallel" : "");
+}
+
+void convolver_reload_if_changed(void)
+{
+  if (ir_filename.empty())
+    return;
+
+  std::lock_guard<std::mutex> lock(reload_mutex);
+  delete retired_set.exchange(NULL);
+
+  // wait until the last change has been loaded and switched in
+  if (!ir_loader.idle() || pending_set.load() != NULL)
+    return;
+
+  struct stat sb;
+  if (stat(ir_filename.c_str(), &sb) != 0 || (sb.st_mtime == ir_mtime && sb.st_size == ir_size))
+    return;
+  ir_mtime = sb.st_mtime;
+  ir_size = sb.st_size;
+  debug(1, "Impulse file \"%s\" has changed -- reloading it.", ir_filename.c_str());
+  ir_loader.start();
 }
 
-void convolver_process_r(float* data, int length)
+void convolver_process(float* data, int frames)
 {
-  convolver_r.process(data, data, length);
+  if (current_set == NULL)
+    return;
+
+  uint64_t time_before = get_absolute_time_in_fp();
+
+  convolver_set* next = pending_set.load();
+  if (next) {
+    // run the new impulse response alongside the current one, keeping the current one's output
+    if (crossfade_buffer.size() < 2 * (size_t)frames)
+      crossfade_buffer.resize(2 * frames);
+    float* faded_in = crossfade_buffer.data();
+    memcpy(faded_in, data, 2 * frames * sizeof(float));
+    convolver_set_process(next, faded_in, frames);
+    convolver_set_process(current_set, data, frames);
+    pending_frames += frames;
+    if (pending_frames >= next->ir_length) {
+      // the new one has heard enough to be complete -- switch to it, crossfading over this packet
+      // so there's no click
+      int i;
+      for (i=0; i<frames; ++i)
+      {
+        const float w = (i + 0.5f) / frames;
+        data[2*i+0] = data[2*i+0] * (1.0f - w) + faded_in[2*i+0] * w;
+        data[2*i+1] = data[2*i+1] * (1.0f - w) + faded_in[2*i+1] * w;
+      }
+      retired_set.store(current_set);
+      current_set = next;
+      pending_frames = 0;
+      pending_set.store(NULL);
+    }
+  } else {
+    convolver_set_process(current_set, data, frames);
+  }
+
+  uint64_t packet_time = get_absolute_time_in_fp() - time_before;
+  process_time += packet_time;
+  if (packet_time > max_packet_time)
+    max_packet_time = packet_time;
+  if (++packets_timed == timing_report_interval) {
+    uint64_t background_time = 0;
+    int p;
+    for (p=0; p<current_set->path_count; ++p)
+      background_time += current_set->paths[p].two_stage.takeBackgroundTime();
+    double to_us = 1000000.0 / ((uint64_t)1 << 32);
+    debug(2, "Convolution with the %s engine, %d paths and %zu samples of IR: %.1f us per packet on average, %.1f us at most, plus %.1f us per packet in the background.",
+          current_set->two_stage ? "two-stage" : "uniform", current_set->path_count, current_set->ir_length,
+          to_us * process_time / packets_timed, to_us * max_packet_time,
+          to_us * background_time / packets_timed);
+    process_time = 0;
+    max_packet_time = 0;
+    packets_timed = 0;
+  }
 }
@@ -5,9 +5,15 @@
 extern "C" {
 #endif
   
-void convolver_init(const char* file, int max_length);
-void convolver_process_l(float* data, int length);
-void convolver_process_r(float* data, int length);
+// the impulse response may have 1, 2 or 4 (true stereo) channels, at any sample rate -- it's
+// resampled to rate, the rate of the audio to be convolved
+// its partitioned spectra are cached in cache_directory, if it's not NULL
+void convolver_init(const char* file, int rate, int max_length, int engine, float gain_db, int parallel, const char* cache_directory);
+// load the impulse response file again in the background if it has changed -- it's switched in
+// by convolver_process()
+void convolver_reload_if_changed(void);
+// convolve interleaved stereo samples in place
+void convolver_process(float* data, int frames);
   
 #ifdef __cplusplus
 }
@@ -521,9 +521,10 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer, int32_t *buffe
   }
 }
 
-static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out,
-                           int numchannels, int numsamples, uint8_t interlacing_shift,
-                           uint8_t interlacing_leftweight) {
+// inlined, so that the usual stereo stream gets a copy of its own with a constant stride
+static inline __attribute__((always_inline)) void
+deinterlace_16(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out, int numchannels,
+               int numsamples, uint8_t interlacing_shift, uint8_t interlacing_leftweight) {
   int i;
   if (numsamples <= 0)
     return;
@@ -971,9 +972,14 @@ void alac_decode_frame(alac_file *alac, unsigned char *inbuffer, void *outbuffer
 
     switch (alac->setinfo_sample_size) {
     case 16: {
-      deinterlace_16(alac->outputsamples_buffer_a, alac->outputsamples_buffer_b,
-                     (int16_t *)outbuffer, alac->numchannels, outputsamples, interlacing_shift,
-                     interlacing_leftweight);
+      if (alac->numchannels == 2)
+        deinterlace_16(alac->outputsamples_buffer_a, alac->outputsamples_buffer_b,
+                       (int16_t *)outbuffer, 2, outputsamples, interlacing_shift,
+                       interlacing_leftweight);
+      else
+        deinterlace_16(alac->outputsamples_buffer_a, alac->outputsamples_buffer_b,
+                       (int16_t *)outbuffer, alac->numchannels, outputsamples, interlacing_shift,
+                       interlacing_leftweight);
       break;
     }
     case 24: {
@@ -1,3 +1,5 @@
+#include <new>
+#include <stdlib.h>
 #include <string.h>
 
 // these are headers for the ALAC decoder, utilities and endian utilities
@@ -13,46 +15,105 @@ typedef struct magicCookie {
   ALACAudioChannelLayout channelLayoutInfo; // seems to be unused
 } magicCookie;
 
-magicCookie cookie;
-ALACDecoder *theDecoder;
+struct apple_alac_decoder {
+  magicCookie cookie;
+  ALACDecoder *decoder;
+  uint32_t frame_length; // the number of frames in a packet, at most
+  uint32_t num_channels;
+  uint32_t bit_depth;
+  uint8_t *scratch; // the decoder's own output, for widening to 32 bits
+};
 
-extern "C" int apple_alac_init(int32_t fmtp[12]) {
-
-  memset(&cookie, 0, sizeof(magicCookie));
+extern "C" apple_alac_decoder *apple_alac_create(int32_t fmtp[12]) {
+  apple_alac_decoder *d = (apple_alac_decoder *)calloc(1, sizeof(apple_alac_decoder));
+  if (d == NULL)
+    return NULL;
 
   // create a magic cookie for the decoder from the fmtp information. It seems to be in the same
   // format as a simple magic cookie
 
-  cookie.config.frameLength = Swap32NtoB(352);
-  cookie.config.compatibleVersion = fmtp[2];         // should be zero, uint8_t
-  cookie.config.bitDepth = fmtp[3];                  // uint8_t expected to be 16
-  cookie.config.pb = fmtp[4];                        // uint8_t should be 40;
-  cookie.config.mb = fmtp[5];                        // uint8_t should be 10;
-  cookie.config.kb = fmtp[6];                        // uint8_t should be 14;
-  cookie.config.numChannels = fmtp[7];               // uint8_t expected to be 2
-  cookie.config.maxRun = Swap16NtoB(fmtp[8]);        // uint16_t expected to be 255
-  cookie.config.maxFrameBytes = Swap32NtoB(fmtp[9]); // uint32_t should be 0;
-  cookie.config.avgBitRate = Swap32NtoB(fmtp[10]);   // uint32_t should be 0;;
-  cookie.config.sampleRate = Swap32NtoB(fmtp[11]);   // uint32_t expected to be 44100;
-
-  theDecoder = new ALACDecoder;
-  theDecoder->Init(&cookie, sizeof(magicCookie));
+  d->cookie.config.frameLength = Swap32NtoB(fmtp[1]);  // uint32_t expected to be 352
+  d->cookie.config.compatibleVersion = fmtp[2];         // should be zero, uint8_t
+  d->cookie.config.bitDepth = fmtp[3];                  // uint8_t expected to be 16
+  d->cookie.config.pb = fmtp[4];                        // uint8_t should be 40;
+  d->cookie.config.mb = fmtp[5];                        // uint8_t should be 10;
+  d->cookie.config.kb = fmtp[6];                        // uint8_t should be 14;
+  d->cookie.config.numChannels = fmtp[7];               // uint8_t expected to be 2
+  d->cookie.config.maxRun = Swap16NtoB(fmtp[8]);        // uint16_t expected to be 255
+  d->cookie.config.maxFrameBytes = Swap32NtoB(fmtp[9]); // uint32_t should be 0;
+  d->cookie.config.avgBitRate = Swap32NtoB(fmtp[10]);   // uint32_t should be 0;;
+  d->cookie.config.sampleRate = Swap32NtoB(fmtp[11]);   // uint32_t expected to be 44100;
 
-  return 0;
+  d->frame_length = fmtp[1];
+  d->num_channels = fmtp[7];
+  d->bit_depth = fmtp[3];
+
+  // the decoder packs 20 bit samples into three bytes, as it does 24 bit ones
+  uint32_t bytes_per_sample = d->bit_depth == 20 ? 3 : (d->bit_depth + 7) / 8;
+  d->scratch = (uint8_t *)malloc(d->frame_length * d->num_channels * bytes_per_sample);
+  d->decoder = new (std::nothrow) ALACDecoder;
+  if ((d->scratch == NULL) || (d->decoder == NULL) ||
+      (d->decoder->Init(&d->cookie, sizeof(magicCookie)) != 0)) {
+    apple_alac_destroy(d);
+    return NULL;
+  }
+  return d;
+}
+
+extern "C" void apple_alac_destroy(apple_alac_decoder *d) {
+  if (d) {
+    delete d->decoder;
+    free(d->scratch);
+    free(d);
+  }
 }
 
-extern "C" int apple_alac_decode_frame(unsigned char *sampleBuffer, uint32_t bufferLength,
-                                       unsigned char *dest, int *outsize) {
+// read a sample packed into three bytes, in the host's byte order, as the decoder writes them
+static inline int32_t packed_24(const uint8_t *p) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8));
+#else
+  return (int32_t)(((uint32_t)p[2] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[0] << 8));
+#endif
+}
+
+extern "C" int apple_alac_decode_frame(apple_alac_decoder *d, unsigned char *sampleBuffer,
+                                       uint32_t bufferLength, void *dest, int *outsize,
+                                       enum apple_alac_output output) {
   uint32_t numFrames = 0;
   BitBuffer theInputBuffer;
   BitBufferInit(&theInputBuffer, sampleBuffer, bufferLength);
-  theDecoder->Decode(&theInputBuffer, dest, Swap32BtoN(cookie.config.frameLength),
-                     cookie.config.numChannels, &numFrames);
+
+  // 32 bit samples, and anything wanted in the decoder's own format, go straight to dest;
+  // otherwise they're widened from the decoder's output
+  uint8_t *decoded = (uint8_t *)dest;
+  if ((output == AAO_s32) && (d->bit_depth != 32))
+    decoded = d->scratch;
+  int32_t status =
+      d->decoder->Decode(&theInputBuffer, decoded, d->frame_length, d->num_channels, &numFrames);
   *outsize = numFrames;
-  return 0;
-}
+  if ((status != 0) || (decoded == dest))
+    return status;
 
-extern "C" int apple_alac_terminate() {
-  delete (theDecoder);
+  int32_t *out = (int32_t *)dest;
+  uint32_t samples = numFrames * d->num_channels;
+  uint32_t i;
+  switch (d->bit_depth) {
+  case 16: {
+    const int16_t *in = (const int16_t *)decoded;
+    for (i = 0; i < samples; i++)
+      out[i] = (int32_t)((uint32_t)(uint16_t)in[i] << 16);
+  } break;
+  case 20:
+  case 24: {
+    // a 20 bit sample is already in the top bits of its three bytes
+    const uint8_t *in = decoded;
+    for (i = 0; i < samples; i++, in += 3)
+      out[i] = packed_24(in);
+  } break;
+  default:
+    *outsize = 0;
+    return -1;
+  }
   return 0;
 }
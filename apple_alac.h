@@ -10,10 +10,22 @@
 #define EXTERNC
 #endif
 
-EXTERNC int apple_alac_init(int32_t fmtp[12]);
-EXTERNC int apple_alac_terminate();
-EXTERNC int apple_alac_decode_frame(unsigned char *sampleBuffer, uint32_t bufferLength,
-                                    unsigned char *dest, int *outsize);
+// An instance of the Apple ALAC decoder, set up for one stream.
+typedef struct apple_alac_decoder apple_alac_decoder;
+
+enum apple_alac_output {
+  AAO_native = 0, // the decoder's own packed samples, at the stream's bit depth
+  AAO_s32,        // 32-bit samples with the stream's samples in their top bits
+};
+
+// make a decoder for the stream described by the fmtp of the ANNOUNCE -- NULL if it can't be done
+EXTERNC apple_alac_decoder *apple_alac_create(int32_t fmtp[12]);
+EXTERNC void apple_alac_destroy(apple_alac_decoder *decoder);
+// Decode a packet into dest, which must have room for the stream's frames per packet, interleaved.
+// outsize is set to the number of frames decoded. Returns 0 if all went well.
+EXTERNC int apple_alac_decode_frame(apple_alac_decoder *decoder, unsigned char *sampleBuffer,
+                                    uint32_t bufferLength, void *dest, int *outsize,
+                                    enum apple_alac_output output);
 
 #undef EXTERNC
 
@@ -43,6 +43,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <bcm_host.h>
@@ -191,6 +193,7 @@ static char s_metaArtist[256] = { '\0' };
 static char s_metaAlbum[256] = { '\0' };
 static char *s_metaArtwork = NULL;
 static size_t s_metaArtworkSize = 0;
+static char *s_metaArtworkPath = NULL; // the cover art cache file s_metaArtwork was read from, if any
 static volatile bool s_hasMetaChanged = false;
 static volatile bool s_hasMetaArtworkChanged = false;
 
@@ -302,6 +305,9 @@ static void *metaDataThread(void *argument) {
                     break;
 
                 case 'PICT':
+                    free(s_metaArtworkPath);
+                    s_metaArtworkPath = NULL;
+
                     if (outputlength <= ARTWORK_SIZE_MAX) {
                         memcpy(s_metaArtwork, payload, outputlength);
                         s_metaArtworkSize = outputlength;
@@ -313,6 +319,45 @@ static void *metaDataThread(void *argument) {
                     s_hasMetaArtworkChanged = true;
                     break;
 
+                case 'pcpt': {
+                    // the artwork is in the cover art cache -- the same file is often sent for track after track
+                    if ((payload == NULL) || ((s_metaArtworkPath) && (strcmp(s_metaArtworkPath, payload) == 0))) {
+                        break;
+                    }
+
+                    free(s_metaArtworkPath);
+                    s_metaArtworkPath = NULL;
+                    s_metaArtworkSize = 0;
+                    int artworkFD = open(payload, O_RDONLY);
+                    struct stat sb;
+
+                    if ((artworkFD >= 0) && (fstat(artworkFD, &sb) == 0) && (sb.st_size > 0) && (sb.st_size <= ARTWORK_SIZE_MAX)) {
+                        // read it straight into the artwork buffer
+                        size_t got = 0;
+                        ssize_t n;
+
+                        while ((got < (size_t)sb.st_size) && ((n = read(artworkFD, s_metaArtwork + got, sb.st_size - got)) > 0)) {
+                            got += n;
+                        }
+
+                        if (got == (size_t)sb.st_size) {
+                            s_metaArtworkSize = got;
+                            s_metaArtworkPath = strdup(payload);
+                        }
+                    }
+
+                    if (artworkFD >= 0) {
+                        close(artworkFD);
+                    }
+
+                    if (s_metaArtworkSize == 0) {
+                        memset(s_metaArtwork, 0, ARTWORK_SIZE_MAX);
+                    }
+
+                    s_hasMetaArtworkChanged = true;
+                    break;
+                }
+
                 default:
                     break;
             }
@@ -555,6 +600,7 @@ static void deinit2(void) {
 
     if (config.metadata_enabled) {
         free(s_metaArtwork);
+        free(s_metaArtworkPath);
         free(prevArtwork);
         pthread_join(s_metaDataThread, NULL);
     }
@@ -0,0 +1,204 @@
+/*
+ * Benchmark of the biquad filters. This file is part of Shairport Sync.
+ *
+ * The cost per packet of the block engine in biquad.c, used by the loudness filter and the
+ * parametric equaliser, is compared with that of the per-sample, single precision filter it
+ * replaced, a copy of which is kept here. Each is run on packets of music and then on as many
+ * packets of silence, since the old filter's state decays into denormals when the audio falls
+ * silent.
+ *
+ * Build it with "make bench" and run it as "bench/biquad_bench [packets]".
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "biquad.h"
+#include "common.h"
+#include "loudness.h"
+
+#define FRAMES_PER_PACKET 352
+#define EQ_SECTIONS 5
+
+// loudness.c and biquad.c are linked in as they are, so these stand in for the daemon's logging
+void die(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+void warn(__attribute__((unused)) const char *format, ...) {}
+void inform(__attribute__((unused)) const char *format, ...) {}
+void debug(__attribute__((unused)) int level, __attribute__((unused)) const char *format, ...) {}
+
+// The old filter, from before the block engine -- one of these for each channel, run a sample at
+// a time, in single precision.
+
+typedef struct {
+  float a0, a1, a2, b1, b2;
+  float i1, i2, o1, o2;
+} old_processor;
+
+static void old_loudness_set_volume(old_processor *p, float volume) {
+  float gain = -(volume - config.loudness_reference_volume_db) * 0.5;
+  if (gain < 0)
+    gain = 0;
+  float Fc = 10.0;
+  float Q = 0.5;
+  float Fs = config.output_rate;
+  float K = tan(M_PI * Fc / Fs);
+  float V = pow(10.0, gain / 20.0);
+  float norm = 1 / (1 + 1 / Q * K + K * K);
+  p->a0 = (1 + V / Q * K + K * K) * norm;
+  p->a1 = 2 * (K * K - 1) * norm;
+  p->a2 = (1 - V / Q * K + K * K) * norm;
+  p->b1 = p->a1;
+  p->b2 = (1 - 1 / Q * K + K * K) * norm;
+}
+
+static float old_process(old_processor *p, float i0) {
+  float o0 = p->a0 * i0 + p->a1 * p->i1 + p->a2 * p->i2 - p->b1 * p->o1 - p->b2 * p->o2;
+  p->o2 = p->o1;
+  p->o1 = o0;
+  p->i2 = p->i1;
+  p->i1 = i0;
+  return o0;
+}
+
+static void old_set(old_processor *p, const biquad_coefficients *c) {
+  p->a0 = c->b0;
+  p->a1 = c->b1;
+  p->a2 = c->b2;
+  p->b1 = c->a1;
+  p->b2 = c->a2;
+}
+
+// run a cascade of the old filters over a packet, a sample at a time, as the player did
+static void old_packet(old_processor (*p)[2], int sections, float *data, int frames) {
+  int i, j;
+  for (i = 0; i < frames; i++) {
+    float l = data[2 * i], r = data[2 * i + 1];
+    for (j = 0; j < sections; j++) {
+      l = old_process(&p[j][0], l);
+      r = old_process(&p[j][1], r);
+    }
+    data[2 * i] = l;
+    data[2 * i + 1] = r;
+  }
+}
+
+static const struct {
+  enum biquad_type type;
+  double frequency, q, gain_db;
+} eq[EQ_SECTIONS] = {{BQ_low_shelf, 80, 0.7, 4},
+                     {BQ_peaking, 250, 1.0, -3},
+                     {BQ_peaking, 1000, 1.4, 2},
+                     {BQ_peaking, 4000, 2.0, -2},
+                     {BQ_high_shelf, 10000, 0.7, 3}};
+
+// a packet of music, of a few tones at around -6 dB, scaled as the player scales its samples
+static float music[2 * FRAMES_PER_PACKET];
+static float silence[2 * FRAMES_PER_PACKET];
+static float packet[2 * FRAMES_PER_PACKET];
+
+static double seconds_now(void) {
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return tn.tv_sec + tn.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, double seconds, int packets) {
+  printf("%-36s %8.2f us per packet\n", name, seconds * 1e6 / packets);
+}
+
+int main(int argc, char **argv) {
+  int packets = argc > 1 ? atoi(argv[1]) : 100000;
+  if (packets < 2)
+    packets = 2;
+  packets &= ~1; // half music, half silence
+
+  config.output_rate = 44100;
+  config.loudness_reference_volume_db = -20;
+  config.volume_ramp_time = 0.0;
+
+  int i, n;
+  for (i = 0; i < FRAMES_PER_PACKET; i++) {
+    double t = (double)i / config.output_rate;
+    double v = 0.2 * sin(2 * M_PI * 55 * t) + 0.2 * sin(2 * M_PI * 440 * t) +
+               0.1 * sin(2 * M_PI * 3520 * t);
+    music[2 * i] = v * 2147483647.0;
+    music[2 * i + 1] = -v * 2147483647.0;
+  }
+
+  printf("%d packets of %d frames at %d frames per second, half music, half silence.\n", packets,
+         FRAMES_PER_PACKET, config.output_rate);
+
+  // the loudness filter, with its gain at -40 dB volume
+  float volume = -40.0;
+  old_processor old_loudness[1][2];
+  memset(old_loudness, 0, sizeof(old_loudness));
+  old_loudness_set_volume(&old_loudness[0][0], volume);
+  old_loudness_set_volume(&old_loudness[0][1], volume);
+  double start = seconds_now();
+  for (n = 0; n < packets; n++) {
+    memcpy(packet, n < packets / 2 ? music : silence, sizeof(packet));
+    old_packet(old_loudness, 1, packet, FRAMES_PER_PACKET);
+  }
+  report("loudness, old per-sample float", seconds_now() - start, packets);
+
+  loudness_set_volume(volume);
+  start = seconds_now();
+  for (n = 0; n < packets; n++) {
+    memcpy(packet, n < packets / 2 ? music : silence, sizeof(packet));
+    loudness_process(packet, FRAMES_PER_PACKET);
+  }
+  report("loudness, block engine", seconds_now() - start, packets);
+
+  // the equaliser
+  old_processor old_eq[EQ_SECTIONS][2];
+  memset(old_eq, 0, sizeof(old_eq));
+  biquad_chain chain;
+  biquad_chain_init(&chain, EQ_SECTIONS);
+  for (i = 0; i < EQ_SECTIONS; i++) {
+    biquad_coefficients c;
+    biquad_design(&c, eq[i].type, config.output_rate, eq[i].frequency, eq[i].q, eq[i].gain_db);
+    old_set(&old_eq[i][0], &c);
+    old_set(&old_eq[i][1], &c);
+    biquad_chain_set(&chain, i, &c);
+  }
+
+  // check first that the two agree on the music, to within single precision
+  float reference[2 * FRAMES_PER_PACKET];
+  memcpy(reference, music, sizeof(reference));
+  memcpy(packet, music, sizeof(packet));
+  old_packet(old_eq, EQ_SECTIONS, reference, FRAMES_PER_PACKET);
+  biquad_chain_process(&chain, packet, FRAMES_PER_PACKET);
+  double worst = 0.0;
+  for (i = 0; i < 2 * FRAMES_PER_PACKET; i++)
+    if (fabs(packet[i] - reference[i]) > worst)
+      worst = fabs(packet[i] - reference[i]);
+  printf("%d section equaliser, largest difference between the two: %.1f dB full scale\n",
+         EQ_SECTIONS, worst > 0.0 ? 20 * log10(worst / 2147483647.0) : -999.0);
+
+  start = seconds_now();
+  for (n = 0; n < packets; n++) {
+    memcpy(packet, n < packets / 2 ? music : silence, sizeof(packet));
+    old_packet(old_eq, EQ_SECTIONS, packet, FRAMES_PER_PACKET);
+  }
+  report("equaliser, old per-sample float", seconds_now() - start, packets);
+
+  start = seconds_now();
+  for (n = 0; n < packets; n++) {
+    memcpy(packet, n < packets / 2 ? music : silence, sizeof(packet));
+    biquad_chain_process(&chain, packet, FRAMES_PER_PACKET);
+  }
+  report("equaliser, block engine", seconds_now() - start, packets);
+  return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Benchmark of the convolution engines. This file is part of Shairport Sync.
+ *
+ * The CPU time per packet of the uniform partitioned engine and of the two-stage engine is
+ * measured for impulse responses of several lengths, with the partition sizes convolver.cpp uses.
+ * The two-stage engine's tail is computed here in the foreground, as it would be on its
+ * background thread, and its time is reported separately.
+ *
+ * Build it with "make bench" and run it as "bench/convolver_bench [packets [ir_length ...]]".
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "../FFTConvolver/FFTConvolver.h"
+#include "../FFTConvolver/TwoStageFFTConvolver.h"
+
+// as in convolver.cpp
+static const size_t frames_per_packet = 352;
+static const size_t uniform_block_size = 352;
+static const size_t head_block_size = 256;
+static const size_t tail_block_size = 4096;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// the two-stage engine, timing its tail work, which the daemon does on a thread of its own
+class TimedTwoStageFFTConvolver : public fftconvolver::TwoStageFFTConvolver
+{
+public:
+  TimedTwoStageFFTConvolver() : backgroundTime(0.0)
+  {
+  }
+
+  double backgroundTime;
+
+protected:
+  virtual void startBackgroundProcessing()
+  {
+    bench_clock::time_point start = bench_clock::now();
+    doBackgroundProcessing();
+    backgroundTime += seconds_since(start);
+  }
+};
+
+int main(int argc, char** argv)
+{
+  int packets = argc > 1 ? atoi(argv[1]) : 2000;
+  if (packets < 1)
+    packets = 1;
+  std::vector<size_t> lengths;
+  for (int i = 2; i < argc; i++)
+    lengths.push_back(strtoul(argv[i], NULL, 10));
+  if (lengths.empty())
+  {
+    lengths.push_back(4096);
+    lengths.push_back(16384);
+    lengths.push_back(49152);
+    lengths.push_back(65536);
+    lengths.push_back(200000);
+  }
+
+  // the input, noise at about -12 dB, the same on every run
+  std::vector<fftconvolver::Sample> input(frames_per_packet * packets);
+  srand(1);
+  for (size_t i = 0; i < input.size(); i++)
+    input[i] = (rand() / (float)RAND_MAX - 0.5f) * 0.5f;
+
+  printf("%d packets of %zu frames, one channel, CPU time per packet in us.\n", packets, frames_per_packet);
+  printf("  IR taps    uniform    two-stage (foreground + background)    largest difference\n");
+  for (size_t l = 0; l < lengths.size(); l++)
+  {
+    // a room's impulse response, roughly: noise decaying by 60 dB over its length
+    std::vector<fftconvolver::Sample> ir(lengths[l]);
+    for (size_t i = 0; i < ir.size(); i++)
+      ir[i] = (rand() / (float)RAND_MAX - 0.5f) * 0.1f * std::pow(10.0f, -3.0f * i / ir.size());
+
+    std::vector<fftconvolver::Sample> uniform_output(input.size()), two_stage_output(input.size());
+
+    fftconvolver::FFTConvolver uniform;
+    uniform.init(uniform_block_size, ir.data(), ir.size());
+    bench_clock::time_point start = bench_clock::now();
+    for (int p = 0; p < packets; p++)
+      uniform.process(&input[p * frames_per_packet], &uniform_output[p * frames_per_packet], frames_per_packet);
+    double uniform_time = seconds_since(start);
+
+    TimedTwoStageFFTConvolver two_stage;
+    two_stage.init(head_block_size, tail_block_size, ir.data(), ir.size());
+    start = bench_clock::now();
+    for (int p = 0; p < packets; p++)
+      two_stage.process(&input[p * frames_per_packet], &two_stage_output[p * frames_per_packet], frames_per_packet);
+    double two_stage_time = seconds_since(start) - two_stage.backgroundTime;
+
+    double worst = 0.0;
+    for (size_t i = 0; i < input.size(); i++)
+      worst = std::max(worst, (double)std::fabs(uniform_output[i] - two_stage_output[i]));
+
+    printf("%9zu %10.1f %12.1f + %-10.1f %31.2g\n", lengths[l], uniform_time * 1e6 / packets,
+           two_stage_time * 1e6 / packets, two_stage.backgroundTime * 1e6 / packets, worst);
+  }
+  return 0;
+}
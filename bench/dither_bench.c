@@ -0,0 +1,185 @@
+/*
+ * Benchmark of the dither generator. This file is part of Shairport Sync.
+ *
+ * The cost per packet of dithering to 16 bits with the block generator in dither.c is compared
+ * with that of the table of random numbers it replaced, a copy of which is kept here along with
+ * the old per-sample dither.
+ *
+ * Build it with "make bench" and run it as "bench/dither_bench [packets]".
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "dither.h"
+
+#define FRAMES_PER_PACKET 352
+#define OUTPUT_BITS 16
+
+// dither.c is linked in as it is, so these stand in for the daemon's logging and random numbers
+
+void die(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+void debug(__attribute__((unused)) int level, __attribute__((unused)) const char *format, ...) {}
+
+// based on http://burtleburtle.net/bob/rand/smallprng.html, as in common.c
+typedef struct ranctx {
+  uint64_t a;
+  uint64_t b;
+  uint64_t c;
+  uint64_t d;
+} ranctx;
+
+static struct ranctx rx;
+
+#define rot(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+static uint64_t ranval(ranctx *x) {
+  uint64_t e = x->a - rot(x->b, 7);
+  x->a = x->b ^ rot(x->c, 13);
+  x->b = x->c + rot(x->d, 37);
+  x->c = x->d + e;
+  x->d = e + x->a;
+  return x->d;
+}
+
+void r64init(uint64_t seed) {
+  uint64_t i;
+  rx.a = 0xf1ea5eed, rx.b = rx.c = rx.d = seed;
+  for (i = 0; i < 20; ++i)
+    (void)ranval(&rx);
+}
+
+uint64_t r64u() { return (ranval(&rx)); }
+
+int64_t r64i() { return (ranval(&rx) >> 1); }
+
+// The old dither, from before the block generator -- a table of random numbers was made at
+// startup and stepped through a sample at a time, with each number's difference from the last
+// used as the dither.
+
+static const int ranarraylength = 1009; // these will be 8-byte numbers.
+static uint64_t *ranarray;
+static int ranarraynext;
+
+static void ranarrayinit() {
+  ranarray = (uint64_t *)malloc(ranarraylength * sizeof(uint64_t));
+  if (ranarray == NULL)
+    die("failed to allocate space for the ranarray.");
+  int i;
+  for (i = 0; i < ranarraylength; i++)
+    ranarray[i] = r64u();
+  ranarraynext = 0;
+}
+
+static int64_t ranarray64i() {
+  uint64_t v = ranarray[ranarraynext];
+  ranarraynext++;
+  ranarraynext = ranarraynext % ranarraylength;
+  return v >> 1;
+}
+
+static int64_t previous_random_number;
+
+static int64_t old_dither_sample(int64_t hyper_sample) {
+  int64_t dither_mask = ((int64_t)1 << (64 + 1 - OUTPUT_BITS)) - 1;
+  int64_t r = ranarray64i();
+  int64_t tpdf = (r & dither_mask) - (previous_random_number & dither_mask);
+  previous_random_number = r;
+  // add dither, allowing for clipping
+  if (tpdf >= 0) {
+    if (INT64_MAX - tpdf >= hyper_sample)
+      hyper_sample += tpdf;
+    else
+      hyper_sample = INT64_MAX;
+  } else {
+    if (INT64_MIN - tpdf <= hyper_sample)
+      hyper_sample += tpdf;
+    else
+      hyper_sample = INT64_MIN;
+  }
+  return hyper_sample;
+}
+
+// a packet of music, a tone at around -12 dB, in the top bits of each sample as the player has it
+static int64_t music[2 * FRAMES_PER_PACKET];
+
+// the output, kept so that the work can't be optimised away
+static int16_t output[2 * FRAMES_PER_PACKET];
+static uint64_t checksum;
+
+static double seconds_now(void) {
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return tn.tv_sec + tn.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, double seconds, int packets) {
+  printf("%-24s %8.2f us per packet\n", name, seconds * 1e6 / packets);
+}
+
+static void finish_packet(void) {
+  int i;
+  for (i = 0; i < 2 * FRAMES_PER_PACKET; i++)
+    checksum = checksum * 31 + (uint16_t)output[i];
+}
+
+static void bench_block(const char *name, enum dither_type type, int rate, int packets) {
+  dither_state d;
+  dither_init(&d, type, rate, OUTPUT_BITS);
+  double start = seconds_now();
+  int n, i;
+  for (n = 0; n < packets; n++) {
+    for (i = 0; i < 2 * FRAMES_PER_PACKET; i++)
+      output[i] = dither_sample(&d, music[i]) >> (64 - OUTPUT_BITS);
+    finish_packet();
+  }
+  report(name, seconds_now() - start, packets);
+}
+
+int main(int argc, char **argv) {
+  int packets = argc > 1 ? atoi(argv[1]) : 100000;
+  if (packets < 1)
+    packets = 1;
+
+  r64init(0);
+  ranarrayinit();
+
+  int i, n;
+  for (i = 0; i < FRAMES_PER_PACKET; i++) {
+    int64_t v = 0.25 * sin(2 * M_PI * 1000 * i / 44100.0) * 2147483647.0;
+    music[2 * i] = v * ((int64_t)1 << 32);
+    music[2 * i + 1] = -v * ((int64_t)1 << 32);
+  }
+
+  printf("%d packets of %d frames, dithered to %d bits.\n", packets, FRAMES_PER_PACKET,
+         OUTPUT_BITS);
+
+  double start = seconds_now();
+  for (n = 0; n < packets; n++) {
+    for (i = 0; i < 2 * FRAMES_PER_PACKET; i++)
+      output[i] = old_dither_sample(music[i]) >> (64 - OUTPUT_BITS);
+    finish_packet();
+  }
+  report("old table", seconds_now() - start, packets);
+
+  bench_block("flat", DT_flat, 44100, packets);
+  bench_block("high_pass", DT_high_pass, 44100, packets);
+  bench_block("shaped, 44,100 Hz", DT_shaped, 44100, packets);
+  bench_block("shaped, 48,000 Hz", DT_shaped, 48000, packets);
+
+  printf("(checksum %016llx)\n", (unsigned long long)checksum);
+  free(ranarray);
+  return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Benchmark of the metadata pipe. This file is part of Shairport Sync.
+ *
+ * Items the size of cover art are written to a pipe, one at a time as PICT items arrive, by
+ * metadata_pipe_write_items() in both the XML and the binary format, while a thread reads the
+ * other end as a metadata reader would. The throughput of the item data and the number of write
+ * system calls each item took are reported. Each write is preceded by a poll for room in the pipe.
+ *
+ * Build it with "make bench" and run it as "bench/metadata_pipe_bench [megabytes [item_kb ...]]".
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "metadata_pipe.h"
+
+// metadata_pipe.c is linked in as it is, so this stands in for the daemon's logging
+void debug(__attribute__((unused)) int level, __attribute__((unused)) const char *format, ...) {}
+
+static double seconds_now(void) {
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return tn.tv_sec + tn.tv_nsec * 1e-9;
+}
+
+// the number of write system calls this thread has made, or -1 if the kernel doesn't count them
+static long long write_calls(void) {
+  char line[64];
+  long long count = -1;
+  FILE *f = fopen("/proc/thread-self/io", "r");
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "syscw: %lld", &count) == 1)
+      break;
+  fclose(f);
+  return count;
+}
+
+// the reader, which drains the pipe until the writer closes it
+static void *reader(void *arg) {
+  int fd = *(int *)arg;
+  static char buf[65536];
+  while (1) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if ((n == 0) || ((n < 0) && (errno != EINTR)))
+      break;
+  }
+  return NULL;
+}
+
+static void run(const char *format_name, enum metadata_pipe_format_type format, char *picture,
+                size_t item_size, int items) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fcntl(fds[1], F_SETFL, O_NONBLOCK); // the daemon opens the pipe with O_NONBLOCK
+  pthread_t reader_thread;
+  if (pthread_create(&reader_thread, NULL, reader, &fds[0]) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+
+  metadata_package pack;
+  memset(&pack, 0, sizeof(pack));
+  pack.type = 'ssnc';
+  pack.code = 'PICT';
+  pack.data = picture;
+  pack.length = item_size;
+
+  long long calls_before = write_calls();
+  double start = seconds_now();
+  int i;
+  for (i = 0; i < items; i++)
+    if (metadata_pipe_write_items(fds[1], format, &pack, 1) < 0) {
+      perror("metadata_pipe_write_items");
+      exit(1);
+    }
+  close(fds[1]);
+  pthread_join(reader_thread, NULL);
+  double elapsed = seconds_now() - start;
+  long long calls = write_calls() - calls_before;
+  close(fds[0]);
+
+  printf("%7zu KB  %-6s  %8.1f MB/s", item_size / 1024, format_name,
+         (double)item_size * items / (elapsed * 1000000.0));
+  if (calls_before >= 0)
+    printf("  %8.1f per item\n", (double)calls / items);
+  else
+    printf("  (write calls aren't counted by this kernel)\n");
+}
+
+int main(int argc, char **argv) {
+  int megabytes = argc > 1 ? atoi(argv[1]) : 200;
+  if (megabytes < 1)
+    megabytes = 1;
+  size_t sizes[16];
+  int nsizes = 0, i, j;
+  for (i = 2; (i < argc) && (nsizes < 16); i++)
+    sizes[nsizes++] = strtoul(argv[i], NULL, 10) * 1024;
+  if (nsizes == 0) {
+    sizes[nsizes++] = 100 * 1024;
+    sizes[nsizes++] = 250 * 1024;
+    sizes[nsizes++] = 500 * 1024;
+    sizes[nsizes++] = 1024 * 1024;
+  }
+
+  printf("About %d MB of PICT items of each size written to a pipe, one item per call.\n",
+         megabytes);
+  printf("%10s  %-6s  %13s  %s\n", "item", "format", "throughput", "write calls");
+  for (i = 0; i < nsizes; i++) {
+    if (sizes[i] == 0)
+      continue;
+    // a JPEG, as far as the encoding is concerned: bytes with no pattern to them
+    char *picture = malloc(sizes[i]);
+    if (picture == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+    srand(1);
+    for (j = 0; j < (int)sizes[i]; j++)
+      picture[j] = rand();
+    int items = ((size_t)megabytes * 1024 * 1024) / sizes[i];
+    if (items < 1)
+      items = 1;
+    run("xml", MPF_xml, picture, sizes[i], items);
+    run("binary", MPF_binary, picture, sizes[i], items);
+    free(picture);
+  }
+  return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Connection load generator for the RTSP server. This file is part of Shairport Sync.
+ *
+ * A number of connections are opened to a running Shairport Sync and left idle, as discovery
+ * probes and senders that have stopped playing leave them. An OPTIONS request is then sent on each
+ * in turn and the time to its response is measured. If the daemon's process ID is given, its
+ * thread count and resident memory are read from /proc before the connections are opened, while
+ * they are idle and after they are closed.
+ *
+ * Build it with "make bench" and run it as
+ * "bench/rtsp_connection_bench [host [port [connections [pid]]]]".
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+static double seconds_now(void) {
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return tn.tv_sec + tn.tv_nsec * 1e-9;
+}
+
+// print the daemon's thread count and resident memory, as /proc has them
+static void report_process(const char *when, int pid) {
+  char path[64], line[256];
+  if (pid <= 0)
+    return;
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "can't read \"%s\": %s\n", path, strerror(errno));
+    return;
+  }
+  printf("%-28s", when);
+  while (fgets(line, sizeof(line), f))
+    if ((strncmp(line, "Threads:", 8) == 0) || (strncmp(line, "VmRSS:", 6) == 0)) {
+      line[strcspn(line, "\n")] = 0;
+      printf("  %s", line);
+    }
+  printf("\n");
+  fclose(f);
+}
+
+static int connect_to(struct addrinfo *info) {
+  struct addrinfo *p;
+  for (p = info; p; p = p->ai_next) {
+    int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      return fd;
+    close(fd);
+  }
+  return -1;
+}
+
+// send an OPTIONS request and read up to the end of the response's headers
+static int options_round_trip(int fd, int cseq) {
+  char request[128], response[2048];
+  int length = snprintf(request, sizeof(request), "OPTIONS * RTSP/1.0\r\nCSeq: %d\r\n\r\n", cseq);
+  if (write(fd, request, length) != length)
+    return -1;
+  size_t got = 0;
+  while (got < sizeof(response) - 1) {
+    ssize_t n = read(fd, response + got, sizeof(response) - 1 - got);
+    if (n <= 0)
+      return -1;
+    got += n;
+    response[got] = 0;
+    if (strstr(response, "\r\n\r\n"))
+      return strncmp(response, "RTSP/1.0 200", 12) == 0 ? 0 : -1;
+  }
+  return -1;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  const char *host = argc > 1 ? argv[1] : "localhost";
+  const char *port = argc > 2 ? argv[2] : "5000";
+  int connections = argc > 3 ? atoi(argv[3]) : 200;
+  int pid = argc > 4 ? atoi(argv[4]) : 0;
+  if (connections < 1)
+    connections = 1;
+
+  struct addrinfo hints, *info;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int ret = getaddrinfo(host, port, &hints, &info);
+  if (ret) {
+    fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(ret));
+    return 1;
+  }
+
+  int *fds = malloc(connections * sizeof(int));
+  double *latency = malloc(connections * sizeof(double));
+  if ((fds == NULL) || (latency == NULL)) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  report_process("before connecting:", pid);
+  int i, opened = 0;
+  double start = seconds_now();
+  for (i = 0; i < connections; i++) {
+    fds[i] = connect_to(info);
+    if (fds[i] < 0) {
+      fprintf(stderr, "connection %d failed: %s\n", i, strerror(errno));
+      break;
+    }
+    opened++;
+  }
+  double connect_time = seconds_now() - start;
+  freeaddrinfo(info);
+  printf("%d connections opened in %.1f ms.\n", opened, connect_time * 1000);
+  usleep(500000); // let the daemon settle
+  report_process("with the connections idle:", pid);
+
+  int answered = 0;
+  for (i = 0; i < opened; i++) {
+    double sent = seconds_now();
+    if (options_round_trip(fds[i], i + 1) == 0)
+      latency[answered++] = seconds_now() - sent;
+  }
+  if (answered) {
+    qsort(latency, answered, sizeof(double), compare_doubles);
+    printf("OPTIONS answered on %d of %d connections, in ms: median %.3f, 99th percentile %.3f, "
+           "worst %.3f.\n",
+           answered, opened, latency[answered / 2] * 1000,
+           latency[(answered * 99) / 100] * 1000, latency[answered - 1] * 1000);
+  } else {
+    printf("No OPTIONS request was answered.\n");
+  }
+
+  for (i = 0; i < opened; i++)
+    close(fds[i]);
+  usleep(500000);
+  report_process("after closing them:", pid);
+  free(fds);
+  free(latency);
+  return answered == opened ? 0 : 1;
+}
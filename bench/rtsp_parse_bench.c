@@ -0,0 +1,373 @@
+/*
+ * Benchmark of the RTSP request parser. This file is part of Shairport Sync.
+ *
+ * A canned conversation -- the requests of a typical play session -- is parsed over and over,
+ * as it would arrive in TCP segments, by the old line-at-a-time parser, a copy of which is kept
+ * here, and by the incremental, in-place one in rtsp_parse.c that replaced it. The time per
+ * request is reported for each.
+ *
+ * Build it with "make bench" and run it as "bench/rtsp_parse_bench [iterations]".
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "common.h"
+#include "rtsp_parse.h"
+
+// rtsp_parse.c is linked in as it is, so these stand in for the daemon's logging
+void die(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+void warn(__attribute__((unused)) const char *format, ...) {}
+void debug(__attribute__((unused)) int level, __attribute__((unused)) const char *format, ...) {}
+
+static const char *requests[] = {
+    "OPTIONS * RTSP/1.0\r\n"
+    "CSeq: 1\r\n"
+    "User-Agent: AirPlay/381.13\r\n"
+    "Active-Remote: 1986535575\r\n"
+    "DACP-ID: 14413BE4996FEA4D\r\n"
+    "Apple-Challenge: 6aESIe1LXmjdPCw5L1NhKg\r\n"
+    "\r\n",
+
+    "ANNOUNCE rtsp://192.168.1.12/2577757553564838296 RTSP/1.0\r\n"
+    "CSeq: 2\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: 607\r\n"
+    "User-Agent: AirPlay/381.13\r\n"
+    "Active-Remote: 1986535575\r\n"
+    "DACP-ID: 14413BE4996FEA4D\r\n"
+    "X-Apple-Client-Name: Living Room\r\n"
+    "\r\n"
+    "v=0\r\n"
+    "o=AirTunes 2577757553564838296 0 IN IP4 192.168.1.5\r\n"
+    "s=AirTunes\r\n"
+    "c=IN IP4 192.168.1.5\r\n"
+    "t=0 0\r\n"
+    "m=audio 0 RTP/AVP 96\r\n"
+    "a=rtpmap:96 AppleLossless\r\n"
+    "a=fmtp:96 352 0 16 40 10 14 2 255 0 0 44100\r\n"
+    "a=rsaaeskey:ArtqWUDmK5m1IHtC2IyU9Y2rP1BRg2qu1zlMqHZpgdFmD4LSCjO5ElqHufQWxcB9vY8N6+GJ1O4Jy2R"
+    "mtYcN8Tq0L4RWr6KkBOlM6drCNz9sw6vyRfi2ufH2jwr0R1hPXr7t9RRfGHdpSA7jfj1ttPq7XmJiQmMG2Wk0sZtW"
+    "Q4RCx0hU6UYWYZ3T8d6e0Ry2D1+r8zmA2dHyYOoDA3C3i9IvMEP4w/1Ws7xhyvGgEn0Dr/QgeqIGKlkk2ThERHyD"
+    "Y8V4PU5Wwr/K4xv3GQnhx5zCqzjSwQRVkvjSzAa9kAc95AX1dvxQ+cUBcY7mCZxqZiHW1B\r\n"
+    "a=aesiv:zcZmAZtqh7uGcEwPXk0QeA\r\n"
+    "a=min-latency:11025\r\n"
+    "a=max-latency:88200\r\n",
+
+    "SETUP rtsp://192.168.1.12/2577757553564838296 RTSP/1.0\r\n"
+    "CSeq: 3\r\n"
+    "Transport: RTP/AVP/UDP;unicast;interleaved=0-1;mode=record;control_port=6001;timing_port=6002\r\n"
+    "User-Agent: AirPlay/381.13\r\n"
+    "Active-Remote: 1986535575\r\n"
+    "DACP-ID: 14413BE4996FEA4D\r\n"
+    "\r\n",
+
+    "RECORD rtsp://192.168.1.12/2577757553564838296 RTSP/1.0\r\n"
+    "CSeq: 4\r\n"
+    "Range: npt=0-\r\n"
+    "Session: 1\r\n"
+    "RTP-Info: seq=17249;rtptime=1819567004\r\n"
+    "User-Agent: AirPlay/381.13\r\n"
+    "Active-Remote: 1986535575\r\n"
+    "DACP-ID: 14413BE4996FEA4D\r\n"
+    "\r\n",
+
+    "SET_PARAMETER rtsp://192.168.1.12/2577757553564838296 RTSP/1.0\r\n"
+    "CSeq: 5\r\n"
+    "Content-Type: text/parameters\r\n"
+    "Content-Length: 20\r\n"
+    "User-Agent: AirPlay/381.13\r\n"
+    "Active-Remote: 1986535575\r\n"
+    "DACP-ID: 14413BE4996FEA4D\r\n"
+    "\r\n"
+    "volume: -11.123877\r\n",
+
+    "FLUSH rtsp://192.168.1.12/2577757553564838296 RTSP/1.0\r\n"
+    "CSeq: 6\r\n"
+    "RTP-Info: seq=17389;rtptime=1819616284\r\n"
+    "Session: 1\r\n"
+    "User-Agent: AirPlay/381.13\r\n"
+    "Active-Remote: 1986535575\r\n"
+    "DACP-ID: 14413BE4996FEA4D\r\n"
+    "\r\n",
+
+    "TEARDOWN rtsp://192.168.1.12/2577757553564838296 RTSP/1.0\r\n"
+    "CSeq: 7\r\n"
+    "Session: 1\r\n"
+    "User-Agent: AirPlay/381.13\r\n"
+    "Active-Remote: 1986535575\r\n"
+    "DACP-ID: 14413BE4996FEA4D\r\n"
+    "\r\n"};
+
+#define REQUEST_COUNT (sizeof(requests) / sizeof(requests[0]))
+#define SEGMENT_SIZE 1448 // the payload of a typical TCP segment
+
+// the conversation, as one stream of bytes
+static char *stream;
+static size_t stream_length;
+
+// a source of the stream, a segment at a time
+static size_t stream_position;
+
+static ssize_t stream_read(char *buf, size_t length) {
+  size_t n = stream_length - stream_position;
+  if (n > length)
+    n = length;
+  if (n > SEGMENT_SIZE)
+    n = SEGMENT_SIZE;
+  memcpy(buf, stream + stream_position, n);
+  stream_position += n;
+  return n;
+}
+
+// the CSeq values seen, so that the parsers can be checked against each other
+static long cseq_total;
+
+// The old parser, from before the event loop: each line is taken from the front of the buffer and
+// handled on its own, with the rest moved down over it, and each header is copied.
+
+typedef struct {
+  int nheaders;
+  char *name[16];
+  char *value[16];
+  int contentlength;
+  char *content;
+  char method[16];
+} old_message;
+
+static void old_msg_free(old_message *msg) {
+  int i;
+  for (i = 0; i < msg->nheaders; i++) {
+    free(msg->name[i]);
+    free(msg->value[i]);
+  }
+  free(msg->content);
+  free(msg);
+}
+
+static char *old_msg_get_header(old_message *msg, char *name) {
+  int i;
+  for (i = 0; i < msg->nheaders; i++)
+    if (!strcasecmp(msg->name[i], name))
+      return msg->value[i];
+  return NULL;
+}
+
+static char *old_nextline(char *in, int inbuf) {
+  char *out = NULL;
+  while (inbuf) {
+    if (*in == '\r') {
+      *in++ = 0;
+      out = in;
+    }
+    if (*in == '\n') {
+      *in++ = 0;
+      out = in;
+    }
+    if (out)
+      break;
+    in++;
+    inbuf--;
+  }
+  return out;
+}
+
+static int old_msg_handle_line(old_message **pmsg, char *line) {
+  old_message *msg = *pmsg;
+  if (!msg) {
+    msg = calloc(1, sizeof(old_message));
+    *pmsg = msg;
+    char *sp, *p;
+    p = strtok_r(line, " ", &sp);
+    if (!p)
+      goto fail;
+    strncpy(msg->method, p, sizeof(msg->method) - 1);
+    p = strtok_r(NULL, " ", &sp);
+    if (!p)
+      goto fail;
+    p = strtok_r(NULL, " ", &sp);
+    if ((!p) || (strcmp(p, "RTSP/1.0")))
+      goto fail;
+    return -1;
+  }
+  if (strlen(line)) {
+    char *p = strstr(line, ": ");
+    if (!p)
+      goto fail;
+    *p = 0;
+    p += 2;
+    if (msg->nheaders < 16) {
+      msg->name[msg->nheaders] = strdup(line);
+      msg->value[msg->nheaders] = strdup(p);
+      msg->nheaders++;
+    }
+    return -1;
+  } else {
+    char *cl = old_msg_get_header(msg, "Content-Length");
+    return cl ? atoi(cl) : 0;
+  }
+fail:
+  *pmsg = NULL;
+  old_msg_free(msg);
+  return 0;
+}
+
+// the buffer carried over from one request to the next -- the old parser read past the end of a
+// request into its buffer and kept what it had read for the next one
+static char *old_buf;
+static ssize_t old_inbuf;
+
+static old_message *old_read_request(void) {
+  ssize_t buflen = 512;
+  char *buf = old_buf;
+  ssize_t inbuf = old_inbuf;
+  old_message *msg = NULL;
+  int msg_size = -1;
+  while (msg_size < 0) {
+    if (inbuf == 0) {
+      ssize_t nread = stream_read(buf + inbuf, buflen - inbuf);
+      if (nread == 0)
+        return NULL;
+      inbuf += nread;
+    }
+    char *next;
+    int progress = 0;
+    while (msg_size < 0 && (next = old_nextline(buf, inbuf))) {
+      msg_size = old_msg_handle_line(&msg, buf);
+      if (!msg)
+        return NULL;
+      inbuf -= next - buf;
+      if (inbuf)
+        memmove(buf, next, inbuf);
+      progress = 1;
+    }
+    if ((msg_size < 0) && (progress == 0)) {
+      ssize_t nread = stream_read(buf + inbuf, buflen - inbuf);
+      if (nread == 0)
+        return NULL;
+      inbuf += nread;
+    }
+  }
+  msg->content = malloc(msg_size + 1);
+  msg->contentlength = msg_size;
+  ssize_t have = inbuf < msg_size ? inbuf : msg_size;
+  memcpy(msg->content, buf, have);
+  inbuf -= have;
+  if (inbuf)
+    memmove(buf, buf + have, inbuf);
+  while (have < msg_size)
+    have += stream_read(msg->content + have, msg_size - have);
+  old_inbuf = inbuf;
+  return msg;
+}
+
+static int run_old(void) {
+  int count = 0;
+  old_message *msg;
+  stream_position = 0;
+  old_inbuf = 0;
+  while ((msg = old_read_request()) != NULL) {
+    char *cseq = old_msg_get_header(msg, "CSeq");
+    if (cseq)
+      cseq_total += atol(cseq);
+    old_msg_free(msg);
+    count++;
+  }
+  return count;
+}
+
+static int run_new(rtsp_parser *parser) {
+  int count = 0;
+  rtsp_message *msg;
+  stream_position = 0;
+  while (1) {
+    if (rtsp_parser_next_request(parser, &msg) != rtsp_read_request_response_ok)
+      break;
+    if (msg == NULL) {
+      ssize_t room = rtsp_parser_make_room(parser);
+      if (room == 0)
+        break;
+      ssize_t nread = stream_read(parser->buf + parser->inbuf, room);
+      if (nread == 0)
+        break;
+      parser->inbuf += nread;
+      continue;
+    }
+    char *cseq = msg_get_indexed_header(msg, rtsp_header_cseq);
+    if (cseq)
+      cseq_total += atol(cseq);
+    msg_free(msg);
+    count++;
+  }
+  return count;
+}
+
+static double seconds_now(void) {
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return tn.tv_sec + tn.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  if (iterations < 1)
+    iterations = 1;
+  size_t i;
+  for (i = 0; i < REQUEST_COUNT; i++)
+    stream_length += strlen(requests[i]);
+  stream = malloc(stream_length);
+  stream_length = 0;
+  for (i = 0; i < REQUEST_COUNT; i++) {
+    memcpy(stream + stream_length, requests[i], strlen(requests[i]));
+    stream_length += strlen(requests[i]);
+  }
+  old_buf = malloc(512 + 1);
+
+  rtsp_parser parser;
+  rtsp_parser_init(&parser);
+
+  // check that both parsers see the whole conversation, and the same CSeqs
+  long expected_cseq = REQUEST_COUNT * (REQUEST_COUNT + 1) / 2;
+  cseq_total = 0;
+  int old_count = run_old();
+  long old_cseq = cseq_total;
+  cseq_total = 0;
+  int new_count = run_new(&parser);
+  if ((old_count != (int)REQUEST_COUNT) || (new_count != (int)REQUEST_COUNT) ||
+      (old_cseq != expected_cseq) || (cseq_total != expected_cseq)) {
+    fprintf(stderr, "The parsers disagree: old %d requests, new %d requests, of %zu.\n",
+            old_count, new_count, REQUEST_COUNT);
+    return 1;
+  }
+
+  double start = seconds_now();
+  int n;
+  for (n = 0; n < iterations; n++)
+    run_old();
+  double old_time = seconds_now() - start;
+  start = seconds_now();
+  for (n = 0; n < iterations; n++)
+    run_new(&parser);
+  double new_time = seconds_now() - start;
+
+  double requests_parsed = (double)iterations * REQUEST_COUNT;
+  printf("%zu requests, %zu bytes, in %d byte segments, %d times.\n", REQUEST_COUNT, stream_length,
+         SEGMENT_SIZE, iterations);
+  printf("old parser: %8.1f ns per request\n", old_time * 1e9 / requests_parsed);
+  printf("new parser: %8.1f ns per request\n", new_time * 1e9 / requests_parsed);
+  rtsp_parser_free(&parser);
+  return 0;
+}
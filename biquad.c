@@ -0,0 +1,148 @@
+#include "biquad.h"
+#include "common.h"
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+
+typedef double biquad_vector __attribute__((vector_size(16)));
+
+// Added to the state on every sample, so that the filter's state never decays into the denormal
+// range when the input falls silent -- denormal arithmetic is very slow on many processors.
+// Samples are scaled to the range of an int32_t, so it is far below the smallest step of the
+// output.
+static const biquad_vector anti_denormal = {1e-18, 1e-18};
+
+void biquad_design(biquad_coefficients *c, enum biquad_type type, double rate, double frequency,
+                   double q, double gain_db) {
+  // keep the frequency below the Nyquist frequency, where the formulas don't work
+  if (frequency > 0.45 * rate)
+    frequency = 0.45 * rate;
+  double A = pow(10.0, gain_db / 40.0);
+  double w0 = 2 * M_PI * frequency / rate;
+  double cosw0 = cos(w0);
+  double alpha = sin(w0) / (2 * q);
+  double b0, b1, b2, a0, a1, a2;
+  switch (type) {
+  case BQ_low_shelf:
+    b0 = A * ((A + 1) - (A - 1) * cosw0 + 2 * sqrt(A) * alpha);
+    b1 = 2 * A * ((A - 1) - (A + 1) * cosw0);
+    b2 = A * ((A + 1) - (A - 1) * cosw0 - 2 * sqrt(A) * alpha);
+    a0 = (A + 1) + (A - 1) * cosw0 + 2 * sqrt(A) * alpha;
+    a1 = -2 * ((A - 1) + (A + 1) * cosw0);
+    a2 = (A + 1) + (A - 1) * cosw0 - 2 * sqrt(A) * alpha;
+    break;
+  case BQ_high_shelf:
+    b0 = A * ((A + 1) + (A - 1) * cosw0 + 2 * sqrt(A) * alpha);
+    b1 = -2 * A * ((A - 1) + (A + 1) * cosw0);
+    b2 = A * ((A + 1) + (A - 1) * cosw0 - 2 * sqrt(A) * alpha);
+    a0 = (A + 1) - (A - 1) * cosw0 + 2 * sqrt(A) * alpha;
+    a1 = 2 * ((A - 1) - (A + 1) * cosw0);
+    a2 = (A + 1) - (A - 1) * cosw0 - 2 * sqrt(A) * alpha;
+    break;
+  case BQ_low_pass:
+    b0 = (1 - cosw0) / 2;
+    b1 = 1 - cosw0;
+    b2 = (1 - cosw0) / 2;
+    a0 = 1 + alpha;
+    a1 = -2 * cosw0;
+    a2 = 1 - alpha;
+    break;
+  case BQ_high_pass:
+    b0 = (1 + cosw0) / 2;
+    b1 = -(1 + cosw0);
+    b2 = (1 + cosw0) / 2;
+    a0 = 1 + alpha;
+    a1 = -2 * cosw0;
+    a2 = 1 - alpha;
+    break;
+  case BQ_peaking:
+  default:
+    b0 = 1 + alpha * A;
+    b1 = -2 * cosw0;
+    b2 = 1 - alpha * A;
+    a0 = 1 + alpha / A;
+    a1 = -2 * cosw0;
+    a2 = 1 - alpha / A;
+    break;
+  }
+  c->b0 = b0 / a0;
+  c->b1 = b1 / a0;
+  c->b2 = b2 / a0;
+  c->a1 = a1 / a0;
+  c->a2 = a2 / a0;
+}
+
+int biquad_type_from_name(const char *name) {
+  if (strcasecmp(name, "peaking") == 0)
+    return BQ_peaking;
+  if (strcasecmp(name, "low_shelf") == 0)
+    return BQ_low_shelf;
+  if (strcasecmp(name, "high_shelf") == 0)
+    return BQ_high_shelf;
+  if (strcasecmp(name, "low_pass") == 0)
+    return BQ_low_pass;
+  if (strcasecmp(name, "high_pass") == 0)
+    return BQ_high_pass;
+  return -1;
+}
+
+void biquad_chain_init(biquad_chain *chain, int section_count) {
+  if (section_count > BIQUAD_MAX_SECTIONS)
+    die("A biquad filter chain can not have more than %d sections.", BIQUAD_MAX_SECTIONS);
+  memset(chain, 0, sizeof(biquad_chain));
+  chain->section_count = section_count;
+  // start each section off as a filter which passes its input unchanged
+  int i;
+  for (i = 0; i < section_count; i++) {
+    chain->sections[i].b0[0] = 1.0;
+    chain->sections[i].b0[1] = 1.0;
+  }
+}
+
+void biquad_chain_set(biquad_chain *chain, int section, const biquad_coefficients *c) {
+  biquad_section *s = &chain->sections[section];
+  int lane;
+  for (lane = 0; lane < 2; lane++) {
+    s->b0[lane] = c->b0;
+    s->b1[lane] = c->b1;
+    s->b2[lane] = c->b2;
+    s->a1[lane] = c->a1;
+    s->a2[lane] = c->a2;
+  }
+}
+
+void biquad_chain_reset(biquad_chain *chain) {
+  int i;
+  for (i = 0; i < chain->section_count; i++) {
+    memset(chain->sections[i].s1, 0, sizeof(chain->sections[i].s1));
+    memset(chain->sections[i].s2, 0, sizeof(chain->sections[i].s2));
+  }
+}
+
+// The block is run through each section in turn, so that a section's coefficients and state stay
+// in registers for the whole block.
+void biquad_chain_process(biquad_chain *chain, float *data, int frames) {
+  int i, j;
+  for (i = 0; i < chain->section_count; i++) {
+    biquad_section *s = &chain->sections[i];
+    const biquad_vector b0 = *(biquad_vector *)s->b0;
+    const biquad_vector b1 = *(biquad_vector *)s->b1;
+    const biquad_vector b2 = *(biquad_vector *)s->b2;
+    const biquad_vector a1 = *(biquad_vector *)s->a1;
+    const biquad_vector a2 = *(biquad_vector *)s->a2;
+    biquad_vector s1 = *(biquad_vector *)s->s1;
+    biquad_vector s2 = *(biquad_vector *)s->s2;
+    float *p = data;
+    for (j = 0; j < frames; j++) {
+      biquad_vector x = {p[0], p[1]};
+      biquad_vector y = b0 * x + s1;
+      s1 = b1 * x - a1 * y + s2;
+      s2 = b2 * x - a2 * y + anti_denormal;
+      p[0] = y[0];
+      p[1] = y[1];
+      p += 2;
+    }
+    *(biquad_vector *)s->s1 = s1;
+    *(biquad_vector *)s->s2 = s2;
+  }
+}
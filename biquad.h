@@ -0,0 +1,48 @@
+#pragma once
+
+// A cascade of biquad filter sections, run over blocks of interleaved stereo float samples.
+// Each section is a transposed direct form II filter. Both channels are processed together, as a
+// pair of doubles in one vector register. Double precision is needed because single precision
+// coefficients can place the poles of a low frequency filter outside the unit circle at high
+// sample rates, e.g. a 10 Hz shelf at 352,800 Hz.
+
+#define BIQUAD_MAX_SECTIONS 16
+
+enum biquad_type {
+  BQ_peaking = 0,
+  BQ_low_shelf,
+  BQ_high_shelf,
+  BQ_low_pass,
+  BQ_high_pass,
+};
+
+typedef struct {
+  double b0, b1, b2, a1, a2; // normalised so that a0 is 1
+} biquad_coefficients;
+
+// a section's coefficients and state, each held for both channels, left then right
+typedef struct {
+  double b0[2], b1[2], b2[2], a1[2], a2[2];
+  double s1[2], s2[2];
+} __attribute__((aligned(16))) biquad_section;
+
+typedef struct {
+  int section_count;
+  biquad_section sections[BIQUAD_MAX_SECTIONS];
+} biquad_chain;
+
+// design a filter from the "Audio EQ Cookbook" by Robert Bristow-Johnson
+// gain_db is ignored for the low and high pass filters
+void biquad_design(biquad_coefficients *c, enum biquad_type type, double rate, double frequency,
+                   double q, double gain_db);
+
+// parse a filter type name, returning -1 if it isn't recognised
+int biquad_type_from_name(const char *name);
+
+void biquad_chain_init(biquad_chain *chain, int section_count);
+// set a section's coefficients, keeping its state, so that it can be changed while in use
+void biquad_chain_set(biquad_chain *chain, int section, const biquad_coefficients *c);
+// clear the filter's history
+void biquad_chain_reset(biquad_chain *chain);
+// filter interleaved stereo samples in place
+void biquad_chain_process(biquad_chain *chain, float *data, int frames);
@@ -0,0 +1,248 @@
+/*
+ * Recording and replaying RTP sessions. This file is part of Shairport Sync.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "common.h"
+#include "rtp.h"
+
+#define CAPTURE_STREAM_LENGTH (12 * 4 + 1 + 16 + 16 + 8)
+#define CAPTURE_FILE_BUFFER_LENGTH 65536
+
+struct capture {
+  FILE *file;
+  char *buffer;
+  uint64_t records, bytes;
+  int failed; // a write has failed, so nothing more is written
+};
+
+static void put_uint32(uint8_t *p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static void put_uint64(uint8_t *p, uint64_t v) {
+  put_uint32(p, v >> 32);
+  put_uint32(p + 4, v & 0xffffffff);
+}
+
+static uint32_t get_uint32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static uint64_t get_uint64(const uint8_t *p) {
+  return ((uint64_t)get_uint32(p) << 32) + get_uint32(p + 4);
+}
+
+capture *capture_open(const char *path, rtsp_conn_info *conn) {
+  // each session gets a file of its own, named after its conversation and when it started
+  char name[4096], started[32];
+  time_t now = time(NULL);
+  struct tm local;
+  strftime(started, sizeof(started), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+  snprintf(name, sizeof(name), "%s.%d.%s", path, conn->connection_number, started);
+
+  capture *c = calloc(1, sizeof(capture));
+  if (c == NULL)
+    return NULL;
+  // the recording holds the stream's key, so only its owner may read it, and an existing file,
+  // or a link planted in its place, is never written through
+  int fd = open(name, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR);
+  if ((fd < 0) || ((c->file = fdopen(fd, "wb")) == NULL)) {
+    warn("Can't create \"%s\" to record the session in -- error %d.", name, errno);
+    if (fd >= 0)
+      close(fd);
+    free(c);
+    return NULL;
+  }
+  // the packets arrive on the RTP thread, so they're written in large blocks
+  c->buffer = malloc(CAPTURE_FILE_BUFFER_LENGTH);
+  if (c->buffer)
+    setvbuf(c->file, c->buffer, _IOFBF, CAPTURE_FILE_BUFFER_LENGTH);
+  fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), c->file);
+
+  uint8_t stream[CAPTURE_STREAM_LENGTH];
+  uint8_t *p = stream;
+  int i;
+  for (i = 0; i < 12; i++, p += 4)
+    put_uint32(p, conn->stream.fmtp[i]);
+  *p++ = conn->stream.encrypted ? 1 : 0;
+  memcpy(p, conn->stream.aeskey, 16);
+  p += 16;
+  memcpy(p, conn->stream.aesiv, 16);
+  p += 16;
+  put_uint64(p, config.latency);
+  capture_packet(c, CAPTURE_STREAM, get_absolute_time_in_fp(), stream, sizeof(stream));
+  debug(1, "Recording the session in \"%s\".", name);
+  return c;
+}
+
+void capture_packet(capture *c, enum capture_record_type type, uint64_t time, const void *data,
+                    size_t length) {
+  if ((c->failed) || (length > 0xffff))
+    return;
+  uint8_t header[CAPTURE_HEADER_LENGTH];
+  header[0] = type;
+  header[1] = 0;
+  header[2] = length >> 8;
+  header[3] = length & 0xff;
+  put_uint64(header + 4, time);
+  if ((fwrite(header, 1, sizeof(header), c->file) != sizeof(header)) ||
+      (fwrite(data, 1, length, c->file) != length)) {
+    warn("Error writing the session's recording -- it is incomplete.");
+    c->failed = 1;
+    return;
+  }
+  c->records++;
+  c->bytes += sizeof(header) + length;
+}
+
+void capture_close(capture *c) {
+  if (c) {
+    if (fclose(c->file) != 0)
+      warn("Error closing the session's recording -- it may be incomplete.");
+    debug(1, "Recorded %llu packets in %llu bytes.", c->records, c->bytes);
+    free(c->buffer);
+    free(c);
+  }
+}
+
+// read a record, returning its length, or -1 at the end of the file or if it's damaged
+static int capture_read(FILE *f, enum capture_record_type *type, uint64_t *time, uint8_t *data) {
+  uint8_t header[CAPTURE_HEADER_LENGTH];
+  if (fread(header, 1, sizeof(header), f) != sizeof(header))
+    return -1;
+  *type = header[0];
+  int length = (header[2] << 8) | header[3];
+  *time = get_uint64(header + 4);
+  if ((int)fread(data, 1, length, f) != length) {
+    warn("The recording ends in the middle of a packet.");
+    return -1;
+  }
+  return length;
+}
+
+// the 64-bit FNV-1a hash, folding in a frame's samples
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length) {
+  const uint8_t *p = data;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+int capture_replay(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    warn("Can't open the recording \"%s\" -- error %d.", path, errno);
+    return -1;
+  }
+  char magic[sizeof(CAPTURE_MAGIC) - 1];
+  uint8_t *data = malloc(0x10000);
+  enum capture_record_type type;
+  uint64_t time;
+  if ((data == NULL) || (fread(magic, 1, sizeof(magic), f) != sizeof(magic)) ||
+      (memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) ||
+      (capture_read(f, &type, &time, data) != CAPTURE_STREAM_LENGTH) ||
+      (type != CAPTURE_STREAM)) {
+    warn("\"%s\" is not a recording of a session.", path);
+    free(data);
+    fclose(f);
+    return -1;
+  }
+
+  rtsp_conn_info *conn = calloc(1, sizeof(rtsp_conn_info));
+  if (conn == NULL)
+    die("Couldn't allocate memory for replaying a recording.");
+  uint8_t *p = data;
+  int i;
+  for (i = 0; i < 12; i++, p += 4)
+    conn->stream.fmtp[i] = get_uint32(p);
+  conn->stream.encrypted = *p++;
+  memcpy(conn->stream.aeskey, p, 16);
+  p += 16;
+  memcpy(conn->stream.aesiv, p, 16);
+  p += 16;
+  config.latency = get_uint64(p);
+
+  set_virtual_time_in_fp(time);
+  rtp_initialise(conn);
+  if (player_replay_begin(conn) != 0) {
+    warn("The stream recorded in \"%s\" can't be decoded.", path);
+    rtp_terminate(conn);
+    set_virtual_time_in_fp(0);
+    free(conn);
+    free(data);
+    fclose(f);
+    return -1;
+  }
+  rtp_replay_begin(conn);
+
+  uint64_t records[CAPTURE_TIMING_REQUEST + 1] = {0};
+  uint64_t frames = 0, checksum = 0xcbf29ce484222325;
+  clock_t cpu_time = clock();
+  int rc = 0, length;
+  while ((length = capture_read(f, &type, &time, data)) >= 0) {
+    if ((type <= CAPTURE_STREAM) || (type > CAPTURE_TIMING_REQUEST)) {
+      warn("Unknown record of type %d in the recording -- replay abandoned.", type);
+      rc = -1;
+      break;
+    }
+    records[type]++;
+    set_virtual_time_in_fp(time);
+    rtp_replay_packet(type, data, length, conn);
+    abuf_t *frame;
+    while ((frame = player_replay_frame(time, conn)) != NULL) {
+      if (frame->timestamp) {
+        checksum = fnv1a(checksum, frame->data,
+                         sizeof(int32_t) * frame->length * conn->input_num_channels);
+        frames += frame->length;
+      } else {
+        checksum = fnv1a(checksum, "missing", 7);
+      }
+    }
+  }
+  if ((rc == 0) && (!feof(f)))
+    rc = -1;
+  cpu_time = clock() - cpu_time;
+
+  inform("Replayed %llu audio, %llu control and %llu timing packets and %llu timing requests.",
+         records[CAPTURE_AUDIO], records[CAPTURE_CONTROL], records[CAPTURE_TIMING],
+         records[CAPTURE_TIMING_REQUEST]);
+  inform("Played %llu frames with a checksum of %016llx. Packets missing: %llu, late: %llu, too "
+         "late: %llu. Resend requests: %llu, for %llu packets, of which %llu arrived.",
+         frames, checksum, conn->missing_packets, conn->late_packets, conn->too_late_packets,
+         conn->resend_requests, conn->resend_packets, conn->resend_recovered);
+  inform("Clock uncertainty at the end: %.3f ms. CPU time taken: %.3f seconds.",
+         conn->clock_uncertainty * 1000.0 / ((uint64_t)1 << 32), 1.0 * cpu_time / CLOCKS_PER_SEC);
+  if (conn->packets_decoded) {
+    double decoding_time = 1.0 * conn->decoding_time / ((uint64_t)1 << 32);
+    double decrypting_time = 1.0 * conn->decrypting_time / ((uint64_t)1 << 32);
+    inform("Decrypted and decoded %llu packets in %.3f seconds -- %.1f microseconds per packet, "
+           "%.1f of them decrypting, or %.0f packets per second.",
+           conn->packets_decoded, decoding_time, decoding_time * 1000000.0 / conn->packets_decoded,
+           decrypting_time * 1000000.0 / conn->packets_decoded,
+           decoding_time > 0.0 ? conn->packets_decoded / decoding_time : 0.0);
+  }
+
+  player_replay_end(conn);
+  rtp_terminate(conn);
+  set_virtual_time_in_fp(0);
+  free(conn);
+  free(data);
+  fclose(f);
+  return rc;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "player.h"
+
+// Recording a session's RTP traffic, and replaying it.
+// A capture file starts with CAPTURE_MAGIC, followed by records, each with a twelve byte header:
+//  type -- one byte, a capture_record_type
+//  flags -- one byte, zero
+//  length -- two bytes, the length of the body that follows the header
+//  time -- eight bytes, the local time, as from get_absolute_time_in_fp(), when the packet arrived
+//          or, for a timing request, when it was sent
+// All numbers are in network byte order. The first record is a CAPTURE_STREAM, whose body is the
+// stream's twelve fmtp numbers of four bytes each, a byte that's 1 if it's encrypted, the AES key
+// and initialisation vector of sixteen bytes each, and the latency in frames, of eight bytes. The
+// rest hold packets, just as they were received or sent.
+// A capture holds the key to the stream, so it should be kept as private as the audio itself.
+//
+// When a capture is replayed, its packets are put through the same handlers as when they
+// arrived, with the clock stopped at each packet's time, and the frames are taken out of the
+// buffer when they fall due. Nothing is played -- a checksum of the frames and the counts of
+// missing, late and resent packets are logged, so that runs can be compared, along with the CPU
+// time taken and the time spent decrypting and decoding each packet.
+
+#define CAPTURE_MAGIC "SPSCAP1\n"
+#define CAPTURE_HEADER_LENGTH 12
+
+enum capture_record_type {
+  CAPTURE_STREAM = 1,
+  CAPTURE_AUDIO,          // a packet received on the audio port
+  CAPTURE_CONTROL,        // a packet received on the control port
+  CAPTURE_TIMING,         // a packet received on the timing port
+  CAPTURE_TIMING_REQUEST, // a timing request sent
+};
+
+typedef struct capture capture;
+
+// start recording a session in a new file, named by adding the conversation number and the
+// local time to path, e.g. "path.3.20170621-101500" -- NULL if the file can't be created
+capture *capture_open(const char *path, rtsp_conn_info *conn);
+void capture_packet(capture *c, enum capture_record_type type, uint64_t time, const void *data,
+                    size_t length);
+void capture_close(capture *c);
+
+// replay a capture, returning 0 if it could be read to the end
+int capture_replay(const char *path);
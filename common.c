@@ -26,9 +26,11 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <memory.h>
 #include <poll.h>
 #include <popt.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,6 +41,7 @@
 #include <unistd.h>
 
 #include "common.h"
+#include "hooks.h"
 #include <assert.h>
 
 #ifdef COMPILE_FOR_OSX
@@ -326,23 +329,67 @@ static char super_secret_key[] =
     "2gG0N5hvJpzwwhbhXqFKA4zaaSrw622wDniAK5MlIE0tIAKKP4yxNGjoD2QYjhBGuhvkWKY=\n"
     "-----END RSA PRIVATE KEY-----\0";
 
-#ifdef HAVE_LIBSSL
-uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
-  static RSA *rsa = NULL;
+// The private key is parsed once, by rsa_load_key(), and is only read after that.
+// With mbed TLS and PolarSSL, an RSA private key operation updates the blinding values held in
+// the key's context, and it needs a random number generator. So each operation borrows a copy of
+// the key, along with its own seeded generator, from a small pool. A copy is made and seeded only
+// when none is spare, and at most RSA_SPARE_CONTEXTS are kept, which is enough for the RTSP
+// workers that use them.
+
+#if defined(HAVE_LIBMBEDTLS) || defined(HAVE_LIBPOLARSSL)
+#define RSA_SPARE_CONTEXTS 4
+
+typedef struct rsa_worker_context rsa_worker_context;
+static rsa_worker_context *rsa_worker_context_new(void);
+static void rsa_worker_context_free(rsa_worker_context *t);
+
+static pthread_mutex_t rsa_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static rsa_worker_context *rsa_spare_contexts[RSA_SPARE_CONTEXTS];
+static int rsa_nspare = 0;
+
+static rsa_worker_context *rsa_worker_context_acquire(void) {
+  rsa_worker_context *t = NULL;
+  pthread_mutex_lock(&rsa_pool_lock);
+  if (rsa_nspare)
+    t = rsa_spare_contexts[--rsa_nspare];
+  pthread_mutex_unlock(&rsa_pool_lock);
+  if (t == NULL)
+    t = rsa_worker_context_new();
+  return t;
+}
 
-  if (!rsa) {
-    BIO *bmem = BIO_new_mem_buf(super_secret_key, -1);
-    rsa = PEM_read_bio_RSAPrivateKey(bmem, NULL, NULL, NULL);
-    BIO_free(bmem);
+static void rsa_worker_context_release(rsa_worker_context *t) {
+  pthread_mutex_lock(&rsa_pool_lock);
+  if (rsa_nspare < RSA_SPARE_CONTEXTS) {
+    rsa_spare_contexts[rsa_nspare++] = t;
+    t = NULL;
   }
+  pthread_mutex_unlock(&rsa_pool_lock);
+  if (t)
+    rsa_worker_context_free(t);
+}
+#endif
+
+#ifdef HAVE_LIBSSL
+static RSA *rsa_key = NULL;
+
+void rsa_load_key(void) {
+  BIO *bmem = BIO_new_mem_buf(super_secret_key, -1);
+  rsa_key = PEM_read_bio_RSAPrivateKey(bmem, NULL, NULL, NULL);
+  BIO_free(bmem);
+  if (rsa_key == NULL)
+    die("Can't read the private key.");
+}
 
-  uint8_t *out = malloc(RSA_size(rsa));
+// OpenSSL serialises the blinding itself and keeps a process-wide random number generator
+uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
+  uint8_t *out = malloc(RSA_size(rsa_key));
   switch (mode) {
   case RSA_MODE_AUTH:
-    *outlen = RSA_private_encrypt(inlen, input, out, rsa, RSA_PKCS1_PADDING);
+    *outlen = RSA_private_encrypt(inlen, input, out, rsa_key, RSA_PKCS1_PADDING);
     break;
   case RSA_MODE_KEY:
-    *outlen = RSA_private_decrypt(inlen, input, out, rsa, RSA_PKCS1_OAEP_PADDING);
+    *outlen = RSA_private_decrypt(inlen, input, out, rsa_key, RSA_PKCS1_OAEP_PADDING);
     break;
   default:
     die("bad rsa mode");
@@ -352,38 +399,61 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
 #endif
 
 #ifdef HAVE_LIBMBEDTLS
-uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
-  mbedtls_pk_context pkctx;
-  mbedtls_rsa_context *trsa;
-  const char *pers = "rsa_encrypt";
-  size_t olen = *outlen;
-  int rc;
+static mbedtls_pk_context rsa_key;
 
+struct rsa_worker_context {
   mbedtls_entropy_context entropy;
   mbedtls_ctr_drbg_context ctr_drbg;
+  mbedtls_rsa_context rsa;
+};
+
+static void rsa_worker_context_free(rsa_worker_context *t) {
+  mbedtls_rsa_free(&t->rsa);
+  mbedtls_ctr_drbg_free(&t->ctr_drbg);
+  mbedtls_entropy_free(&t->entropy);
+  free(t);
+}
 
-  mbedtls_entropy_init(&entropy);
-
-  mbedtls_ctr_drbg_init(&ctr_drbg);
-  mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)pers,
-                        strlen(pers));
-
-  mbedtls_pk_init(&pkctx);
+void rsa_load_key(void) {
+  mbedtls_pk_init(&rsa_key);
+  int rc = mbedtls_pk_parse_key(&rsa_key, (unsigned char *)super_secret_key,
+                                sizeof(super_secret_key), NULL, 0);
+  if (rc != 0)
+    die("Error %d reading the private key.", rc);
+}
 
-  rc = mbedtls_pk_parse_key(&pkctx, (unsigned char *)super_secret_key, sizeof(super_secret_key),
-                            NULL, 0);
+static rsa_worker_context *rsa_worker_context_new(void) {
+  const char *pers = "rsa_encrypt";
+  rsa_worker_context *t = malloc(sizeof(rsa_worker_context));
+  if (t == NULL)
+    die("Can't allocate an RSA context.");
+  mbedtls_entropy_init(&t->entropy);
+  mbedtls_ctr_drbg_init(&t->ctr_drbg);
+  int rc = mbedtls_ctr_drbg_seed(&t->ctr_drbg, mbedtls_entropy_func, &t->entropy,
+                                 (const unsigned char *)pers, strlen(pers));
+  if (rc != 0)
+    debug(1, "mbedtls_ctr_drbg_seed error %d.", rc);
+  mbedtls_rsa_init(&t->rsa, MBEDTLS_RSA_PKCS_V15, MBEDTLS_MD_NONE);
+  rc = mbedtls_rsa_copy(&t->rsa, mbedtls_pk_rsa(rsa_key));
   if (rc != 0)
-    debug(1, "Error %d reading the private key.", rc);
+    die("Error %d copying the private key.", rc);
+  return t;
+}
+
+uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
+  rsa_worker_context *t = rsa_worker_context_acquire();
+  mbedtls_rsa_context *trsa = &t->rsa;
+  size_t olen = *outlen;
+  int rc;
 
   uint8_t *outbuf = NULL;
-  trsa = mbedtls_pk_rsa(pkctx);
 
   switch (mode) {
   case RSA_MODE_AUTH:
     mbedtls_rsa_set_padding(trsa, MBEDTLS_RSA_PKCS_V15, MBEDTLS_MD_NONE);
     outbuf = malloc(trsa->len);
-    rc = mbedtls_rsa_pkcs1_encrypt(trsa, mbedtls_ctr_drbg_random, &ctr_drbg, MBEDTLS_RSA_PRIVATE,
-                                   inlen, input, outbuf);
+    rc = mbedtls_rsa_pkcs1_encrypt(trsa, mbedtls_ctr_drbg_random, &t->ctr_drbg,
+                                   MBEDTLS_RSA_PRIVATE, inlen, input, outbuf);
     if (rc != 0)
       debug(1, "mbedtls_pk_encrypt error %d.", rc);
     *outlen = trsa->len;
@@ -391,8 +461,8 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
   case RSA_MODE_KEY:
     mbedtls_rsa_set_padding(trsa, MBEDTLS_RSA_PKCS_V21, MBEDTLS_MD_SHA1);
     outbuf = malloc(trsa->len);
-    rc = mbedtls_rsa_pkcs1_decrypt(trsa, mbedtls_ctr_drbg_random, &ctr_drbg, MBEDTLS_RSA_PRIVATE,
-                                   &olen, input, outbuf, trsa->len);
+    rc = mbedtls_rsa_pkcs1_decrypt(trsa, mbedtls_ctr_drbg_random, &t->ctr_drbg,
+                                   MBEDTLS_RSA_PRIVATE, &olen, input, outbuf, trsa->len);
     if (rc != 0)
       debug(1, "mbedtls_pk_decrypt error %d.", rc);
     *outlen = olen;
@@ -400,56 +470,93 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
   default:
     die("bad rsa mode");
   }
-
-  mbedtls_ctr_drbg_free(&ctr_drbg);
-  mbedtls_entropy_free(&entropy);
-  mbedtls_pk_free(&pkctx);
+  rsa_worker_context_release(t);
   return outbuf;
 }
 #endif
 
 #ifdef HAVE_LIBPOLARSSL
-uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
-  rsa_context trsa;
-  const char *pers = "rsa_encrypt";
-  int rc;
+static rsa_context rsa_key;
 
+struct rsa_worker_context {
   entropy_context entropy;
   ctr_drbg_context ctr_drbg;
-  entropy_init(&entropy);
-  if ((rc = ctr_drbg_init(&ctr_drbg, entropy_func, &entropy, (const unsigned char *)pers,
+  rsa_context rsa;
+};
+
+static void rsa_worker_context_free(rsa_worker_context *t) {
+  rsa_free(&t->rsa);
+#if POLARSSL_VERSION_NUMBER >= 0x01030800
+  ctr_drbg_free(&t->ctr_drbg);
+#endif
+#if POLARSSL_VERSION_NUMBER >= 0x01030000
+  entropy_free(&t->entropy);
+#endif
+  free(t);
+}
+
+// BTW, parsing seems to reset a lot of parameters in the rsa_context
+static int rsa_parse_key(rsa_context *trsa) {
+  rsa_init(trsa, RSA_PKCS_V21, POLARSSL_MD_SHA1); // padding and hash id get overwritten
+  return x509parse_key(trsa, (unsigned char *)super_secret_key, strlen(super_secret_key), NULL,
+                       0);
+}
+
+void rsa_load_key(void) {
+  int rc = rsa_parse_key(&rsa_key);
+  if (rc != 0)
+    die("Error %d reading the private key.", rc);
+}
+
+static rsa_worker_context *rsa_worker_context_new(void) {
+  const char *pers = "rsa_encrypt";
+  int rc;
+  rsa_worker_context *t = malloc(sizeof(rsa_worker_context));
+  if (t == NULL)
+    die("Can't allocate an RSA context.");
+  entropy_init(&t->entropy);
+  if ((rc = ctr_drbg_init(&t->ctr_drbg, entropy_func, &t->entropy, (const unsigned char *)pers,
                           strlen(pers))) != 0)
     debug(1, "ctr_drbg_init returned %d\n", rc);
-
-  rsa_init(&trsa, RSA_PKCS_V21, POLARSSL_MD_SHA1); // padding and hash id get overwritten
-  // BTW, this seems to reset a lot of parameters in the rsa_context
-  rc = x509parse_key(&trsa, (unsigned char *)super_secret_key, strlen(super_secret_key), NULL, 0);
+#if POLARSSL_VERSION_NUMBER >= 0x01030000
+  rsa_init(&t->rsa, RSA_PKCS_V21, POLARSSL_MD_SHA1);
+  rc = rsa_copy(&t->rsa, &rsa_key);
+#else
+  rc = rsa_parse_key(&t->rsa); // there's no rsa_copy() before 1.3
+#endif
   if (rc != 0)
-    debug(1, "Error %d reading the private key.");
+    die("Error %d copying the private key.", rc);
+  return t;
+}
+
+uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
+  rsa_worker_context *t = rsa_worker_context_acquire();
+  rsa_context *trsa = &t->rsa;
+  int rc;
 
   uint8_t *out = NULL;
 
   switch (mode) {
   case RSA_MODE_AUTH:
-    trsa.padding = RSA_PKCS_V15;
-    trsa.hash_id = POLARSSL_MD_NONE;
+    trsa->padding = RSA_PKCS_V15;
+    trsa->hash_id = POLARSSL_MD_NONE;
     debug(2, "rsa_apply encrypt");
-    out = malloc(trsa.len);
-    rc = rsa_pkcs1_encrypt(&trsa, ctr_drbg_random, &ctr_drbg, RSA_PRIVATE, inlen, input, out);
+    out = malloc(trsa->len);
+    rc = rsa_pkcs1_encrypt(trsa, ctr_drbg_random, &t->ctr_drbg, RSA_PRIVATE, inlen, input, out);
     if (rc != 0)
       debug(1, "rsa_pkcs1_encrypt error %d.", rc);
-    *outlen = trsa.len;
+    *outlen = trsa->len;
     break;
   case RSA_MODE_KEY:
     debug(2, "rsa_apply decrypt");
-    trsa.padding = RSA_PKCS_V21;
-    trsa.hash_id = POLARSSL_MD_SHA1;
-    out = malloc(trsa.len);
+    trsa->padding = RSA_PKCS_V21;
+    trsa->hash_id = POLARSSL_MD_SHA1;
+    out = malloc(trsa->len);
 #if POLARSSL_VERSION_NUMBER >= 0x01020900
-    rc = rsa_pkcs1_decrypt(&trsa, ctr_drbg_random, &ctr_drbg, RSA_PRIVATE, (size_t *)outlen, input,
-                           out, trsa.len);
+    rc = rsa_pkcs1_decrypt(trsa, ctr_drbg_random, &t->ctr_drbg, RSA_PRIVATE, (size_t *)outlen,
+                           input, out, trsa->len);
 #else
-    rc = rsa_pkcs1_decrypt(&trsa, RSA_PRIVATE, outlen, input, out, trsa.len);
+    rc = rsa_pkcs1_decrypt(trsa, RSA_PRIVATE, outlen, input, out, trsa->len);
 #endif
     if (rc != 0)
       debug(1, "decrypt error %d.", rc);
@@ -457,156 +564,93 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
   default:
     die("bad rsa mode");
   }
-  rsa_free(&trsa);
+  rsa_worker_context_release(t);
   debug(2, "rsa_apply exit");
   return out;
 }
 #endif
 
-void command_set_volume(double volume) {
-  if (config.cmd_set_volume) {
-    /*Spawn a child to run the program.*/
-    pid_t pid = fork();
-    if (pid == 0) { /* child process */
-      size_t command_buffer_size = strlen(config.cmd_set_volume) + 32;
-      char *command_buffer = (char *)malloc(command_buffer_size);
-      if (command_buffer == NULL) {
-        inform("Couldn't allocate memory for set_volume argument string");
-      } else {
-        memset(command_buffer, 0, command_buffer_size);
-        sprintf(command_buffer, "%s%f", config.cmd_set_volume, volume);
-        // debug(1,"command_buffer is \"%s\".",command_buffer);
-        int argC;
-        char **argV;
-        // debug(1,"set_volume command found.");
-        if (poptParseArgvString(command_buffer, &argC, (const char ***)&argV) != 0) {
-          // note that argV should be free()'d after use, but we expect this fork to exit
-          // eventually.
-          warn("Can't decipher on-set-volume command arguments \"%s\".", command_buffer);
-          free(argV);
-          free(command_buffer);
-        } else {
-          free(command_buffer);
-          // debug(1,"Executing on-set-volume command %s with %d arguments.",argV[0],argC);
-          execv(argV[0], argV);
-          warn("Execution of on-set-volume command \"%s\" failed to start", config.cmd_set_volume);
-          // debug(1, "Error executing on-set-volume command %s", config.cmd_set_volume);
-          exit(127); /* only if execv fails */
-        }
-      }
+// The persistent on-set-volume helper, started on first use and restarted if it goes away.
+// Each new volume is written to its standard input as a line of text.
+static pthread_mutex_t volume_helper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int volume_helper_fd = -1;
+
+static int volume_helper_start(void) {
+  int pipes[2];
+  if (pipe(pipes) != 0) {
+    warn("Unable to allocate a pipe for the on-set-volume command.");
+    debug(1, "pipe finished with error %d", errno);
+    return -1;
+  }
+  // don't let other children inherit the helper's input
+  fcntl(pipes[1], F_SETFD, FD_CLOEXEC);
+  pid_t pid = hook_spawn("on-set-volume", config.cmd_set_volume, pipes[0], -1);
+  close(pipes[0]);
+  if (pid < 0) {
+    close(pipes[1]);
+    return -1;
+  }
+  debug(1, "Persistent on-set-volume command \"%s\" started as process %d.", config.cmd_set_volume,
+        pid);
+  return pipes[1];
+}
 
-    } else {
-      if (config.cmd_blocking) { /* pid!=0 means parent process and if blocking is true, wait for
-                                    process to finish */
-        pid_t rc = waitpid(pid, 0, 0); /* wait for child to exit */
-        if (rc != pid) {
-          warn("Execution of on-set-volume command returned an error.");
-          debug(1, "on-set-volume command %s finished with error %d", config.cmd_set_volume, errno);
-        }
-      }
-      // debug(1,"Continue after on-set-volume command");
-    }
+static void command_set_volume_persistent(double volume) {
+  char line[32];
+  int len = snprintf(line, sizeof(line), "%f\n", volume);
+  pthread_mutex_lock(&volume_helper_mutex);
+  int attempt;
+  // if the helper has gone away, the write fails with EPIPE, so start it again and try once more
+  for (attempt = 0; attempt < 2; attempt++) {
+    if (volume_helper_fd < 0)
+      volume_helper_fd = volume_helper_start();
+    if (volume_helper_fd < 0)
+      break;
+    if (write(volume_helper_fd, line, len) == len)
+      break;
+    debug(1, "Persistent on-set-volume command has gone away -- error %d.", errno);
+    close(volume_helper_fd);
+    volume_helper_fd = -1;
   }
+  pthread_mutex_unlock(&volume_helper_mutex);
 }
 
-void command_start(void) {
-  if (config.cmd_start) {
-    pid_t pid;
-    int pipes[2];
+void command_set_volume(double volume) {
+  if ((config.cmd_set_volume) && (config.cmd_set_volume_persistent)) {
+    command_set_volume_persistent(volume);
+  } else if (config.cmd_set_volume) {
+    // the volume is appended to the command line
+    char argument[32];
+    snprintf(argument, sizeof(argument), "%f", volume);
+    hook_run("on-set-volume", config.cmd_set_volume, argument,
+             (config.cmd_blocking ? HOOK_WAIT_FOR_EXIT : 0) | HOOK_REPLACE_QUEUED, NULL);
+  }
+}
 
-    if (config.cmd_start_returns_output && pipe(pipes) != 0) {
-      warn("Unable to allocate pipe for popen of start command.");
-      debug(1, "pipe finished with error %d", errno);
-      return;
-    }
-    /*Spawn a child to run the program.*/
-    pid = fork();
-    if (pid == 0) { /* child process */
-      int argC;
-      char **argV;
-
-      if (config.cmd_start_returns_output) {
-        close(pipes[0]);
-        if (dup2(pipes[1], 1) < 0) {
-          warn("Unable to reopen pipe as stdout for popen of start command");
-          debug(1, "dup2 finished with error %d", errno);
-          close(pipes[1]);
-          return;
-        }
-      }
+#ifdef CONFIG_ALSA
+static void command_start_output_handler(char *output) {
+  debug(1, "received '%s' as the device to use from the on-start command", output);
+  set_alsa_out_dev(output);
+}
+#endif
 
-      // debug(1,"on-start command found.");
-      if (poptParseArgvString(config.cmd_start, &argC, (const char ***)&argV) !=
-          0) // note that argV should be free()'d after use, but we expect this fork to exit
-             // eventually.
-        debug(1, "Can't decipher on-start command arguments");
-      else {
-        // debug(1,"Executing on-start command %s with %d arguments.",argV[0],argC);
-        execv(argV[0], argV);
-        warn("Execution of on-start command failed to start");
-        debug(1, "Error executing on-start command %s", config.cmd_start);
-        exit(127); /* only if execv fails */
-      }
-    } else {
-      if (config.cmd_blocking || config.cmd_start_returns_output) { /* pid!=0 means parent process
-                                    and if blocking is true, wait for
-                                    process to finish */
-        pid_t rc = waitpid(pid, 0, 0);                              /* wait for child to exit */
-        if (rc != pid) {
-          warn("Execution of on-start command returned an error.");
-          debug(1, "on-start command %s finished with error %d", config.cmd_start, errno);
-        }
-        if (config.cmd_start_returns_output) {
-          static char buffer[256];
-          int len;
-          close(pipes[1]);
-          len = read(pipes[0], buffer, 255);
-          close(pipes[0]);
-          buffer[len] = '\0';
-          if (buffer[len - 1] == '\n')
-            buffer[len - 1] = '\0'; // strip trailing newlines
-          debug(1, "received '%s' as the device to use from the on-start command", buffer);
+uint64_t command_start(void) {
+  uint64_t ticket = 0;
+  if (config.cmd_start) {
+    hook_output_handler output_handler = NULL;
 #ifdef CONFIG_ALSA
-          set_alsa_out_dev(buffer);
+    if (config.cmd_start_returns_output)
+      output_handler = command_start_output_handler;
 #endif
-        }
-      }
-      // debug(1,"Continue after on-start command");
-    }
+    ticket = hook_run("on-start", config.cmd_start, NULL,
+                      config.cmd_blocking ? HOOK_WAIT_FOR_EXIT : 0, output_handler);
   }
+  return ticket;
 }
 
 void command_stop(void) {
-  if (config.cmd_stop) {
-    /*Spawn a child to run the program.*/
-    pid_t pid = fork();
-    if (pid == 0) { /* child process */
-      int argC;
-      char **argV;
-      // debug(1,"on-stop command found.");
-      if (poptParseArgvString(config.cmd_stop, &argC, (const char ***)&argV) !=
-          0) // note that argV should be free()'d after use, but we expect this fork to exit
-             // eventually.
-        debug(1, "Can't decipher on-stop command arguments");
-      else {
-        // debug(1,"Executing on-stop command %s",config.cmd_stop);
-        execv(argV[0], argV);
-        warn("Execution of on-stop command failed to start");
-        debug(1, "Error executing on-stop command %s", config.cmd_stop);
-        exit(127); /* only if execv fails */
-      }
-    } else {
-      if (config.cmd_blocking) { /* pid!=0 means parent process and if blocking is true, wait for
-                                    process to finish */
-        pid_t rc = waitpid(pid, 0, 0); /* wait for child to exit */
-        if (rc != pid) {
-          warn("Execution of on-stop command returned an error.");
-          debug(1, "Stop command %s finished with error %d", config.cmd_stop, errno);
-        }
-      }
-      // debug(1,"Continue after on-stop command");
-    }
-  }
+  if (config.cmd_stop)
+    hook_run("on-stop", config.cmd_stop, NULL, config.cmd_blocking ? HOOK_WAIT_FOR_EXIT : 0, NULL);
 }
 
 // this is for reading an unsigned 32 bit number, such as an RTP timestamp
@@ -681,8 +725,21 @@ double vol2attn(double vol, long max_db, long min_db) {
   return vol_setting;
 }
 
+static uint64_t virtual_time_fp = 0; // when non-zero, the clock stands at this
+
+void set_virtual_time_in_fp(uint64_t time) {
+  __atomic_store_n(&virtual_time_fp, time, __ATOMIC_RELAXED);
+}
+
 uint64_t get_absolute_time_in_fp() {
-  uint64_t time_now_fp;
+  uint64_t time_now_fp = __atomic_load_n(&virtual_time_fp, __ATOMIC_RELAXED);
+  if (time_now_fp)
+    return time_now_fp;
+  return get_monotonic_time_in_fp();
+}
+
+uint64_t get_monotonic_time_in_fp() {
+  uint64_t time_now_fp = 0;
 #ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
   struct timespec tn;
   // can't use CLOCK_MONOTONIC_RAW as it's not implemented in OpenWrt
@@ -830,35 +887,3 @@ void r64init(uint64_t seed) { raninit(&rx, seed); }
 uint64_t r64u() { return (ranval(&rx)); }
 
 int64_t r64i() { return (ranval(&rx) >> 1); }
-
-/* generate an array of 64-bit random numbers */
-const int ranarraylength = 1009; // these will be 8-byte numbers.
-
-uint64_t *ranarray;
-
-int ranarraynext;
-
-void ranarrayinit() {
-  ranarray = (uint64_t *)malloc(ranarraylength * sizeof(uint64_t));
-  if (ranarray) {
-    int i;
-    for (i = 0; i < ranarraylength; i++)
-      ranarray[i] = r64u();
-    ranarraynext = 0;
-  } else {
-    die("failed to allocate space for the ranarray.");
-  }
-}
-
-uint64_t ranarrayval() {
-  uint64_t v = ranarray[ranarraynext];
-  ranarraynext++;
-  ranarraynext = ranarraynext % ranarraylength;
-  return v;
-}
-
-void r64arrayinit() { ranarrayinit(); }
-
-uint64_t ranarray64u() { return (ranarrayval()); }
-
-int64_t ranarray64i() { return (ranarrayval() >> 1); }
@@ -7,8 +7,10 @@
 #include <sys/socket.h>
 
 #include "audio.h"
+#include "biquad.h"
 #include "config.h"
 #include "definitions.h"
+#include "dither.h"
 #include "mdns.h"
 
 // struct sockaddr_in6 is bigger than struct sockaddr. derp
@@ -46,6 +48,36 @@ enum playback_mode_type {
   ST_right_only,
 } playback_mode_type;
 
+enum metadata_pipe_format_type {
+  MPF_xml = 0, // XML items with base64-encoded data, as always
+  MPF_binary,  // length-prefixed binary records
+};
+
+enum convolution_engine_type {
+  CE_auto = 0,  // two-stage for long impulse responses, uniform otherwise
+  CE_uniform,   // uniformly-partitioned FFT convolution
+  CE_two_stage, // short head partitions plus long tail partitions computed in the background
+};
+
+// the stages of the floating point DSP pipeline, in their default order
+enum dsp_stage_type {
+  DSP_mode_mix = 0,     // mono, reverse stereo, left only or right only
+  DSP_convolution,      // convolution with an impulse response
+  DSP_parametric_eq,    // the parametric equaliser
+  DSP_volume,           // software volume
+  DSP_loudness,         // the loudness filter
+  DSP_drift_correction, // add or remove a frame to stay in sync
+  DSP_stage_count,
+};
+
+// a section of the parametric equaliser
+typedef struct {
+  enum biquad_type type;
+  double frequency;
+  double q;
+  double gain_db;
+} parametric_eq_section;
+
 enum decoders_supported_type {
   decoder_hammerton = 0,
   decoder_apple_alac,
@@ -83,7 +115,10 @@ typedef struct {
   char *metadata_sockaddr;
   int metadata_sockport;
   int metadata_sockmsglength;
+  enum metadata_pipe_format_type metadata_pipe_format;
   int get_coverart;
+  char *cover_art_cache_directory; // if set, cover art is stored here and sent as a path
+  size_t cover_art_cache_size;     // in bytes; zero means no limit
 #endif
   uint8_t hw_addr[6];
   int port;
@@ -92,6 +127,9 @@ typedef struct {
   int ignore_volume_control;
   int volume_max_db_set; // set to 1 if a maximum volume db has been set
   int volume_max_db;
+  double volume_ramp_time; // the time, in seconds, over which software volume changes are spread
+  double volume_update_interval; // the shortest time, in seconds, between volume changes being
+                                 // applied -- changes arriving in between are coalesced
   int no_sync;            // disable synchronisation, even if it's available
   int no_mmap;            // disable use of mmap-based output, even if it's available
   double resyncthreshold; // if it get's out of whack my more than this number of seconds, resync.
@@ -119,9 +157,18 @@ typedef struct {
   int logOutputLevel;    // log output level
   int statistics_requested, use_negotiated_latencies;
   enum playback_mode_type playback_mode;
+  enum dither_type dither;
+  double output_idle_timeout; // stop the output after this many seconds of silence -- 0.0 for never
   char *cmd_start, *cmd_stop, *cmd_set_volume;
   int cmd_blocking, cmd_start_returns_output;
+  int cmd_set_volume_persistent; // run cmd_set_volume once and write each new volume to its stdin
+  double cmd_timeout; // how long, in seconds, to wait for a command to finish -- 0 means forever
   double tolerance; // allow this much drift before attempting to correct it
+  int adaptive_latency; // set the latency from the network's jitter rather than the source's
+  double adaptive_latency_minimum; // seconds -- the least latency it may come down to
+  double adaptive_latency_margin;  // seconds kept above the peak transit time
+  char *capture_file; // if set, each session's packets are recorded here -- see capture.h
+  char *replay_file;  // a recorded session to replay instead of running as a receiver
   enum stuffing_type packet_stuffing;
   int decoders_supported;
   int use_apple_decoder; // set to 1 if you want to use the apple decoder instead of the original by
@@ -149,10 +196,16 @@ typedef struct {
   const char *convolution_ir_file;
   float convolution_gain;
   int convolution_max_length;
+  enum convolution_engine_type convolution_engine;
+  int convolution_parallel; // convolve the two channels on separate threads
+  const char *convolution_cache_directory; // where partitioned impulse responses are kept, or NULL
 #endif
 
   int loudness;
   float loudness_reference_volume_db;
+  int parametric_eq_section_count;
+  parametric_eq_section parametric_eq[BIQUAD_MAX_SECTIONS];
+  enum dsp_stage_type dsp_stage_order[DSP_stage_count]; // the order of the DSP pipeline's stages
   int alsa_use_playback_switch_for_mute;
 #if defined(HAVE_DBUS)
   enum dbus_session_type dbus_service_bus_type;
@@ -182,10 +235,6 @@ void r64init(uint64_t seed);
 uint64_t r64u();
 int64_t r64i();
 
-void r64arrayinit();
-uint64_t ranarray64u();
-int64_t ranarray64i();
-
 extern int debuglev;
 void die(const char *format, ...);
 void warn(const char *format, ...);
@@ -197,6 +246,8 @@ char *base64_enc(uint8_t *input, int length);
 
 #define RSA_MODE_AUTH (0)
 #define RSA_MODE_KEY (1)
+// parse the private key -- this must be done before rsa_apply() is used
+void rsa_load_key(void);
 uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode);
 
 // given a volume (0 to -30) and high and low attenuations in dB*100 (e.g. 0 to -6000 for 0 to -60
@@ -206,6 +257,12 @@ double vol2attn(double vol, long max_db, long min_db);
 // return a monolithic (always increasing) time in nanoseconds
 
 uint64_t get_absolute_time_in_fp(void);
+// Stop the clock at a given time, as when replaying a capture, so that get_absolute_time_in_fp()
+// returns it. Zero sets the clock going again.
+void set_virtual_time_in_fp(uint64_t time);
+// the clock itself, which keeps going even when stopped for a replay -- for measuring how long
+// things take
+uint64_t get_monotonic_time_in_fp(void);
 
 // this is for reading an unsigned 32 bit number, such as an RTP timestamp
 
@@ -215,7 +272,7 @@ uint32_t uatoi(const char *nptr);
 shairport_cfg config;
 config_t config_file_stuff;
 
-void command_start(void);
+uint64_t command_start(void); // returns a ticket for hook_wait()
 void command_stop(void);
 void command_set_volume(double volume);
 
@@ -0,0 +1,253 @@
+/*
+ * Content-addressed cover art cache. This file is part of Shairport Sync.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBSSL
+#include <openssl/md5.h>
+#endif
+
+#ifdef HAVE_LIBMBEDTLS
+#include <mbedtls/md5.h>
+#endif
+
+#ifdef HAVE_LIBPOLARSSL
+#include <polarssl/md5.h>
+#endif
+
+#include "common.h"
+#include "coverart.h"
+
+typedef struct {
+  char name[48]; // the hash, followed by the file extension
+  size_t size;
+  time_t last_used;
+} coverart_entry;
+
+static char *cache_directory = NULL;
+static size_t cache_size_limit;
+static size_t cache_size;
+static coverart_entry *entries = NULL;
+static unsigned int entry_count, entry_capacity;
+static unsigned int cache_hits, cache_misses;
+
+static void coverart_hash(const char *data, size_t length, char *hex) {
+  unsigned char digest[16];
+#ifdef HAVE_LIBSSL
+  MD5_CTX ctx;
+  MD5_Init(&ctx);
+  MD5_Update(&ctx, data, length);
+  MD5_Final(digest, &ctx);
+#endif
+
+#ifdef HAVE_LIBMBEDTLS
+  mbedtls_md5_context tctx;
+  mbedtls_md5_starts(&tctx);
+  mbedtls_md5_update(&tctx, (const unsigned char *)data, length);
+  mbedtls_md5_finish(&tctx, digest);
+#endif
+
+#ifdef HAVE_LIBPOLARSSL
+  md5_context tctx;
+  md5_starts(&tctx);
+  md5_update(&tctx, (const unsigned char *)data, length);
+  md5_finish(&tctx, digest);
+#endif
+
+  int i;
+  for (i = 0; i < 16; i++)
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+static const char *coverart_extension(const char *data, size_t length) {
+  const unsigned char *p = (const unsigned char *)data;
+  if ((length >= 3) && (p[0] == 0xff) && (p[1] == 0xd8) && (p[2] == 0xff))
+    return "jpg";
+  if ((length >= 4) && (p[0] == 0x89) && (p[1] == 'P') && (p[2] == 'N') && (p[3] == 'G'))
+    return "png";
+  return "img";
+}
+
+// a cache file is named with 32 hex digits, a dot and an extension -- partly-written files have a
+// further ".tmp" extension
+static int coverart_is_cache_file_name(const char *name) {
+  int i;
+  for (i = 0; i < 32; i++)
+    if (!(((name[i] >= '0') && (name[i] <= '9')) || ((name[i] >= 'a') && (name[i] <= 'f'))))
+      return 0;
+  return (name[32] == '.') && (strchr(name + 33, '.') == NULL) &&
+         (strlen(name) < sizeof(((coverart_entry *)0)->name));
+}
+
+static char *coverart_path(const char *name) {
+  size_t pl = strlen(cache_directory) + 1 + strlen(name) + 1;
+  char *path = malloc(pl);
+  if (path)
+    snprintf(path, pl, "%s/%s", cache_directory, name);
+  return path;
+}
+
+static coverart_entry *coverart_add_entry(const char *name, size_t size, time_t last_used) {
+  if (entry_count == entry_capacity) {
+    unsigned int new_capacity = entry_capacity ? entry_capacity * 2 : 32;
+    coverart_entry *new_entries = realloc(entries, new_capacity * sizeof(coverart_entry));
+    if (new_entries == NULL)
+      return NULL;
+    entries = new_entries;
+    entry_capacity = new_capacity;
+  }
+  coverart_entry *entry = &entries[entry_count++];
+  snprintf(entry->name, sizeof(entry->name), "%s", name);
+  entry->size = size;
+  entry->last_used = last_used;
+  cache_size += size;
+  return entry;
+}
+
+// remove the least recently used images until the cache fits its limit, keeping the one just used
+static void coverart_evict(const coverart_entry *keep) {
+  while ((cache_size_limit) && (cache_size > cache_size_limit) && (entry_count > 1)) {
+    unsigned int i, oldest = entry_count;
+    for (i = 0; i < entry_count; i++)
+      if ((&entries[i] != keep) &&
+          ((oldest == entry_count) || (entries[i].last_used < entries[oldest].last_used)))
+        oldest = i;
+    char *path = coverart_path(entries[oldest].name);
+    if (path) {
+      if ((unlink(path) != 0) && (errno != ENOENT))
+        debug(1, "Could not remove cover art cache file \"%s\": \"%s\".", path, strerror(errno));
+      free(path);
+    }
+    debug(2, "Cover art cache: evicted \"%s\" (%zu bytes).", entries[oldest].name,
+          entries[oldest].size);
+    cache_size -= entries[oldest].size;
+    entry_count--;
+    if (oldest != entry_count) {
+      if (keep == &entries[entry_count])
+        keep = &entries[oldest];
+      entries[oldest] = entries[entry_count];
+    }
+  }
+}
+
+int coverart_cache_init(const char *directory, size_t size_limit) {
+  if ((mkdir(directory, 0755) != 0) && (errno != EEXIST)) {
+    warn("Could not create the cover art cache directory \"%s\": \"%s\". The cache will not be "
+         "used.",
+         directory, strerror(errno));
+    return -1;
+  }
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    warn("Could not open the cover art cache directory \"%s\": \"%s\". The cache will not be used.",
+         directory, strerror(errno));
+    return -1;
+  }
+  cache_directory = strdup(directory);
+  cache_size_limit = size_limit;
+
+  // pick up the images left by a previous run, using their modification times as last use
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    if (!coverart_is_cache_file_name(de->d_name))
+      continue;
+    char *path = coverart_path(de->d_name);
+    struct stat sb;
+    if ((path) && (stat(path, &sb) == 0) && (S_ISREG(sb.st_mode)))
+      coverart_add_entry(de->d_name, sb.st_size, sb.st_mtime);
+    free(path);
+  }
+  closedir(dir);
+  coverart_evict(NULL);
+  debug(1, "Cover art cache \"%s\" holds %u image(s) in %zu bytes.", cache_directory, entry_count,
+        cache_size);
+  return 0;
+}
+
+int coverart_cache_enabled(void) { return cache_directory != NULL; }
+
+char *coverart_cache_store(const char *data, size_t length) {
+  if ((cache_directory == NULL) || (data == NULL) || (length == 0))
+    return NULL;
+
+  char name[48];
+  coverart_hash(data, length, name);
+  snprintf(name + 32, sizeof(name) - 32, ".%s", coverart_extension(data, length));
+  char *path = coverart_path(name);
+  if (path == NULL)
+    return NULL;
+
+  time_t now = time(NULL);
+  unsigned int i;
+  for (i = 0; i < entry_count; i++) {
+    if ((strcmp(entries[i].name, name) == 0) && (access(path, R_OK) == 0)) {
+      // already cached -- just record the use so it isn't evicted
+      entries[i].last_used = now;
+      utime(path, NULL);
+      cache_hits++;
+      debug(2, "Cover art cache: \"%s\" already cached -- %u hit(s), %u miss(es).", name,
+            cache_hits, cache_misses);
+      return path;
+    }
+  }
+
+  // write to a temporary file and rename it, so that a reader never sees a partial image
+  size_t tl = strlen(path) + 5;
+  char *temp_path = malloc(tl);
+  if (temp_path == NULL) {
+    free(path);
+    return NULL;
+  }
+  snprintf(temp_path, tl, "%s.tmp", path);
+  int ok = 0;
+  int tfd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (tfd >= 0) {
+    size_t written = 0;
+    while (written < length) {
+      ssize_t rc = write(tfd, data + written, length - written);
+      if (rc < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      written += rc;
+    }
+    ok = ((close(tfd) == 0) && (written == length) && (rename(temp_path, path) == 0));
+  }
+  if (!ok) {
+    debug(1, "Could not store cover art in \"%s\": \"%s\".", path, strerror(errno));
+    unlink(temp_path);
+    free(temp_path);
+    free(path);
+    return NULL;
+  }
+  free(temp_path);
+
+  // the file may have been removed from under us, in which case it has an entry already
+  coverart_entry *entry = NULL;
+  for (i = 0; i < entry_count; i++)
+    if (strcmp(entries[i].name, name) == 0) {
+      entry = &entries[i];
+      entry->last_used = now;
+    }
+  if (entry == NULL)
+    entry = coverart_add_entry(name, length, now);
+  cache_misses++;
+  debug(2, "Cover art cache: stored \"%s\" (%zu bytes) -- %u hit(s), %u miss(es).", name, length,
+        cache_hits, cache_misses);
+  coverart_evict(entry);
+  return path;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+// A content-addressed cache of cover art images.
+// Each image is stored once, in a file in the cache directory named after the MD5 hash of its
+// contents, so the same picture arriving for every track of an album is written only once.
+// The least recently used images are removed when the cache grows larger than its size limit.
+// The cache is only used from the metadata thread, so it is not protected by a lock.
+
+int coverart_cache_init(const char *directory, size_t size_limit);
+int coverart_cache_enabled(void);
+
+// store an image in the cache, if it's not already there, and return a malloc'ed string holding
+// the full path of its file, or NULL if it could not be stored
+char *coverart_cache_store(const char *data, size_t length);
@@ -0,0 +1,98 @@
+/*
+ * Dither. This file is part of Shairport Sync.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#include "common.h"
+#include "dither.h"
+
+typedef uint64_t dither_vector __attribute__((vector_size(32)));
+
+// The 9-tap F-weighted error feedback filter for 44,100 frames per second, by Wannamaker.
+static const double shaping_44100[] = {2.412, -3.370, 3.937, -4.174, 3.353,
+                                       -2.205, 1.281, -0.569, 0.0847};
+
+// The same noise spectrum for 48,000 frames per second -- the minimum phase filter whose response,
+// at each frequency up to 22,050 Hz, matches that of the filter above, truncated to 12 taps.
+static const double shaping_48000[] = {2.6254, -3.8247, 4.2889, -3.8931, 2.3630, -0.8251,
+                                       -0.1095, 0.5148,  -0.4934, 0.2216,  -0.0940, 0.0468};
+
+void dither_init(dither_state *d, enum dither_type type, int rate, int bits) {
+  memset(d, 0, sizeof(dither_state));
+  int i;
+  for (i = 0; i < 4; i++) {
+    // the generators mustn't start at zero
+    do
+      d->s0[i] = r64u();
+    while (d->s0[i] == 0);
+    d->s1[i] = r64u();
+  }
+  d->next = DITHER_BLOCK_LENGTH;
+  d->type = type;
+  d->bits = bits;
+  if (type == DT_shaped) {
+    if (rate == 44100) {
+      d->coefficients = shaping_44100;
+      d->taps = sizeof(shaping_44100) / sizeof(double);
+    } else if (rate == 48000) {
+      d->coefficients = shaping_48000;
+      d->taps = sizeof(shaping_48000) / sizeof(double);
+    } else {
+      debug(1, "No noise shaping filter for %d frames per second -- using high pass dither.", rate);
+      d->type = DT_high_pass;
+    }
+  }
+}
+
+// the next four random numbers, each uniform over one step of the output
+static inline void dither_uniform(dither_vector *u, dither_vector *s0, dither_vector *s1,
+                                  int bits) {
+  dither_vector x = *s0;
+  const dither_vector y = *s1;
+  *s0 = y;
+  x ^= x << 23;
+  *s1 = x ^ y ^ (x >> 17) ^ (y >> 26);
+  *u = (*s1 + y) >> bits;
+}
+
+void dither_refill(dither_state *d) {
+  dither_vector s0, s1;
+  memcpy(&s0, d->s0, sizeof(s0));
+  memcpy(&s1, d->s1, sizeof(s1));
+  int i;
+  if (d->type == DT_high_pass) {
+    // keep the last block's final left and right values, to follow on from
+    d->uniform[0] = d->uniform[DITHER_BLOCK_LENGTH];
+    d->uniform[1] = d->uniform[DITHER_BLOCK_LENGTH + 1];
+    for (i = 0; i < DITHER_BLOCK_LENGTH; i += 4) {
+      dither_vector u;
+      dither_uniform(&u, &s0, &s1, d->bits);
+      memcpy(&d->uniform[i + 2], &u, sizeof(u));
+    }
+    for (i = 0; i < DITHER_BLOCK_LENGTH; i++)
+      d->tpdf[i] = d->uniform[i + 2] - d->uniform[i];
+  } else {
+    for (i = 0; i < DITHER_BLOCK_LENGTH; i += 4) {
+      dither_vector u, v;
+      dither_uniform(&u, &s0, &s1, d->bits);
+      dither_uniform(&v, &s0, &s1, d->bits);
+      dither_vector t = u - v; // modulo 2^64, so the same as the signed difference
+      memcpy(&d->tpdf[i], &t, sizeof(t));
+    }
+  }
+  memcpy(d->s0, &s0, sizeof(s0));
+  memcpy(d->s1, &s1, sizeof(s1));
+  d->next = 0;
+}
+
+int dither_type_from_name(const char *name) {
+  if (strcasecmp(name, "flat") == 0)
+    return DT_flat;
+  if (strcasecmp(name, "high_pass") == 0)
+    return DT_high_pass;
+  if (strcasecmp(name, "shaped") == 0)
+    return DT_shaped;
+  return -1;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+
+// Dither for reducing samples to the output resolution.
+// A block of triangular (TPDF) dither values, one step of the output wide, is made at a time by
+// four xorshift128+ generators run side by side in a vector, and used a sample at a time. Samples
+// arrive interleaved left, right, so even positions in the block are left and odd ones right.
+//  DT_flat      -- dither with a flat spectrum, the difference of two random numbers.
+//  DT_high_pass -- the difference between successive random numbers of each channel, which moves
+//                  the dither noise towards high frequencies.
+//  DT_shaped    -- flat dither, with the quantisation error fed back through a filter which moves
+//                  it to where the ear is least sensitive. The filters are designed for 44,100 and
+//                  48,000 frames per second -- at other rates, DT_high_pass is used.
+
+#define DITHER_BLOCK_LENGTH 1024
+#define DITHER_MAX_TAPS 12
+
+enum dither_type {
+  DT_flat = 0,
+  DT_high_pass,
+  DT_shaped,
+};
+
+typedef struct {
+  uint64_t s0[4], s1[4]; // the generators' states
+  int64_t tpdf[DITHER_BLOCK_LENGTH];
+  int64_t uniform[DITHER_BLOCK_LENGTH + 2]; // for DT_high_pass, after the last block's final pair
+  int next;
+  enum dither_type type;
+  int bits;
+  int taps; // for DT_shaped
+  const double *coefficients;
+  // each channel's past quantisation errors, most recent first from error_start, held twice over
+  // so that they can be read without wrapping around
+  double error[2][2 * DITHER_MAX_TAPS];
+  int error_start[2];
+} dither_state;
+
+// get ready to dither samples for output at the given number of bits
+void dither_init(dither_state *d, enum dither_type type, int rate, int bits);
+// make the next block of dither
+void dither_refill(dither_state *d);
+// parse a dither type name, returning -1 if it isn't recognised
+int dither_type_from_name(const char *name);
+
+// Dither a sample, held in the top bits of an int64_t, for output at the number of bits given to
+// dither_init(). It stays in the top bits -- only the low bits are to be discarded.
+static inline int64_t dither_sample(dither_state *d, int64_t sample) {
+  if (d->next == DITHER_BLOCK_LENGTH)
+    dither_refill(d);
+  const int channel = d->next & 1;
+  const int64_t tpdf = d->tpdf[d->next++];
+
+  if (d->type != DT_shaped) {
+    // add dither, allowing for clipping -- which is rare, so the branch is well predicted
+    int64_t result;
+    if (__builtin_add_overflow(sample, tpdf, &result))
+      result = tpdf > 0 ? INT64_MAX : INT64_MIN;
+    return result;
+  }
+
+  double *error = d->error[channel];
+  const double *c = d->coefficients;
+  const double *past = error + d->error_start[channel];
+  // two sums, to shorten the chain of dependent additions
+  double feedback_even = 0.0, feedback_odd = 0.0;
+  int i;
+  for (i = 0; i + 1 < d->taps; i += 2) {
+    feedback_even += c[i] * past[i];
+    feedback_odd += c[i + 1] * past[i + 1];
+  }
+  if (i < d->taps)
+    feedback_even += c[i] * past[i];
+  double wanted = (double)sample - (feedback_even + feedback_odd);
+  double dithered = wanted + tpdf;
+  int64_t result;
+  if (dithered >= 9223372036854775807.0)
+    result = INT64_MAX;
+  else if (dithered <= -9223372036854775808.0)
+    result = INT64_MIN;
+  else
+    result = dithered;
+  // the error is what will be lost, limited so that clipping can't make the feedback run away
+  const int64_t step = (int64_t)1 << (64 - d->bits);
+  double e = (double)(result & ~(step - 1)) - wanted;
+  if (e > 2.0 * step)
+    e = 2.0 * step;
+  else if (e < -2.0 * step)
+    e = -2.0 * step;
+  int start = d->error_start[channel];
+  start = (start == 0) ? d->taps - 1 : start - 1;
+  error[start] = e;
+  error[start + d->taps] = e;
+  d->error_start[channel] = start;
+  return result;
+}
@@ -0,0 +1,341 @@
+/*
+ * The floating point DSP pipeline. This file is part of Shairport Sync.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBSOXR
+#include <soxr.h>
+#endif
+
+#ifdef CONFIG_CONVOLUTION
+#include <FFTConvolver/convolver.h>
+#endif
+
+#include "biquad.h"
+#include "common.h"
+#include "dsp.h"
+#include "loudness.h"
+
+// the number of packets over which the cost of each stage is averaged for the log
+#define DSP_TIMING_INTERVAL 1000
+
+// how long the filters are given to ring down after the input falls silent, over and above the
+// length of the convolver's impulse response
+#define DSP_SETTLING_TIME 1.0
+
+typedef struct {
+  const char *name;
+  int (*enabled)(void);
+  void (*process)(dsp_block *block, rtsp_conn_info *conn);
+  // bring the stage to where it would be after processing a block of silence, once it has settled
+  // -- NULL if there's nothing to do
+  void (*skip)(dsp_block *block, rtsp_conn_info *conn);
+} dsp_stage;
+
+// the parametric equaliser, kept here rather than in the connection so that it is suitably
+// aligned for vector instructions
+static biquad_chain parametric_eq_filter;
+
+static uint64_t stage_time[DSP_stage_count];
+static uint64_t quantiser_time;
+static int packets_timed;
+
+static int mode_mix_enabled(void) { return config.playback_mode != ST_stereo; }
+
+static void mode_mix_process(dsp_block *block, rtsp_conn_info *conn) {
+  float *p = block->data;
+  int i;
+  for (i = 0; i < block->frames; i++) {
+    float l = p[0];
+    float r = p[1];
+    switch (config.playback_mode) {
+    case ST_mono:
+      l = r = (l + r) * 0.5f;
+      break;
+    case ST_reverse_stereo:
+      l = p[1];
+      r = p[0];
+      break;
+    case ST_left_only:
+      r = l;
+      break;
+    case ST_right_only:
+      l = r;
+      break;
+    case ST_stereo:
+      break;
+    }
+    p[0] = l;
+    p[1] = r;
+    p += 2;
+  }
+}
+
+#ifdef CONFIG_CONVOLUTION
+static int convolution_enabled(void) { return config.convolution; }
+
+// the convolution gain is built into the impulse response
+static void convolution_process(dsp_block *block, rtsp_conn_info *conn) {
+  convolver_process(block->data, block->frames);
+}
+#else
+static int convolution_enabled(void) { return 0; }
+static void convolution_process(dsp_block *block, rtsp_conn_info *conn) {}
+#endif
+
+static int parametric_eq_enabled(void) { return config.parametric_eq_section_count != 0; }
+
+static void parametric_eq_process(dsp_block *block, rtsp_conn_info *conn) {
+  biquad_chain_process(&parametric_eq_filter, block->data, block->frames);
+}
+
+// what's left of the filters' history after a long silence is just rounding noise
+static void parametric_eq_skip(dsp_block *block, rtsp_conn_info *conn) {
+  biquad_chain_reset(&parametric_eq_filter);
+}
+
+static int volume_enabled(void) { return 1; }
+
+// apply the software volume, following the volume ramp a frame at a time while it's moving
+static void volume_process(dsp_block *block, rtsp_conn_info *conn) {
+  const float scale = 1.0f / 4294967296.0f; // the ramp's volumes are scaled by 2^32
+  volume_ramp_t *ramp = &conn->volume_ramp;
+  float *p = block->data;
+  int i = 0;
+  for (; (i < block->frames) && (ramp->frames_left); i++) {
+    float gain = volume_ramp_next(ramp) * scale;
+    p[2 * i] *= gain;
+    p[2 * i + 1] *= gain;
+  }
+  // the rest of the packet is at a steady volume
+  float gain = ramp->current * scale;
+  for (i = 2 * i; i < 2 * block->frames; i++)
+    p[i] *= gain;
+}
+
+static void volume_skip(dsp_block *block, rtsp_conn_info *conn) {
+  volume_ramp_skip(&conn->volume_ramp, block->frames);
+}
+
+static int loudness_enabled(void) { return config.loudness; }
+
+static void loudness_stage_process(dsp_block *block, rtsp_conn_info *conn) {
+  loudness_process(block->data, block->frames);
+}
+
+static void loudness_stage_skip(dsp_block *block, rtsp_conn_info *conn) {
+  loudness_skip(block->frames);
+}
+
+static int drift_correction_enabled(void) { return 1; }
+
+// add or remove a frame where the signal is quietest or, failing that, loudest, as
+// stuff_buffer_basic_32() does for integer samples
+static void drift_correction_basic(dsp_block *block) {
+  float *p = block->data;
+  int length = block->frames;
+  int stuff = block->amount_to_stuff;
+  float min_delta = 4294967296.0f;
+  float max_delta = 0.0f;
+  int min_pos = 0, max_pos = 0;
+  int i;
+  for (i = 2; i < length; i++) {
+    float delta = 0.0f;
+    int c;
+    for (c = 0; c < 2; c++) {
+      float a = p[(i - 2) * 2 + c], b = p[(i - 1) * 2 + c], d = p[i * 2 + c];
+      float lo = a < b ? (a < d ? a : d) : (b < d ? b : d);
+      float hi = a > b ? (a > d ? a : d) : (b > d ? b : d);
+      delta += (hi - lo) * 0.5f;
+    }
+    if (delta < min_delta) {
+      min_delta = delta;
+      min_pos = i - 1;
+    }
+    if (delta > max_delta) {
+      max_delta = delta;
+      max_pos = i - 1;
+    }
+  }
+
+  int stuff_position;
+  if (min_delta < (float)(1 << 20))
+    stuff_position = min_pos;
+  else if (max_delta > (float)(1 << 30))
+    stuff_position = max_pos;
+  else
+    return;
+
+  if (stuff == 1) {
+    // interpolate one frame
+    memmove(p + (stuff_position + 1) * 2, p + stuff_position * 2,
+            (length - stuff_position) * 2 * sizeof(float));
+    p[stuff_position * 2] = (p[(stuff_position - 1) * 2] + p[(stuff_position + 1) * 2]) * 0.5f;
+    p[stuff_position * 2 + 1] =
+        (p[(stuff_position - 1) * 2 + 1] + p[(stuff_position + 1) * 2 + 1]) * 0.5f;
+  } else {
+    memmove(p + stuff_position * 2, p + (stuff_position + 1) * 2,
+            (length - stuff_position - 1) * 2 * sizeof(float));
+  }
+  block->frames += stuff;
+  block->amount_stuffed = stuff;
+}
+
+#ifdef HAVE_LIBSOXR
+// resample the whole packet to be one frame longer or shorter
+static void drift_correction_soxr(dsp_block *block) {
+  int length = block->frames;
+  int stuff = block->amount_to_stuff;
+  soxr_io_spec_t io_spec;
+  io_spec.itype = SOXR_FLOAT32_I;
+  io_spec.otype = SOXR_FLOAT32_I;
+  io_spec.scale = 1.0;
+  io_spec.e = NULL;
+  io_spec.flags = 0;
+
+  size_t odone;
+  soxr_error_t error = soxr_oneshot(length, length + stuff, 2, block->data, length, NULL,
+                                    block->scratch, length + stuff, &odone, &io_spec, NULL, NULL);
+  if (error)
+    die("soxr error: %s\n", soxr_strerror(error));
+  if (odone > (size_t)(length + 1))
+    die("odone = %d!\n", odone);
+
+  // keep the first and last few frames, to mitigate the Gibbs phenomenon
+  const int gpm = 5;
+  memcpy(block->scratch, block->data, gpm * 2 * sizeof(float));
+  memcpy(block->scratch + (length + stuff - gpm) * 2, block->data + (length - gpm) * 2,
+         gpm * 2 * sizeof(float));
+
+  memcpy(block->data, block->scratch, (length + stuff) * 2 * sizeof(float));
+  block->frames += stuff;
+  block->amount_stuffed = stuff;
+}
+#endif
+
+static void drift_correction_process(dsp_block *block, rtsp_conn_info *conn) {
+  block->amount_stuffed = 0;
+  if ((block->amount_to_stuff > 1) || (block->amount_to_stuff < -1) ||
+      (block->amount_to_stuff == 0) || (block->frames < 100))
+    return;
+#ifdef HAVE_LIBSOXR
+  if (config.packet_stuffing == ST_soxr) {
+    drift_correction_soxr(block);
+    return;
+  }
+#endif
+  drift_correction_basic(block);
+}
+
+// a frame of silence can be added or removed anywhere
+static void drift_correction_skip(dsp_block *block, rtsp_conn_info *conn) {
+  block->amount_stuffed = 0;
+  if ((block->amount_to_stuff > 1) || (block->amount_to_stuff < -1) || (block->frames < 100))
+    return;
+  block->frames += block->amount_to_stuff;
+  block->amount_stuffed = block->amount_to_stuff;
+}
+
+static const dsp_stage dsp_stages[DSP_stage_count] = {
+    {"mode", mode_mix_enabled, mode_mix_process, NULL},
+    // by the time it has settled, all it holds of the past input is silence
+    {"convolution", convolution_enabled, convolution_process, NULL},
+    {"parametric_eq", parametric_eq_enabled, parametric_eq_process, parametric_eq_skip},
+    {"volume", volume_enabled, volume_process, volume_skip},
+    {"loudness", loudness_enabled, loudness_stage_process, loudness_stage_skip},
+    {"drift_correction", drift_correction_enabled, drift_correction_process,
+     drift_correction_skip},
+};
+
+int dsp_stage_from_name(const char *name) {
+  int i;
+  for (i = 0; i < DSP_stage_count; i++)
+    if (strcasecmp(name, dsp_stages[i].name) == 0)
+      return i;
+  return -1;
+}
+
+const char *dsp_stage_name(enum dsp_stage_type stage) { return dsp_stages[stage].name; }
+
+int dsp_pipeline_wanted(void) {
+  return convolution_enabled() || parametric_eq_enabled() || loudness_enabled();
+}
+
+int64_t dsp_pipeline_settling_frames(void) {
+  int64_t frames = (int64_t)(DSP_SETTLING_TIME * config.output_rate);
+#ifdef CONFIG_CONVOLUTION
+  // the impulse response is resampled to the output rate and cut to the maximum length
+  if (config.convolution)
+    frames += config.convolution_max_length;
+#endif
+  return frames;
+}
+
+void dsp_pipeline_init(rtsp_conn_info *conn) {
+  // design the parametric equaliser for the output rate -- the audio has been brought up to that
+  // rate by the time it's filtered
+  biquad_chain_init(&parametric_eq_filter, config.parametric_eq_section_count);
+  int i;
+  for (i = 0; i < config.parametric_eq_section_count; i++) {
+    biquad_coefficients c;
+    biquad_design(&c, config.parametric_eq[i].type, config.output_rate,
+                  config.parametric_eq[i].frequency, config.parametric_eq[i].q,
+                  config.parametric_eq[i].gain_db);
+    biquad_chain_set(&parametric_eq_filter, i, &c);
+  }
+
+  memset(stage_time, 0, sizeof(stage_time));
+  quantiser_time = 0;
+  packets_timed = 0;
+}
+
+void dsp_pipeline_add_quantiser_time(uint64_t time) {
+  quantiser_time += time;
+  if (++packets_timed == DSP_TIMING_INTERVAL) {
+    char report[256];
+    size_t len = 0;
+    double to_us = 1000000.0 / ((uint64_t)1 << 32);
+    int i;
+    report[0] = 0;
+    for (i = 0; i < DSP_stage_count; i++) {
+      enum dsp_stage_type stage = config.dsp_stage_order[i];
+      if ((dsp_stages[stage].enabled()) && (len < sizeof(report)))
+        len += snprintf(report + len, sizeof(report) - len, "%s %.1f, ", dsp_stages[stage].name,
+                        to_us * stage_time[stage] / packets_timed);
+    }
+    debug(2, "DSP pipeline time in us per packet: %squantiser %.1f.", report,
+          to_us * quantiser_time / packets_timed);
+    memset(stage_time, 0, sizeof(stage_time));
+    quantiser_time = 0;
+    packets_timed = 0;
+  }
+}
+
+void dsp_pipeline_process(dsp_block *block, rtsp_conn_info *conn) {
+  block->amount_stuffed = 0;
+  int i;
+  for (i = 0; i < DSP_stage_count; i++) {
+    enum dsp_stage_type stage = config.dsp_stage_order[i];
+    if (dsp_stages[stage].enabled()) {
+      uint64_t time_before = get_absolute_time_in_fp();
+      dsp_stages[stage].process(block, conn);
+      stage_time[stage] += get_absolute_time_in_fp() - time_before;
+    }
+  }
+}
+
+void dsp_pipeline_skip(dsp_block *block, rtsp_conn_info *conn) {
+  block->amount_stuffed = 0;
+  int i;
+  for (i = 0; i < DSP_stage_count; i++) {
+    enum dsp_stage_type stage = config.dsp_stage_order[i];
+    if ((dsp_stages[stage].enabled()) && (dsp_stages[stage].skip))
+      dsp_stages[stage].skip(block, conn);
+  }
+}
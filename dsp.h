@@ -0,0 +1,35 @@
+#pragma once
+
+#include "player.h"
+
+// The floating point DSP pipeline.
+// When any floating point processing is enabled, the player converts each packet to interleaved
+// stereo floats, scaled to the range of an int32_t, and passes it through the stages of the
+// pipeline in the order given by config.dsp_stage_order. It then dithers and quantises the result
+// to the output format just once.
+
+typedef struct {
+  float *data;         // interleaved stereo samples, with room for max_frame_size_change more
+  float *scratch;      // as big as data, for stages that can't work in place
+  int frames;          // the number of frames in data
+  int amount_to_stuff; // the number of frames the drift correction stage should add or remove
+  int amount_stuffed;  // the number it did add or remove
+} dsp_block;
+
+// whether any floating point processing is enabled
+int dsp_pipeline_wanted(void);
+// get the stages ready for a new play session at config.output_rate
+void dsp_pipeline_init(rtsp_conn_info *conn);
+void dsp_pipeline_process(dsp_block *block, rtsp_conn_info *conn);
+// Silence needn't be processed once the stages have settled, i.e. once the input has been silent
+// for dsp_pipeline_settling_frames(). Instead, the stages are brought to where they would be had
+// the block been processed -- the block's data isn't touched and the output is all zeros, with
+// block->frames adjusted for any frame the drift correction adds or removes.
+int64_t dsp_pipeline_settling_frames(void);
+void dsp_pipeline_skip(dsp_block *block, rtsp_conn_info *conn);
+// the timing counters are reported every so many packets -- this counts the quantiser in too
+void dsp_pipeline_add_quantiser_time(uint64_t time);
+
+// parse a stage name, returning -1 if it isn't recognised
+int dsp_stage_from_name(const char *name);
+const char *dsp_stage_name(enum dsp_stage_type stage);
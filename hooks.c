@@ -0,0 +1,306 @@
+/*
+ * Running external commands. This file is part of Shairport Sync.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <popt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "hooks.h"
+
+extern char **environ;
+
+#define HOOK_QUEUE_LENGTH 16
+#define HOOK_OUTPUT_LENGTH 256
+#define HOOK_STATISTICS_LENGTH 8
+
+// how long a command that has timed out is given to exit after SIGTERM before it's killed
+#define HOOK_KILL_GRACE_TIME 1.0
+
+typedef struct {
+  const char *name;
+  char *command_line;
+  int flags;
+  hook_output_handler output_handler;
+  uint64_t ticket;
+  uint64_t time_queued;
+} hook_job;
+
+// the latency of each kind of command, for the log
+typedef struct {
+  const char *name;
+  int runs;
+  uint64_t queue_time, spawn_time, run_time, max_run_time;
+} hook_statistics;
+
+static pthread_mutex_t hook_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hook_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t hook_thread;
+static int hook_thread_started = 0;
+static hook_job hook_queue[HOOK_QUEUE_LENGTH];
+static int hook_queue_start = 0, hook_queue_count = 0;
+static uint64_t hook_last_ticket = 0, hook_completed_ticket = 0;
+static hook_statistics hook_stats[HOOK_STATISTICS_LENGTH]; // only used by the hook thread
+
+static double fp_to_ms(uint64_t t) { return t * 1000.0 / ((uint64_t)1 << 32); }
+
+static hook_statistics *hook_statistics_for(const char *name) {
+  int i;
+  for (i = 0; i < HOOK_STATISTICS_LENGTH; i++) {
+    if (hook_stats[i].name == NULL)
+      hook_stats[i].name = name;
+    if (strcmp(hook_stats[i].name, name) == 0)
+      return &hook_stats[i];
+  }
+  return NULL;
+}
+
+// Wait for a child to exit, until the deadline. The SIGCHLD handler may reap the child first, in
+// which case its exit status is lost. Returns 1 if it has exited.
+static int hook_reap(pid_t pid, uint64_t deadline, int *status) {
+  while (1) {
+    pid_t rc = waitpid(pid, status, WNOHANG);
+    if (rc == pid)
+      return 1;
+    if ((rc < 0) && (errno != EINTR)) {
+      *status = -1;
+      return 1;
+    }
+    if ((deadline) && (get_absolute_time_in_fp() >= deadline))
+      return 0;
+    usleep(10000);
+  }
+}
+
+// read the command's output until it closes its end of the pipe or the deadline passes
+static void hook_collect_output(int fd, char *buffer, uint64_t deadline) {
+  int len = 0;
+  while (len < HOOK_OUTPUT_LENGTH - 1) {
+    int timeout = -1;
+    if (deadline) {
+      uint64_t time_now = get_absolute_time_in_fp();
+      if (time_now >= deadline)
+        break;
+      timeout = (int)fp_to_ms(deadline - time_now) + 1;
+    }
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int rc = poll(&pfd, 1, timeout);
+    if ((rc < 0) && (errno == EINTR))
+      continue;
+    if (rc <= 0)
+      break;
+    ssize_t got = read(fd, buffer + len, HOOK_OUTPUT_LENGTH - 1 - len);
+    if ((got < 0) && (errno == EINTR))
+      continue;
+    if (got <= 0)
+      break;
+    len += got;
+  }
+  buffer[len] = '\0';
+  if ((len) && (buffer[len - 1] == '\n'))
+    buffer[len - 1] = '\0'; // strip a trailing newline
+}
+
+pid_t hook_spawn(const char *name, const char *command_line, int input_fd, int output_fd) {
+  int argC;
+  char **argV;
+  if (poptParseArgvString(command_line, &argC, (const char ***)&argV) != 0) {
+    warn("Can't decipher %s command arguments \"%s\".", name, command_line);
+    return -1;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (input_fd >= 0) {
+    posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&actions, input_fd);
+  }
+  if (output_fd >= 0) {
+    posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, output_fd);
+  }
+  // the daemon's threads run with most signals blocked -- the command shouldn't inherit that
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  sigset_t signals;
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attributes, &signals);
+  sigaddset(&signals, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attributes, &signals);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  pid_t pid;
+  int rc = posix_spawn(&pid, argV[0], &actions, &attributes, argV, environ);
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&actions);
+  free(argV);
+  if (rc != 0) {
+    warn("Execution of %s command \"%s\" failed to start.", name, command_line);
+    debug(1, "posix_spawn finished with error %d", rc);
+    return -1;
+  }
+  return pid;
+}
+
+static void hook_execute(hook_job *job) {
+  static char output[HOOK_OUTPUT_LENGTH]; // passed to the output handler, which may keep it
+  int pipes[2] = {-1, -1};
+  if (job->output_handler) {
+    if (pipe(pipes) != 0) {
+      warn("Unable to allocate a pipe for the output of the %s command.", job->name);
+      debug(1, "pipe finished with error %d", errno);
+      return;
+    }
+    fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
+  }
+
+  uint64_t time_started = get_absolute_time_in_fp();
+  pid_t pid = hook_spawn(job->name, job->command_line, -1, pipes[1]);
+  uint64_t time_spawned = get_absolute_time_in_fp();
+  if (job->output_handler)
+    close(pipes[1]);
+  if (pid < 0) {
+    if (job->output_handler)
+      close(pipes[0]);
+    return;
+  }
+
+  int status = 0;
+  int exited = 1;
+  if ((job->flags & HOOK_WAIT_FOR_EXIT) || (job->output_handler)) {
+    uint64_t deadline = 0;
+    if (config.cmd_timeout > 0.0)
+      deadline = time_spawned + (uint64_t)(config.cmd_timeout * ((uint64_t)1 << 32));
+    if (job->output_handler) {
+      hook_collect_output(pipes[0], output, deadline);
+      close(pipes[0]);
+    }
+    exited = hook_reap(pid, deadline, &status);
+    if (exited == 0) {
+      warn("The %s command \"%s\" has not finished after %.1f seconds and will be stopped.",
+           job->name, job->command_line, config.cmd_timeout);
+      kill(pid, SIGTERM);
+      uint64_t grace = (uint64_t)(HOOK_KILL_GRACE_TIME * ((uint64_t)1 << 32));
+      if (hook_reap(pid, get_absolute_time_in_fp() + grace, &status) == 0) {
+        kill(pid, SIGKILL);
+        hook_reap(pid, 0, &status);
+      }
+    } else if ((status > 0) && ((!WIFEXITED(status)) || (WEXITSTATUS(status) != 0))) {
+      warn("Execution of %s command returned an error.", job->name);
+      debug(1, "%s command %s finished with status %d", job->name, job->command_line, status);
+    }
+    if ((exited) && (job->output_handler))
+      job->output_handler(output);
+  }
+  uint64_t time_finished = get_absolute_time_in_fp();
+
+  hook_statistics *stats = hook_statistics_for(job->name);
+  if (stats) {
+    uint64_t run_time = time_finished - time_spawned;
+    stats->runs++;
+    stats->queue_time += time_started - job->time_queued;
+    stats->spawn_time += time_spawned - time_started;
+    stats->run_time += run_time;
+    if (run_time > stats->max_run_time)
+      stats->max_run_time = run_time;
+    debug(2,
+          "%s command: %.2f ms in the queue, %.2f ms to spawn, %.2f ms %s. Averages over %d runs: "
+          "%.2f ms queued, %.2f ms spawning, %.2f ms running, with a maximum of %.2f ms running.",
+          job->name, fp_to_ms(time_started - job->time_queued),
+          fp_to_ms(time_spawned - time_started), fp_to_ms(run_time),
+          ((job->flags & HOOK_WAIT_FOR_EXIT) || (job->output_handler)) ? "to run" : "not waited for",
+          stats->runs, fp_to_ms(stats->queue_time) / stats->runs,
+          fp_to_ms(stats->spawn_time) / stats->runs, fp_to_ms(stats->run_time) / stats->runs,
+          fp_to_ms(stats->max_run_time));
+  }
+}
+
+static void *hook_thread_func(void *arg) {
+  pthread_mutex_lock(&hook_mutex);
+  while (1) {
+    while (hook_queue_count == 0)
+      pthread_cond_wait(&hook_cond, &hook_mutex);
+    hook_job job = hook_queue[hook_queue_start];
+    hook_queue_start = (hook_queue_start + 1) % HOOK_QUEUE_LENGTH;
+    hook_queue_count--;
+    pthread_mutex_unlock(&hook_mutex);
+
+    hook_execute(&job);
+    free(job.command_line);
+
+    pthread_mutex_lock(&hook_mutex);
+    hook_completed_ticket = job.ticket;
+    pthread_cond_broadcast(&hook_cond);
+  }
+  return NULL;
+}
+
+uint64_t hook_run(const char *name, const char *command, const char *argument, int flags,
+                  hook_output_handler output_handler) {
+  size_t command_line_size = strlen(command) + (argument ? strlen(argument) : 0) + 1;
+  char *command_line = malloc(command_line_size);
+  if (command_line == NULL) {
+    warn("Couldn't allocate memory for the %s command line.", name);
+    return 0;
+  }
+  snprintf(command_line, command_line_size, "%s%s", command, argument ? argument : "");
+
+  uint64_t ticket = 0;
+  pthread_mutex_lock(&hook_mutex);
+  if (hook_thread_started == 0) {
+    if (pthread_create(&hook_thread, NULL, &hook_thread_func, NULL) != 0)
+      die("Could not create the thread to run external commands.");
+    hook_thread_started = 1;
+  }
+  if (flags & HOOK_REPLACE_QUEUED) {
+    int i;
+    for (i = 0; (i < hook_queue_count) && (ticket == 0); i++) {
+      hook_job *job = &hook_queue[(hook_queue_start + i) % HOOK_QUEUE_LENGTH];
+      if (strcmp(job->name, name) == 0) {
+        // it keeps its place in the queue, and its ticket
+        free(job->command_line);
+        job->command_line = command_line;
+        job->flags = flags;
+        job->output_handler = output_handler;
+        ticket = job->ticket;
+      }
+    }
+  }
+  if (ticket == 0) {
+    if (hook_queue_count == HOOK_QUEUE_LENGTH) {
+      warn("Too many external commands are waiting to run -- the %s command \"%s\" is dropped.",
+           name, command_line);
+      free(command_line);
+    } else {
+      hook_job *job = &hook_queue[(hook_queue_start + hook_queue_count) % HOOK_QUEUE_LENGTH];
+      job->name = name;
+      job->command_line = command_line;
+      job->flags = flags;
+      job->output_handler = output_handler;
+      job->ticket = ticket = ++hook_last_ticket;
+      job->time_queued = get_absolute_time_in_fp();
+      hook_queue_count++;
+      pthread_cond_broadcast(&hook_cond);
+    }
+  }
+  pthread_mutex_unlock(&hook_mutex);
+  return ticket;
+}
+
+void hook_wait(uint64_t ticket) {
+  pthread_mutex_lock(&hook_mutex);
+  while (hook_completed_ticket < ticket)
+    pthread_cond_wait(&hook_cond, &hook_mutex);
+  pthread_mutex_unlock(&hook_mutex);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// The external commands run at the start and end of play and when the volume is set.
+// Commands are queued and run in order by a thread of their own, so that neither the RTSP thread
+// nor the player thread waits for a command to be started or to finish. Each is started with
+// posix_spawn(), which doesn't copy the daemon's memory map, as fork() does.
+
+#define HOOK_WAIT_FOR_EXIT 1    // wait, for up to config.cmd_timeout, for it to finish
+#define HOOK_REPLACE_QUEUED 2   // replace a queued command of the same name not yet started
+
+// called on the hook thread with what the command wrote to its standard output
+typedef void (*hook_output_handler)(char *output);
+
+// Queue a command, given as a command line to which the argument, if any, is appended.
+// If output_handler isn't NULL, the command's output is collected and passed to it.
+// Returns a ticket for hook_wait(), or 0 if the queue is full and the command is dropped.
+uint64_t hook_run(const char *name, const char *command, const char *argument, int flags,
+                  hook_output_handler output_handler);
+
+// wait until a queued command has been run and, if it was to be waited for, has finished
+void hook_wait(uint64_t ticket);
+
+// Start a command straight away, with its standard input and output taken from the given file
+// descriptors, or inherited where they are -1. Returns its process id, or -1 if it can't be started.
+pid_t hook_spawn(const char *name, const char *command_line, int input_fd, int output_fd);
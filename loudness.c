@@ -1,42 +1,97 @@
 #include "loudness.h"
+#include "biquad.h"
 #include "common.h"
 #include <math.h>
 
-loudness_processor loudness_r;
-loudness_processor loudness_l;
+// While the volume ramps, the filter is redesigned for each block of this many frames
+#define LOUDNESS_RAMP_BLOCK 32
 
-void _loudness_set_volume(loudness_processor *p, float volume) {
+// this has no sections, so it passes the audio unchanged, until it's first used
+static biquad_chain loudness_filter;
+
+// the volume, in dB, set by the RTSP thread and read by the player thread, using atomic operations
+static float loudness_target_volume;
+
+// the volume the filter is designed for, which ramps towards the target, and the ramp itself --
+// these are only used by the player thread
+static float loudness_volume, loudness_ramp_target, loudness_ramp_step;
+static int loudness_ramp_blocks_left;
+
+void _loudness_set_volume(biquad_chain *chain, float volume) {
   float gain = -(volume - config.loudness_reference_volume_db) * 0.5;
   if (gain < 0)
     gain = 0;
 
-  float Fc = 10.0;
-  float Q = 0.5;
+  if (chain->section_count == 0)
+    biquad_chain_init(chain, 1);
+
+  double Fc = 10.0;
+  double Q = 0.5;
 
   // Formula from http://www.earlevel.com/main/2011/01/02/biquad-formulas/
-  float Fs = 44100.0;
+  // The audio has been brought up to the output rate by the time it's filtered.
+  double Fs = config.output_rate;
 
-  float K = tan(M_PI * Fc / Fs);
-  float V = pow(10.0, gain / 20.0);
+  double K = tan(M_PI * Fc / Fs);
+  double V = pow(10.0, gain / 20.0);
 
-  float norm = 1 / (1 + 1 / Q * K + K * K);
-  p->a0 = (1 + V / Q * K + K * K) * norm;
-  p->a1 = 2 * (K * K - 1) * norm;
-  p->a2 = (1 - V / Q * K + K * K) * norm;
-  p->b1 = p->a1;
-  p->b2 = (1 - 1 / Q * K + K * K) * norm;
+  double norm = 1 / (1 + 1 / Q * K + K * K);
+  biquad_coefficients c;
+  c.b0 = (1 + V / Q * K + K * K) * norm;
+  c.b1 = 2 * (K * K - 1) * norm;
+  c.b2 = (1 - V / Q * K + K * K) * norm;
+  c.a1 = c.b1;
+  c.a2 = (1 - 1 / Q * K + K * K) * norm;
+  biquad_chain_set(chain, 0, &c);
 }
 
-float loudness_process(loudness_processor *p, float i0) {
-  float o0 = p->a0 * i0 + p->a1 * p->i1 + p->a2 * p->i2 - p->b1 * p->o1 - p->b2 * p->o2;
-
-  p->o2 = p->o1;
-  p->o1 = o0;
+// The filter follows changes of volume over the same ramp time as the volume itself, so that its
+// coefficients don't jump.
+static void loudness_follow_target(void) {
+  float target;
+  __atomic_load(&loudness_target_volume, &target, __ATOMIC_ACQUIRE);
+  if (loudness_filter.section_count == 0) {
+    loudness_volume = loudness_ramp_target = target;
+    _loudness_set_volume(&loudness_filter, loudness_volume);
+  } else if (target != loudness_ramp_target) {
+    loudness_ramp_target = target;
+    loudness_ramp_blocks_left = config.volume_ramp_time * config.output_rate / LOUDNESS_RAMP_BLOCK;
+    if (loudness_ramp_blocks_left == 0)
+      loudness_ramp_blocks_left = 1;
+    loudness_ramp_step = (target - loudness_volume) / loudness_ramp_blocks_left;
+  }
+}
 
-  p->i2 = p->i1;
-  p->i1 = i0;
+void loudness_process(float *data, int frames) {
+  loudness_follow_target();
+  while ((frames > 0) && (loudness_ramp_blocks_left)) {
+    loudness_volume += loudness_ramp_step;
+    if (--loudness_ramp_blocks_left == 0)
+      loudness_volume = loudness_ramp_target;
+    _loudness_set_volume(&loudness_filter, loudness_volume);
+    int block = frames < LOUDNESS_RAMP_BLOCK ? frames : LOUDNESS_RAMP_BLOCK;
+    biquad_chain_process(&loudness_filter, data, block);
+    data += 2 * block;
+    frames -= block;
+  }
+  if (frames > 0)
+    biquad_chain_process(&loudness_filter, data, frames);
+}
 
-  return o0;
+void loudness_skip(int frames) {
+  loudness_follow_target();
+  if (loudness_ramp_blocks_left) {
+    int blocks = (frames + LOUDNESS_RAMP_BLOCK - 1) / LOUDNESS_RAMP_BLOCK;
+    if (blocks >= loudness_ramp_blocks_left) {
+      loudness_volume = loudness_ramp_target;
+      loudness_ramp_blocks_left = 0;
+    } else {
+      loudness_volume += loudness_ramp_step * blocks;
+      loudness_ramp_blocks_left -= blocks;
+    }
+    _loudness_set_volume(&loudness_filter, loudness_volume);
+  }
+  biquad_chain_reset(&loudness_filter);
 }
 
 void loudness_set_volume(float volume) {
@@ -45,6 +100,5 @@ void loudness_set_volume(float volume) {
     gain = 0;
 
   inform("Volume: %.1f dB - Loudness gain @10Hz: %.1f dB", volume, gain);
-  _loudness_set_volume(&loudness_l, volume);
-  _loudness_set_volume(&loudness_r, volume);
+  __atomic_store(&loudness_target_volume, &volume, __ATOMIC_RELEASE);
 }
@@ -2,13 +2,9 @@
 
 #include <stdio.h>
 
-typedef struct {
-  float a0, a1, a2, b1, b2;
-  float i1, i2, o1, o2;
-} loudness_processor;
-
-extern loudness_processor loudness_r;
-extern loudness_processor loudness_l;
-
 void loudness_set_volume(float volume);
-float loudness_process(loudness_processor *p, float sample);
+// filter interleaved stereo samples in place
+void loudness_process(float *data, int frames);
+// follow the volume over a number of silent frames without filtering them, leaving the filter
+// with no history, as it would be after a long silence
+void loudness_skip(int frames);
@@ -0,0 +1,167 @@
+/*
+ * Metadata pipe output. This file is part of Shairport Sync.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "metadata_pipe.h"
+
+// including a simple base64 encoder to minimise malloc/free activity
+
+// From Stack Overflow, with thanks:
+// http://stackoverflow.com/questions/342409/how-do-i-base64-encode-decode-in-c
+// minor mods to make independent of C99.
+// more significant changes make it not malloc memory
+// needs to initialise the docoding table first
+
+// add _so to end of name to avoid confusion with polarssl's implementation
+
+static char encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M',
+                                'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z',
+                                'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm',
+                                'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z',
+                                '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'};
+
+static int mod_table[] = {0, 2, 1};
+
+// pass in a pointer to the data, its length, a pointer to the output buffer and
+// a pointer to an int
+// containing its maximum length
+// the actual length will be returned.
+
+char *base64_encode_so(const unsigned char *data, size_t input_length, char *encoded_data,
+                       size_t *output_length) {
+
+  size_t calculated_output_length = 4 * ((input_length + 2) / 3);
+  if (calculated_output_length > *output_length)
+    return (NULL);
+  *output_length = calculated_output_length;
+
+  int i, j;
+  for (i = 0, j = 0; i < input_length;) {
+
+    uint32_t octet_a = i < input_length ? (unsigned char)data[i++] : 0;
+    uint32_t octet_b = i < input_length ? (unsigned char)data[i++] : 0;
+    uint32_t octet_c = i < input_length ? (unsigned char)data[i++] : 0;
+
+    uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
+
+    encoded_data[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
+    encoded_data[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
+    encoded_data[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
+    encoded_data[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
+  }
+
+  for (i = 0; i < mod_table[input_length % 3]; i++)
+    encoded_data[*output_length - 1 - i] = '=';
+
+  return encoded_data;
+}
+
+// like non_blocking_write() in common.c, but gathers the data from a number of buffers.
+// Partial writes are continued by updating the iovec array in place.
+ssize_t non_blocking_writev(int fd, struct iovec *iov, int iovcnt) {
+  size_t count = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++)
+    count += iov[i].iov_len;
+  size_t bytes_remaining = count;
+  int rc = 1;
+  struct pollfd ufds[1];
+  while ((bytes_remaining > 0) && (rc > 0)) {
+    ufds[0].fd = fd;
+    ufds[0].events = POLLOUT;
+    rc = poll(ufds, 1, 5000);
+    if (rc == 0) {
+      rc = -1;
+      errno = -ETIMEDOUT;
+    } else if (rc > 0) {
+      ssize_t bytes_written = writev(fd, iov, iovcnt);
+      if (bytes_written == -1) {
+        rc = -1;
+      } else {
+        bytes_remaining -= bytes_written;
+        // step over what has been written
+        while ((iovcnt > 0) && ((size_t)bytes_written >= iov->iov_len)) {
+          bytes_written -= iov->iov_len;
+          iov++;
+          iovcnt--;
+        }
+        if (iovcnt > 0) {
+          iov->iov_base = (char *)iov->iov_base + bytes_written;
+          iov->iov_len -= bytes_written;
+        }
+      }
+    }
+  }
+  if (rc > 0)
+    return count - bytes_remaining;
+  else
+    return rc;
+}
+
+ssize_t metadata_pipe_write_items(int fd, enum metadata_pipe_format_type format,
+                                  metadata_package *packs, int count) {
+  struct iovec iov[metadata_batch_size * 5];
+  char headers[metadata_batch_size][128];
+  char *encodings[metadata_batch_size];
+  int niov = 0;
+  int i;
+  if (count > metadata_batch_size)
+    count = metadata_batch_size;
+  for (i = 0; i < count; i++) {
+    metadata_package *pack = &packs[i];
+    int have_data = (pack->data != NULL) && (pack->length > 0);
+    encodings[i] = NULL;
+    if (format == MPF_binary) {
+      uint32_t v[3];
+      v[0] = htonl(pack->type);
+      v[1] = htonl(pack->code);
+      v[2] = htonl(have_data ? pack->length : 0);
+      memcpy(headers[i], v, sizeof(v));
+      iov[niov].iov_base = headers[i];
+      iov[niov++].iov_len = sizeof(v);
+      if (have_data) {
+        iov[niov].iov_base = pack->data;
+        iov[niov++].iov_len = pack->length;
+      }
+    } else {
+      snprintf(headers[i], sizeof(headers[i]),
+               "<item><type>%x</type><code>%x</code><length>%u</length>", pack->type, pack->code,
+               pack->length);
+      iov[niov].iov_base = headers[i];
+      iov[niov++].iov_len = strlen(headers[i]);
+      if (have_data) {
+        size_t encoded_length = 4 * ((pack->length + 2) / 3);
+        encodings[i] = malloc(encoded_length);
+        if ((encodings[i] == NULL) ||
+            (base64_encode_so((unsigned char *)pack->data, pack->length, encodings[i],
+                              &encoded_length) == NULL)) {
+          debug(1, "Error encoding base64 data.");
+          encoded_length = 0;
+        }
+        iov[niov].iov_base = "\n<data encoding=\"base64\">\n";
+        iov[niov++].iov_len = strlen("\n<data encoding=\"base64\">\n");
+        iov[niov].iov_base = encodings[i];
+        iov[niov++].iov_len = encoded_length;
+        iov[niov].iov_base = "</data>";
+        iov[niov++].iov_len = strlen("</data>");
+      }
+      iov[niov].iov_base = "</item>\n";
+      iov[niov++].iov_len = strlen("</item>\n");
+    }
+  }
+
+  ssize_t ret = non_blocking_writev(fd, iov, niov);
+
+  for (i = 0; i < count; i++)
+    if (encodings[i])
+      free(encodings[i]);
+  return ret;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "rtsp_parse.h"
+
+// The writing of metadata items to the metadata pipe, a batch at a time, with one gathering write.
+// In XML format, each item's data is base64-encoded in one piece rather than in 57-byte groups,
+// producing the same output. In binary format, each item is a 4-byte type, a 4-byte code and a
+// 4-byte length, all in network byte order, followed by the data, which is written as-is.
+
+// the most metadata items written to the pipe in one go
+#define metadata_batch_size 16
+
+typedef struct {
+  uint32_t type;
+  uint32_t code;
+  char *data;
+  uint32_t length;
+  rtsp_message *carrier;
+} metadata_package;
+
+// Write a batch of up to metadata_batch_size items to the pipe open on fd.
+// Returns the number of bytes written, or -1 with errno set.
+ssize_t metadata_pipe_write_items(int fd, enum metadata_pipe_format_type format,
+                                  metadata_package *packs, int count);
+
+// encode into the caller's buffer, whose size is passed in *output_length. Returns NULL if it's
+// too small; otherwise the encoded length is left in *output_length
+char *base64_encode_so(const unsigned char *data, size_t input_length, char *encoded_data,
+                       size_t *output_length);
+
+ssize_t non_blocking_writev(int fd, struct iovec *iov, int iovcnt); // the iovec array is modified
@@ -57,7 +57,7 @@
 #endif
 
 #ifdef HAVE_LIBSSL
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 #endif
 
 #ifdef HAVE_LIBSOXR
@@ -95,6 +95,8 @@
 #include "apple_alac.h"
 #endif
 
+#include "dsp.h"
+#include "hooks.h"
 #include "loudness.h"
 
 // default buffer size
@@ -105,9 +107,49 @@
 // DAC buffer occupancy stuff
 #define DAC_BUFFER_QUEUE_MINIMUM_LENGTH 600
 
+// the most, as a multiple of the configured tolerance, that the sync tolerance is widened to allow
+// for an uncertain source clock
+#define CLOCK_UNCERTAINTY_TOLERANCE_LIMIT 4.0
+
 // static abuf_t audio_buffer[BUFFER_FRAMES];
 #define BUFIDX(seqno) ((seq_t)(seqno) % BUFFER_FRAMES)
 
+// Silence is played from a page of zeros, shared by everyone, a chunk at a time.
+// The biggest output frame is eight bytes.
+#define ZERO_PAGE_FRAMES 8192
+static char zero_page[ZERO_PAGE_FRAMES * 8];
+
+static void play_silence(int64_t frames) {
+  while (frames > 0) {
+    int chunk = frames < ZERO_PAGE_FRAMES ? frames : ZERO_PAGE_FRAMES;
+    config.output->play((short *)zero_page, chunk);
+    frames -= chunk;
+  }
+}
+
+// whether every sample of a decoded packet is zero -- the samples are ORed together in a way that
+// the compiler can vectorise, rather than looking at them one by one
+static int samples_are_silent(const int32_t *data, int samples) {
+  const uint32_t *p = (const uint32_t *)data;
+  uint32_t any = 0;
+  int i;
+  for (i = 0; i < samples; i++)
+    any |= p[i];
+  return any == 0;
+}
+
+// Start the output again after it has been stopped during a long silence. It starts empty, so
+// unless the prefiller silence is about to be sent, it's filled up to where the next frame is due
+// once the sync error has been worked out.
+static void player_output_wake(int refill, rtsp_conn_info *conn) {
+  debug(1, "Restarting the output after a silence.");
+  config.output->start(config.output_rate, config.output_format);
+  conn->output_idle = 0;
+  conn->output_refill = refill;
+}
+
+static void player_volume_apply(double airplay_volume, rtsp_conn_info *conn);
+
 // make timestamps and seqnos definitely monotonic
 
 // add an epoch to the timestamp. The monotonic timestamp guaranteed to start between 2^32 and 2^33
@@ -165,7 +207,9 @@ static void ab_resync(rtsp_conn_info *conn) {
   for (i = 0; i < BUFFER_FRAMES; i++) {
     conn->audio_buffer[i].ready = 0;
     conn->audio_buffer[i].sequence_number = 0;
+    conn->audio_buffer[i].missing_since = 0;
   }
+  conn->resend_outstanding = 0;
   conn->ab_synced = 0;
   conn->last_seqno_read = -1;
   conn->ab_buffering = 1;
@@ -226,6 +270,183 @@ static inline seq_t seq_sum(seq_t a, seq_t b) {
   return r;
 }
 
+// Resending. When a gap opens in the sequence numbers of the packets arriving, each missing
+// packet is tracked in its slot in the audio buffer. Once it has been missing for long enough
+// that it's unlikely just to be out of order, it is asked for -- runs of missing packets that are
+// due to be asked for together are asked for with a single request. It's asked for again, at
+// ever longer intervals, until it arrives, but only while a resent packet could arrive before
+// the slot is played.
+
+#define RESEND_HOLDOFF 0.010        // seconds to wait for a packet that's merely out of order
+#define RESEND_FIRST_INTERVAL 0.040 // seconds to wait for a resend, doubling on each retry
+#define RESEND_RESPONSE_TIME 0.020  // don't ask unless at least this long before it's played
+
+static uint64_t seconds_to_fp(double seconds) { return (uint64_t)(seconds * ((uint64_t)1 << 32)); }
+
+// start tracking a missing packet's slot
+static void resend_track(abuf_t *abuf, rtsp_conn_info *conn) {
+  if (abuf->missing_since == 0)
+    conn->resend_outstanding++;
+  abuf->missing_since = get_absolute_time_in_fp();
+  abuf->resend_due = abuf->missing_since + seconds_to_fp(RESEND_HOLDOFF);
+  abuf->resends = 0;
+}
+
+// stop tracking a slot, because its packet has arrived or because it's being played without it
+static void resend_untrack(abuf_t *abuf, int arrived, rtsp_conn_info *conn) {
+  if (abuf->missing_since) {
+    if ((arrived) && (abuf->resends))
+      conn->resend_recovered++;
+    abuf->missing_since = 0;
+    conn->resend_outstanding--;
+  }
+}
+
+// ask for the missing packets that are due to be asked for -- called with the ab_mutex locked
+static void resend_schedule(uint64_t time_now, rtsp_conn_info *conn) {
+  // the buffer is played a packet at a time, so a slot's turn comes that many packets from now
+  uint64_t packet_time = ((uint64_t)conn->max_frames_per_packet << 32) / conn->input_rate;
+  uint64_t response_time = seconds_to_fp(RESEND_RESPONSE_TIME);
+  int32_t filled = seq_diff(conn->ab_read, conn->ab_write, conn->ab_read);
+  int run_start = -1;
+  int i;
+  for (i = 0; i <= filled; i++) {
+    int wanted = 0;
+    if (i < filled) {
+      abuf_t *abuf = conn->audio_buffer + BUFIDX(seq_sum(conn->ab_read, i));
+      wanted = (abuf->missing_since) && (abuf->ready == 0) && (abuf->resend_due <= time_now) &&
+               (i * packet_time > response_time);
+    }
+    if ((wanted) && (run_start < 0)) {
+      run_start = i;
+    } else if ((wanted == 0) && (run_start >= 0)) {
+      // ask for the run of packets as one request
+      seq_t first = seq_sum(conn->ab_read, run_start);
+      rtp_request_resend(first, i - run_start, conn);
+      conn->resend_requests++;
+      int j;
+      for (j = run_start; j < i; j++) {
+        abuf_t *abuf = conn->audio_buffer + BUFIDX(seq_sum(conn->ab_read, j));
+        if (abuf->resends == 0)
+          conn->resend_packets++;
+        abuf->resend_due = time_now + (seconds_to_fp(RESEND_FIRST_INTERVAL) << abuf->resends);
+        if (abuf->resends < 8)
+          abuf->resends++;
+      }
+      run_start = -1;
+    }
+  }
+}
+
+// Adaptive latency. For a source that doesn't need its receivers in lockstep, the latency can be
+// cut to what the network needs. Each packet's transit time -- how long after its frames would
+// play with no latency at all it arrives -- is noted, and the latency follows the recent peak of
+// those, with a margin, plus an allowance that's raised when packets have to be resent or go
+// missing and which then decays. The latency is moved a frame at a time, and only while the
+// drift corrector is keeping up, so the change is taken up by stuffing rather than by a resync --
+// except that when it has to grow by more than a little, e.g. after a loss, it grows at once,
+// with the difference made up by a burst of silence, since waiting for the stuffing would leave it
+// short for many seconds. It shrinks by a frame for every few packets, so coming down from two
+// seconds to a quarter of a second takes about forty minutes.
+
+#define ADAPTIVE_LATENCY_PEAK_DECAY 0.001    // seconds per second the transit peak falls by
+#define ADAPTIVE_LATENCY_PENALTY_DECAY 0.002 // seconds per second the allowance falls by
+#define ADAPTIVE_LATENCY_LOSS_PENALTY 0.100  // seconds added for each packet lost or too late
+#define ADAPTIVE_LATENCY_RESEND_ALLOWANCE (RESEND_HOLDOFF + 2 * RESEND_FIRST_INTERVAL)
+#define ADAPTIVE_LATENCY_SHRINK_PACKETS 4 // packets played for each frame the latency shrinks
+#define ADAPTIVE_LATENCY_JUMP 0.010       // seconds short, beyond which the latency grows at once
+
+// the latency in use, in frames at the input rate
+static inline int64_t session_latency(rtsp_conn_info *conn) {
+  return config.latency - __atomic_load_n(&conn->latency_reduction, __ATOMIC_RELAXED);
+}
+
+static void adaptive_latency_reset(rtsp_conn_info *conn) {
+  __atomic_store_n(&conn->latency_reduction, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&conn->transit_peak, INT64_MIN, __ATOMIC_RELAXED);
+  conn->latency_penalty = 0;
+  conn->adaptive_latency_losses = 0;
+  conn->adaptive_latency_resends = 0;
+  conn->adaptive_latency_packets = 0;
+}
+
+// note the transit time of a packet arriving in sequence -- called with the ab_mutex locked
+static void adaptive_latency_note_arrival(int64_t timestamp, int frames, uint64_t arrival_time,
+                                          rtsp_conn_info *conn) {
+  int64_t reference_timestamp;
+  uint64_t reference_timestamp_time, remote_reference_timestamp_time;
+  get_reference_timestamp_stuff(&reference_timestamp, &reference_timestamp_time,
+                                &remote_reference_timestamp_time, conn);
+  if (reference_timestamp == 0)
+    return;
+  int64_t due = (int64_t)reference_timestamp_time +
+                (timestamp - reference_timestamp) * ((int64_t)1 << 32) / conn->input_rate;
+  int64_t transit = (int64_t)arrival_time - due;
+  int64_t peak = __atomic_load_n(&conn->transit_peak, __ATOMIC_RELAXED);
+  if (peak != INT64_MIN)
+    peak -= seconds_to_fp(ADAPTIVE_LATENCY_PEAK_DECAY) * frames / conn->input_rate;
+  if (transit > peak)
+    peak = transit;
+  __atomic_store_n(&conn->transit_peak, peak, __ATOMIC_RELAXED);
+}
+
+// called by the player thread for each packet played with the synchronisation error it has,
+// in output frames, to move the latency a step towards what's needed. Returns the number of
+// frames of silence, at the output rate, to play before the packet to make up for an increase
+// that has been made at once
+static int64_t adaptive_latency_update(int64_t sync_error, double tolerance,
+                                       rtsp_conn_info *conn) {
+  int64_t peak = __atomic_load_n(&conn->transit_peak, __ATOMIC_RELAXED);
+  if (peak == INT64_MIN)
+    return 0;
+
+  // resends and losses since the last packet raise the allowance, which otherwise decays
+  uint64_t losses = conn->missing_packets + conn->too_late_packets;
+  if (losses > conn->adaptive_latency_losses)
+    conn->latency_penalty +=
+        (losses - conn->adaptive_latency_losses) * seconds_to_fp(ADAPTIVE_LATENCY_LOSS_PENALTY);
+  conn->adaptive_latency_losses = losses;
+  if ((conn->resend_packets > conn->adaptive_latency_resends) &&
+      (conn->latency_penalty < seconds_to_fp(ADAPTIVE_LATENCY_RESEND_ALLOWANCE)))
+    conn->latency_penalty = seconds_to_fp(ADAPTIVE_LATENCY_RESEND_ALLOWANCE);
+  conn->adaptive_latency_resends = conn->resend_packets;
+  uint64_t decay = seconds_to_fp(ADAPTIVE_LATENCY_PENALTY_DECAY) * conn->max_frames_per_packet /
+                   conn->input_rate;
+  conn->latency_penalty = conn->latency_penalty > decay ? conn->latency_penalty - decay : 0;
+
+  // a frame must be here by the time the backend's buffer is to be filled with it
+  double needed = (peak + (int64_t)conn->latency_penalty) * 1.0 / ((uint64_t)1 << 32) +
+                  config.adaptive_latency_margin + config.audio_backend_buffer_desired_length -
+                  config.audio_backend_latency_offset;
+  if (needed < config.adaptive_latency_minimum)
+    needed = config.adaptive_latency_minimum;
+  int64_t target = config.latency - (int64_t)(needed * conn->input_rate);
+  if (target < 0)
+    target = 0;
+
+  // leave it alone while the drift corrector is catching up with the last change
+  if ((sync_error > 2 * tolerance * config.output_rate) ||
+      (sync_error < -2 * tolerance * config.output_rate))
+    return 0;
+
+  int64_t silence = 0;
+  int64_t reduction = __atomic_load_n(&conn->latency_reduction, __ATOMIC_RELAXED);
+  if (reduction - target > (int64_t)(ADAPTIVE_LATENCY_JUMP * conn->input_rate)) {
+    silence = (reduction - target) * conn->output_sample_ratio; // grow in one step
+    reduction = target;
+    conn->adaptive_latency_packets = 0;
+  } else if (target < reduction) {
+    reduction--; // grow by a frame, for the drift corrector to take up
+    conn->adaptive_latency_packets = 0;
+  } else if ((target > reduction) &&
+             (++conn->adaptive_latency_packets >= ADAPTIVE_LATENCY_SHRINK_PACKETS)) {
+    reduction++;
+    conn->adaptive_latency_packets = 0;
+  }
+  __atomic_store_n(&conn->latency_reduction, reduction, __ATOMIC_RELAXED);
+  return silence;
+}
+
 // now for 32-bit wrapping in timestamps
 
 // this returns true if the second arg is strictly after the first
@@ -245,90 +466,350 @@ static inline int seq32_order(uint32_t a, uint32_t b) {
   return (C & 0x80000000) == 0;
 }
 
-static int alac_decode(short *dest, int *destlen, uint8_t *buf, int len, rtsp_conn_info *conn) {
-  // parameters: where the decoded stuff goes, its length in samples,
-  // the incoming packet, the length of the incoming packet in bytes
-  // destlen should contain the allowed max number of samples on entry
+// Decrypt a packet in place, in the receive buffer, so that it can be decoded from there.
+// Each packet is encrypted separately, starting from the stream's IV. Only whole AES blocks are
+// encrypted -- any bytes left over at the end are in the clear.
+static void packet_decrypt(uint8_t *buf, int len, rtsp_conn_info *conn) {
+  int aeslen = len & ~0xf;
+#if defined(HAVE_LIBMBEDTLS) || defined(HAVE_LIBPOLARSSL)
+  unsigned char iv[16]; // it's updated as the packet is decrypted
+  memcpy(iv, conn->stream.aesiv, sizeof(iv));
+#endif
+#ifdef HAVE_LIBMBEDTLS
+  mbedtls_aes_crypt_cbc(&conn->dctx, MBEDTLS_AES_DECRYPT, aeslen, iv, buf, buf);
+#endif
+#ifdef HAVE_LIBPOLARSSL
+  aes_crypt_cbc(&conn->dctx, AES_DECRYPT, aeslen, iv, buf, buf);
+#endif
+#ifdef HAVE_LIBSSL
+  // restart the cipher at the stream's IV, keeping the expanded key
+  int outlen;
+  EVP_DecryptInit_ex(conn->aes_ctx, NULL, NULL, NULL, conn->stream.aesiv);
+  EVP_DecryptUpdate(conn->aes_ctx, buf, &outlen, buf, aeslen);
+#endif
+}
+
+static void standard_widen(int32_t *dest, const int16_t *in, int frames, rtsp_conn_info *conn);
+
+static int alac_decode(int32_t *dest, int *destlen, uint8_t *buf, int len, rtsp_conn_info *conn) {
+  // parameters: where the decoded stuff goes, as interleaved 32-bit samples, its length in frames,
+  // the incoming packet, the length of the incoming packet in bytes -- an encrypted packet is
+  // decrypted where it is
+  // destlen should contain the allowed max number of frames on entry
 
   if (len > MAX_PACKET) {
     warn("Incoming audio packet size is too large at %d; it should not exceed %d.", len,
          MAX_PACKET);
     return -1;
   }
-  unsigned char packet[MAX_PACKET];
-  unsigned char packetp[MAX_PACKET];
-  assert(len <= MAX_PACKET);
-  int reply = 0;                                          // everything okay
-  int outsize = conn->input_bytes_per_frame * (*destlen); // the size the output should be, in bytes
-  int toutsize = outsize;
+  int reply = 0; // everything okay
+  int frames = 0;
 
   if (conn->stream.encrypted) {
-    unsigned char iv[16];
-    int aeslen = len & ~0xf;
-    memcpy(iv, conn->stream.aesiv, sizeof(iv));
-#ifdef HAVE_LIBMBEDTLS
-    mbedtls_aes_crypt_cbc(&conn->dctx, MBEDTLS_AES_DECRYPT, aeslen, iv, buf, packet);
-#endif
-#ifdef HAVE_LIBPOLARSSL
-    aes_crypt_cbc(&conn->dctx, AES_DECRYPT, aeslen, iv, buf, packet);
-#endif
-#ifdef HAVE_LIBSSL
-    AES_cbc_encrypt(buf, packet, aeslen, &conn->aes, iv, AES_DECRYPT);
-#endif
-    memcpy(packet + aeslen, buf + aeslen, len - aeslen);
+    uint64_t time_before_decrypting = get_monotonic_time_in_fp();
+    packet_decrypt(buf, len, conn);
+    __atomic_fetch_add(&conn->decrypting_time, get_monotonic_time_in_fp() - time_before_decrypting,
+                       __ATOMIC_RELAXED);
+  }
+
+  // for the standard stream, the decoders write 16-bit samples, which are widened and mixed in one
+  // go -- see choose_standard_kernel()
 #ifdef HAVE_APPLE_ALAC
-    if (config.use_apple_decoder) {
-      if (conn->decoder_in_use != 1 << decoder_apple_alac) {
-        debug(1, "Apple ALAC Decoder used on encrypted audio.");
-        conn->decoder_in_use = 1 << decoder_apple_alac;
-      }
-      apple_alac_decode_frame(packet, len, (unsigned char *)dest, &outsize);
-      outsize = outsize * 4; // bring the size to bytes
-    } else
-#endif
-    {
-      if (conn->decoder_in_use != 1 << decoder_hammerton) {
-        debug(1, "Hammerton Decoder used on encrypted audio.");
-        conn->decoder_in_use = 1 << decoder_hammerton;
-      }
-      alac_decode_frame(conn->decoder_info, packet, (unsigned char *)dest, &outsize);
+  if (config.use_apple_decoder) {
+    if (conn->decoder_in_use != 1 << decoder_apple_alac) {
+      debug(1, "Apple ALAC Decoder used on %s audio.",
+            conn->stream.encrypted ? "encrypted" : "unencrypted");
+      conn->decoder_in_use = 1 << decoder_apple_alac;
     }
-  } else {
-// not encrypted
-#ifdef HAVE_APPLE_ALAC
-    if (config.use_apple_decoder) {
-      if (conn->decoder_in_use != 1 << decoder_apple_alac) {
-        debug(1, "Apple ALAC Decoder used on unencrypted audio.");
-        conn->decoder_in_use = 1 << decoder_apple_alac;
-      }
-      apple_alac_decode_frame(buf, len, (unsigned char *)dest, &outsize);
-      outsize = outsize * 4; // bring the size to bytes
-    } else
+    // otherwise, the decoder writes 32-bit samples straight into the audio buffer
+    int rc;
+    if (conn->standard_kernel)
+      rc = apple_alac_decode_frame(conn->apple_decoder, buf, len, conn->decoder_output, &frames,
+                                   AAO_native);
+    else
+      rc = apple_alac_decode_frame(conn->apple_decoder, buf, len, dest, &frames, AAO_s32);
+    if (rc != 0) {
+      debug(2, "Apple ALAC Decoder couldn't decode a packet.");
+      frames = 0;
+      reply = -1;
+    } else if ((conn->standard_kernel) && (frames <= *destlen)) {
+      standard_widen(dest, (const int16_t *)conn->decoder_output, frames, conn);
+    }
+  } else
 #endif
-    {
-      if (conn->decoder_in_use != 1 << decoder_hammerton) {
-        debug(1, "Hammerton Decoder used on unencrypted audio.");
-        conn->decoder_in_use = 1 << decoder_hammerton;
-      }
-      alac_decode_frame(conn->decoder_info, buf, dest, &outsize);
+  {
+    if (conn->decoder_in_use != 1 << decoder_hammerton) {
+      debug(1, "Hammerton Decoder used on %s audio.",
+            conn->stream.encrypted ? "encrypted" : "unencrypted");
+      conn->decoder_in_use = 1 << decoder_hammerton;
+    }
+    int outsize = conn->input_bytes_per_frame * (*destlen); // the room for its output, in bytes
+    alac_decode_frame(conn->decoder_info, buf, (unsigned char *)conn->decoder_output, &outsize);
+    frames = outsize / conn->input_bytes_per_frame;
+    if ((outsize % conn->input_bytes_per_frame) != 0)
+      debug(1, "Number of audio frames (%d) does not correspond exactly to the number of bytes "
+               "(%d) and the audio frame size (%d).",
+            frames, outsize, conn->input_bytes_per_frame);
+    int i;
+    if (conn->standard_kernel) {
+      standard_widen(dest, (const int16_t *)conn->decoder_output, frames, conn);
+    } else if (conn->input_bit_depth == 16) {
+      const int16_t *in = (const int16_t *)conn->decoder_output;
+      for (i = 0; i < frames * conn->input_num_channels; i++)
+        dest[i] = (int32_t)((uint32_t)(uint16_t)in[i] << 16);
+    } else {
+      // 24 bit samples come packed into three bytes, little endian
+      const uint8_t *in = conn->decoder_output;
+      for (i = 0; i < frames * conn->input_num_channels; i++, in += 3)
+        dest[i] = (int32_t)(((uint32_t)in[2] << 24) | ((uint32_t)in[1] << 16) |
+                            ((uint32_t)in[0] << 8));
     }
   }
 
-  if (outsize > toutsize) {
-    debug(2, "Output from alac_decode larger (%d bytes, not frames) than expected (%d bytes) -- "
+  if (frames > *destlen) {
+    debug(2, "Output from alac_decode larger (%d frames) than expected (%d frames) -- "
              "truncated, but buffer overflow possible! Encrypted = %d.",
-          outsize, toutsize, conn->stream.encrypted);
+          frames, *destlen, conn->stream.encrypted);
     reply = -1; // output packet is the wrong size
   }
 
-  *destlen = outsize / conn->input_bytes_per_frame;
-  if ((outsize % conn->input_bytes_per_frame) != 0)
-    debug(1, "Number of audio frames (%d) does not correspond exactly to the number of bytes (%d) "
-             "and the audio frame size (%d).",
-          *destlen, outsize, conn->input_bytes_per_frame);
+  *destlen = frames;
   return reply;
 }
 
+// For input with more than two channels, the channels of each ALAC channel layout, in order, and
+// the share of each that goes to the left and right of the output. The centre and the surrounds
+// are mixed in at -3 dB, the front channels either side of the centre are panned at constant power
+// and the LFE channel is left out.
+static const double downmix_gains[MAX_INPUT_CHANNELS - 2][MAX_INPUT_CHANNELS][2] = {
+    // C L R
+    {{0.7071, 0.7071}, {1.0, 0.0}, {0.0, 1.0}},
+    // C L R Cs
+    {{0.7071, 0.7071}, {1.0, 0.0}, {0.0, 1.0}, {0.5, 0.5}},
+    // C L R Ls Rs
+    {{0.7071, 0.7071}, {1.0, 0.0}, {0.0, 1.0}, {0.7071, 0.0}, {0.0, 0.7071}},
+    // C L R Ls Rs LFE
+    {{0.7071, 0.7071}, {1.0, 0.0}, {0.0, 1.0}, {0.7071, 0.0}, {0.0, 0.7071}, {0.0, 0.0}},
+    // C L R Ls Rs Cs LFE
+    {{0.7071, 0.7071}, {1.0, 0.0}, {0.0, 1.0}, {0.7071, 0.0}, {0.0, 0.7071}, {0.5, 0.5},
+     {0.0, 0.0}},
+    // C Lc Rc L R Ls Rs LFE
+    {{0.7071, 0.7071}, {0.9239, 0.3827}, {0.3827, 0.9239}, {1.0, 0.0}, {0.0, 1.0}, {0.7071, 0.0},
+     {0.0, 0.7071}, {0.0, 0.0}},
+};
+
+// Work out the gains for folding the input's channels down to the output's two. They're scaled so
+// that the gains going to each side add up to no more than one, so the result can't clip.
+static void init_downmix(rtsp_conn_info *conn) {
+  memset(conn->downmix, 0, sizeof(conn->downmix));
+  int channels = conn->input_num_channels;
+  if (channels <= 2)
+    return;
+  const double(*gains)[2] = downmix_gains[channels - 3];
+  double left = 0.0, right = 0.0;
+  int c;
+  for (c = 0; c < channels; c++) {
+    left += gains[c][0];
+    right += gains[c][1];
+  }
+  double scale = 65536.0 / (left > right ? left : right);
+  for (c = 0; c < channels; c++) {
+    conn->downmix[0][c] = (int32_t)(gains[c][0] * scale);
+    conn->downmix[1][c] = (int32_t)(gains[c][1] * scale);
+  }
+  debug(2, "%d channel input will be folded down to stereo.", channels);
+}
+
+// do the mode stuff -- mono / reverse stereo / left only / right only -- to a frame, and write it
+// out, replicating it if upsampling
+static inline __attribute__((always_inline)) int32_t *
+put_stereo_frame(int32_t *out, int32_t l, int32_t r, enum playback_mode_type mode, int ratio) {
+  switch (mode) {
+  case ST_mono: {
+    // half of each, which keeps all 17 bits of the sum of 16-bit left and right -- the 17th bit
+    // will influence dithering later
+    int32_t both = (l >> 1) + (r >> 1);
+    l = both;
+    r = both;
+  } break;
+  case ST_reverse_stereo: {
+    int32_t t = l;
+    l = r;
+    r = t;
+  } break;
+  case ST_left_only:
+    r = l;
+    break;
+  case ST_right_only:
+    l = r;
+    break;
+  case ST_stereo:
+    break; // nothing extra to do
+  }
+  int j;
+  for (j = 0; j < ratio; j++) {
+    *out++ = l;
+    *out++ = r;
+  }
+  return out;
+}
+
+// fold frames of more than two channels down to stereo -- it's inlined with a constant number of
+// channels for each channel count, so that the inner loop can be unrolled
+static inline __attribute__((always_inline)) int32_t *
+downmix_frames(int32_t *out, const int32_t *in, int frames, const int channels,
+               enum playback_mode_type mode, int ratio, rtsp_conn_info *conn) {
+  const int32_t *gl = conn->downmix[0], *gr = conn->downmix[1];
+  int i, c;
+  for (i = 0; i < frames; i++, in += channels) {
+    int64_t l = 0, r = 0;
+    for (c = 0; c < channels; c++) {
+      l += (int64_t)in[c] * gl[c];
+      r += (int64_t)in[c] * gr[c];
+    }
+    out = put_stereo_frame(out, (int32_t)(l >> 16), (int32_t)(r >> 16), mode, ratio);
+  }
+  return out;
+}
+
+// Make a frame of decoded audio into the two channels of the output, doing the mode stuff unless
+// the DSP pipeline is to do it. Returns the input itself if there's nothing to do, or else out,
+// the transition buffer.
+static int32_t *channels_to_stereo(int32_t *in, int frames, int32_t *out, int do_mode,
+                                   rtsp_conn_info *conn) {
+  enum playback_mode_type mode = do_mode ? config.playback_mode : ST_stereo;
+  int ratio = conn->output_sample_ratio;
+  int32_t *outp = out;
+  int i;
+  switch (conn->input_num_channels) {
+  case 1:
+    for (i = 0; i < frames; i++, in++)
+      outp = put_stereo_frame(outp, *in, *in, ST_stereo, ratio);
+    break;
+  case 2:
+    if ((mode == ST_stereo) && (ratio == 1))
+      return in;
+    for (i = 0; i < frames; i++, in += 2)
+      outp = put_stereo_frame(outp, in[0], in[1], mode, ratio);
+    break;
+  case 3:
+    downmix_frames(outp, in, frames, 3, mode, ratio, conn);
+    break;
+  case 4:
+    downmix_frames(outp, in, frames, 4, mode, ratio, conn);
+    break;
+  case 5:
+    downmix_frames(outp, in, frames, 5, mode, ratio, conn);
+    break;
+  case 6:
+    downmix_frames(outp, in, frames, 6, mode, ratio, conn);
+    break;
+  case 7:
+    downmix_frames(outp, in, frames, 7, mode, ratio, conn);
+    break;
+  default:
+    downmix_frames(outp, in, frames, 8, mode, ratio, conn);
+    break;
+  }
+  return out;
+}
+
+// Almost every stream is 352 frames of 16-bit stereo at 44,100 frames per second. For it, a packet
+// is widened to 32 bits and has the mode stuff done in one pass, by a kernel made for each mode
+// with the mode and the number of frames as constants.
+
+#define STANDARD_FRAMES 352
+
+static inline __attribute__((always_inline)) void
+widen_stereo_16(int32_t *dest, const int16_t *in, int frames, enum playback_mode_type mode) {
+  int i;
+  for (i = 0; i < frames; i++, in += 2)
+    dest = put_stereo_frame(dest, (int32_t)((uint32_t)(uint16_t)in[0] << 16),
+                            (int32_t)((uint32_t)(uint16_t)in[1] << 16), mode, 1);
+}
+
+#define STANDARD_KERNEL(mode)                                                                      \
+  static void standard_kernel_##mode(int32_t *dest, const int16_t *in) {                          \
+    widen_stereo_16(dest, in, STANDARD_FRAMES, mode);                                              \
+  }
+
+STANDARD_KERNEL(ST_stereo)
+STANDARD_KERNEL(ST_mono)
+STANDARD_KERNEL(ST_reverse_stereo)
+STANDARD_KERNEL(ST_left_only)
+STANDARD_KERNEL(ST_right_only)
+
+// widen a packet of the standard stream, which may be short of the full number of frames
+static void standard_widen(int32_t *dest, const int16_t *in, int frames, rtsp_conn_info *conn) {
+  if (frames == STANDARD_FRAMES)
+    conn->standard_kernel(dest, in);
+  else
+    widen_stereo_16(dest, in, frames, conn->standard_mode);
+}
+
+// Choose the standard stream's kernel, if it is the standard stream. When there's DSP to do, the
+// DSP pipeline does the mode stuff, so the kernel only widens.
+static void choose_standard_kernel(rtsp_conn_info *conn) {
+  conn->standard_kernel = NULL;
+  if ((conn->max_frames_per_packet != STANDARD_FRAMES) || (conn->input_bit_depth != 16) ||
+      (conn->input_num_channels != 2) || (conn->input_rate != 44100))
+    return;
+  conn->standard_mode = dsp_pipeline_wanted() ? ST_stereo : config.playback_mode;
+  switch (conn->standard_mode) {
+  case ST_mono:
+    conn->standard_kernel = standard_kernel_ST_mono;
+    break;
+  case ST_reverse_stereo:
+    conn->standard_kernel = standard_kernel_ST_reverse_stereo;
+    break;
+  case ST_left_only:
+    conn->standard_kernel = standard_kernel_ST_left_only;
+    break;
+  case ST_right_only:
+    conn->standard_kernel = standard_kernel_ST_right_only;
+    break;
+  default:
+    conn->standard_kernel = standard_kernel_ST_stereo;
+    break;
+  }
+  debug(2, "Using the kernels for a stream of %d frames of 16-bit stereo.", STANDARD_FRAMES);
+}
+
+// check that a stream, as described by its fmtp numbers, can be played -- see init_decoder()
+int player_check_stream_format(int32_t fmtp[12]) {
+  int frames_per_packet = fmtp[1];
+  int bit_depth = fmtp[3];
+  int channels = fmtp[7];
+  int rate = fmtp[11];
+  if ((bit_depth != 16) && (bit_depth != 20) && (bit_depth != 24)) {
+    warn("Shairport Sync only supports 16, 20 and 24 bit input, not %d bit input.", bit_depth);
+    return -1;
+  }
+  if ((channels < 1) || (channels > MAX_INPUT_CHANNELS)) {
+    warn("Shairport Sync can't play audio with %d channels.", channels);
+    return -1;
+  }
+  if ((frames_per_packet < 1) || (rate < 1) || (rate > config.output_rate)) {
+    warn("Shairport Sync can't play a stream of %d frames per packet at %d frames per second.",
+         frames_per_packet, rate);
+    return -1;
+  }
+  // the Hammerton decoder only does one or two channels, at 16 or 24 bits
+  int decodable = (bit_depth != 20) && (channels <= 2);
+#ifdef HAVE_APPLE_ALAC
+  if (config.use_apple_decoder)
+    decodable = 1;
+#endif
+  if (decodable == 0) {
+    warn("The Hammerton decoder can't decode %d bit audio with %d channels.", bit_depth, channels);
+    return -1;
+  }
+  return 0;
+}
+
+static void terminate_decoders(rtsp_conn_info *conn);
+
+// returns non-zero if the stream can't be played or its decoder can't be created
 static int init_decoder(int32_t fmtp[12], rtsp_conn_info *conn) {
 
   // This is a guess, but the format of the fmtp looks identical to the format of an
@@ -417,11 +898,20 @@ static int init_decoder(int32_t fmtp[12], rtsp_conn_info *conn) {
   conn->input_bit_depth = fmtp[3];
 
   conn->input_bytes_per_frame = conn->input_num_channels * ((conn->input_bit_depth + 7) / 8);
+  // the stream was checked when it was announced, but a capture being replayed wasn't
+  if (player_check_stream_format(fmtp) != 0)
+    return 1;
+  init_downmix(conn);
+  choose_standard_kernel(conn);
 
   alac = alac_create(conn->input_bit_depth, conn->input_num_channels);
   if (!alac)
     return 1;
   conn->decoder_info = alac;
+  conn->decoder_output = NULL;
+#ifdef HAVE_APPLE_ALAC
+  conn->apple_decoder = NULL;
+#endif
 
   alac->setinfo_max_samples_per_frame = conn->max_frames_per_packet;
   alac->setinfo_7a = fmtp[2];
@@ -435,26 +925,42 @@ static int init_decoder(int32_t fmtp[12], rtsp_conn_info *conn) {
   alac->setinfo_86 = fmtp[10];
   alac->setinfo_8a_rate = fmtp[11];
   alac_allocate_buffers(alac);
+  conn->decoder_output = malloc(conn->input_bytes_per_frame * conn->max_frames_per_packet);
+  if (conn->decoder_output == NULL) {
+    terminate_decoders(conn);
+    return 1;
+  }
 
 #ifdef HAVE_APPLE_ALAC
-  apple_alac_init(fmtp);
+  conn->apple_decoder = apple_alac_create(fmtp);
+  if (conn->apple_decoder == NULL) {
+    terminate_decoders(conn);
+    return 1;
+  }
 #endif
 
   return 0;
 }
 
 static void terminate_decoders(rtsp_conn_info *conn) {
-  alac_free(conn->decoder_info);
+  if (conn->decoder_info)
+    alac_free(conn->decoder_info);
+  conn->decoder_info = NULL;
+  free(conn->decoder_output);
+  conn->decoder_output = NULL;
 #ifdef HAVE_APPLE_ALAC
-  apple_alac_terminate();
+  apple_alac_destroy(conn->apple_decoder);
+  conn->apple_decoder = NULL;
 #endif
 }
 
 static void init_buffer(rtsp_conn_info *conn) {
+  // decoded packets are held as 32-bit samples, whatever the input's bit depth
   int i;
   for (i = 0; i < BUFFER_FRAMES; i++)
-    conn->audio_buffer[i].data = malloc(
-        conn->input_bytes_per_frame * (conn->max_frames_per_packet + conn->max_frame_size_change));
+    conn->audio_buffer[i].data =
+        malloc(sizeof(int32_t) * conn->input_num_channels *
+               (conn->max_frames_per_packet + conn->max_frame_size_change));
   ab_resync(conn);
 }
 
@@ -508,6 +1014,9 @@ void player_put_packet(seq_t seqno, int64_t timestamp, uint8_t *data, int len,
       if (conn->ab_write == seqno) { // expected packet
         abuf = conn->audio_buffer + BUFIDX(seqno);
         conn->ab_write = SUCCESSOR(seqno);
+        if (config.adaptive_latency)
+          adaptive_latency_note_arrival(ltimestamp, conn->max_frames_per_packet,
+                                        conn->time_of_last_audio_packet, conn);
       } else if (seq_order(conn->ab_write, seqno, conn->ab_read)) { // newer than expected
         // if (ORDINATE(seqno)>(BUFFER_FRAMES*7)/8)
         // debug(1,"An interval of %u frames has opened, with ab_read: %u, ab_write: %u and seqno:
@@ -521,12 +1030,14 @@ void player_put_packet(seq_t seqno, int64_t timestamp, uint8_t *data, int len,
           abuf->ready = 0; // to be sure, to be sure
           abuf->timestamp = 0;
           abuf->sequence_number = 0;
+          resend_track(abuf, conn);
         }
         // debug(1,"N %d s %u.",seq_diff(ab_write,PREDECESSOR(seqno))+1,ab_write);
         abuf = conn->audio_buffer + BUFIDX(seqno);
-        //        rtp_request_resend(ab_write, gap);
-        //        resend_requests++;
         conn->ab_write = SUCCESSOR(seqno);
+        if (config.adaptive_latency)
+          adaptive_latency_note_arrival(ltimestamp, conn->max_frames_per_packet,
+                                        conn->time_of_last_audio_packet, conn);
       } else if (seq_order(conn->ab_read, seqno, conn->ab_read)) { // late but not yet played
         conn->late_packets++;
         abuf = conn->audio_buffer + BUFIDX(seqno);
@@ -537,11 +1048,27 @@ void player_put_packet(seq_t seqno, int64_t timestamp, uint8_t *data, int len,
 
       if (abuf) {
         int datalen = conn->max_frames_per_packet;
-        if (alac_decode(abuf->data, &datalen, data, len, conn) == 0) {
+        // timed by the clock itself, as the clock is stopped while a capture is replayed
+        uint64_t time_before_decoding = get_monotonic_time_in_fp();
+        int decoded = alac_decode(abuf->data, &datalen, data, len, conn);
+        __atomic_fetch_add(&conn->decoding_time, get_monotonic_time_in_fp() - time_before_decoding,
+                           __ATOMIC_RELAXED);
+        __atomic_fetch_add(&conn->packets_decoded, 1, __ATOMIC_RELAXED);
+        if (decoded == 0) {
+          resend_untrack(abuf, 1, conn);
           abuf->ready = 1;
           abuf->length = datalen;
           abuf->timestamp = ltimestamp;
           abuf->sequence_number = seqno;
+          abuf->silent = samples_are_silent(abuf->data, datalen * conn->input_num_channels);
+          if (abuf->silent == 0) {
+            // the player looks ahead to this to see whether sound is on its way
+            int64_t last = __atomic_load_n(&conn->last_sound_timestamp, __ATOMIC_RELAXED);
+            while ((ltimestamp > last) &&
+                   (!__atomic_compare_exchange_n(&conn->last_sound_timestamp, &last, ltimestamp, 0,
+                                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED)))
+              ;
+          }
         } else {
           debug(1, "Bad audio packet detected and discarded.");
           abuf->ready = 0;
@@ -569,78 +1096,19 @@ int32_t rand_in_range(int32_t exclusive_range_limit) {
   return sp >> 32;
 }
 
-static inline void process_sample(int32_t sample, char **outp, enum sps_format_t format, int volume,
-                                  int dither, rtsp_conn_info *conn) {
-  int64_t hyper_sample = sample;
+// dither a sample, held in the top bits of an int64_t, to the output format and output it
+static inline __attribute__((always_inline)) void
+quantise_sample(int64_t hyper_sample, char **outp, enum sps_format_t format, int dither,
+                rtsp_conn_info *conn) {
   int result;
 
-  if (config.loudness) {
-    hyper_sample <<=
-        32; // Do not apply volume as it has already been done with the Loudness DSP filter
-  } else {
-    int64_t hyper_volume = (int64_t)volume << 16;
-    hyper_sample =
-        hyper_sample * hyper_volume; // this is 64 bit bit multiplication -- we may need to
-                                     // dither it down to its
-                                     // target resolution
-  }
-
-  // next, do dither, if necessary
+  // do dither, if necessary
   if (dither) {
 
-    // add a TPDF dither -- see
-    // http://www.users.qwest.net/%7Evolt42/cadenzarecording/DitherExplained.pdf
-    // and the discussion around https://www.hydrogenaud.io/forums/index.php?showtopic=16963&st=25
-
-    // I think, for a 32 --> 16 bits, the range of
-    // random numbers needs to be from -2^16 to 2^16, i.e. from -65536 to 65536 inclusive, not from
-    // -32768 to +32767
-
-    // See the original paper at
+    // add a TPDF dither -- see dither.h, and the original paper at
     // http://www.ece.rochester.edu/courses/ECE472/resources/Papers/Lipshitz_1992.pdf
     // by Lipshitz, Wannamaker and Vanderkooy, 1992.
-
-    int64_t dither_mask;
-    switch (format) {
-    case SPS_FORMAT_S32:
-      dither_mask = (int64_t)1 << (64 + 1 - 32);
-      break;
-    case SPS_FORMAT_S24:
-    case SPS_FORMAT_S24_3LE:
-    case SPS_FORMAT_S24_3BE:
-      dither_mask = (int64_t)1 << (64 + 1 - 24);
-      break;
-    case SPS_FORMAT_S16:
-      dither_mask = (int64_t)1 << (64 + 1 - 16);
-      break;
-    case SPS_FORMAT_S8:
-    case SPS_FORMAT_U8:
-      dither_mask = (int64_t)1 << (64 + 1 - 8);
-      break;
-    case SPS_FORMAT_UNKNOWN:
-      die("Unexpected SPS_FORMAT_UNKNOWN while calculating dither mask.");
-    }
-    dither_mask -= 1;
-    // int64_t r = r64i();
-    int64_t r = ranarray64i(); // use an array of precalculated pseudorandom numbers rather than
-                               // calculating them on the fly. Should be easier on low-powered
-                               // processors
-
-    int64_t tpdf = (r & dither_mask) - (conn->previous_random_number & dither_mask);
-    conn->previous_random_number = r;
-    // add dither, allowing for clipping
-    if (tpdf >= 0) {
-      if (INT64_MAX - tpdf >= hyper_sample)
-        hyper_sample += tpdf;
-      else
-        hyper_sample = INT64_MAX;
-    } else {
-      if (INT64_MIN - tpdf <= hyper_sample)
-        hyper_sample += tpdf;
-      else
-        hyper_sample = INT64_MIN;
-    }
-    // dither is complete here
+    hyper_sample = dither_sample(&conn->dither, hyper_sample);
   }
 
   // move the result to the desired position in the int64_t
@@ -700,13 +1168,59 @@ static inline void process_sample(int32_t sample, char **outp, enum sps_format_t
   *outp += result;
 }
 
+// the hyper_volume is a multiplier scaled by 2^32 -- see volume_ramp_t
+static inline __attribute__((always_inline)) void
+process_sample(int32_t sample, char **outp, enum sps_format_t format, int64_t hyper_volume,
+               int dither, rtsp_conn_info *conn) {
+  int64_t hyper_sample = sample;
+  hyper_sample = hyper_sample * hyper_volume; // this is 64 bit bit multiplication -- we may need to
+                                              // dither it down to its
+                                              // target resolution
+  quantise_sample(hyper_sample, outp, format, dither, conn);
+}
+
+// Apply the volume to a run of stereo frames, dither them and format them for output. It's
+// inlined with the output format as a constant for 16-bit output, the usual format, so that its
+// samples don't each go through the switch on the format. Returns where the input got to.
+static inline __attribute__((always_inline)) int32_t *
+process_frames_as(int32_t *inptr, char **outptr, int frames, enum sps_format_t format, int dither,
+                  rtsp_conn_info *conn) {
+  int i;
+  for (i = 0; i < frames; i++) {
+    int64_t hyper_volume = volume_ramp_next(&conn->volume_ramp);
+    process_sample(*inptr++, outptr, format, hyper_volume, dither, conn);
+    process_sample(*inptr++, outptr, format, hyper_volume, dither, conn);
+  }
+  return inptr;
+}
+
+static int32_t *process_frames(int32_t *inptr, char **outptr, int frames,
+                               enum sps_format_t format, int dither, rtsp_conn_info *conn) {
+  if (format == SPS_FORMAT_S16)
+    return process_frames_as(inptr, outptr, frames, SPS_FORMAT_S16, dither, conn);
+  return process_frames_as(inptr, outptr, frames, format, dither, conn);
+}
+
+// the same, for a floating point sample scaled to the range of an int32_t -- the volume has
+// already been applied by the DSP pipeline
+static inline void process_float_sample(float sample, char **outp, enum sps_format_t format,
+                                        int dither, rtsp_conn_info *conn) {
+  double hyper_sample = sample * 4294967296.0;
+  int64_t clipped_sample;
+  if (hyper_sample >= 9223372036854775807.0)
+    clipped_sample = INT64_MAX;
+  else if (hyper_sample <= -9223372036854775808.0)
+    clipped_sample = INT64_MIN;
+  else
+    clipped_sample = hyper_sample;
+  quantise_sample(clipped_sample, outp, format, dither, conn);
+}
+
 // get the next frame, when available. return 0 if underrun/stream reset.
 static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
   int16_t buf_fill;
   uint64_t local_time_now;
   // struct timespec tn;
-  abuf_t *abuf = 0;
-  int i;
   abuf_t *curframe;
   int notified_buffer_empty = 0; // diagnostic only
 
@@ -731,8 +1245,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
         debug(1, "As Yeats almost said, \"Too long a silence / can make a stone of the heart\" "
                  "from RTSP conversation %d.",
               conn->connection_number);
-        conn->stop = 1;
-        pthread_kill(conn->thread, SIGUSR1);
+        rtsp_request_conversation_stop(conn);
       }
     }
     int rco = get_requested_connection_state_to_output();
@@ -805,6 +1318,8 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
         notified_buffer_empty = 0; // at least one buffer now -- diagnostic only.
         if (conn->ab_buffering) {  // if we are getting packets but not yet forwarding them to the
                                    // player
+          if (conn->output_idle)
+            player_output_wake(0, conn);
           int have_sent_prefiller_silence; // set true when we have sent some silent frames to the
                                            // DAC
           int64_t reference_timestamp;
@@ -857,7 +1372,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
               // debug(1, "Output sample ratio is %d", conn->output_sample_ratio);
 
               int64_t delta = (conn->first_packet_timestamp - reference_timestamp) +
-                              config.latency * conn->output_sample_ratio +
+                              session_latency(conn) * conn->output_sample_ratio +
                               (int64_t)(config.audio_backend_latency_offset * config.output_rate);
 
               if (delta >= 0) {
@@ -883,7 +1398,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
           if (conn->first_packet_time_to_play != 0) {
             // recalculate conn->first_packet_time_to_play -- the latency might change
             int64_t delta = (conn->first_packet_timestamp - reference_timestamp) +
-                            config.latency * conn->output_sample_ratio +
+                            session_latency(conn) * conn->output_sample_ratio +
                             (int64_t)(config.audio_backend_latency_offset * config.output_rate);
 
             if (delta >= 0) {
@@ -985,7 +1500,6 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
                       // ab_write),ab_read,ab_write);
                       conn->ab_buffering = 0;
                     }
-                    signed short *silence;
                     // if (fs==0)
                     //  debug(2,"Zero length silence buffer needed with gross_frame_gap of %lld and
                     //  dac_delay of %lld.",gross_frame_gap,dac_delay);
@@ -994,19 +1508,10 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
                     // ouotputting frames for a while -- it could get loaded up but not start
                     // responding
                     // for many milliseconds.
-                    if (fs > 0) {
-                      silence = malloc(conn->output_bytes_per_frame * fs);
-                      if (silence == NULL)
-                        debug(1, "Failed to allocate %d byte silence buffer.", fs);
-                      else {
-                        memset(silence, 0, conn->output_bytes_per_frame * fs);
-                        // debug(1,"Frames to start: %llu, DAC delay %d, buffer: %d
-                        // packets.",exact_frame_gap,dac_delay,seq_diff(conn->ab_read,
-                        // conn->ab_write, conn->ab_read));
-                        config.output->play(silence, fs);
-                        free(silence);
-                      }
-                    }
+                    // debug(1,"Frames to start: %llu, DAC delay %d, buffer: %d
+                    // packets.",exact_frame_gap,dac_delay,seq_diff(conn->ab_read,
+                    // conn->ab_write, conn->ab_read));
+                    play_silence(fs);
                     have_sent_prefiller_silence =
                         1; // even if we haven't sent silence because it's zero frames long...
                   }
@@ -1015,26 +1520,10 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
                   // debug(1,"Back end has no delay function.");
                   // send the appropriate prefiller here...
 
-                  signed short *silence;
                   if (lead_time != 0) {
                     int64_t frame_gap = (lead_time * config.output_rate) >> 32;
                     // debug(1,"%d frames needed.",frame_gap);
-                    while (frame_gap > 0) {
-                      size_t fs = config.output_rate / 10;
-                      if (fs > frame_gap)
-                        fs = frame_gap;
-
-                      silence = malloc(conn->output_bytes_per_frame * fs);
-                      if (silence == NULL)
-                        debug(1, "Failed to allocate %d frame silence buffer.", fs);
-                      else {
-                        // debug(1, "Outputting %d frames of silence.", fs);
-                        memset(silence, 0, conn->output_bytes_per_frame * fs);
-                        config.output->play(silence, fs);
-                        free(silence);
-                      }
-                      frame_gap -= fs;
-                    }
+                    play_silence(frame_gap);
                   }
                   have_sent_prefiller_silence = 1;
                   conn->ab_buffering = 0;
@@ -1083,7 +1572,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
         int64_t packet_timestamp = curframe->timestamp; // types okay
         int64_t delta = packet_timestamp - reference_timestamp;
         int64_t offset =
-            config.latency * conn->output_sample_ratio +
+            session_latency(conn) * conn->output_sample_ratio +
             (int64_t)(config.audio_backend_latency_offset * config.output_rate) -
             config.audio_backend_buffer_desired_length *
                 config.output_rate; // all arguments are int32_t, so expression promotion okay
@@ -1155,25 +1644,14 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
 
   seq_t read = conn->ab_read;
 
-  // check if t+8, t+16, t+32, t+64, t+128, ... (buffer_start_fill / 2)
-  // packets have arrived... last-chance resend
-
-  if (!conn->ab_buffering) {
-    for (i = 8; i < (seq_diff(conn->ab_read, conn->ab_write, conn->ab_read) / 2); i = (i * 2)) {
-      seq_t next = seq_sum(conn->ab_read, i);
-      abuf = conn->audio_buffer + BUFIDX(next);
-      if (!abuf->ready) {
-        rtp_request_resend(next, 1, conn);
-        // debug(1,"Resend %u.",next);
-        conn->resend_requests++;
-      }
-    }
-  }
+  if ((!conn->ab_buffering) && (conn->resend_outstanding))
+    resend_schedule(get_absolute_time_in_fp(), conn);
 
   if (!curframe->ready) {
     // debug(1, "Supplying a silent frame for frame %u", read);
     conn->missing_packets++;
     curframe->timestamp = 0; // indicate a silent frame should be substituted
+    resend_untrack(curframe, 0, conn);
   }
   curframe->ready = 0;
   conn->ab_read = SUCCESSOR(conn->ab_read);
@@ -1216,9 +1694,23 @@ static inline int32_t max(int32_t a, int32_t b, int32_t c) {
 }
 
 
+// start ramping to the latest volume setting, if it has changed -- this is done once per packet
+static void volume_ramp_update(rtsp_conn_info *conn) {
+  int64_t target = (int64_t)__atomic_load_n(&conn->fix_volume, __ATOMIC_ACQUIRE) << 16;
+  volume_ramp_t *ramp = &conn->volume_ramp;
+  if (target != ramp->target) {
+    ramp->target = target;
+    ramp->frames_left = config.volume_ramp_time * config.output_rate;
+    if (ramp->frames_left == 0)
+      ramp->current = target;
+    else
+      ramp->step = (target - ramp->current) / ramp->frames_left;
+  }
+}
+
 // this takes an array of signed 32-bit integers and (a) removes or inserts a frame as specified in
 // stuff,
-// (b) multiplies each sample by the fixedvolume (a 16-bit quantity)
+// (b) multiplies each sample by the volume, ramping it a frame at a time to a new setting
 // (c) dithers the result to the output size 32/24/16/8 bits
 // (d) outputs the result in the approprate format
 // formats accepted so far include U8, S8, S16, S24, S24_3LE, S24_3BE and S32
@@ -1233,7 +1725,6 @@ static int stuff_buffer_basic_32(int32_t *inptr, int length, enum sps_format_t l
     tstuff = 0; // if any of these conditions hold, don't stuff anything/
   }
 
-  int i;
   int stuffsamp = length;
 
     if (tstuff) {
@@ -1272,18 +1763,16 @@ static int stuff_buffer_basic_32(int32_t *inptr, int length, enum sps_format_t l
         }
     }
 
-  pthread_mutex_lock(&conn->vol_mutex);
-  for (i = 0; i < stuffsamp; i++) { // the whole frame, if no stuffing
-    process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-  };
+  // the whole frame, if no stuffing
+  inptr = process_frames(inptr, &l_outptr, stuffsamp, l_output_format, dither, conn);
   if (tstuff) {
     if (tstuff == 1) {
       // debug(3, "+++++++++");
       // interpolate one sample
-      process_sample(mean_32(inptr[-2], inptr[0]), &l_outptr, l_output_format, conn->fix_volume,
+      int64_t hyper_volume = volume_ramp_next(&conn->volume_ramp);
+      process_sample(mean_32(inptr[-2], inptr[0]), &l_outptr, l_output_format, hyper_volume,
                      dither, conn);
-      process_sample(mean_32(inptr[-1], inptr[1]), &l_outptr, l_output_format, conn->fix_volume,
+      process_sample(mean_32(inptr[-1], inptr[1]), &l_outptr, l_output_format, hyper_volume,
                      dither, conn);
     } else if (stuff == -1) {
       // debug(3, "---------");
@@ -1297,12 +1786,8 @@ static int stuff_buffer_basic_32(int32_t *inptr, int length, enum sps_format_t l
     if (tstuff < 0)
       remainder = remainder + tstuff; // don't run over the correct end of the output buffer
 
-    for (i = stuffsamp; i < remainder; i++) {
-      process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    }
+    inptr = process_frames(inptr, &l_outptr, remainder - stuffsamp, l_output_format, dither, conn);
   }
-  pthread_mutex_unlock(&conn->vol_mutex);
   conn->amountStuffed = tstuff;
   return length + tstuff;
 }
@@ -1312,7 +1797,7 @@ static int stuff_buffer_basic_32(int32_t *inptr, int length, enum sps_format_t l
 // (a) uses libsoxr to
 // resample the array to have one more or one less frame, as specified in
 // stuff,
-// (b) multiplies each sample by the fixedvolume (a 16-bit quantity)
+// (b) multiplies each sample by the volume, ramping it a frame at a time to a new setting
 // (c) dithers the result to the output size 32/24/16/8 bits
 // (d) outputs the result in the approprate format
 // formats accepted so far include U8, S8, S16, S24, S24_3LE, S24_3BE and S32
@@ -1373,24 +1858,14 @@ static int stuff_buffer_soxr_32(int32_t *inptr, int32_t *scratchBuffer, int leng
     }
 
     // now, do the volume, dither and formatting processing
-    ip = scratchBuffer;
     char *l_outptr = outptr;
-    for (i = 0; i < length + tstuff; i++) {
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    };
+    process_frames(scratchBuffer, &l_outptr, length + tstuff, l_output_format, dither, conn);
 
   } else { // the whole frame, if no stuffing
 
     // now, do the volume, dither and formatting processing
-    int32_t *ip = inptr;
     char *l_outptr = outptr;
-    int i;
-
-    for (i = 0; i < length; i++) {
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    };
+    process_frames(inptr, &l_outptr, length, l_output_format, dither, conn);
   }
   conn->amountStuffed = tstuff;
   return length + tstuff;
@@ -1401,13 +1876,62 @@ typedef struct stats { // statistics for running averages
   int64_t sync_error, correction, drift;
 } stats_t;
 
-static void *player_thread_func(void *arg) {
+// this takes an array of interleaved stereo floats and
+// (a) passes it through the DSP pipeline, which adds or removes a frame as specified in stuff
+// and applies the volume, among other things
+// (b) dithers the result to the output size 32/24/16/8 bits, if dither is set
+// (c) outputs the result in the approprate format
+
+static int dsp_play_buffer(float *inptr, float *scratchBuffer, int length,
+                           enum sps_format_t l_output_format, char *outptr, int stuff, int dither,
+                           rtsp_conn_info *conn) {
+  dsp_block block;
+  block.data = inptr;
+  block.scratch = scratchBuffer;
+  block.frames = length;
+  block.amount_to_stuff = stuff;
+  dsp_pipeline_process(&block, conn);
+
+  uint64_t time_before = get_absolute_time_in_fp();
+  char *l_outptr = outptr;
+  float *ip = inptr;
+  int i;
+  for (i = 0; i < block.frames; i++) {
+    process_float_sample(*ip++, &l_outptr, l_output_format, dither, conn);
+    process_float_sample(*ip++, &l_outptr, l_output_format, dither, conn);
+  }
+  dsp_pipeline_add_quantiser_time(get_absolute_time_in_fp() - time_before);
 
-  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  conn->amountStuffed = block.amount_stuffed;
+  return block.frames;
+}
 
+// A silent packet is played as zeros, without being converted, processed or dithered, but with
+// a frame added or removed as requested. The DSP stages and the volume ramp are moved on as if it
+// had been processed. Returns the number of frames to play.
+static int silent_play_buffer(int length, int stuff, int use_dsp, rtsp_conn_info *conn) {
+  if (use_dsp) {
+    dsp_block block;
+    block.data = block.scratch = NULL;
+    block.frames = length;
+    block.amount_to_stuff = stuff;
+    dsp_pipeline_skip(&block, conn);
+    conn->amountStuffed = block.amount_stuffed;
+    return block.frames;
+  }
+  volume_ramp_skip(&conn->volume_ramp, length);
+  if ((stuff > 1) || (stuff < -1) || (length < 100))
+    stuff = 0;
+  conn->amountStuffed = stuff;
+  return length + stuff;
+}
+
+// set up the connection's decoder, buffers and decryption for a stream -- for the player thread,
+// and for replaying a capture. Returns non-zero if the decoder can't be created, when only the
+// mutexes and the flowcontrol condition variable are left to be destroyed
+static int player_prepare(rtsp_conn_info *conn) {
   conn->please_stop = 0;
   conn->packet_count = 0;
-  conn->previous_random_number = 0;
   conn->input_bytes_per_frame = 4;
   conn->player_thread_please_stop = 0;
   conn->decoder_in_use = 0;
@@ -1415,6 +1939,13 @@ static void *player_thread_func(void *arg) {
   conn->ab_synced = 0;
   conn->first_packet_timestamp = 0;
   conn->flush_requested = 0;
+  conn->last_sound_timestamp = 0;
+  conn->silent_frames = 0;
+  conn->output_idle = 0;
+  conn->output_refill = 0;
+  conn->decoding_time = 0;
+  conn->decrypting_time = 0;
+  conn->packets_decoded = 0;
   // conn->fix_volume = 0x10000;
 
   int rc = pthread_mutex_init(&conn->ab_mutex, NULL);
@@ -1423,9 +1954,6 @@ static void *player_thread_func(void *arg) {
   rc = pthread_mutex_init(&conn->flush_mutex, NULL);
   if (rc)
     debug(1, "Error initialising flush_mutex.");
-  rc = pthread_mutex_init(&conn->vol_mutex, NULL);
-  if (rc)
-    debug(1, "Error initialising vol_mutex.");
 // set the flowcontrol condition variable to wait on a monotonic clock
 #ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
   pthread_condattr_t attr;
@@ -1438,13 +1966,19 @@ static void *player_thread_func(void *arg) {
 #endif
   if (rc)
     debug(1, "Error initialising flowcontrol condition variable.");
-  config.output->start(config.output_rate, config.output_format);
 
-  init_decoder((int32_t *)&conn->stream.fmtp,
-               conn); // this sets up incoming rate, bit depth, channels
+  if (init_decoder((int32_t *)&conn->stream.fmtp,
+                   conn) != 0) { // this sets up incoming rate, bit depth, channels
+    warn("Could not create the decoder for the audio stream of RTSP conversation %d.",
+         conn->connection_number);
+    return -1;
+  }
   // must be after decoder init
   init_buffer(conn);
 
+#ifdef HAVE_LIBSSL
+  conn->aes_ctx = NULL;
+#endif
   if (conn->stream.encrypted) {
 #ifdef HAVE_LIBMBEDTLS
     memset(&conn->dctx, 0, sizeof(mbedtls_aes_context));
@@ -1457,7 +1991,11 @@ static void *player_thread_func(void *arg) {
 #endif
 
 #ifdef HAVE_LIBSSL
-    AES_set_decrypt_key(conn->stream.aeskey, 128, &conn->aes);
+    conn->aes_ctx = EVP_CIPHER_CTX_new();
+    if (conn->aes_ctx == NULL)
+      die("Failed to allocate a cipher context.");
+    EVP_DecryptInit_ex(conn->aes_ctx, EVP_aes_128_cbc(), NULL, conn->stream.aeskey, NULL);
+    EVP_CIPHER_CTX_set_padding(conn->aes_ctx, 0); // only whole blocks are decrypted
 #endif
   }
 
@@ -1475,6 +2013,139 @@ static void *player_thread_func(void *arg) {
       500 * conn->output_sample_ratio; // we add or subtract one frame at the nominal
                                        // rate, multiply it by the frame ratio.
                                        // but, on some occasions, more than one frame could be added
+  conn->missing_packets = conn->late_packets = conn->too_late_packets = conn->resend_requests = 0;
+  conn->resend_packets = conn->resend_recovered = 0;
+  adaptive_latency_reset(conn);
+  conn->flush_rtp_timestamp =
+      0; // it seems this number has a special significance -- it seems to be used
+         // as a null operand, so we'll use it like that too
+  return 0;
+}
+
+// destroy the flow control and mutexes
+static void player_release_locks(rtsp_conn_info *conn) {
+  int rc = pthread_cond_destroy(&conn->flowcontrol);
+  if (rc)
+    debug(1, "Error destroying flowcontrol condition variable.");
+  rc = pthread_mutex_destroy(&conn->flush_mutex);
+  if (rc)
+    debug(1, "Error destroying flush_mutex variable.");
+  rc = pthread_mutex_destroy(&conn->ab_mutex);
+  if (rc)
+    debug(1, "Error destroying ab_mutex variable.");
+}
+
+static void player_release(rtsp_conn_info *conn) {
+  free_audio_buffers(conn);
+  terminate_decoders(conn);
+#ifdef HAVE_LIBSSL
+  if (conn->aes_ctx) {
+    EVP_CIPHER_CTX_free(conn->aes_ctx);
+    conn->aes_ctx = NULL;
+  }
+#endif
+  player_release_locks(conn);
+}
+
+// Replaying a capture. The packets are put into the buffer as they arrived, and the frames are
+// taken out when they fall due, by the same reckoning as buffer_get_frame(), but without waiting
+// -- time is whatever the capture says it is. There's no output.
+
+int player_replay_begin(rtsp_conn_info *conn) {
+  if (player_prepare(conn) != 0) {
+    player_release_locks(conn);
+    return -1;
+  }
+  conn->connection_state_to_output = 1;
+  return 0;
+}
+
+void player_replay_end(rtsp_conn_info *conn) { player_release(conn); }
+
+abuf_t *player_replay_frame(uint64_t time_now, rtsp_conn_info *conn) {
+  abuf_t *frame = NULL;
+  pthread_mutex_lock(&conn->ab_mutex);
+  if (conn->resend_outstanding)
+    resend_schedule(time_now, conn);
+  int32_t filled = seq_diff(conn->ab_read, conn->ab_write, conn->ab_read);
+  int64_t reference_timestamp;
+  uint64_t reference_timestamp_time, remote_reference_timestamp_time;
+  get_reference_timestamp_stuff(&reference_timestamp, &reference_timestamp_time,
+                                &remote_reference_timestamp_time, conn);
+  if ((conn->ab_synced) && (filled > 0) && (reference_timestamp)) {
+    // a missing frame is due when the first ready frame after it, less its place, would be
+    int i;
+    for (i = 0; i < filled; i++) {
+      abuf_t *abuf = conn->audio_buffer + BUFIDX(seq_sum(conn->ab_read, i));
+      if (abuf->ready) {
+        int64_t timestamp = abuf->timestamp - (int64_t)i * conn->max_frames_per_packet;
+        int64_t offset = (timestamp - reference_timestamp) * conn->output_sample_ratio +
+                         session_latency(conn) * conn->output_sample_ratio +
+                         (int64_t)(config.audio_backend_latency_offset * config.output_rate) -
+                         (int64_t)(config.audio_backend_buffer_desired_length * config.output_rate);
+        uint64_t time_to_play =
+            reference_timestamp_time + offset * ((int64_t)1 << 32) / config.output_rate;
+        if (time_now >= time_to_play) {
+          frame = conn->audio_buffer + BUFIDX(conn->ab_read);
+          if (!frame->ready) {
+            conn->missing_packets++;
+            frame->timestamp = 0;
+            resend_untrack(frame, 0, conn);
+          }
+          frame->ready = 0;
+          conn->ab_read = SUCCESSOR(conn->ab_read);
+        }
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&conn->ab_mutex);
+  return frame;
+}
+
+static void *player_thread_func(void *arg) {
+
+  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+
+  if (player_prepare(conn) != 0) {
+    // the session can't be played, so end it, and wait to be stopped in the usual way.
+    // player_stop() signals flowcontrol without holding ab_mutex, so look for its request to stop
+    // at least every tenth of a second rather than relying on the signal
+    rtsp_request_conversation_stop(conn);
+    pthread_mutex_lock(&conn->ab_mutex);
+    while (conn->player_thread_please_stop == 0) {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+      struct timespec time_of_wakeup;
+      clock_gettime(CLOCK_MONOTONIC, &time_of_wakeup);
+      time_of_wakeup.tv_nsec += 100000000;
+      if (time_of_wakeup.tv_nsec >= 1000000000) {
+        time_of_wakeup.tv_sec++;
+        time_of_wakeup.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&conn->flowcontrol, &conn->ab_mutex, &time_of_wakeup);
+#endif
+#ifdef COMPILE_FOR_OSX
+      struct timespec time_to_wait;
+      time_to_wait.tv_sec = 0;
+      time_to_wait.tv_nsec = 100000000;
+      pthread_cond_timedwait_relative_np(&conn->flowcontrol, &conn->ab_mutex, &time_to_wait);
+#endif
+    }
+    pthread_mutex_unlock(&conn->ab_mutex);
+    player_release_locks(conn);
+    return NULL;
+  }
+
+  // the on-start command may name the output device, so its output is needed before any audio
+  // is played, and with wait_for_completion, audio waits for it to finish anyway -- meanwhile,
+  // incoming packets are buffered
+  if ((config.cmd_start_returns_output) || (config.cmd_blocking)) {
+    uint64_t time_before = get_absolute_time_in_fp();
+    hook_wait(conn->start_command_ticket);
+    debug(2, "Waited %.2f ms for the on-start command.",
+          (get_absolute_time_in_fp() - time_before) * 1000.0 / ((uint64_t)1 << 32));
+  }
+  config.output->start(config.output_rate, config.output_format);
 
   switch (config.output_format) {
   case SPS_FORMAT_S24_3LE:
@@ -1493,11 +2164,8 @@ static void *player_thread_func(void *arg) {
 
   debug(1, "Output frame bytes is %d.", conn->output_bytes_per_frame);
 
-  // create and start the timing, control and audio receiver threads
-  pthread_t rtp_audio_thread, rtp_control_thread, rtp_timing_thread;
-  pthread_create(&rtp_audio_thread, NULL, &rtp_audio_receiver, (void *)conn);
-  pthread_create(&rtp_control_thread, NULL, &rtp_control_receiver, (void *)conn);
-  pthread_create(&rtp_timing_thread, NULL, &rtp_timing_receiver, (void *)conn);
+  // start serving the audio, control and timing ports
+  rtp_start(conn);
 
   conn->session_corrections = 0;
   conn->play_segment_reference_frame = 0; // zero signals that we are not in a play segment
@@ -1546,10 +2214,12 @@ static void *player_thread_func(void *arg) {
   static char rnstate[256];
   initstate(time(NULL), rnstate, 256);
 
-  signed short *inbuf, *tbuf, *silence;
+  int32_t *inbuf, *tbuf;
 
   int32_t *sbuf;
 
+  float *fbuf, *fsbuf;
+
   char *outbuf;
 
   int inbuflength;
@@ -1577,6 +2247,7 @@ static void *player_thread_func(void *arg) {
   }
 
   debug(1, "Output bit depth is %d.", output_bit_depth);
+  dither_init(&conn->dither, config.dither, config.output_rate, output_bit_depth);
 
   if (conn->input_bit_depth > output_bit_depth) {
     debug(1, "Dithering will be enabled because the input bit depth is greater than the output bit "
@@ -1602,25 +2273,29 @@ static void *player_thread_func(void *arg) {
     if (sbuf == NULL)
       debug(1, "Failed to allocate memory for the sbuf buffer.");
   }
-  // We might need an output buffer and a buffer of silence.
-  // The size of these dependents on the number of frames, the size of each frame and the maximum
+  // when there's floating point processing to do, each packet is converted straight to floats and
+  // passed through the DSP pipeline, which needs a buffer to work in and another for scratch
+  int use_dsp = dsp_pipeline_wanted();
+  fbuf = fsbuf = NULL;
+  if (use_dsp) {
+    size_t fbuf_size = sizeof(float) * 2 * (conn->max_frames_per_packet * conn->output_sample_ratio +
+                                            conn->max_frame_size_change);
+    fbuf = malloc(fbuf_size);
+    fsbuf = malloc(fbuf_size);
+    if ((fbuf == NULL) || (fsbuf == NULL))
+      die("Failed to allocate memory for the DSP pipeline's buffers.");
+  }
+  // Silent packets are played as zeros, but with the DSP pipeline, not until the stages have had
+  // time to settle after the sound before them.
+  int64_t silence_settling_frames = use_dsp ? dsp_pipeline_settling_frames() : 0;
+  // We need an output buffer.
+  // The size of it depends on the number of frames, the size of each frame and the maximum
   // size change
   outbuf = malloc(
       conn->output_bytes_per_frame *
       (conn->max_frames_per_packet * conn->output_sample_ratio + conn->max_frame_size_change));
   if (outbuf == NULL)
     die("Failed to allocate memory for an output buffer.");
-  silence = malloc(conn->output_bytes_per_frame * conn->max_frames_per_packet *
-                   conn->output_sample_ratio);
-  if (silence == NULL)
-    die("Failed to allocate memory for a silence buffer.");
-  memset(silence, 0,
-         conn->output_bytes_per_frame * conn->max_frames_per_packet * conn->output_sample_ratio);
-  conn->first_packet_timestamp = 0;
-  conn->missing_packets = conn->late_packets = conn->too_late_packets = conn->resend_requests = 0;
-  conn->flush_rtp_timestamp =
-      0; // it seems this number has a special significance -- it seems to be used
-         // as a null operand, so we'll use it like that too
   int sync_error_out_of_bounds =
       0; // number of times in a row that there's been a serious sync error
 
@@ -1673,8 +2348,18 @@ static void *player_thread_func(void *arg) {
 	// set the default volume to whaterver it was before, as stored in the config airplay_volume
 	debug(1,"Set initial volume to %f.",config.airplay_volume);
 	
-	player_volume(config.airplay_volume,conn);
+	player_volume_apply(config.airplay_volume,conn);
+
+  // start at the volume just set, rather than ramping up to it
+  conn->volume_ramp.target = (int64_t)__atomic_load_n(&conn->fix_volume, __ATOMIC_ACQUIRE) << 16;
+  conn->volume_ramp.current = conn->volume_ramp.target;
+  conn->volume_ramp.frames_left = 0;
+
+  if (use_dsp)
+    dsp_pipeline_init(conn);
 	
+  uint64_t processing_time = 0; // for reporting the CPU time per packet
+  int packets_processed = 0;
   int rolling_sync_error[16] = {};
   uint8_t rolling_sync_error_idx = 0;
 
@@ -1691,7 +2376,8 @@ static void *player_thread_func(void *arg) {
           // debug(1,"Player has a supplied silent frame.");
           conn->last_seqno_read = (SUCCESSOR(conn->last_seqno_read) &
                                    0xffff); // manage the packet out of sequence minder
-          config.output->play(silence, conn->max_frames_per_packet * conn->output_sample_ratio);
+          if (conn->output_idle == 0)
+            play_silence(conn->max_frames_per_packet * conn->output_sample_ratio);
         } else if (conn->play_number_after_flush < 10) {
           /*
           int64_t difference = 0;
@@ -1701,77 +2387,51 @@ static void *player_thread_func(void *arg) {
           debug(1, "Play number %d, monotonic timestamp %llx, difference
           %lld.",conn->play_number_after_flush,inframe->timestamp,difference);
           */
-          config.output->play(silence, conn->max_frames_per_packet * conn->output_sample_ratio);
+          play_silence(conn->max_frames_per_packet * conn->output_sample_ratio);
+        } else if ((conn->output_idle) && (inframe->silent) &&
+                   (__atomic_load_n(&conn->last_sound_timestamp, __ATOMIC_ACQUIRE) <=
+                    inframe->timestamp)) {
+          // the output is stopped and there's no sound on the way yet, so the packet is dropped
+          volume_ramp_update(conn);
+          int skipped_frames = inbuflength * conn->output_sample_ratio;
+          silent_play_buffer(skipped_frames, 0, use_dsp, conn);
+          conn->silent_frames += skipped_frames;
+          conn->last_seqno_read = inframe->sequence_number;
+          inframe->timestamp = 0;
+          inframe->sequence_number = 0;
         } else {
+          volume_ramp_update(conn);
+          if (conn->output_idle)
+            player_output_wake(1, conn);
+          if (inframe->silent)
+            conn->silent_frames += inbuflength * conn->output_sample_ratio;
+          else
+            conn->silent_frames = 0;
+          int play_zeros = (inframe->silent) && (conn->silent_frames > silence_settling_frames);
           int enable_dither = 0;
-          if ((conn->fix_volume != 0x10000) || (conn->input_bit_depth > output_bit_depth) ||
+          if ((conn->volume_ramp.current != ((int64_t)0x10000 << 16)) ||
+              (conn->volume_ramp.frames_left) || (conn->input_bit_depth > output_bit_depth) ||
               (config.playback_mode == ST_mono))
             enable_dither = 1;
 
-          // here, let's transform the frame of data, if necessary
-
-          switch (conn->input_bit_depth) {
-          case 16: {
-            int i, j;
-            int16_t ls, rs;
-            int32_t ll, rl;
-            int16_t *inps = inbuf;
-            int16_t *outps = tbuf;
-            int32_t *outpl = (int32_t *)tbuf;
-            for (i = 0; i < inbuflength; i++) {
-              ls = *inps++;
-              rs = *inps++;
-
-              // here, do the mode stuff -- mono / reverse stereo / leftonly / rightonly
-              // also, raise the 16-bit samples to 32 bits.
-
-              switch (config.playback_mode) {
-              case ST_mono: {
-                int32_t both = ls + rs;
-                both = both << (16 - 1); // keep all 17 bits of the sum of the 16bit left and right
-                                         // -- the 17th bit will influence dithering later
-                ll = both;
-                rl = both;
-              } break;
-              case ST_reverse_stereo: {
-                ll = rs;
-                rl = ls;
-                ll = ll << 16;
-                rl = rl << 16;
-              } break;
-              case ST_left_only:
-                rl = ls;
-                ll = ls;
-                ll = ll << 16;
-                rl = rl << 16;
-                break;
-              case ST_right_only:
-                ll = rs;
-                rl = rs;
-                ll = ll << 16;
-                rl = rl << 16;
-                break;
-              case ST_stereo:
-                ll = ls;
-                rl = rs;
-                ll = ll << 16;
-                rl = rl << 16;
-                break; // nothing extra to do
-              }
-
-              // here, replicate the samples if you're upsampling
-
-              for (j = 0; j < conn->output_sample_ratio; j++) {
-                *outpl++ = ll;
-                *outpl++ = rl;
-              }
+          // here, let's transform the frame of data, if necessary -- its samples are already
+          // 32 bits, so in plain stereo at the output rate it can be used just as it is
+
+          uint64_t time_before_processing = get_absolute_time_in_fp();
+          int32_t *stuffbuf = inbuf; // what's passed to the stuffing functions
+          if (play_zeros == 0) {
+            // the standard stream's kernel has already done the mode stuff
+            stuffbuf = channels_to_stereo(inbuf, inbuflength, tbuf,
+                                          (use_dsp == 0) && (conn->standard_kernel == NULL), conn);
+            if (use_dsp) {
+              // convert to floats -- the DSP pipeline does the mode stuff
+              int i;
+              for (i = 0; i < 2 * inbuflength * conn->output_sample_ratio; i++)
+                fbuf[i] = stuffbuf[i];
             }
-
-          } break;
-          default:
-            die("Shairport Sync only supports 16 bit input");
           }
 
+          uint64_t packet_processing_time = get_absolute_time_in_fp() - time_before_processing;
           inbuflength *= conn->output_sample_ratio;
 
           // We have a frame of data. We need to see if we want to add or remove a frame from it to
@@ -1886,10 +2546,25 @@ static void *player_thread_func(void *arg) {
             // if negative, the packet will be early -- the delay is less than expected.
 
             sync_error =
-                delay - (config.latency * conn->output_sample_ratio +
+                delay - (session_latency(conn) * conn->output_sample_ratio +
                          (int64_t)(config.audio_backend_latency_offset *
                                    config.output_rate)); // int64_t from int64_t - int32_t, so okay
 
+            if (conn->output_refill) {
+              // the output has just been restarted, empty -- fill it with silence up to where
+              // this frame is due, as the prefiller silence does at the start of play
+              conn->output_refill = 0;
+              int64_t refill = -sync_error;
+              if (refill > 2 * config.audio_backend_buffer_desired_length * config.output_rate)
+                refill = 2 * config.audio_backend_buffer_desired_length * config.output_rate;
+              if (refill > 0) {
+                debug(2, "Refilling the restarted output with %lld frames of silence.", refill);
+                play_silence(refill);
+                sync_error += refill;
+              }
+              memset(rolling_sync_error, 0, sizeof(rolling_sync_error));
+            }
+
               {
                   rolling_sync_error[rolling_sync_error_idx] = sync_error;
                   rolling_sync_error_idx++;
@@ -1933,25 +2608,36 @@ static void *player_thread_func(void *arg) {
                 if (silence_length > (filler_length * 5))
                   silence_length = filler_length * 5;
 
-                char *long_silence = malloc(conn->output_bytes_per_frame * silence_length);
-                if (long_silence == NULL)
-                  die("Failed to allocate memory for a long_silence buffer of %d frames.",
-                      silence_length);
-                memset(long_silence, 0, conn->output_bytes_per_frame * silence_length);
-                config.output->play((short *)long_silence, silence_length);
-                free(long_silence);
+                play_silence(silence_length);
               }
             } else {
 
               // before we finally commit to this frame, check its sequencing and timing
 
-              // require a certain error before bothering to fix it...
-              if (sync_error > config.tolerance * config.output_rate) { // int64_t > int, okay
+              // require a certain error before bothering to fix it -- errors within the
+              // uncertainty of the source's clock, up to a limit, aren't worth chasing
+              double tolerance = config.tolerance;
+              double clock_uncertainty =
+                  __atomic_load_n(&conn->clock_uncertainty, __ATOMIC_RELAXED) * 1.0 /
+                  ((uint64_t)1 << 32);
+              if (clock_uncertainty > CLOCK_UNCERTAINTY_TOLERANCE_LIMIT * config.tolerance)
+                clock_uncertainty = CLOCK_UNCERTAINTY_TOLERANCE_LIMIT * config.tolerance;
+              if (clock_uncertainty > tolerance)
+                tolerance = clock_uncertainty;
+              if (sync_error > tolerance * config.output_rate) { // int64_t > int, okay
                 amount_to_stuff = -1;
               }
-              if (sync_error < -config.tolerance * config.output_rate) {
+              if (sync_error < -tolerance * config.output_rate) {
                 amount_to_stuff = 1;
               }
+              if (config.adaptive_latency) {
+                int64_t silence = adaptive_latency_update(sync_error, tolerance, conn);
+                if (silence) {
+                  debug(2, "Adaptive latency: grown by %.1f ms at once.",
+                        1000.0 * silence / config.output_rate);
+                  play_silence(silence);
+                }
+              }
 
               // only allow stuffing if there is enough time to do it -- check DAC buffer...
               if (current_delay < DAC_BUFFER_QUEUE_MINIMUM_LENGTH) {
@@ -1985,74 +2671,30 @@ static void *player_thread_func(void *arg) {
               if (config.no_sync != 0)
                 amount_to_stuff = 0; // no stuffing if it's been disabled
 
-              // Apply DSP here
-              if (config.loudness
-#ifdef CONFIG_CONVOLUTION
-                  || config.convolution
-#endif
-                  ) {
-                int32_t *tbuf32 = (int32_t *)tbuf;
-                float fbuf_l[inbuflength];
-                float fbuf_r[inbuflength];
-
-                // Deinterleave, and convert to float
-                int i;
-                for (i = 0; i < inbuflength; ++i) {
-                  fbuf_l[i] = tbuf32[2 * i];
-                  fbuf_r[i] = tbuf32[2 * i + 1];
-                }
-
-#ifdef CONFIG_CONVOLUTION
-                // Apply convolution
-                if (config.convolution) {
-                  convolver_process_l(fbuf_l, inbuflength);
-                  convolver_process_r(fbuf_r, inbuflength);
-
-                  float gain = pow(10.0, config.convolution_gain / 20.0);
-                  for (i = 0; i < inbuflength; ++i) {
-                    fbuf_l[i] *= gain;
-                    fbuf_r[i] *= gain;
-                  }
-                }
-#endif
-
-                if (config.loudness) {
-                  // Apply volume and loudness
-                  // Volume must be applied here because the loudness filter will increase the
-                  // signal level and it would saturate the int32_t otherwise
-                  float gain = conn->fix_volume / 65536.0f;
-                  float gain_db = 20 * log10(gain);
-                  // debug(1, "Applying soft volume dB: %f k: %f", gain_db, gain);
-
-                  for (i = 0; i < inbuflength; ++i) {
-                    fbuf_l[i] = loudness_process(&loudness_l, fbuf_l[i] * gain);
-                    fbuf_r[i] = loudness_process(&loudness_r, fbuf_r[i] * gain);
-                  }
-                }
-
-                // Interleave and convert back to int32_t
-                for (i = 0; i < inbuflength; ++i) {
-                  tbuf32[2 * i] = fbuf_l[i];
-                  tbuf32[2 * i + 1] = fbuf_r[i];
-                }
-              }
-
-              switch (config.packet_stuffing) {
-              case ST_basic:
-                //                if (amount_to_stuff) debug(1,"Basic stuff...");
-                play_samples =
-                    stuff_buffer_basic_32((int32_t *)tbuf, inbuflength, config.output_format,
-                                          outbuf, amount_to_stuff, enable_dither, conn);
-                break;
-              case ST_soxr:
+              time_before_processing = get_absolute_time_in_fp();
+              if (play_zeros)
+                play_samples = silent_play_buffer(inbuflength, amount_to_stuff, use_dsp, conn);
+              else if (use_dsp)
+                play_samples = dsp_play_buffer(fbuf, fsbuf, inbuflength, config.output_format,
+                                               outbuf, amount_to_stuff, enable_dither, conn);
+              else
+                switch (config.packet_stuffing) {
+                case ST_basic:
+                  //                if (amount_to_stuff) debug(1,"Basic stuff...");
+                  play_samples =
+                      stuff_buffer_basic_32(stuffbuf, inbuflength, config.output_format, outbuf,
+                                            amount_to_stuff, enable_dither, conn);
+                  break;
+                case ST_soxr:
 #ifdef HAVE_LIBSOXR
-                //                if (amount_to_stuff) debug(1,"Soxr stuff...");
-                play_samples = stuff_buffer_soxr_32((int32_t *)tbuf, (int32_t *)sbuf, inbuflength,
-                                                    config.output_format, outbuf, amount_to_stuff,
-                                                    enable_dither, conn);
+                  //                if (amount_to_stuff) debug(1,"Soxr stuff...");
+                  play_samples =
+                      stuff_buffer_soxr_32(stuffbuf, sbuf, inbuflength, config.output_format,
+                                           outbuf, amount_to_stuff, enable_dither, conn);
 #endif
-                break;
-              }
+                  break;
+                }
+              packet_processing_time += get_absolute_time_in_fp() - time_before_processing;
 
               /*
               {
@@ -2074,6 +2716,8 @@ static void *player_thread_func(void *arg) {
               else {
                 if (play_samples == 0)
                   debug(1, "play_samples==0 skipping it (1).");
+                else if (play_zeros)
+                  play_silence(play_samples);
                 else
                   config.output->play((short *)outbuf, play_samples); // remove the (short*)!
               }
@@ -2104,14 +2748,39 @@ static void *player_thread_func(void *arg) {
           } else {
             // if there is no delay procedure, or it's not working or not allowed, there can be no
             // synchronising
-            play_samples = stuff_buffer_basic_32((int32_t *)tbuf, inbuflength, config.output_format,
-                                                 outbuf, 0, enable_dither, conn);
+            conn->output_refill = 0;
+            time_before_processing = get_absolute_time_in_fp();
+            if (play_zeros)
+              play_samples = silent_play_buffer(inbuflength, 0, use_dsp, conn);
+            else if (use_dsp)
+              play_samples = dsp_play_buffer(fbuf, fsbuf, inbuflength, config.output_format,
+                                             outbuf, 0, enable_dither, conn);
+            else
+              play_samples = stuff_buffer_basic_32(stuffbuf, inbuflength, config.output_format,
+                                                   outbuf, 0, enable_dither, conn);
+            packet_processing_time += get_absolute_time_in_fp() - time_before_processing;
             if (outbuf == NULL)
               debug(1, "NULL outbuf to play -- skipping it.");
+            else if (play_zeros)
+              play_silence(play_samples);
             else
               config.output->play((short *)outbuf, play_samples); // remove the (short*)!
           }
 
+          processing_time += packet_processing_time;
+          packets_processed++;
+
+          // after a long enough silence, with no sound on the way, the output can be stopped
+          if ((config.output_idle_timeout > 0.0) && (config.output->stop) &&
+              (conn->silent_frames >= config.output_idle_timeout * config.output_rate) &&
+              (__atomic_load_n(&conn->last_sound_timestamp, __ATOMIC_ACQUIRE) <=
+               inframe->timestamp)) {
+            debug(1, "Stopping the output after %.1f seconds of silence.",
+                  (double)conn->silent_frames / config.output_rate);
+            config.output->stop();
+            conn->output_idle = 1;
+          }
+
           // mark the frame as finished
           inframe->timestamp = 0;
           inframe->sequence_number = 0;
@@ -2237,6 +2906,33 @@ static void *player_thread_func(void *arg) {
               inform("No frames received in the last sampling interval.");
             }
           }
+          // the CPU time taken per packet by the decoder thread and by this one, which is what the
+          // standard stream's kernels are there to cut
+          uint64_t decoding_time = __atomic_exchange_n(&conn->decoding_time, 0, __ATOMIC_RELAXED);
+          uint64_t decrypting_time =
+              __atomic_exchange_n(&conn->decrypting_time, 0, __ATOMIC_RELAXED);
+          uint64_t packets_decoded =
+              __atomic_exchange_n(&conn->packets_decoded, 0, __ATOMIC_RELAXED);
+          if ((packets_decoded) && (packets_processed))
+            debug(2, "%s stream: %.1f microseconds decoding, %.1f of them decrypting, and %.1f "
+                     "microseconds processing per packet.",
+                  conn->standard_kernel ? "Standard" : "Non-standard",
+                  decoding_time * 1000000.0 / ((uint64_t)1 << 32) / packets_decoded,
+                  decrypting_time * 1000000.0 / ((uint64_t)1 << 32) / packets_decoded,
+                  processing_time * 1000000.0 / ((uint64_t)1 << 32) / packets_processed);
+          processing_time = 0;
+          packets_processed = 0;
+          if (config.adaptive_latency)
+            debug(2, "Adaptive latency: %.3f seconds, with a transit time peak of %.1f ms and an "
+                     "allowance of %.1f ms for resends and losses.",
+                  1.0 * session_latency(conn) / conn->input_rate,
+                  1000.0 * __atomic_load_n(&conn->transit_peak, __ATOMIC_RELAXED) /
+                      ((uint64_t)1 << 32),
+                  1000.0 * conn->latency_penalty / ((uint64_t)1 << 32));
+          if (conn->resend_packets)
+            debug(2, "Resending: %llu requests for %llu packets, of which %llu (%.1f%%) arrived.",
+                  conn->resend_requests, conn->resend_packets, conn->resend_recovered,
+                  100.0 * conn->resend_recovered / conn->resend_packets);
           minimum_dac_queue_size = INT64_MAX;   // hack reset
           maximum_buffer_occupancy = INT32_MIN; // can't be less than this
           minimum_buffer_occupancy = INT32_MAX; // can't be more than this
@@ -2260,40 +2956,18 @@ static void *player_thread_func(void *arg) {
                                                // as a remote control. Specifically we might need
                                                // the port number
 
-  if (config.output->stop)
+  if ((config.output->stop) && (conn->output_idle == 0))
     config.output->stop();
   usleep(100000); // allow this time to (?) allow the alsa subsystem to finish cleaning up after
                   // itself. 50 ms seems too short
 
-  debug(2, "Shut down audio, control and timing threads");
+  debug(2, "Shut down the RTP receiver");
   conn->please_stop = 1;
-  pthread_kill(rtp_audio_thread, SIGUSR1);
-  pthread_kill(rtp_control_thread, SIGUSR1);
-  pthread_kill(rtp_timing_thread, SIGUSR1);
-  pthread_join(rtp_timing_thread, NULL);
-  debug(3, "timing thread joined");
-  pthread_join(rtp_audio_thread, NULL);
-  debug(3, "audio thread joined");
-  pthread_join(rtp_control_thread, NULL);
-  debug(3, "control thread joined");
+  rtp_stop(conn);
   clear_reference_timestamp(conn);
   conn->rtp_running = 0;
 
-  free_audio_buffers(conn);
-  terminate_decoders(conn);
-  // remove flow control and mutexes
-  rc = pthread_cond_destroy(&conn->flowcontrol);
-  if (rc)
-    debug(1, "Error destroying flowcontrol condition variable.");
-  rc = pthread_mutex_destroy(&conn->flush_mutex);
-  if (rc)
-    debug(1, "Error destroying flush_mutex variable.");
-  rc = pthread_mutex_destroy(&conn->ab_mutex);
-  if (rc)
-    debug(1, "Error destroying ab_mutex variable.");
-  rc = pthread_mutex_destroy(&conn->vol_mutex);
-  if (rc)
-    debug(1, "Error destroying vol_mutex variable.");
+  player_release(conn);
 
   debug(1, "Player thread exit on RTSP conversation thread %d.", conn->connection_number);
   if (conn->dacp_id) {
@@ -2302,12 +2976,14 @@ static void *player_thread_func(void *arg) {
   }
   if (outbuf)
     free(outbuf);
-  if (silence)
-    free(silence);
   if (tbuf)
     free(tbuf);
   if (sbuf)
     free(sbuf);
+  if (fbuf)
+    free(fbuf);
+  if (fsbuf)
+    free(fsbuf);
   return 0;
 }
 
@@ -2508,9 +3184,8 @@ void player_volume_without_notification(double airplay_volume, rtsp_conn_info *c
   // debug(1,"Software attenuation set to %f, i.e %f out of 65,536, for airplay volume of
   // %f",software_attenuation,temp_fix_volume,airplay_volume);
 
-  pthread_mutex_lock(&conn->vol_mutex);
-  conn->fix_volume = temp_fix_volume;
-  pthread_mutex_unlock(&conn->vol_mutex);
+  // the player thread picks this up at its next packet and ramps to it
+  __atomic_store_n(&conn->fix_volume, (int)temp_fix_volume, __ATOMIC_RELEASE);
 
   if (config.loudness)
     loudness_set_volume(software_attenuation / 100);
@@ -2536,7 +3211,7 @@ void player_volume_without_notification(double airplay_volume, rtsp_conn_info *c
 	config.airplay_volume = airplay_volume;
 }
 
-void player_volume(double airplay_volume, rtsp_conn_info *conn) {
+static void player_volume_apply(double airplay_volume, rtsp_conn_info *conn) {
   command_set_volume(airplay_volume);
 
 #ifdef HAVE_DBUS
@@ -2578,6 +3253,72 @@ void player_volume(double airplay_volume, rtsp_conn_info *conn) {
   player_volume_without_notification(airplay_volume, conn);
 }
 
+// Dragging a volume slider sends a stream of volume changes, each of which may run the
+// on-set-volume command and set the mixer. So changes are handed to a thread which applies the
+// latest of them, no more often than once per config.volume_update_interval.
+static pthread_mutex_t volume_update_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t volume_update_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t volume_update_thread;
+static int volume_update_thread_started = 0;
+static rtsp_conn_info *volume_update_conn = NULL; // the connection of the pending change, if any
+static rtsp_conn_info *volume_update_busy_conn = NULL; // the connection whose change is being applied
+static double volume_update_volume;
+static uint64_t volume_updates_requested, volume_updates_applied;
+
+static void *volume_update_thread_func(void *arg) {
+  pthread_mutex_lock(&volume_update_mutex);
+  while (1) {
+    while (volume_update_conn == NULL)
+      pthread_cond_wait(&volume_update_cond, &volume_update_mutex);
+    rtsp_conn_info *conn = volume_update_conn;
+    double airplay_volume = volume_update_volume;
+    volume_update_conn = NULL;
+    volume_update_busy_conn = conn;
+    volume_updates_applied++;
+    debug(3, "Applying volume %f -- %" PRIu64 " of %" PRIu64 " volume changes applied.",
+          airplay_volume, volume_updates_applied, volume_updates_requested);
+    pthread_mutex_unlock(&volume_update_mutex);
+
+    player_volume_apply(airplay_volume, conn);
+
+    pthread_mutex_lock(&volume_update_mutex);
+    volume_update_busy_conn = NULL;
+    pthread_cond_broadcast(&volume_update_cond); // in case player_volume_cancel() is waiting
+    pthread_mutex_unlock(&volume_update_mutex);
+    // changes arriving now are held until the interval is up
+    usleep((useconds_t)(config.volume_update_interval * 1000000));
+    pthread_mutex_lock(&volume_update_mutex);
+  }
+  return NULL;
+}
+
+void player_volume(double airplay_volume, rtsp_conn_info *conn) {
+  if (config.volume_update_interval == 0.0) {
+    player_volume_apply(airplay_volume, conn);
+    return;
+  }
+  pthread_mutex_lock(&volume_update_mutex);
+  if (volume_update_thread_started == 0) {
+    if (pthread_create(&volume_update_thread, NULL, &volume_update_thread_func, NULL) != 0)
+      die("Could not create the volume update thread.");
+    volume_update_thread_started = 1;
+  }
+  volume_updates_requested++;
+  volume_update_volume = airplay_volume;
+  volume_update_conn = conn;
+  pthread_cond_broadcast(&volume_update_cond);
+  pthread_mutex_unlock(&volume_update_mutex);
+}
+
+void player_volume_cancel(rtsp_conn_info *conn) {
+  pthread_mutex_lock(&volume_update_mutex);
+  if (volume_update_conn == conn)
+    volume_update_conn = NULL;
+  while (volume_update_busy_conn == conn)
+    pthread_cond_wait(&volume_update_cond, &volume_update_mutex);
+  pthread_mutex_unlock(&volume_update_mutex);
+}
+
 void player_flush(int64_t timestamp, rtsp_conn_info *conn) {
   debug(3, "Flush requested up to %u. It seems as if 0 is special.", timestamp);
   pthread_mutex_lock(&conn->flush_mutex);
@@ -2590,6 +3331,10 @@ void player_flush(int64_t timestamp, rtsp_conn_info *conn) {
 #ifdef CONFIG_METADATA
   send_ssnc_metadata('pfls', NULL, 0, 1);
 #endif
+#ifdef CONFIG_CONVOLUTION
+  if (config.convolution)
+    convolver_reload_if_changed();
+#endif
 #if defined(HAVE_MPRIS)
   if ((conn->play_state != SST_stopped) && (conn->play_state != SST_paused))
     conn->play_state = SST_paused;
@@ -2605,9 +3350,13 @@ int player_play(rtsp_conn_info *conn) {
   if (config.buffer_start_fill > BUFFER_FRAMES)
     die("specified buffer starting fill %d > buffer size %d", config.buffer_start_fill,
         BUFFER_FRAMES);
-  command_start();
+  conn->start_command_ticket = command_start();
 #ifdef CONFIG_METADATA
   send_ssnc_metadata('pbeg', NULL, 0, 1);
+#endif
+#ifdef CONFIG_CONVOLUTION
+  if (config.convolution)
+    convolver_reload_if_changed();
 #endif
   pthread_t *pt = malloc(sizeof(pthread_t));
   if (pt == NULL)
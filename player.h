@@ -18,13 +18,19 @@
 #endif
 
 #ifdef HAVE_LIBSSL
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 #endif
 
 #include "alac.h"
 #include "audio.h"
+#include "dither.h"
 
-#define time_ping_history 8
+#ifdef HAVE_APPLE_ALAC
+#include "apple_alac.h"
+#endif
+
+#define time_ping_history 16
+#define timing_requests_in_flight 8
 
 #if defined(HAVE_DBUS) || defined(HAVE_MPRIS)
 enum session_status_type {
@@ -34,6 +40,39 @@ enum session_status_type {
 } sst_type;
 #endif
 
+// The software volume actually applied, which moves a frame at a time towards the latest volume
+// setting over the configured ramp time, so that a change of volume doesn't click or zip.
+// Volumes are multipliers scaled by 2^32, i.e. fix_volume << 16.
+typedef struct {
+  int64_t current;
+  int64_t target;
+  int64_t step;
+  int frames_left;
+} volume_ramp_t;
+
+// the volume to apply to the next frame
+static inline int64_t volume_ramp_next(volume_ramp_t *ramp) {
+  if (ramp->frames_left) {
+    ramp->current += ramp->step;
+    if (--ramp->frames_left == 0)
+      ramp->current = ramp->target;
+  }
+  return ramp->current;
+}
+
+// move the ramp on by a number of frames without applying it, as for frames that are silent
+static inline void volume_ramp_skip(volume_ramp_t *ramp, int frames) {
+  if (ramp->frames_left) {
+    if (frames >= ramp->frames_left) {
+      ramp->current = ramp->target;
+      ramp->frames_left = 0;
+    } else {
+      ramp->current += ramp->step * frames;
+      ramp->frames_left -= frames;
+    }
+  }
+}
+
 typedef struct time_ping_record {
   uint64_t local_to_remote_difference;
   uint64_t dispersion;
@@ -47,10 +86,18 @@ typedef struct audio_buffer_entry { // decoded audio packets
   int ready;
   int64_t timestamp;
   seq_t sequence_number;
-  signed short *data;
-  int length; // the length of the decoded data
+  int32_t *data; // interleaved, with the input's samples in the top bits
+  int length;     // the length of the decoded data, in frames
+  int silent; // set if every sample of the decoded data is zero
+  // for resending -- see resend_schedule()
+  uint64_t missing_since; // when it was found to be missing, or 0 if it isn't known to be
+  uint64_t resend_due;    // when to ask for it (again)
+  int resends;            // the number of times it has been asked for
 } abuf_t;
 
+// the most channels an ALAC stream can have
+#define MAX_INPUT_CHANNELS 8
+
 // default buffer size
 // needs to be a power of 2 because of the way BUFIDX(seqno) works
 #define BUFFER_FRAMES 512
@@ -72,18 +119,28 @@ typedef struct {
   stream_cfg stream;
   SOCKADDR remote, local;
   int stop;
-  int running;
-  pthread_t thread;
 
   // pthread_t *ptp;
   pthread_t *player_thread;
+  uint64_t start_command_ticket; // for waiting for the on-start command's output
 
   abuf_t audio_buffer[BUFFER_FRAMES];
   int max_frames_per_packet, input_num_channels, input_bit_depth, input_rate;
   int input_bytes_per_frame, output_bytes_per_frame, output_sample_ratio;
   int max_frame_size_change;
-  int64_t previous_random_number;
+  dither_state dither;
   alac_file *decoder_info;
+  uint8_t *decoder_output; // the Hammerton decoder's output, before it's widened to 32 bits
+  int32_t downmix[2][MAX_INPUT_CHANNELS]; // each channel's gain to the left and right, x 2^16
+  // for the standard stream, the kernel that widens a packet and does the mode stuff in one go,
+  // and the mode it does -- NULL for any other stream. See init_decoder().
+  void (*standard_kernel)(int32_t *dest, const int16_t *in);
+  int standard_mode;
+  // for reporting the CPU time per packet -- the decoding time includes the decrypting time
+  uint64_t decoding_time, decrypting_time, packets_decoded;
+#ifdef HAVE_APPLE_ALAC
+  apple_alac_decoder *apple_decoder;
+#endif
   uint32_t please_stop;
   uint64_t packet_count;
   int connection_state_to_output;
@@ -91,14 +148,26 @@ typedef struct {
   int64_t first_packet_time_to_play, time_since_play_started; // nanoseconds
                                                               // stats
   uint64_t missing_packets, late_packets, too_late_packets, resend_requests;
+  int resend_outstanding; // the number of missing packets being tracked for resending
+  uint64_t resend_packets, resend_recovered; // packets asked for, and those of them that arrived
+  // adaptive latency -- see adaptive_latency_update()
+  int64_t latency_reduction; // frames taken off the latency, at the input rate
+  int64_t transit_peak;      // the recent peak of the packets' transit times, decaying
+  uint64_t latency_penalty;  // the allowance for recent resends and losses, decaying
+  uint64_t adaptive_latency_losses, adaptive_latency_resends; // the counts when last looked at
+  int adaptive_latency_packets; // packets played since the latency last shrank
   int decoder_in_use;
   // debug variables
   int32_t last_seqno_read;
   // mutexes and condition variables
   pthread_cond_t flowcontrol;
   pthread_mutex_t ab_mutex, flush_mutex;
-  pthread_mutex_t vol_mutex;
-  int fix_volume;
+  int fix_volume; // set by the RTSP thread and read by the player thread, using atomic operations
+  volume_ramp_t volume_ramp; // only used by the player thread
+  int64_t last_sound_timestamp; // of the latest packet that isn't silent, using atomic operations
+  int64_t silent_frames;        // the length of the current run of silent output frames
+  int output_idle;              // set while the output is stopped during a long silence
+  int output_refill;            // set when the output has been restarted and is empty
   uint32_t timestamp_epoch, last_timestamp,
       maximum_timestamp_interval; // timestamp_epoch of zero means not initialised, could start at 2
                                   // or 1.
@@ -118,7 +187,8 @@ typedef struct {
 #endif
 
 #ifdef HAVE_LIBSSL
-  AES_KEY aes;
+  EVP_CIPHER_CTX *aes_ctx; // holds the expanded key -- EVP uses AES-NI or the ARMv8 AES
+                           // instructions where they are available
 #endif
 
 #ifdef HAVE_DBUS
@@ -148,6 +218,9 @@ typedef struct {
   int audio_socket;                   // our local [server] audio socket
   int control_socket;                 // our local [server] control socket
   int timing_socket;                  // local timing socket
+  pthread_t rtp_thread;               // serves the three sockets above
+  int rtp_stop_pipe[2];               // a byte written here asks it to stop
+  struct capture *capture;            // where the session is being recorded, if it is
 
   int64_t reference_timestamp;
   uint64_t reference_timestamp_time;
@@ -159,14 +232,19 @@ typedef struct {
   uint8_t time_ping_count;
   struct time_ping_record time_pings[time_ping_history];
 
-  uint64_t departure_time; // dangerous -- this assumes that there will never be two timing
-                           // request in flight at the same time
+  // the departure times of the timing requests in flight, indexed by their sequence numbers, for
+  // matching replies to them -- zero once a reply has been matched
+  uint64_t timing_departures[timing_requests_in_flight];
+  uint64_t departure_time; // the latest, for replies that don't say which request they answer
+  // how far, on average, each new timing measurement is from the chosen local to remote time
+  // difference -- the lower, the better the clock. It sets the pace of the timing requests and
+  // the smallest sync error worth correcting.
+  uint64_t clock_uncertainty;
 
   pthread_mutex_t reference_time_mutex;
 
   uint64_t local_to_remote_time_difference; // used to switch between local and remote clocks
 
-  int timing_sender_stop; // for asking the timing-sending thread to stop
   int last_stuff_request;
 
   int64_t play_segment_reference_frame;
@@ -188,15 +266,28 @@ typedef struct {
 
 } rtsp_conn_info;
 
+// returns 0 if a stream with these fmtp numbers can be played, logging why not otherwise
+int player_check_stream_format(int32_t fmtp[12]);
 int player_play(rtsp_conn_info *conn);
 void player_stop(rtsp_conn_info *conn);
 
+// the change is applied asynchronously, coalesced with any others that follow it closely
 void player_volume(double f, rtsp_conn_info *conn);
+// forget any pending change for a connection, waiting for one being applied to finish
+void player_volume_cancel(rtsp_conn_info *conn);
 void player_volume_without_notification(double f, rtsp_conn_info *conn);
 void player_flush(int64_t timestamp, rtsp_conn_info *conn);
 void player_put_packet(seq_t seqno, int64_t timestamp, uint8_t *data, int len,
                        rtsp_conn_info *conn);
 
+// for replaying a capture -- see capture.h
+// returns non-zero if the stream can't be decoded
+int player_replay_begin(rtsp_conn_info *conn);
+void player_replay_end(rtsp_conn_info *conn);
+// take the next frame from the buffer if it's due to be played at time_now, or return NULL -- a
+// frame that never arrived comes back with a timestamp of zero
+abuf_t *player_replay_frame(uint64_t time_now, rtsp_conn_info *conn);
+
 int64_t monotonic_timestamp(uint32_t timestamp,
                             rtsp_conn_info *conn); // add an epoch to the timestamp. The monotonic
 // timestamp guaranteed to start between 2^32 2^33
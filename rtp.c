@@ -32,6 +32,7 @@
 #include <memory.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -39,12 +40,11 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "common.h"
 #include "player.h"
 #include "rtp.h"
 
-void memory_barrier();
-
 void rtp_initialise(rtsp_conn_info *conn) {
 
   conn->rtp_running = 0;
@@ -62,234 +62,228 @@ void rtp_terminate(rtsp_conn_info *conn) {
     debug(1, "Error destroying reference_time_mutex variable.");
 }
 
-void *rtp_audio_receiver(void *arg) {
-  debug(2, "Audio receiver -- Server RTP thread starting.");
-
-  // we inherit the signal mask (SIGUSR1)
-  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
-
-  int32_t last_seqno = -1;
-  uint8_t packet[2048], *pktp;
-
-  uint64_t time_of_previous_packet_fp = 0;
-  float longest_packet_time_interval_us = 0.0;
-
+// the audio receiver's statistics, kept from packet to packet
+typedef struct {
+  int32_t last_seqno;
+  uint64_t time_of_previous_packet_fp;
+  float longest_packet_time_interval_us;
   // mean and variance calculations from "online_variance" algorithm at
   // https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Online_algorithm
+  int32_t stat_n;
+  float stat_mean;
+  float stat_M2;
+} rtp_audio_state;
+
+// handle a packet arriving at the audio port
+static void rtp_audio_packet(rtsp_conn_info *conn, rtp_audio_state *st, uint8_t *packet,
+                             ssize_t nread) {
+  uint8_t *pktp;
+  uint64_t local_time_now_fp = get_absolute_time_in_fp();
+  if (st->time_of_previous_packet_fp) {
+    float time_interval_us =
+        (((local_time_now_fp - st->time_of_previous_packet_fp) * 1000000) >> 32) * 1.0;
+    st->time_of_previous_packet_fp = local_time_now_fp;
+    if (time_interval_us > st->longest_packet_time_interval_us)
+      st->longest_packet_time_interval_us = time_interval_us;
+    st->stat_n += 1;
+    float stat_delta = time_interval_us - st->stat_mean;
+    st->stat_mean += stat_delta / st->stat_n;
+    st->stat_M2 += stat_delta * (time_interval_us - st->stat_mean);
+    if (st->stat_n % 2500 == 0) {
+      debug(2, "Packet reception interval stats: mean, standard deviation and max for the last "
+               "2,500 packets in microseconds: %10.1f, %10.1f, %10.1f.",
+            st->stat_mean, sqrtf(st->stat_M2 / (st->stat_n - 1)), st->longest_packet_time_interval_us);
+      st->stat_n = 0;
+      st->stat_mean = 0.0;
+      st->stat_M2 = 0.0;
+      st->time_of_previous_packet_fp = 0;
+      st->longest_packet_time_interval_us = 0.0;
+    }
+  } else {
+    st->time_of_previous_packet_fp = local_time_now_fp;
+  }
 
-  int32_t stat_n = 0;
-  float stat_mean = 0.0;
-  float stat_M2 = 0.0;
-
-  ssize_t nread;
-  while (conn->please_stop == 0) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(conn->audio_socket, &readfds);
-    do {
-      memory_barrier();
-    } while (conn->please_stop == 0 &&
-             pselect(conn->audio_socket + 1, &readfds, NULL, NULL, NULL, &pselect_sigset) <= 0);
-    if (conn->please_stop != 0) {
-      break;
+  ssize_t plen = nread;
+  uint8_t type = packet[1] & ~0x80;
+  if (type == 0x60 || type == 0x56) { // audio data / resend
+    pktp = packet;
+    if (type == 0x56) {
+      pktp += 4;
+      plen -= 4;
     }
-    nread = recv(conn->audio_socket, packet, sizeof(packet), 0);
-
-    uint64_t local_time_now_fp = get_absolute_time_in_fp();
-    if (time_of_previous_packet_fp) {
-      float time_interval_us =
-          (((local_time_now_fp - time_of_previous_packet_fp) * 1000000) >> 32) * 1.0;
-      time_of_previous_packet_fp = local_time_now_fp;
-      if (time_interval_us > longest_packet_time_interval_us)
-        longest_packet_time_interval_us = time_interval_us;
-      stat_n += 1;
-      float stat_delta = time_interval_us - stat_mean;
-      stat_mean += stat_delta / stat_n;
-      stat_M2 += stat_delta * (time_interval_us - stat_mean);
-      if (stat_n % 2500 == 0) {
-        debug(2, "Packet reception interval stats: mean, standard deviation and max for the last "
-                 "2,500 packets in microseconds: %10.1f, %10.1f, %10.1f.",
-              stat_mean, sqrtf(stat_M2 / (stat_n - 1)), longest_packet_time_interval_us);
-        stat_n = 0;
-        stat_mean = 0.0;
-        stat_M2 = 0.0;
-        time_of_previous_packet_fp = 0;
-        longest_packet_time_interval_us = 0.0;
-      }
-    } else {
-      time_of_previous_packet_fp = local_time_now_fp;
+    seq_t seqno = ntohs(*(unsigned short *)(pktp + 2));
+    // increment st->last_seqno and see if it's the same as the incoming seqno
+
+    if (st->last_seqno == -1)
+      st->last_seqno = seqno;
+    else {
+      st->last_seqno = (st->last_seqno + 1) & 0xffff;
+      // if (seqno != st->last_seqno)
+      //  debug(3, "RTP: Packets out of sequence: expected: %d, got %d.", st->last_seqno, seqno);
+      st->last_seqno = seqno; // reset warning...
     }
+    int64_t timestamp = monotonic_timestamp(ntohl(*(unsigned long *)(pktp + 4)), conn);
 
-    if (nread < 0)
-      break;
-
-    ssize_t plen = nread;
-    uint8_t type = packet[1] & ~0x80;
-    if (type == 0x60 || type == 0x56) { // audio data / resend
-      pktp = packet;
-      if (type == 0x56) {
-        pktp += 4;
-        plen -= 4;
-      }
-      seq_t seqno = ntohs(*(unsigned short *)(pktp + 2));
-      // increment last_seqno and see if it's the same as the incoming seqno
-
-      if (last_seqno == -1)
-        last_seqno = seqno;
-      else {
-        last_seqno = (last_seqno + 1) & 0xffff;
-        // if (seqno != last_seqno)
-        //  debug(3, "RTP: Packets out of sequence: expected: %d, got %d.", last_seqno, seqno);
-        last_seqno = seqno; // reset warning...
-      }
-      int64_t timestamp = monotonic_timestamp(ntohl(*(unsigned long *)(pktp + 4)), conn);
-
-      // if (packet[1]&0x10)
-      //	debug(1,"Audio packet Extension bit set.");
+    // if (packet[1]&0x10)
+    //	debug(1,"Audio packet Extension bit set.");
 
-      pktp += 12;
-      plen -= 12;
+    pktp += 12;
+    plen -= 12;
 
-      // check if packet contains enough content to be reasonable
-      if (plen >= 16) {
-        player_put_packet(seqno, timestamp, pktp, plen, conn);
-        continue;
-      }
-      if (type == 0x56 && seqno == 0) {
-        debug(2, "resend-related request packet received, ignoring.");
-        continue;
-      }
-      debug(1, "Audio receiver -- Unknown RTP packet of type 0x%02X length %d seqno %d", type,
-            nread, seqno);
+    // check if packet contains enough content to be reasonable
+    if (plen >= 16) {
+      player_put_packet(seqno, timestamp, pktp, plen, conn);
+      return;
     }
-    warn("Audio receiver -- Unknown RTP packet of type 0x%02X length %d.", type, nread);
+    if (type == 0x56 && seqno == 0) {
+      debug(2, "resend-related request packet received, ignoring.");
+      return;
+    }
+    debug(1, "Audio receiver -- Unknown RTP packet of type 0x%02X length %d seqno %d", type,
+          nread, seqno);
   }
-
-  debug(3, "Audio receiver -- Server RTP thread interrupted. terminating.");
-  close(conn->audio_socket);
-
-  return NULL;
+  warn("Audio receiver -- Unknown RTP packet of type 0x%02X length %d.", type, nread);
 }
 
-void *rtp_control_receiver(void *arg) {
-  // we inherit the signal mask (SIGUSR1)
-
-  debug(2, "Control receiver -- Server RTP thread starting.");
-
-  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
-
-  conn->reference_timestamp = 0; // nothing valid received yet
-  uint8_t packet[2048], *pktp;
+// handle a packet arriving at the control port
+static void rtp_control_packet(rtsp_conn_info *conn, uint8_t *packet, ssize_t nread) {
+  uint8_t *pktp;
   struct timespec tn;
   uint64_t remote_time_of_sync, local_time_now, remote_time_now;
   int64_t sync_rtp_timestamp, rtp_timestamp_less_latency;
-  ssize_t nread;
-  while (conn->please_stop == 0) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(conn->control_socket, &readfds);
-    do {
-      memory_barrier();
-    } while (conn->please_stop == 0 &&
-             pselect(conn->control_socket + 1, &readfds, NULL, NULL, NULL, &pselect_sigset) <= 0);
-    if (conn->please_stop != 0) {
-      break;
-    }
-    nread = recv(conn->control_socket, packet, sizeof(packet), 0);
-    local_time_now = get_absolute_time_in_fp();
-    //        clock_gettime(CLOCK_MONOTONIC,&tn);
-    //        local_time_now=((uint64_t)tn.tv_sec<<32)+((uint64_t)tn.tv_nsec<<32)/1000000000;
-
-    if (nread < 0)
-      break;
-
-    ssize_t plen = nread;
-    if (packet[1] == 0xd4) { // sync data
-      /*
-      char obf[4096];
-      char *obfp = obf;
-      int obfc;
-      for (obfc=0;obfc<plen;obfc++) {
-        sprintf(obfp,"%02X",packet[obfc]);
-        obfp+=2;
-      };
-      *obfp=0;
-      debug(1,"Sync Packet Received: \"%s\"",obf);
-      */
-      if (conn->local_to_remote_time_difference) { // need a time packet to be interchanged first...
-
-        remote_time_of_sync = (uint64_t)ntohl(*((uint32_t *)&packet[8])) << 32;
-        remote_time_of_sync += ntohl(*((uint32_t *)&packet[12]));
-
-        // debug(1,"Remote Sync Time: %0llx.",remote_time_of_sync);
-
-        rtp_timestamp_less_latency = monotonic_timestamp(ntohl(*((uint32_t *)&packet[4])), conn);
-        sync_rtp_timestamp = monotonic_timestamp(ntohl(*((uint32_t *)&packet[16])), conn);
-
-        if (config.use_negotiated_latencies) {
-          int64_t la = sync_rtp_timestamp - rtp_timestamp_less_latency + conn->staticLatencyCorrection;
-          if (la != config.latency) {
-            config.latency = la;
-            debug(1,"Using negotiated latency of %lld frames and a static latency correction of %lld",sync_rtp_timestamp - rtp_timestamp_less_latency,conn->staticLatencyCorrection);
-          }
+  local_time_now = get_absolute_time_in_fp();
+  //        clock_gettime(CLOCK_MONOTONIC,&tn);
+  //        local_time_now=((uint64_t)tn.tv_sec<<32)+((uint64_t)tn.tv_nsec<<32)/1000000000;
+
+  ssize_t plen = nread;
+  if (packet[1] == 0xd4) { // sync data
+    /*
+    char obf[4096];
+    char *obfp = obf;
+    int obfc;
+    for (obfc=0;obfc<plen;obfc++) {
+      sprintf(obfp,"%02X",packet[obfc]);
+      obfp+=2;
+    };
+    *obfp=0;
+    debug(1,"Sync Packet Received: \"%s\"",obf);
+    */
+    if (conn->local_to_remote_time_difference) { // need a time packet to be interchanged first...
+
+      remote_time_of_sync = (uint64_t)ntohl(*((uint32_t *)&packet[8])) << 32;
+      remote_time_of_sync += ntohl(*((uint32_t *)&packet[12]));
+
+      // debug(1,"Remote Sync Time: %0llx.",remote_time_of_sync);
+
+      rtp_timestamp_less_latency = monotonic_timestamp(ntohl(*((uint32_t *)&packet[4])), conn);
+      sync_rtp_timestamp = monotonic_timestamp(ntohl(*((uint32_t *)&packet[16])), conn);
+
+      if (config.use_negotiated_latencies) {
+        int64_t la = sync_rtp_timestamp - rtp_timestamp_less_latency + conn->staticLatencyCorrection;
+        if (la != config.latency) {
+          config.latency = la;
+          debug(1,"Using negotiated latency of %lld frames and a static latency correction of %lld",sync_rtp_timestamp - rtp_timestamp_less_latency,conn->staticLatencyCorrection);
         }
+      }
 
-        if (packet[0] & 0x10) {
-          // if it's a packet right after a flush or resume
-          sync_rtp_timestamp += 352; // add frame_size -- can't see a reference to this anywhere,
-                                     // but it seems to get everything into sync.
-          // it's as if the first sync after a flush or resume is the timing of the next packet
-          // after the one whose RTP is given. Weird.
-        }
-        pthread_mutex_lock(&conn->reference_time_mutex);
-        conn->remote_reference_timestamp_time = remote_time_of_sync;
-        conn->reference_timestamp_time =
-            remote_time_of_sync - conn->local_to_remote_time_difference;
-        conn->reference_timestamp = sync_rtp_timestamp;
-        pthread_mutex_unlock(&conn->reference_time_mutex);
-        // debug(1,"New Reference timestamp and timestamp time...");
-        // get estimated remote time now
-        // remote_time_now = local_time_now + local_to_remote_time_difference;
-
-        // debug(1,"Sync Time is %lld us late (remote
-        // times).",((remote_time_now-remote_time_of_sync)*1000000)>>32);
-        // debug(1,"Sync Time is %lld us late (local
-        // times).",((local_time_now-reference_timestamp_time)*1000000)>>32);
-      } else {
-        debug(1, "Sync packet received before we got a timing packet back.");
+      if (packet[0] & 0x10) {
+        // if it's a packet right after a flush or resume
+        sync_rtp_timestamp += 352; // add frame_size -- can't see a reference to this anywhere,
+                                   // but it seems to get everything into sync.
+        // it's as if the first sync after a flush or resume is the timing of the next packet
+        // after the one whose RTP is given. Weird.
       }
-    } else if (packet[1] == 0xd6) { // resent audio data in the control path -- whaale only?
-      // debug(1, "Control Port -- Retransmitted Audio Data Packet received.");
-      pktp = packet + 4;
-      plen -= 4;
-      seq_t seqno = ntohs(*(unsigned short *)(pktp + 2));
+      pthread_mutex_lock(&conn->reference_time_mutex);
+      conn->remote_reference_timestamp_time = remote_time_of_sync;
+      conn->reference_timestamp_time =
+          remote_time_of_sync - conn->local_to_remote_time_difference;
+      conn->reference_timestamp = sync_rtp_timestamp;
+      pthread_mutex_unlock(&conn->reference_time_mutex);
+      // debug(1,"New Reference timestamp and timestamp time...");
+      // get estimated remote time now
+      // remote_time_now = local_time_now + local_to_remote_time_difference;
+
+      // debug(1,"Sync Time is %lld us late (remote
+      // times).",((remote_time_now-remote_time_of_sync)*1000000)>>32);
+      // debug(1,"Sync Time is %lld us late (local
+      // times).",((local_time_now-reference_timestamp_time)*1000000)>>32);
+    } else {
+      debug(1, "Sync packet received before we got a timing packet back.");
+    }
+  } else if (packet[1] == 0xd6) { // resent audio data in the control path -- whaale only?
+    // debug(1, "Control Port -- Retransmitted Audio Data Packet received.");
+    pktp = packet + 4;
+    plen -= 4;
+    seq_t seqno = ntohs(*(unsigned short *)(pktp + 2));
 
-      int64_t timestamp = monotonic_timestamp(ntohl(*(unsigned long *)(pktp + 4)), conn);
+    int64_t timestamp = monotonic_timestamp(ntohl(*(unsigned long *)(pktp + 4)), conn);
 
-      pktp += 12;
-      plen -= 12;
+    pktp += 12;
+    plen -= 12;
 
-      // check if packet contains enough content to be reasonable
-      if (plen >= 16) {
-        player_put_packet(seqno, timestamp, pktp, plen, conn);
-        continue;
-      } else {
-        debug(3, "Too-short retransmitted audio packet received in control port, ignored.");
-      }
-    } else
-      debug(1, "Control Port -- Unknown RTP packet of type 0x%02X length %d, ignored.", packet[1],
-            nread);
-  }
+    // check if packet contains enough content to be reasonable
+    if (plen >= 16) {
+      player_put_packet(seqno, timestamp, pktp, plen, conn);
+      return;
+    } else {
+      debug(3, "Too-short retransmitted audio packet received in control port, ignored.");
+    }
+  } else
+    debug(1, "Control Port -- Unknown RTP packet of type 0x%02X length %d, ignored.", packet[1],
+          nread);
+}
 
-  debug(3, "Control RTP thread interrupted. terminating.");
-  close(conn->control_socket);
+// The timing requests are sent more often when the clock measurements are noisy, so that there's
+// more chance of one with a short round trip to go by, and less often when they're steady.
+#define TIMING_INTERVAL_MIN 0.5 // seconds
+#define TIMING_INTERVAL_MAX 3.0
+#define TIMING_UNCERTAINTY_TARGET 0.001 // seconds -- at or below this, the interval is the longest
+
+static useconds_t timing_interval(rtsp_conn_info *conn) {
+  double uncertainty = __atomic_load_n(&conn->clock_uncertainty, __ATOMIC_RELAXED) * 1.0 /
+                       ((uint64_t)1 << 32);
+  double interval = TIMING_INTERVAL_MAX;
+  if (uncertainty > TIMING_UNCERTAINTY_TARGET)
+    interval = TIMING_INTERVAL_MAX * TIMING_UNCERTAINTY_TARGET / uncertainty;
+  if (interval < TIMING_INTERVAL_MIN)
+    interval = TIMING_INTERVAL_MIN;
+  return (useconds_t)(interval * 1000000);
+}
 
-  return NULL;
+// find the departure time of the request a timing reply answers, from the origin time it returns,
+// and mark the request as answered -- returns 0 if the reply doesn't match a request in flight
+static uint64_t timing_departure_for(uint64_t origin_time, rtsp_conn_info *conn) {
+  if (origin_time == 0) // the reply doesn't say which request it's for
+    return __atomic_load_n(&conn->departure_time, __ATOMIC_ACQUIRE);
+  int i;
+  for (i = 0; i < timing_requests_in_flight; i++) {
+    uint64_t departure = origin_time;
+    if (__atomic_compare_exchange_n(&conn->timing_departures[i], &departure, 0, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return departure;
+  }
+  return 0;
 }
 
-void *rtp_timing_sender(void *arg) {
-  debug(2, "Timing sender thread starting.");
-  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+// remember when a timing request went, to match its reply to
+static void timing_note_departure(uint16_t sequence_number, uint64_t departure_time,
+                                  rtsp_conn_info *conn) {
+  __atomic_store_n(&conn->timing_departures[sequence_number % timing_requests_in_flight],
+                   departure_time, __ATOMIC_RELEASE);
+  __atomic_store_n(&conn->departure_time, departure_time, __ATOMIC_RELEASE);
+}
+
+// the timing exchange's state, kept from packet to packet
+typedef struct {
+  uint64_t request_number;
+  uint16_t sequence_number;
+  uint64_t next_request_time;
+  uint64_t first_remote_time, first_local_time;
+  uint64_t first_local_to_remote_time_difference, first_local_to_remote_time_difference_time;
+} rtp_timing_state;
+
+// send a timing request, and work out when the next is due
+static void rtp_timing_send(rtsp_conn_info *conn, rtp_timing_state *st) {
   struct timing_request {
     char leader;
     char type;
@@ -298,285 +292,388 @@ void *rtp_timing_sender(void *arg) {
     uint64_t origin, receive, transmit;
   };
 
-  uint64_t request_number = 0;
-
   struct timing_request req; // *not* a standard RTCP NACK
 
   req.leader = 0x80;
   req.type = 0xd2; // Timing request
   req.filler = 0;
-  req.seqno = htons(7);
-
-  conn->time_ping_count = 0;
-
-  // we inherit the signal mask (SIGUSR1)
-  while (conn->timing_sender_stop == 0) {
-    // debug(1,"Send a timing request");
-
-    if (!conn->rtp_running)
-      debug(1, "rtp_timing_sender called without active stream in RTSP conversation thread %d!",
-            conn->connection_number);
-
-    // debug(1, "Requesting ntp timestamp exchange.");
-
-    req.filler = 0;
-    req.origin = req.receive = req.transmit = 0;
-
-    //    clock_gettime(CLOCK_MONOTONIC,&dtt);
-    conn->departure_time = get_absolute_time_in_fp();
-    socklen_t msgsize = sizeof(struct sockaddr_in);
+  req.origin = req.receive = req.transmit = 0;
+
+  // each request carries its own sequence number and departure time, which the reply returns as
+  // its origin time, so that several can be in flight at once
+  uint64_t departure_time = get_absolute_time_in_fp();
+  uint32_t transmit[2] = {htonl(departure_time >> 32), htonl(departure_time & 0xffffffff)};
+  memcpy(&req.transmit, transmit, sizeof(transmit));
+  req.seqno = htons(st->sequence_number);
+  timing_note_departure(st->sequence_number, departure_time, conn);
+  st->sequence_number++;
+  if (conn->capture)
+    capture_packet(conn->capture, CAPTURE_TIMING_REQUEST, departure_time, &req, sizeof(req));
+  socklen_t msgsize = sizeof(struct sockaddr_in);
 #ifdef AF_INET6
-    if (conn->rtp_client_timing_socket.SAFAMILY == AF_INET6) {
-      msgsize = sizeof(struct sockaddr_in6);
-    }
+  if (conn->rtp_client_timing_socket.SAFAMILY == AF_INET6) {
+    msgsize = sizeof(struct sockaddr_in6);
+  }
 #endif
-    fd_set writefds;
-    FD_ZERO(&writefds);
-    FD_SET(conn->timing_socket, &writefds);
-    do {
-      memory_barrier();
-    } while (conn->timing_sender_stop == 0 &&
-             pselect(conn->timing_socket + 1, NULL, &writefds, NULL, NULL, &pselect_sigset) <= 0);
-    if (conn->timing_sender_stop != 0) {
-      break;
-    }
-    if (sendto(conn->timing_socket, &req, sizeof(req), 0,
-               (struct sockaddr *)&conn->rtp_client_timing_socket, msgsize) == -1) {
-      perror("Error sendto-ing to timing socket");
-    }
-    request_number++;
-    if (request_number <= 4)
-      usleep(500000);
-    else
-      sleep(3);
+  if (sendto(conn->timing_socket, &req, sizeof(req), 0,
+             (struct sockaddr *)&conn->rtp_client_timing_socket, msgsize) == -1) {
+    perror("Error sendto-ing to timing socket");
   }
-  debug(3, "rtp_timing_sender thread interrupted. terminating.");
-  return NULL;
+  st->request_number++;
+  uint64_t interval = ((uint64_t)1 << 32) / 2; // the first four are half a second apart
+  if (st->request_number > 4)
+    interval = ((uint64_t)timing_interval(conn) << 32) / 1000000;
+  st->next_request_time = departure_time + interval;
 }
 
-void *rtp_timing_receiver(void *arg) {
-  debug(2, "Timing receiver -- Server RTP thread starting.");
-  // we inherit the signal mask (SIGUSR1)
-  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
-
-  uint8_t packet[2048], *pktp;
-  ssize_t nread;
-  conn->timing_sender_stop = 0;
-  pthread_t timer_requester;
-  pthread_create(&timer_requester, NULL, &rtp_timing_sender, arg);
-  //    struct timespec att;
-  uint64_t distant_receive_time, distant_transmit_time, arrival_time, return_time, transit_time,
+// handle a packet arriving at the timing port
+static void rtp_timing_packet(rtsp_conn_info *conn, rtp_timing_state *st, uint8_t *packet,
+                              ssize_t nread) {
+  uint64_t distant_receive_time, distant_transmit_time, arrival_time, return_time,
       processing_time;
-  local_to_remote_time_jitters = 0;
-  local_to_remote_time_jitters_count = 0;
-  uint64_t first_remote_time = 0;
-  uint64_t first_local_time = 0;
-
-  uint64_t first_local_to_remote_time_difference = 0;
-  uint64_t first_local_to_remote_time_difference_time;
-  uint64_t l2rtd = 0;
-  while (conn->please_stop == 0) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(conn->timing_socket, &readfds);
-    do {
-      memory_barrier();
-    } while (conn->please_stop == 0 &&
-             pselect(conn->timing_socket + 1, &readfds, NULL, NULL, NULL, &pselect_sigset) <= 0);
-    if (conn->please_stop != 0) {
-      break;
+  arrival_time = get_absolute_time_in_fp();
+  //      clock_gettime(CLOCK_MONOTONIC,&att);
+
+  ssize_t plen = nread;
+  // debug(1,"Packet Received on Timing Port.");
+  if (packet[1] == 0xd3) { // timing reply
+    /*
+    char obf[4096];
+    char *obfp = obf;
+    int obfc;
+    for (obfc=0;obfc<plen;obfc++) {
+      sprintf(obfp,"%02X",packet[obfc]);
+      obfp+=2;
+    };
+    *obfp=0;
+    //debug(1,"Timing Packet Received: \"%s\"",obf);
+    */
+
+    // arrival_time = ((uint64_t)att.tv_sec<<32)+((uint64_t)att.tv_nsec<<32)/1000000000;
+    // departure_time = ((uint64_t)dtt.tv_sec<<32)+((uint64_t)dtt.tv_nsec<<32)/1000000000;
+
+    uint64_t origin_time = (uint64_t)ntohl(*((uint32_t *)&packet[8])) << 32;
+    origin_time += ntohl(*((uint32_t *)&packet[12]));
+    uint64_t departure_time = timing_departure_for(origin_time, conn);
+    if ((departure_time == 0) || (departure_time > arrival_time)) {
+      debug(3, "Timing reply doesn't match a timing request in flight -- ignored.");
+      return;
     }
-    nread = recv(conn->timing_socket, packet, sizeof(packet), 0);
-    arrival_time = get_absolute_time_in_fp();
-    //      clock_gettime(CLOCK_MONOTONIC,&att);
+    return_time = arrival_time - departure_time;
 
-    if (nread < 0)
-      break;
+    // uint64_t rtus = (return_time*1000000)>>32; debug(1,"Time ping turnaround time: %lld
+    // us.",rtus);
 
-    ssize_t plen = nread;
-    // debug(1,"Packet Received on Timing Port.");
-    if (packet[1] == 0xd3) { // timing reply
-      /*
-      char obf[4096];
-      char *obfp = obf;
-      int obfc;
-      for (obfc=0;obfc<plen;obfc++) {
-        sprintf(obfp,"%02X",packet[obfc]);
-        obfp+=2;
-      };
-      *obfp=0;
-      //debug(1,"Timing Packet Received: \"%s\"",obf);
-      */
+    // distant_receive_time =
+    // ((uint64_t)ntohl(*((uint32_t*)&packet[16])))<<32+ntohl(*((uint32_t*)&packet[20]));
 
-      // arrival_time = ((uint64_t)att.tv_sec<<32)+((uint64_t)att.tv_nsec<<32)/1000000000;
-      // departure_time = ((uint64_t)dtt.tv_sec<<32)+((uint64_t)dtt.tv_nsec<<32)/1000000000;
+    distant_receive_time = (uint64_t)ntohl(*((uint32_t *)&packet[16])) << 32;
+    distant_receive_time += ntohl(*((uint32_t *)&packet[20]));
 
-      return_time = arrival_time - conn->departure_time;
+    // distant_transmit_time =
+    // ((uint64_t)ntohl(*((uint32_t*)&packet[24])))<<32+ntohl(*((uint32_t*)&packet[28]));
 
-      // uint64_t rtus = (return_time*1000000)>>32; debug(1,"Time ping turnaround time: %lld
-      // us.",rtus);
+    distant_transmit_time = (uint64_t)ntohl(*((uint32_t *)&packet[24])) << 32;
+    distant_transmit_time += ntohl(*((uint32_t *)&packet[28]));
 
-      // distant_receive_time =
-      // ((uint64_t)ntohl(*((uint32_t*)&packet[16])))<<32+ntohl(*((uint32_t*)&packet[20]));
+    processing_time = distant_transmit_time - distant_receive_time;
 
-      distant_receive_time = (uint64_t)ntohl(*((uint32_t *)&packet[16])) << 32;
-      distant_receive_time += ntohl(*((uint32_t *)&packet[20]));
+    // debug(1,"Return trip time: %lluuS, remote processing time:
+    // %lluuS.",(return_time*1000000)>>32,(processing_time*1000000)>>32);
 
-      // distant_transmit_time =
-      // ((uint64_t)ntohl(*((uint32_t*)&packet[24])))<<32+ntohl(*((uint32_t*)&packet[28]));
+    uint64_t local_time_by_remote_clock = distant_transmit_time + return_time / 2;
 
-      distant_transmit_time = (uint64_t)ntohl(*((uint32_t *)&packet[24])) << 32;
-      distant_transmit_time += ntohl(*((uint32_t *)&packet[28]));
+    unsigned int cc, chosen;
+    for (cc = time_ping_history - 1; cc > 0; cc--) {
+      conn->time_pings[cc] = conn->time_pings[cc - 1];
+      conn->time_pings[cc].dispersion = (conn->time_pings[cc].dispersion * 110) /
+                                        100; // make the dispersions 'age' by this rational factor
+    }
+    // these are for diagnostics only -- not used
+    conn->time_pings[0].local_time = arrival_time;
+    conn->time_pings[0].remote_time = distant_transmit_time;
+
+    conn->time_pings[0].local_to_remote_difference = local_time_by_remote_clock - arrival_time;
+    conn->time_pings[0].dispersion = return_time;
+    if (conn->time_ping_count < time_ping_history)
+      conn->time_ping_count++;
+
+    uint64_t local_time_chosen = arrival_time;
+    ;
+    uint64_t remote_time_chosen = distant_transmit_time;
+    // now pick the timestamp with the lowest dispersion
+    uint64_t l2rtd = conn->time_pings[0].local_to_remote_difference;
+    uint64_t tld = conn->time_pings[0].dispersion;
+    chosen = 0;
+    for (cc = 1; cc < conn->time_ping_count; cc++)
+      if (conn->time_pings[cc].dispersion < tld) {
+        l2rtd = conn->time_pings[cc].local_to_remote_difference;
+        chosen = cc;
+        tld = conn->time_pings[cc].dispersion;
+        local_time_chosen = conn->time_pings[cc].local_time;
+        remote_time_chosen = conn->time_pings[cc].remote_time;
+      }
+    int64_t ji;
 
-      processing_time = distant_transmit_time - distant_receive_time;
+    if (conn->time_ping_count > 1) {
+      if (l2rtd > conn->local_to_remote_time_difference) {
+        local_to_remote_time_jitters =
+            local_to_remote_time_jitters + l2rtd - conn->local_to_remote_time_difference;
+        ji = l2rtd - conn->local_to_remote_time_difference;
+      } else {
+        local_to_remote_time_jitters =
+            local_to_remote_time_jitters + conn->local_to_remote_time_difference - l2rtd;
+        ji = -(conn->local_to_remote_time_difference - l2rtd);
+      }
+      local_to_remote_time_jitters_count += 1;
+    }
+    // uncomment below to print jitter between client's clock and oour clock
+    // int64_t rtus = (tld*1000000)>>32; ji = (ji*1000000)>>32; debug(1,"Choosing time difference
+    // with dispersion of %lld us with delta of %lld us",rtus,ji);
+
+    conn->local_to_remote_time_difference = l2rtd;
+
+    // the clock quality -- a running average of how far each measurement is from the estimate,
+    // starting from the uncertainty of the first, which is half its round trip
+    uint64_t residual = conn->time_pings[0].local_to_remote_difference > l2rtd
+                            ? conn->time_pings[0].local_to_remote_difference - l2rtd
+                            : l2rtd - conn->time_pings[0].local_to_remote_difference;
+    uint64_t uncertainty = conn->clock_uncertainty;
+    if (conn->time_ping_count <= 1)
+      uncertainty = return_time / 2;
+    else
+      uncertainty = uncertainty - uncertainty / 8 + residual / 8;
+    __atomic_store_n(&conn->clock_uncertainty, uncertainty, __ATOMIC_RELAXED);
+    debug(3, "Timing reply with a round trip of %.2f ms -- the clock uncertainty is %.2f ms.",
+          return_time * 1000.0 / ((uint64_t)1 << 32), uncertainty * 1000.0 / ((uint64_t)1 << 32));
+    if (st->first_local_to_remote_time_difference == 0) {
+      st->first_local_to_remote_time_difference = conn->local_to_remote_time_difference;
+      st->first_local_to_remote_time_difference_time = get_absolute_time_in_fp();
+    }
 
-      // debug(1,"Return trip time: %lluuS, remote processing time:
-      // %lluuS.",(return_time*1000000)>>32,(processing_time*1000000)>>32);
+    int64_t clock_drift, clock_drift_in_usec;
+    double clock_drift_ppm = 0.0;
+    if (st->first_local_time == 0) {
+      st->first_local_time = local_time_chosen;
+      st->first_remote_time = remote_time_chosen;
+      clock_drift = 0;
+    } else {
+      uint64_t local_time_change = local_time_chosen - st->first_local_time;
+      uint64_t remote_time_change = remote_time_chosen - st->first_remote_time;
+
+      if (remote_time_change >= local_time_change)
+        clock_drift = remote_time_change - local_time_change;
+      else
+        clock_drift = -(local_time_change - remote_time_change);
+      if (clock_drift >= 0)
+        clock_drift_in_usec = (clock_drift * 1000000) >> 32;
+      else
+        clock_drift_in_usec = -(((-clock_drift) * 1000000) >> 32);
+      clock_drift_ppm = (1.0 * clock_drift_in_usec) / (local_time_change >> 32);
+    }
 
-      uint64_t local_time_by_remote_clock = distant_transmit_time + return_time / 2;
+    int64_t source_drift_usec;
+    if (conn->play_segment_reference_frame != 0) {
+      int64_t reference_timestamp;
+      uint64_t reference_timestamp_time, remote_reference_timestamp_time;
+      get_reference_timestamp_stuff(&reference_timestamp, &reference_timestamp_time,
+                                    &remote_reference_timestamp_time, conn);
+      uint64_t frame_difference = 0;
+      if (reference_timestamp >= conn->play_segment_reference_frame)
+        frame_difference =
+            (uint64_t)reference_timestamp - (uint64_t)conn->play_segment_reference_frame;
+      else // rollover
+        frame_difference = (uint64_t)reference_timestamp + 0x100000000 -
+                           (uint64_t)conn->play_segment_reference_frame;
+      uint64_t frame_time_difference_calculated = (((uint64_t)frame_difference << 32) / 44100);
+      uint64_t frame_time_difference_actual =
+          remote_reference_timestamp_time -
+          conn->play_segment_reference_frame_remote_time; // this is all done by reference to the
+                                                          // sources' system clock
+      // debug(1,"%llu frames since play started, %llu usec calculated, %llu usec
+      // actual",frame_difference, (frame_time_difference_calculated*1000000)>>32,
+      // (frame_time_difference_actual*1000000)>>32);
+      if (frame_time_difference_calculated >=
+          frame_time_difference_actual) // i.e. if the time it should have taken to send the
+                                        // packets is greater than the actual time difference
+                                        // measured on the source clock
+        // then the source DAC's clock is running fast relative to the source system clock
+        source_drift_usec = frame_time_difference_calculated - frame_time_difference_actual;
+      else
+        // otherwise the source DAC's clock is running slow relative to the source system clock
+        source_drift_usec = -(frame_time_difference_actual - frame_time_difference_calculated);
+    } else
+      source_drift_usec = 0;
+    source_drift_usec = (source_drift_usec * 1000000) >> 32; // turn it to microseconds
 
-      unsigned int cc, chosen;
-      for (cc = time_ping_history - 1; cc > 0; cc--) {
-        conn->time_pings[cc] = conn->time_pings[cc - 1];
-        conn->time_pings[cc].dispersion = (conn->time_pings[cc].dispersion * 110) /
-                                          100; // make the dispersions 'age' by this rational factor
-      }
-      // these are for diagnostics only -- not used
-      conn->time_pings[0].local_time = arrival_time;
-      conn->time_pings[0].remote_time = distant_transmit_time;
-
-      conn->time_pings[0].local_to_remote_difference = local_time_by_remote_clock - arrival_time;
-      conn->time_pings[0].dispersion = return_time;
-      if (conn->time_ping_count < time_ping_history)
-        conn->time_ping_count++;
-
-      uint64_t local_time_chosen = arrival_time;
-      ;
-      uint64_t remote_time_chosen = distant_transmit_time;
-      // now pick the timestamp with the lowest dispersion
-      uint64_t l2rtd = conn->time_pings[0].local_to_remote_difference;
-      uint64_t tld = conn->time_pings[0].dispersion;
-      chosen = 0;
-      for (cc = 1; cc < conn->time_ping_count; cc++)
-        if (conn->time_pings[cc].dispersion < tld) {
-          l2rtd = conn->time_pings[cc].local_to_remote_difference;
-          chosen = cc;
-          tld = conn->time_pings[cc].dispersion;
-          local_time_chosen = conn->time_pings[cc].local_time;
-          remote_time_chosen = conn->time_pings[cc].remote_time;
-        }
-      int64_t ji;
-
-      if (conn->time_ping_count > 1) {
-        if (l2rtd > conn->local_to_remote_time_difference) {
-          local_to_remote_time_jitters =
-              local_to_remote_time_jitters + l2rtd - conn->local_to_remote_time_difference;
-          ji = l2rtd - conn->local_to_remote_time_difference;
-        } else {
-          local_to_remote_time_jitters =
-              local_to_remote_time_jitters + conn->local_to_remote_time_difference - l2rtd;
-          ji = -(conn->local_to_remote_time_difference - l2rtd);
-        }
-        local_to_remote_time_jitters_count += 1;
-      }
-      // uncomment below to print jitter between client's clock and oour clock
-      // int64_t rtus = (tld*1000000)>>32; ji = (ji*1000000)>>32; debug(1,"Choosing time difference
-      // with dispersion of %lld us with delta of %lld us",rtus,ji);
-
-      conn->local_to_remote_time_difference = l2rtd;
-      if (first_local_to_remote_time_difference == 0) {
-        first_local_to_remote_time_difference = conn->local_to_remote_time_difference;
-        first_local_to_remote_time_difference_time = get_absolute_time_in_fp();
-      }
+    // long current_delay = 0;
+    // if (config.output->delay) {
+    //       config.output->delay(&current_delay);
+    //}
+    //  Useful for troubleshooting:
+    // debug(1, "clock_drift_ppm %f\tchosen %5d\tsource_drift_usec %10.1lld\treturn_time_in_usec
+    // %10.1llu",
+    // clock_drift_ppm,
+    // chosen,
+    //(session_corrections*1000000)/44100,
+    // current_delay,
+    // source_drift_usec,
+    // buffer_occupancy,
+    //(return_time*1000000)>>32);
 
-      int64_t clock_drift, clock_drift_in_usec;
-      double clock_drift_ppm = 0.0;
-      if (first_local_time == 0) {
-        first_local_time = local_time_chosen;
-        first_remote_time = remote_time_chosen;
-        clock_drift = 0;
-      } else {
-        uint64_t local_time_change = local_time_chosen - first_local_time;
-        uint64_t remote_time_change = remote_time_chosen - first_remote_time;
-
-        if (remote_time_change >= local_time_change)
-          clock_drift = remote_time_change - local_time_change;
-        else
-          clock_drift = -(local_time_change - remote_time_change);
-        if (clock_drift >= 0)
-          clock_drift_in_usec = (clock_drift * 1000000) >> 32;
-        else
-          clock_drift_in_usec = -(((-clock_drift) * 1000000) >> 32);
-        clock_drift_ppm = (1.0 * clock_drift_in_usec) / (local_time_change >> 32);
-      }
+  } else {
+    debug(1, "Timing port -- Unknown RTP packet of type 0x%02X length %d.", packet[1], nread);
+  }
+}
 
-      int64_t source_drift_usec;
-      if (conn->play_segment_reference_frame != 0) {
-        int64_t reference_timestamp;
-        uint64_t reference_timestamp_time, remote_reference_timestamp_time;
-        get_reference_timestamp_stuff(&reference_timestamp, &reference_timestamp_time,
-                                      &remote_reference_timestamp_time, conn);
-        uint64_t frame_difference = 0;
-        if (reference_timestamp >= conn->play_segment_reference_frame)
-          frame_difference =
-              (uint64_t)reference_timestamp - (uint64_t)conn->play_segment_reference_frame;
-        else // rollover
-          frame_difference = (uint64_t)reference_timestamp + 0x100000000 -
-                             (uint64_t)conn->play_segment_reference_frame;
-        uint64_t frame_time_difference_calculated = (((uint64_t)frame_difference << 32) / 44100);
-        uint64_t frame_time_difference_actual =
-            remote_reference_timestamp_time -
-            conn->play_segment_reference_frame_remote_time; // this is all done by reference to the
-                                                            // sources' system clock
-        // debug(1,"%llu frames since play started, %llu usec calculated, %llu usec
-        // actual",frame_difference, (frame_time_difference_calculated*1000000)>>32,
-        // (frame_time_difference_actual*1000000)>>32);
-        if (frame_time_difference_calculated >=
-            frame_time_difference_actual) // i.e. if the time it should have taken to send the
-                                          // packets is greater than the actual time difference
-                                          // measured on the source clock
-          // then the source DAC's clock is running fast relative to the source system clock
-          source_drift_usec = frame_time_difference_calculated - frame_time_difference_actual;
-        else
-          // otherwise the source DAC's clock is running slow relative to the source system clock
-          source_drift_usec = -(frame_time_difference_actual - frame_time_difference_calculated);
-      } else
-        source_drift_usec = 0;
-      source_drift_usec = (source_drift_usec * 1000000) >> 32; // turn it to microseconds
-
-      // long current_delay = 0;
-      // if (config.output->delay) {
-      //       config.output->delay(&current_delay);
-      //}
-      //  Useful for troubleshooting:
-      // debug(1, "clock_drift_ppm %f\tchosen %5d\tsource_drift_usec %10.1lld\treturn_time_in_usec
-      // %10.1llu",
-      // clock_drift_ppm,
-      // chosen,
-      //(session_corrections*1000000)/44100,
-      // current_delay,
-      // source_drift_usec,
-      // buffer_occupancy,
-      //(return_time*1000000)>>32);
+static void rtp_session_reset(rtp_audio_state *audio, rtp_timing_state *timing,
+                              rtsp_conn_info *conn) {
+  memset(audio, 0, sizeof(rtp_audio_state));
+  audio->last_seqno = -1;
+  memset(timing, 0, sizeof(rtp_timing_state));
 
-    } else {
-      debug(1, "Timing port -- Unknown RTP packet of type 0x%02X length %d.", packet[1], nread);
+  conn->reference_timestamp = 0; // nothing valid received yet
+  conn->time_ping_count = 0;
+  conn->clock_uncertainty = 0;
+  memset(conn->timing_departures, 0, sizeof(conn->timing_departures));
+  local_to_remote_time_jitters = 0;
+  local_to_remote_time_jitters_count = 0;
+}
+
+// receive a packet, recording it if the session is being recorded
+static ssize_t rtp_receive(int fd, uint8_t *packet, size_t size, enum capture_record_type type,
+                           rtsp_conn_info *conn) {
+  ssize_t nread = recv(fd, packet, size, 0);
+  if (nread < 0)
+    debug(1, "RTP receiver -- error %d receiving a packet.", errno);
+  else if (conn->capture)
+    capture_packet(conn->capture, type, get_absolute_time_in_fp(), packet, nread);
+  return nread;
+}
+
+// One thread serves a session's audio, control and timing ports, and sends its timing requests
+// when they fall due. It's asked to stop by a byte written to its stop pipe.
+static void *rtp_receiver(void *arg) {
+  debug(2, "RTP receiver thread starting.");
+  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+
+  rtp_audio_state audio;
+  rtp_timing_state timing;
+  rtp_session_reset(&audio, &timing, conn);
+  conn->capture = NULL;
+  if (config.capture_file)
+    conn->capture = capture_open(config.capture_file, conn);
+
+  enum { rtp_audio_fd = 0, rtp_control_fd, rtp_timing_fd, rtp_stop_fd, rtp_fds };
+  struct pollfd fds[rtp_fds];
+  fds[rtp_audio_fd].fd = conn->audio_socket;
+  fds[rtp_control_fd].fd = conn->control_socket;
+  fds[rtp_timing_fd].fd = conn->timing_socket;
+  fds[rtp_stop_fd].fd = conn->rtp_stop_pipe[0];
+  int i;
+  for (i = 0; i < rtp_fds; i++)
+    fds[i].events = POLLIN;
+
+  int stop = 0;
+  while (stop == 0) {
+    uint64_t time_now = get_absolute_time_in_fp();
+    if (time_now >= timing.next_request_time) {
+      rtp_timing_send(conn, &timing);
+      continue;
+    }
+    // round up, so as not to wake just before the request is due
+    int timeout = (((timing.next_request_time - time_now) * 1000) >> 32) + 1;
+    int rc = poll(fds, rtp_fds, timeout);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      die("Error %d waiting for RTP packets.", errno);
     }
+    for (i = 0; i < rtp_fds; i++) {
+      if (fds[i].revents & (POLLERR | POLLNVAL)) {
+        debug(1, "RTP receiver -- error on port %d, which will no longer be served.", i);
+        fds[i].fd = -1; // poll ignores it from now on
+        if (i == rtp_stop_fd)
+          stop = 1;
+      }
+    }
+    if (fds[rtp_stop_fd].revents & (POLLIN | POLLHUP))
+      stop = 1;
+    uint8_t packet[2048];
+    ssize_t nread;
+    if ((fds[rtp_audio_fd].revents & POLLIN) &&
+        ((nread = rtp_receive(conn->audio_socket, packet, sizeof(packet), CAPTURE_AUDIO, conn)) >=
+         0))
+      rtp_audio_packet(conn, &audio, packet, nread);
+    if ((fds[rtp_control_fd].revents & POLLIN) &&
+        ((nread = rtp_receive(conn->control_socket, packet, sizeof(packet), CAPTURE_CONTROL,
+                              conn)) >= 0))
+      rtp_control_packet(conn, packet, nread);
+    if ((fds[rtp_timing_fd].revents & POLLIN) &&
+        ((nread = rtp_receive(conn->timing_socket, packet, sizeof(packet), CAPTURE_TIMING,
+                              conn)) >= 0))
+      rtp_timing_packet(conn, &timing, packet, nread);
   }
 
-  debug(3, "Timing thread interrupted. terminating.");
-  conn->timing_sender_stop = 1;
-  void *retval;
-  pthread_kill(timer_requester, SIGUSR1);
-  debug(3, "Wait for timer requester to exit.");
-  pthread_join(timer_requester, &retval);
-  debug(3, "Closed and terminated timer requester thread.");
-  debug(3, "Timing RTP thread terminated.");
+  debug(3, "RTP receiver thread stopping.");
+  capture_close(conn->capture);
+  conn->capture = NULL;
+  close(conn->audio_socket);
+  close(conn->control_socket);
   close(conn->timing_socket);
-
   return NULL;
 }
 
+void rtp_start(rtsp_conn_info *conn) {
+  if (pipe(conn->rtp_stop_pipe) != 0)
+    die("Could not create the pipe to stop the RTP receiver.");
+  if (pthread_create(&conn->rtp_thread, NULL, &rtp_receiver, (void *)conn) != 0)
+    die("Could not create the RTP receiver thread.");
+}
+
+void rtp_stop(rtsp_conn_info *conn) {
+  char c = 0;
+  if (write(conn->rtp_stop_pipe[1], &c, 1) != 1)
+    debug(1, "Error %d asking the RTP receiver to stop.", errno);
+  pthread_join(conn->rtp_thread, NULL);
+  close(conn->rtp_stop_pipe[0]);
+  close(conn->rtp_stop_pipe[1]);
+  debug(3, "RTP receiver thread stopped.");
+}
+
+// the receivers' state when replaying a capture, which is done on one thread
+static rtp_audio_state replay_audio;
+static rtp_timing_state replay_timing;
+
+void rtp_replay_begin(rtsp_conn_info *conn) {
+  rtp_session_reset(&replay_audio, &replay_timing, conn);
+}
+
+void rtp_replay_packet(enum capture_record_type type, uint8_t *packet, size_t length,
+                       rtsp_conn_info *conn) {
+  switch (type) {
+  case CAPTURE_AUDIO:
+    rtp_audio_packet(conn, &replay_audio, packet, length);
+    break;
+  case CAPTURE_CONTROL:
+    rtp_control_packet(conn, packet, length);
+    break;
+  case CAPTURE_TIMING:
+    rtp_timing_packet(conn, &replay_timing, packet, length);
+    break;
+  case CAPTURE_TIMING_REQUEST:
+    // the reply to it will be matched by the departure time it carries
+    if (length >= 32)
+      timing_note_departure(ntohs(*(uint16_t *)(packet + 2)),
+                            ((uint64_t)ntohl(*(uint32_t *)(packet + 24)) << 32) +
+                                ntohl(*(uint32_t *)(packet + 28)),
+                            conn);
+    break;
+  default:
+    break;
+  }
+}
+
 static int bind_port(int ip_family, const char *self_ip_address, uint32_t scope_id, int *sock) {
   // look for a port in the range, if any was specified.
   int desired_port = config.udp_port_base;
@@ -3,14 +3,20 @@
 
 #include <sys/socket.h>
 
+#include "capture.h"
 #include "player.h"
 
 void rtp_initialise(rtsp_conn_info *conn);
 void rtp_terminate(rtsp_conn_info *conn);
 
-void *rtp_audio_receiver(void *arg);
-void *rtp_control_receiver(void *arg);
-void *rtp_timing_receiver(void *arg);
+// start and stop the thread that serves the session's audio, control and timing ports
+void rtp_start(rtsp_conn_info *conn);
+void rtp_stop(rtsp_conn_info *conn);
+
+// put a capture's packets through the receivers -- see capture.h
+void rtp_replay_begin(rtsp_conn_info *conn);
+void rtp_replay_packet(enum capture_record_type type, uint8_t *packet, size_t length,
+                       rtsp_conn_info *conn);
 
 void rtp_setup(SOCKADDR *local, SOCKADDR *remote, int controlport, int timingport,
                int *local_server_port, int *local_control_port, int *local_timing_port,
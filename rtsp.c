@@ -29,11 +29,13 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <memory.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,10 +43,15 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef HAVE_LIBSSL
 #include <openssl/md5.h>
 #endif
@@ -58,9 +65,12 @@
 #endif
 
 #include "common.h"
+#include "coverart.h"
+#include "metadata_pipe.h"
 #include "player.h"
 #include "rtp.h"
 #include "rtsp.h"
+#include "rtsp_parse.h"
 
 #ifdef AF_INET6
 #define INETx_ADDRSTRLEN INET6_ADDRSTRLEN
@@ -70,21 +80,22 @@
 
 #define METADATA_SNDBUF (4 * 1024 * 1024)
 
-enum rtsp_read_request_response {
-  rtsp_read_request_response_ok,
-  rtsp_read_request_response_immediate_shutdown_requested,
-  rtsp_read_request_response_bad_packet,
-  rtsp_read_request_response_channel_closed,
-  rtsp_read_request_response_error
-};
+// the most descriptors the event loop will take from one wait
+#define RTSP_MAX_EVENTS 32
+
+// how long an interrupting conversation waits for the playing one to give up the player
+#define RTSP_PLAY_LOCK_WAIT_SECONDS 3
+
+// the most worker threads handling requests that may block
+#define RTSP_MAX_WORKERS 4
 
 // Mike Brady's part...
 static pthread_mutex_t barrier_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t play_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// every time we want to retain or release a reference count, lock it with this
-// if a reference count is read as zero, it means the it's being deallocated.
-static pthread_mutex_t reference_counter_lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled, with its mutex held, whenever the play lock is released
+static pthread_mutex_t play_lock_release_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t play_lock_released = PTHREAD_COND_INITIALIZER;
 
 // only one thread is allowed to use the player at once.
 // it monitors the request variable (at least when interrupted)
@@ -92,8 +103,6 @@ static pthread_mutex_t reference_counter_lock = PTHREAD_MUTEX_INITIALIZER;
 // static int please_shutdown = 0;
 // static pthread_t playing_thread = 0;
 
-static rtsp_conn_info **conns = NULL;
-
 int RTSP_connection_index = 0;
 
 void memory_barrier() {
@@ -101,197 +110,414 @@ void memory_barrier() {
   pthread_mutex_unlock(&barrier_mutex);
 }
 
-#ifdef CONFIG_METADATA
-typedef struct {
-  pthread_mutex_t pc_queue_lock;
-  pthread_cond_t pc_queue_item_added_signal;
-  pthread_cond_t pc_queue_item_removed_signal;
-  size_t item_size;  // number of bytes in each item
-  uint32_t count;    // number of items in the queue
-  uint32_t capacity; // maximum number of items
-  uint32_t toq;      // first item to take
-  uint32_t eoq;      // free space at end of queue
-  void *items;       // a pointer to where the items are actually stored
-} pc_queue;          // producer-consumer queue
+static void release_play_lock(void) {
+  playing_conn = NULL;
+  pthread_mutex_unlock(&play_lock);
+  pthread_mutex_lock(&play_lock_release_mutex);
+  pthread_cond_broadcast(&play_lock_released);
+  pthread_mutex_unlock(&play_lock_release_mutex);
+}
+
+// wait up to the given number of seconds for the play lock, returning 0 if it was taken
+static int wait_for_play_lock(int seconds) {
+  int rc = 0;
+  pthread_mutex_lock(&play_lock_release_mutex);
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+  struct timespec time_of_giving_up;
+  clock_gettime(CLOCK_REALTIME, &time_of_giving_up);
+  time_of_giving_up.tv_sec += seconds;
+  while (((rc = pthread_mutex_trylock(&play_lock)) != 0) &&
+         (pthread_cond_timedwait(&play_lock_released, &play_lock_release_mutex,
+                                 &time_of_giving_up) == 0))
+    ;
+#endif
+#ifdef COMPILE_FOR_OSX
+  struct timespec time_to_wait;
+  time_to_wait.tv_sec = seconds;
+  time_to_wait.tv_nsec = 0;
+  while (((rc = pthread_mutex_trylock(&play_lock)) != 0) &&
+         (pthread_cond_timedwait_relative_np(&play_lock_released, &play_lock_release_mutex,
+                                             &time_to_wait) == 0))
+    ;
 #endif
+  pthread_mutex_unlock(&play_lock_release_mutex);
+  return rc;
+}
 
-typedef struct {
-  uint32_t referenceCount; // we might start using this...
-  int nheaders;
-  char *name[16];
-  char *value[16];
+#ifdef CONFIG_METADATA
+// the metadata queue is a bounded lock-free queue with many producers and one consumer,
+// the metadata thread. Each cell carries a sequence number saying whether it is free for the
+// producer claiming that position or full and ready for the consumer.
+// Producers never wait for each other or for the consumer; they only take the lock below
+// to wake the consumer if it has gone to sleep on an empty queue.
 
-  int contentlength;
-  char *content;
+// the capacity must be a power of two
+#define metadata_queue_size 512
 
-  // for requests
-  char method[16];
+// items carrying more than this much data, e.g. cover art, may only use the first
+// three-quarters of the queue, so that small items, e.g. progress and volume
+// reports, can still get through behind a burst of them
+#define metadata_bulk_item_size 4096
 
-  // for responses
-  int respcode;
-} rtsp_message;
+// how long a sender that asks to block waits for room in the queue before its item is dropped
+#define metadata_queue_blocking_wait_ms 100
+
+// the number of different item codes whose drops are counted separately
+#define metadata_drop_counter_count 64
+
+typedef struct {
+  uint32_t sequence;
+  metadata_package pack;
+} metadata_queue_cell;
 
-#ifdef CONFIG_METADATA
 typedef struct {
-  uint32_t type;
   uint32_t code;
-  char *data;
-  uint32_t length;
-  rtsp_message *carrier;
-} metadata_package;
-
-void pc_queue_init(pc_queue *the_queue, char *items, size_t item_size, uint32_t number_of_items) {
-  pthread_mutex_init(&the_queue->pc_queue_lock, NULL);
-  pthread_cond_init(&the_queue->pc_queue_item_added_signal, NULL);
-  pthread_cond_init(&the_queue->pc_queue_item_removed_signal, NULL);
-  the_queue->item_size = item_size;
-  the_queue->items = items;
-  the_queue->count = 0;
-  the_queue->capacity = number_of_items;
-  the_queue->toq = 0;
-  the_queue->eoq = 0;
-}
+  uint32_t drops;
+} metadata_drop_counter;
 
-int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
-                  int block);
+typedef struct {
+  metadata_queue_cell cells[metadata_queue_size];
+  uint32_t enqueue_pos; // claimed by producers
+  uint32_t dequeue_pos; // only ever changed by the consumer
+  int consumer_waiting;
+  pthread_mutex_t consumer_lock;
+  pthread_cond_t item_added;
+  int producers_waiting; // the number of producers waiting for room
+  pthread_mutex_t producer_lock;
+  pthread_cond_t room_made;
+  metadata_drop_counter drop_counters[metadata_drop_counter_count];
+  uint32_t other_drops; // drops of codes that didn't get a counter of their own
+} metadata_queue;
+
+static void metadata_queue_init(metadata_queue *the_queue) {
+  uint32_t i;
+  memset(the_queue, 0, sizeof(metadata_queue));
+  for (i = 0; i < metadata_queue_size; i++)
+    the_queue->cells[i].sequence = i;
+  pthread_mutex_init(&the_queue->consumer_lock, NULL);
+  pthread_cond_init(&the_queue->item_added, NULL);
+  pthread_mutex_init(&the_queue->producer_lock, NULL);
+  pthread_cond_init(&the_queue->room_made, NULL);
+}
 
-int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, int block) {
-  return send_metadata('ssnc', code, data, length, NULL, block);
+// count a dropped item against its code, returning the number of drops of that code so far
+static uint32_t metadata_queue_count_drop(metadata_queue *the_queue, uint32_t code) {
+  int i;
+  for (i = 0; i < metadata_drop_counter_count; i++) {
+    metadata_drop_counter *counter = &the_queue->drop_counters[i];
+    uint32_t existing_code = __atomic_load_n(&counter->code, __ATOMIC_ACQUIRE);
+    if (existing_code == 0) {
+      uint32_t expected = 0;
+      if (__atomic_compare_exchange_n(&counter->code, &expected, code, 0, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE))
+        existing_code = code;
+      else
+        existing_code = expected;
+    }
+    if (existing_code == code)
+      return __atomic_add_fetch(&counter->drops, 1, __ATOMIC_RELAXED);
+  }
+  return __atomic_add_fetch(&the_queue->other_drops, 1, __ATOMIC_RELAXED);
 }
 
-int pc_queue_add_item(pc_queue *the_queue, const void *the_stuff, int block) {
-  int rc;
-  if (the_queue) {
-    if (block == 0) {
-      rc = pthread_mutex_trylock(&the_queue->pc_queue_lock);
-      if (rc == EBUSY)
+// returns 0 if the item was added or EBUSY if the queue has no room for it
+static int metadata_queue_add_item(metadata_queue *the_queue, const metadata_package *pack) {
+  uint32_t limit = metadata_queue_size;
+  if (pack->length > metadata_bulk_item_size)
+    limit = (metadata_queue_size * 3) / 4;
+  metadata_queue_cell *cell;
+  uint32_t pos = __atomic_load_n(&the_queue->enqueue_pos, __ATOMIC_RELAXED);
+  while (1) {
+    cell = &the_queue->cells[pos & (metadata_queue_size - 1)];
+    uint32_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    int32_t diff = (int32_t)(seq - pos);
+    if (diff == 0) {
+      if (pos - __atomic_load_n(&the_queue->dequeue_pos, __ATOMIC_ACQUIRE) >= limit)
         return EBUSY;
-    } else
-      rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error locking for pc_queue_add_item");
-    while (the_queue->count == the_queue->capacity) {
-      rc = pthread_cond_wait(&the_queue->pc_queue_item_removed_signal, &the_queue->pc_queue_lock);
-      if (rc)
-        debug(1, "Error waiting for item to be removed");
+      if (__atomic_compare_exchange_n(&the_queue->enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return EBUSY; // the consumer hasn't taken the item a full lap ago yet
+    } else {
+      pos = __atomic_load_n(&the_queue->enqueue_pos, __ATOMIC_RELAXED);
     }
-    uint32_t i = the_queue->eoq;
-    void *p = the_queue->items + the_queue->item_size * i;
-    //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->eoq;
-    memcpy(p, the_stuff, the_queue->item_size);
-
-    // update the pointer
-    i++;
-    if (i == the_queue->capacity)
-      // fold pointer if necessary
-      i = 0;
-    the_queue->eoq = i;
-    the_queue->count++;
-    if (the_queue->count == the_queue->capacity)
-      debug(1, "pc_queue is full!");
-    rc = pthread_cond_signal(&the_queue->pc_queue_item_added_signal);
-    if (rc)
-      debug(1, "Error signalling after pc_queue_add_item");
-    rc = pthread_mutex_unlock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error unlocking for pc_queue_add_item");
-  } else {
-    debug(1, "Adding an item to a NULL queue");
+  }
+  cell->pack = *pack;
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&the_queue->consumer_waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&the_queue->consumer_lock);
+    pthread_cond_signal(&the_queue->item_added);
+    pthread_mutex_unlock(&the_queue->consumer_lock);
   }
   return 0;
 }
 
-int pc_queue_get_item(pc_queue *the_queue, void *the_stuff) {
-  int rc;
-  if (the_queue) {
-    rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error locking for pc_queue_get_item");
-    while (the_queue->count == 0) {
-      rc = pthread_cond_wait(&the_queue->pc_queue_item_added_signal, &the_queue->pc_queue_lock);
-      if (rc)
-        debug(1, "Error waiting for item to be added");
-    }
-    uint32_t i = the_queue->toq;
-    //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->toq;
-    void *p = the_queue->items + the_queue->item_size * i;
-    memcpy(the_stuff, p, the_queue->item_size);
-
-    // update the pointer
-    i++;
-    if (i == the_queue->capacity)
-      // fold pointer if necessary
-      i = 0;
-    the_queue->toq = i;
-    the_queue->count--;
-    rc = pthread_cond_signal(&the_queue->pc_queue_item_removed_signal);
-    if (rc)
-      debug(1, "Error signalling after pc_queue_removed_item");
-    rc = pthread_mutex_unlock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error unlocking for pc_queue_get_item");
-  } else {
-    debug(1, "Removing an item from a NULL queue");
+// as metadata_queue_add_item, but if the queue is full, wait up to wait_ms milliseconds for the
+// consumer to make room for the item
+static int metadata_queue_add_item_waiting(metadata_queue *the_queue, const metadata_package *pack,
+                                           int wait_ms) {
+  int rc = metadata_queue_add_item(the_queue, pack);
+  if (rc != EBUSY)
+    return rc;
+  pthread_mutex_lock(&the_queue->producer_lock);
+  __atomic_add_fetch(&the_queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+  struct timespec time_of_giving_up;
+  clock_gettime(CLOCK_REALTIME, &time_of_giving_up);
+  uint64_t nsec = time_of_giving_up.tv_nsec + (uint64_t)wait_ms * 1000000;
+  time_of_giving_up.tv_sec += nsec / 1000000000;
+  time_of_giving_up.tv_nsec = nsec % 1000000000;
+  while (((rc = metadata_queue_add_item(the_queue, pack)) == EBUSY) &&
+         (pthread_cond_timedwait(&the_queue->room_made, &the_queue->producer_lock,
+                                 &time_of_giving_up) == 0))
+    ;
+#endif
+#ifdef COMPILE_FOR_OSX
+  struct timespec time_to_wait;
+  time_to_wait.tv_sec = wait_ms / 1000;
+  time_to_wait.tv_nsec = (wait_ms % 1000) * 1000000;
+  while (((rc = metadata_queue_add_item(the_queue, pack)) == EBUSY) &&
+         (pthread_cond_timedwait_relative_np(&the_queue->room_made, &the_queue->producer_lock,
+                                             &time_to_wait) == 0))
+    ;
+#endif
+  __atomic_sub_fetch(&the_queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&the_queue->producer_lock);
+  return rc;
+}
+
+// take as many items as are ready, up to max_items, without waiting
+static uint32_t metadata_queue_take_items(metadata_queue *the_queue, metadata_package *packs,
+                                          uint32_t max_items) {
+  uint32_t taken = 0;
+  while (taken < max_items) {
+    uint32_t pos = the_queue->dequeue_pos;
+    metadata_queue_cell *cell = &the_queue->cells[pos & (metadata_queue_size - 1)];
+    uint32_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_SEQ_CST);
+    if ((int32_t)(seq - (pos + 1)) < 0)
+      break; // empty, or the producer of the next item hasn't finished with it
+    packs[taken++] = cell->pack;
+    __atomic_store_n(&cell->sequence, pos + metadata_queue_size, __ATOMIC_RELEASE);
+    __atomic_store_n(&the_queue->dequeue_pos, pos + 1, __ATOMIC_RELEASE);
   }
-  return 0;
+  return taken;
+}
+
+// wait for at least one item and then take as many as are ready, up to max_items.
+// Returns the number of items taken
+static uint32_t metadata_queue_get_items(metadata_queue *the_queue, metadata_package *packs,
+                                         uint32_t max_items) {
+  uint32_t taken;
+  while ((taken = metadata_queue_take_items(the_queue, packs, max_items)) == 0) {
+    pthread_mutex_lock(&the_queue->consumer_lock);
+    __atomic_store_n(&the_queue->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    // look again, in case an item was added before the producer could see we were waiting
+    taken = metadata_queue_take_items(the_queue, packs, max_items);
+    if (taken == 0)
+      pthread_cond_wait(&the_queue->item_added, &the_queue->consumer_lock);
+    __atomic_store_n(&the_queue->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&the_queue->consumer_lock);
+    if (taken)
+      break;
+  }
+  // wake any producers waiting for room -- the fence pairs with the one implied by their
+  // incrementing producers_waiting before looking for room themselves
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&the_queue->producers_waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&the_queue->producer_lock);
+    pthread_cond_broadcast(&the_queue->room_made);
+    pthread_mutex_unlock(&the_queue->producer_lock);
+  }
+  return taken;
+}
+
+int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
+                  int block);
+
+int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, int block) {
+  return send_metadata('ssnc', code, data, length, NULL, block);
 }
 
 #endif
 
-void ask_other_rtsp_conversation_threads_to_stop(pthread_t except_this_thread);
+// The connections of all RTSP conversations are serviced by the single event loop in
+// rtsp_listen_loop(). It accepts them, reads and parses their requests and sends their responses.
+// Each conversation has a session record holding the connection, the partly-received request
+// and any part of a response the connection couldn't take yet. A conversation has no thread of
+// its own -- an idle one costs only its session record.
+// Requests that are quick to handle are handled on the event loop. Those that can take a while --
+// e.g. an ANNOUNCE waiting for the player, a TEARDOWN stopping it or a SET_PARAMETER running a
+// volume command -- are passed to a small pool of worker threads, which exist only while there
+// are such requests to handle. A conversation's requests are handled in the order they arrived:
+// once one has been passed to a worker, the ones after it follow it there until the worker has
+// caught up. Closing a conversation that has used a worker, which may mean stopping its player,
+// is also left to a worker.
+
+typedef struct rtsp_request_item {
+  rtsp_message *msg;
+  struct rtsp_request_item *next;
+} rtsp_request_item;
+
+typedef struct rtsp_session {
+  rtsp_conn_info *conn;
+  char *auth_nonce;
+  // the following are guarded by rtsp_work_lock
+  rtsp_request_item *requests, *last_request; // requests waiting for a worker
+  int with_workers; // the session is waiting for or being handled by a worker
+  int closing;      // the event loop has let go of the session, so the worker is to close it
+  struct rtsp_session *next_for_workers; // the next session in the workers' queue
+  // the following are shared between the event loop and the workers, guarded by lock
+  pthread_mutex_t lock;
+  char *outbuf; // response bytes the connection hasn't taken yet
+  size_t outlen, outbuflen;
+  // the following belong to the event loop
+  int used_workers;            // a worker has been given one of its requests
+  int watching_output;         // the event loop is waiting for the connection to become writable
+  rtsp_parser parser;          // the requests being received
+  uint64_t content_start_time; // when the awaited request's headers were complete
+  int stall_warning_sent;
+  // for timing the setting up of a play session, from the ANNOUNCE to the response to the RECORD
+  uint64_t announce_time;
+  uint64_t announce_handling_time, setup_handling_time;
+} rtsp_session;
+
+static double fp_to_ms(uint64_t t) { return t * 1000.0 / ((uint64_t)1 << 32); }
+
+static rtsp_session **sessions = NULL;
+static int nsessions = 0;
+
+// the workers, which handle the requests that may block, and the sessions waiting for them
+static pthread_mutex_t rtsp_work_lock = PTHREAD_MUTEX_INITIALIZER;
+static rtsp_session *sessions_for_workers = NULL, *last_session_for_workers = NULL;
+static int workers_running = 0;
+static void *rtsp_worker(void *arg);
+
+// statistics on connection handling
+static int peak_nsessions = 0;
+static uint64_t sessions_accepted = 0;
+
+// the listening sockets
+static int *sockfd = NULL;
+static int nsock = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+#endif
+
+// the event loop is woken by writing a byte into this pipe,
+// e.g. when another thread or a signal handler asks a conversation to stop.
+static int wake_pipe[2] = {-1, -1};
+
+static void rtsp_wake_listen_loop(void) {
+  char c = 0;
+  if ((wake_pipe[1] >= 0) && (write(wake_pipe[1], &c, 1) < 0)) {
+    // the pipe is full, so a wakeup is already pending
+  }
+}
+
+void rtsp_request_conversation_stop(rtsp_conn_info *conn) {
+  conn->stop = 1;
+  rtsp_wake_listen_loop();
+}
 
+// set by rtsp_request_shutdown_stream() and acted on by the event loop
+static volatile sig_atomic_t shutdown_requested = 0;
+
+// this is called from a signal handler, so it only leaves a note for the event loop and wakes it
 void rtsp_request_shutdown_stream(void) {
-  debug(1, "Request to shut down all rtsp conversation threads");
-  ask_other_rtsp_conversation_threads_to_stop(0); // i.e. ask all playing threads to stop
+  shutdown_requested = 1;
+  rtsp_wake_listen_loop();
 }
 
-// keep track of the threads we have spawned so we can join() them
-static int nconns = 0;
-static void track_thread(rtsp_conn_info *conn) {
-  conns = realloc(conns, sizeof(rtsp_conn_info *) * (nconns + 1));
-  if (conns) {
-    conns[nconns] = conn;
-    nconns++;
+static void track_session(rtsp_session *session) {
+  sessions = realloc(sessions, sizeof(rtsp_session *) * (nsessions + 1));
+  if (sessions) {
+    sessions[nsessions] = session;
+    nsessions++;
+    if (nsessions > peak_nsessions)
+      peak_nsessions = nsessions;
   } else {
-    die("could not reallocate memnory for \"conns\" in rtsp.c.");
+    die("could not reallocate memory for \"sessions\" in rtsp.c.");
   }
 }
 
-static void cleanup_threads(void) {
-  void *retval;
+static rtsp_session *session_for_fd(int fd) {
   int i;
-  // debug(2, "culling threads.");
-  for (i = 0; i < nconns;) {
-    if (conns[i]->running == 0) {
-      debug(3, "found RTSP connection thread %d in a non-running state.",
-            conns[i]->connection_number);
-      pthread_join(conns[i]->thread, &retval);
-      debug(3, "RTSP connection thread %d deleted...", conns[i]->connection_number);
-      if (conns[i] == playing_conn)
-        playing_conn = NULL;
-      free(conns[i]);
-      nconns--;
-      if (nconns)
-        conns[i] = conns[nconns];
-    } else {
-      i++;
-    }
-  }
+  for (i = 0; i < nsessions; i++)
+    if (sessions[i]->conn->fd == fd)
+      return sessions[i];
+  return NULL;
 }
 
-// ask all rtsp_conversation threads to stop -- there should be at most one, but
-// ya never know.
+static void rtsp_watch_fd(int fd) {
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    die("could not add a descriptor to the RTSP event loop: \"%s\".", strerror(errno));
+#endif
+}
 
-void ask_other_rtsp_conversation_threads_to_stop(pthread_t except_this_thread) {
-  int i;
-  debug(1, "asking playing threads to stop");
-  for (i = 0; i < nconns; i++) {
-    if (((except_this_thread == 0) || (pthread_equal(conns[i]->thread, except_this_thread) == 0)) &&
-        (conns[i]->running != 0)) {
-      conns[i]->stop = 1;
-      pthread_kill(conns[i]->thread, SIGUSR1);
-    }
+// wait for a conversation's connection to become writable as well as readable, or stop waiting
+static void rtsp_watch_output(rtsp_session *session, int watch) {
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = watch ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.fd = session->conn->fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->conn->fd, &ev) == -1)
+    die("could not change a descriptor in the RTSP event loop: \"%s\".", strerror(errno));
+#endif
+  session->watching_output = watch;
+}
+
+static void rtsp_unwatch_fd(int fd) {
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev; // ignored, but must be non-null on older kernels
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev) == -1)
+    debug(1, "could not remove a descriptor from the RTSP event loop: \"%s\".", strerror(errno));
+#endif
+}
+
+// wait up to timeout_ms milliseconds (-1 for ever) for descriptors to become readable,
+// or writable if that's being waited for.
+// Their number is returned and the descriptors themselves are placed in ready[]
+static int rtsp_wait_for_events(int *ready, int max_ready, int timeout_ms) {
+  int i, n;
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event events[RTSP_MAX_EVENTS];
+  if (max_ready > RTSP_MAX_EVENTS)
+    max_ready = RTSP_MAX_EVENTS;
+  n = epoll_wait(epoll_fd, events, max_ready, timeout_ms);
+  for (i = 0; i < n; i++)
+    ready[i] = events[i].data.fd;
+#else
+  int nfds = nsock + 1 + nsessions;
+  struct pollfd pfds[nfds];
+  memset(pfds, 0, sizeof(pfds));
+  for (i = 0; i < nsock; i++)
+    pfds[i].fd = sockfd[i];
+  pfds[nsock].fd = wake_pipe[0];
+  for (i = 0; i < nfds; i++)
+    pfds[i].events = POLLIN;
+  for (i = 0; i < nsessions; i++) {
+    pfds[nsock + 1 + i].fd = sessions[i]->conn->fd;
+    if (sessions[i]->watching_output)
+      pfds[nsock + 1 + i].events |= POLLOUT;
   }
+  int ret = poll(pfds, nfds, timeout_ms);
+  if (ret <= 0)
+    return ret;
+  n = 0;
+  for (i = 0; (i < nfds) && (n < max_ready); i++)
+    if (pfds[i].revents)
+      ready[n++] = pfds[i].fd;
+#endif
+  return n;
 }
 
 // park a null at the line ending, and return the next line pointer
@@ -317,281 +543,123 @@ static char *nextline(char *in, int inbuf) {
   return out;
 }
 
-static void msg_retain(rtsp_message *msg) {
-  if (msg) {
-    int rc = pthread_mutex_lock(&reference_counter_lock);
-    if (rc)
-      debug(1, "Error %d locking reference counter lock");
-    msg->referenceCount++;
-    rc = pthread_mutex_unlock(&reference_counter_lock);
-    if (rc)
-      debug(1, "Error %d unlocking reference counter lock");
-  } else {
-    debug(1, "null rtsp_message pointer passed to retain");
-  }
-}
-
-static rtsp_message *msg_init(void) {
-  rtsp_message *msg = malloc(sizeof(rtsp_message));
-  if (msg) {
-    memset(msg, 0, sizeof(rtsp_message));
-    msg->referenceCount = 1; // from now on, any access to this must be protected with the lock
-  } else {
-    die("can not allocate memory for an rtsp_message.");
-  }
-  return msg;
-}
-
-static int msg_add_header(rtsp_message *msg, char *name, char *value) {
-  if (msg->nheaders >= sizeof(msg->name) / sizeof(char *)) {
-    warn("too many headers?!");
-    return 1;
-  }
-
-  msg->name[msg->nheaders] = strdup(name);
-  msg->value[msg->nheaders] = strdup(value);
-  msg->nheaders++;
-
-  return 0;
-}
-
-static char *msg_get_header(rtsp_message *msg, char *name) {
-  int i;
-  for (i = 0; i < msg->nheaders; i++)
-    if (!strcasecmp(msg->name[i], name))
-      return msg->value[i];
-  return NULL;
-}
-
 static void debug_print_msg_headers(int level, rtsp_message *msg) {
   int i;
   for (i = 0; i < msg->nheaders; i++) {
-    debug(level, "  Type: \"%s\", content: \"%s\"", msg->name[i], msg->value[i]);
+    debug(level, "  Type: \"%s\", content: \"%s\"", msg->headers[i].name, msg->headers[i].value);
   }
 }
 
-static void msg_free(rtsp_message *msg) {
-
-  if (msg) {
-    int rc = pthread_mutex_lock(&reference_counter_lock);
-    if (rc)
-      debug(1, "Error %d locking reference counter lock during msg_free()", rc);
-    msg->referenceCount--;
-    rc = pthread_mutex_unlock(&reference_counter_lock);
-    if (rc)
-      debug(1, "Error %d unlocking reference counter lock during msg_free()", rc);
-    if (msg->referenceCount == 0) {
-      int i;
-      for (i = 0; i < msg->nheaders; i++) {
-        free(msg->name[i]);
-        free(msg->value[i]);
-      }
-      if (msg->content)
-        free(msg->content);
-      free(msg);
-    } // else {
-      // debug(1,"rtsp_message reference count non-zero:
-      // %d!",msg->referenceCount);
-      //}
-  } else {
-    debug(1, "null rtsp_message pointer passed to msg_free()");
+// read whatever has arrived on a conversation's connection into its receive buffer
+static enum rtsp_read_request_response rtsp_session_fill(rtsp_session *session) {
+  rtsp_conn_info *conn = session->conn;
+  rtsp_parser *parser = &session->parser;
+  ssize_t room = rtsp_parser_make_room(parser);
+  if (room == 0) {
+    warn("overlong RTSP header received");
+    return rtsp_read_request_response_bad_packet;
   }
-}
-
-static int msg_handle_line(rtsp_message **pmsg, char *line) {
-  rtsp_message *msg = *pmsg;
 
-  if (!msg) {
-    msg = msg_init();
-    *pmsg = msg;
-    char *sp, *p;
+  ssize_t nread = read(conn->fd, parser->buf + parser->inbuf, room);
 
-    // debug(1, "received request: %s", line);
-
-    p = strtok_r(line, " ", &sp);
-    if (!p)
-      goto fail;
-    strncpy(msg->method, p, sizeof(msg->method) - 1);
-
-    p = strtok_r(NULL, " ", &sp);
-    if (!p)
-      goto fail;
-
-    p = strtok_r(NULL, " ", &sp);
-    if (!p)
-      goto fail;
-    if (strcmp(p, "RTSP/1.0"))
-      goto fail;
-
-    return -1;
+  if (nread == 0) {
+    // a read of a readable descriptor that returns zero means eof -- implies connection closed
+    debug(3, "RTSP conversation %d -- connection closed.", conn->connection_number);
+    return rtsp_read_request_response_channel_closed;
   }
 
-  if (strlen(line)) {
-    char *p;
-    p = strstr(line, ": ");
-    if (!p) {
-      warn("bad header: >>%s<<", line);
-      goto fail;
-    }
-    *p = 0;
-    p += 2;
-    msg_add_header(msg, line, p);
-    debug(3, "    %s: %s.", line, p);
-    return -1;
-  } else {
-    char *cl = msg_get_header(msg, "Content-Length");
-    if (cl)
-      return atoi(cl);
-    else
-      return 0;
+  if (nread < 0) {
+    if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
+      return rtsp_read_request_response_ok;
+    perror("read failure");
+    return rtsp_read_request_response_channel_closed;
   }
-
-fail:
-  *pmsg = NULL;
-  msg_free(msg);
-  return 0;
+  parser->inbuf += nread;
+  return rtsp_read_request_response_ok;
 }
 
-static enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn,
-                                                         rtsp_message **the_packet) {
-  enum rtsp_read_request_response reply = rtsp_read_request_response_ok;
-  ssize_t buflen = 512;
-  char *buf = malloc(buflen + 1);
-
-  rtsp_message *msg = NULL;
-
-  ssize_t nread;
-  ssize_t inbuf = 0;
-  int msg_size = -1;
-
-  while (msg_size < 0) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(conn->fd, &readfds);
-    do {
-      memory_barrier();
-    } while (conn->stop == 0 &&
-             pselect(conn->fd + 1, &readfds, NULL, NULL, NULL, &pselect_sigset) <= 0);
-    if (conn->stop != 0) {
-      debug(3, "RTSP conversation thread %d shutdown requested.", conn->connection_number);
-      reply = rtsp_read_request_response_immediate_shutdown_requested;
-      goto shutdown;
-    }
-    nread = read(conn->fd, buf + inbuf, buflen - inbuf);
-
-    if (nread == 0) {
-      // a blocking read that returns zero means eof -- implies connection closed
-      debug(3, "RTSP conversation thread %d -- connection closed.", conn->connection_number);
-      reply = rtsp_read_request_response_channel_closed;
-      goto shutdown;
-    }
-
-    if (nread < 0) {
-      if (errno == EINTR)
-        continue;
-      perror("read failure");
-      reply = rtsp_read_request_response_channel_closed;
-      goto shutdown;
-    }
-    inbuf += nread;
-
-    char *next;
-    while (msg_size < 0 && (next = nextline(buf, inbuf))) {
-      msg_size = msg_handle_line(&msg, buf);
-
-      if (!msg) {
-        warn("no RTSP header received");
-        reply = rtsp_read_request_response_bad_packet;
-        goto shutdown;
-      }
-
-      inbuf -= next - buf;
-      if (inbuf)
-        memmove(buf, next, inbuf);
-    }
-  }
-
-  if (msg_size > buflen) {
-    buf = realloc(buf, msg_size);
-    if (!buf) {
-      warn("too much content");
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
-    }
-    buflen = msg_size;
+// assemble a request from what the conversation has received so far, noting when its header
+// block is complete and its content is awaited.
+// *the_packet is left NULL if more data is needed to complete it.
+static enum rtsp_read_request_response rtsp_session_next_request(rtsp_session *session,
+                                                                 rtsp_message **the_packet) {
+  int awaiting_headers = session->parser.msg == NULL;
+  enum rtsp_read_request_response reply = rtsp_parser_next_request(&session->parser, the_packet);
+  if (awaiting_headers && session->parser.msg) {
+    session->content_start_time = get_absolute_time_in_fp();
+    session->stall_warning_sent = 0;
   }
+  return reply;
+}
 
-  uint64_t threshold_time =
-      get_absolute_time_in_fp() + ((uint64_t)5 << 32); // i.e. five seconds from now
-  int warning_message_sent = 0;
-
-  const size_t max_read_chunk = 50000;
-  while (inbuf < msg_size) {
-
-    // we are going to read the stream in chunks and time how long it takes to
-    // do so.
-    // If it's taking too long, (and we find out about it), we will send an
-    // error message as
-    // metadata
-
-    if (warning_message_sent == 0) {
-      uint64_t time_now = get_absolute_time_in_fp();
-      if (time_now > threshold_time) { // it's taking too long
-        debug(1, "Error receiving metadata from source -- transmission seems "
-                 "to be stalled.");
+// if a request's content is taking too long to arrive, send an error message as metadata
+static void rtsp_session_check_for_stall(rtsp_session *session, uint64_t time_now) {
+  rtsp_parser *parser = &session->parser;
+  if ((parser->msg_size > 0) && (parser->inbuf < parser->header_length + parser->msg_size) &&
+      (session->stall_warning_sent == 0) &&
+      (time_now - session->content_start_time > ((uint64_t)5 << 32))) { // five seconds
+    debug(1, "Error receiving metadata from source -- transmission seems "
+             "to be stalled.");
 #ifdef CONFIG_METADATA
-        send_ssnc_metadata('stal', NULL, 0, 1);
+    send_ssnc_metadata('stal', NULL, 0, 0); // the event loop mustn't wait
 #endif
-        warning_message_sent = 1;
+    session->stall_warning_sent = 1;
+  }
+}
+
+// send as much of a conversation's queued output as its connection will take without waiting.
+// Returns -1 if the connection has failed. The session's lock must be held
+static int rtsp_session_write_pending(rtsp_session *session) {
+  size_t sent = 0;
+  int rc = 0;
+  while (sent < session->outlen) {
+    ssize_t n = write(session->conn->fd, session->outbuf + sent, session->outlen - sent);
+    if (n > 0) {
+      sent += n;
+    } else if ((n < 0) && (errno == EINTR)) {
+      continue;
+    } else {
+      if ((n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+        debug(1, "RTSP conversation %d: error %d sending a response.",
+              session->conn->connection_number, errno);
+        rc = -1;
       }
+      break;
     }
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(conn->fd, &readfds);
-    do {
-      memory_barrier();
-    } while (conn->stop == 0 &&
-             pselect(conn->fd + 1, &readfds, NULL, NULL, NULL, &pselect_sigset) <= 0);
-    if (conn->stop != 0) {
-      debug(1, "RTSP shutdown requested.");
-      reply = rtsp_read_request_response_immediate_shutdown_requested;
-      goto shutdown;
-    }
-    ssize_t read_chunk = msg_size - inbuf;
-    if (read_chunk > max_read_chunk)
-      read_chunk = max_read_chunk;
-    nread = read(conn->fd, buf + inbuf, read_chunk);
-    if (!nread) {
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
-    }
-    if (nread < 0) {
-      if (errno == EINTR)
-        continue;
-      perror("read failure");
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
-    }
-    inbuf += nread;
   }
+  if (sent) {
+    session->outlen -= sent;
+    if (session->outlen)
+      memmove(session->outbuf, session->outbuf + sent, session->outlen);
+  }
+  return rc;
+}
 
-  msg->contentlength = inbuf;
-  msg->content = buf;
-  *the_packet = msg;
-  return reply;
-
-shutdown:
-  if (msg) {
-    msg_free(msg); // which will free the content and everything else
+// queue a response for sending and send as much of it as the connection will take now.
+// If some is left over, the event loop is woken to send it when the connection is writable.
+static void rtsp_session_send(rtsp_session *session, const char *data, size_t length) {
+  int wake = 0, failed = 0;
+  pthread_mutex_lock(&session->lock);
+  if (session->outlen + length > session->outbuflen) {
+    char *outbuf = realloc(session->outbuf, session->outlen + length);
+    if (outbuf == NULL)
+      die("could not allocate a send buffer for RTSP conversation %d.",
+          session->conn->connection_number);
+    session->outbuf = outbuf;
+    session->outbuflen = session->outlen + length;
   }
-  // in case the message wasn't formed or wasn't fully initialised
-  if ((msg && (msg->content == NULL)) || (!msg))
-    free(buf);
-  *the_packet = NULL;
-  return reply;
+  memcpy(session->outbuf + session->outlen, data, length);
+  session->outlen += length;
+  failed = rtsp_session_write_pending(session);
+  wake = session->outlen != 0;
+  pthread_mutex_unlock(&session->lock);
+  if (failed)
+    rtsp_request_conversation_stop(session->conn);
+  else if (wake)
+    rtsp_wake_listen_loop();
 }
 
-static void msg_write_response(int fd, rtsp_message *resp) {
+static void msg_write_response(rtsp_session *session, rtsp_message *resp) {
   char pkt[1024];
   int pktfree = sizeof(pkt);
   char *p = pkt;
@@ -604,8 +672,8 @@ static void msg_write_response(int fd, rtsp_message *resp) {
   p += n;
 
   for (i = 0; i < resp->nheaders; i++) {
-    //    debug(3, "    %s: %s.", resp->name[i], resp->value[i]);
-    n = snprintf(p, pktfree, "%s: %s\r\n", resp->name[i], resp->value[i]);
+    //    debug(3, "    %s: %s.", resp->headers[i].name, resp->headers[i].value);
+    n = snprintf(p, pktfree, "%s: %s\r\n", resp->headers[i].name, resp->headers[i].value);
     pktfree -= n;
     p += n;
     if (pktfree <= 0)
@@ -616,7 +684,7 @@ static void msg_write_response(int fd, rtsp_message *resp) {
     die("Attempted to write overlong RTSP packet");
 
   strcpy(p, "\r\n");
-  int ignore = write(fd, pkt, p - pkt + 2);
+  rtsp_session_send(session, pkt, p - pkt + 2);
 }
 
 static void handle_record(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
@@ -635,7 +703,7 @@ static void handle_record(rtsp_conn_info *conn, rtsp_message *req, rtsp_message
 
   char *p;
   uint32_t rtptime = 0;
-  char *hdr = msg_get_header(req, "RTP-Info");
+  char *hdr = msg_get_indexed_header(req, rtsp_header_rtp_info);
 
   if (hdr) {
     // debug(1,"FLUSH message received: \"%s\".",hdr);
@@ -687,7 +755,7 @@ static void handle_flush(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *
   //            "it's sending a response to flush anyway",conn->connection_number);
   char *p = NULL;
   uint32_t rtptime = 0;
-  char *hdr = msg_get_header(req, "RTP-Info");
+  char *hdr = msg_get_indexed_header(req, rtsp_header_rtp_info);
 
   if (hdr) {
     // debug(1,"FLUSH message received: \"%s\".",hdr);
@@ -715,7 +783,7 @@ static void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *
   int cport, tport;
   int lsport, lcport, ltport;
 
-  char *ar = msg_get_header(req, "Active-Remote");
+  char *ar = msg_get_indexed_header(req, rtsp_header_active_remote);
   if (ar) {
     debug(1, "Active-Remote string seen: \"%s\".", ar);
     // get the active remote
@@ -852,8 +920,7 @@ static void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *
 error:
   warn("Error in setup request -- unlocking play lock on RTSP conversation thread %d.",
        conn->connection_number);
-  playing_conn = NULL;
-  pthread_mutex_unlock(&play_lock);
+  release_play_lock();
   resp->respcode = 451; // invalid arguments
 }
 
@@ -967,69 +1034,15 @@ static void handle_set_parameter_parameter(rtsp_conn_info *conn, rtsp_message *r
 //    "ssnc", "chnk", packet_ix, packet_counts, packet_tag, packet_type, chunked_data.
 //    Notice that the number of items is different to the standard
 
-// including a simple base64 encoder to minimise malloc/free activity
-
-// From Stack Overflow, with thanks:
-// http://stackoverflow.com/questions/342409/how-do-i-base64-encode-decode-in-c
-// minor mods to make independent of C99.
-// more significant changes make it not malloc memory
-// needs to initialise the docoding table first
-
-// add _so to end of name to avoid confusion with polarssl's implementation
-
-static char encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M',
-                                'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z',
-                                'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm',
-                                'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z',
-                                '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'};
-
-static int mod_table[] = {0, 2, 1};
-
-// pass in a pointer to the data, its length, a pointer to the output buffer and
-// a pointer to an int
-// containing its maximum length
-// the actual length will be returned.
-
-char *base64_encode_so(const unsigned char *data, size_t input_length, char *encoded_data,
-                       size_t *output_length) {
-
-  size_t calculated_output_length = 4 * ((input_length + 2) / 3);
-  if (calculated_output_length > *output_length)
-    return (NULL);
-  *output_length = calculated_output_length;
-
-  int i, j;
-  for (i = 0, j = 0; i < input_length;) {
-
-    uint32_t octet_a = i < input_length ? (unsigned char)data[i++] : 0;
-    uint32_t octet_b = i < input_length ? (unsigned char)data[i++] : 0;
-    uint32_t octet_c = i < input_length ? (unsigned char)data[i++] : 0;
-
-    uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
-
-    encoded_data[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
-    encoded_data[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
-    encoded_data[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
-    encoded_data[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
-  }
-
-  for (i = 0; i < mod_table[input_length % 3]; i++)
-    encoded_data[*output_length - 1 - i] = '=';
-
-  return encoded_data;
-}
-
 // with thanks!
 //
 
 static int fd = -1;
 static int dirty = 0;
-pc_queue metadata_queue;
+static metadata_queue metadata_items;
 static int metadata_sock = -1;
 static struct sockaddr_in metadata_sockaddr;
 static char *metadata_sockmsg;
-#define metadata_queue_size 500
-metadata_package metadata_queue_items[metadata_queue_size];
 
 static pthread_t metadata_thread;
 
@@ -1093,10 +1106,7 @@ static void metadata_close(void) {
   fd = -1;
 }
 
-void metadata_process(uint32_t type, uint32_t code, char *data, uint32_t length) {
-  // debug(2, "Process metadata with type %x, code %x and length %u.", type, code, length);
-  int ret;
-
+static void metadata_socket_send(uint32_t type, uint32_t code, char *data, uint32_t length) {
   if (metadata_sock >= 0 && length < config.metadata_sockmsglength - 8) {
     char *ptr = metadata_sockmsg;
     uint32_t v;
@@ -1151,87 +1161,83 @@ void metadata_process(uint32_t type, uint32_t code, char *data, uint32_t length)
         break;
     } while (1);
   }
+}
 
+// write a batch of metadata items to the pipe, opening it if a reader has come along
+static void metadata_pipe_write(metadata_package *packs, int count) {
   // readers may go away and come back
   if (fd < 0)
     metadata_open();
   if (fd < 0)
     return;
-  char thestring[1024];
-  snprintf(thestring, 1024, "<item><type>%x</type><code>%x</code><length>%u</length>", type, code,
-           length);
-  ret = non_blocking_write(fd, thestring, strlen(thestring));
+
+  size_t total_length = 0;
+  int i;
+  for (i = 0; i < count; i++)
+    total_length += packs[i].data ? packs[i].length : 0;
+
+  uint64_t time_before = get_absolute_time_in_fp();
+  ssize_t ret = metadata_pipe_write_items(fd, config.metadata_pipe_format, packs, count);
   if (ret < 0) {
-    // debug(1,"metadata_process error %d exit 1",ret);
-    return;
+    debug(2, "metadata_pipe_write error: \"%s\".", strerror(errno));
+  } else if (total_length >= 65536) {
+    // report the throughput for large items such as cover art
+    double elapsed = (1.0 * (get_absolute_time_in_fp() - time_before)) / ((uint64_t)1 << 32);
+    debug(2, "Metadata pipe: %d item(s) with %zu bytes of data written as %zd bytes in %.3f ms "
+             "(%.1f MB/s).",
+          count, total_length, ret, elapsed * 1000.0,
+          elapsed > 0.0 ? total_length / (elapsed * 1000000.0) : 0.0);
   }
-  if ((data != NULL) && (length > 0)) {
-    snprintf(thestring, 1024, "\n<data encoding=\"base64\">\n");
-    ret = non_blocking_write(fd, thestring, strlen(thestring));
-    if (ret < 0) {
-      // debug(1,"metadata_process error %d exit 2",ret);
-      return;
-    }
-    // here, we write the data in base64 form using our nice base64 encoder
-    // but, we break it into lines of 76 output characters, except for the last
-    // one.
-    // thus, we send groups of (76/4)*3 =  57 bytes to the encoder at a time
-    size_t remaining_count = length;
-    char *remaining_data = data;
-    size_t towrite_count;
-    char outbuf[76];
-    while ((remaining_count) && (ret >= 0)) {
-      size_t towrite_count = remaining_count;
-      if (towrite_count > 57)
-        towrite_count = 57;
-      size_t outbuf_size = 76; // size of output buffer on entry, length of result on exit
-      if (base64_encode_so((unsigned char *)remaining_data, towrite_count, outbuf, &outbuf_size) ==
-          NULL)
-        debug(1, "Error encoding base64 data.");
-      // debug(1,"Remaining count: %d ret: %d, outbuf_size:
-      // %d.",remaining_count,ret,outbuf_size);
-      ret = non_blocking_write(fd, outbuf, outbuf_size);
-      if (ret < 0) {
-        // debug(1,"metadata_process error %d exit 3",ret);
-        return;
-      }
-      remaining_data += towrite_count;
-      remaining_count -= towrite_count;
-    }
-    snprintf(thestring, 1024, "</data>");
-    ret = non_blocking_write(fd, thestring, strlen(thestring));
-    if (ret < 0) {
-      // debug(1,"metadata_process error %d exit 4",ret);
-      return;
+}
+
+// release the data carried by a metadata item
+static void metadata_package_release(metadata_package *pack) {
+  if (pack->carrier)
+    msg_free(pack->carrier); // release the message
+  else if (pack->data)
+    free(pack->data);
+}
+
+// if the cover art cache is in use, replace a picture with the path of its file in the cache,
+// sent as an 'ssnc' 'pcpt' item. Only the metadata pipe's readers share this machine's
+// filesystem, so this is done after the picture itself has gone to the metadata socket.
+static void metadata_cache_cover_art(metadata_package *pack) {
+  if ((pack->type == 'ssnc') && (pack->code == 'PICT') && (pack->data) && (pack->length) &&
+      (coverart_cache_enabled())) {
+    char *path = coverart_cache_store(pack->data, pack->length);
+    if (path) {
+      metadata_package_release(pack);
+      pack->code = 'pcpt';
+      pack->data = path;
+      pack->length = strlen(path);
+      pack->carrier = NULL;
     }
   }
-  snprintf(thestring, 1024, "</item>\n");
-  ret = non_blocking_write(fd, thestring, strlen(thestring));
-  if (ret < 0) {
-    // debug(1,"metadata_process error %d exit 5",ret);
-    return;
-  }
 }
 
 void *metadata_thread_function(void *ignore) {
   metadata_create();
-  metadata_package pack;
+  metadata_package packs[metadata_batch_size];
   while (1) {
-    pc_queue_get_item(&metadata_queue, &pack);
-    if (config.metadata_enabled)
-      metadata_process(pack.type, pack.code, pack.data, pack.length);
-    if (pack.carrier)
-      msg_free(pack.carrier); // release the message
-    else if (pack.data)
-      free(pack.data);
+    int i, count = metadata_queue_get_items(&metadata_items, packs, metadata_batch_size);
+    if (config.metadata_enabled) {
+      for (i = 0; i < count; i++)
+        metadata_socket_send(packs[i].type, packs[i].code, packs[i].data, packs[i].length);
+      for (i = 0; i < count; i++)
+        metadata_cache_cover_art(&packs[i]);
+      metadata_pipe_write(packs, count);
+    }
+    for (i = 0; i < count; i++)
+      metadata_package_release(&packs[i]);
   }
   pthread_exit(NULL);
 }
 
 void metadata_init(void) {
-  // create a pc_queue for passing information to a threaded metadata handler
-  pc_queue_init(&metadata_queue, (char *)&metadata_queue_items, sizeof(metadata_package),
-                metadata_queue_size);
+  // create a queue for passing information to a threaded metadata handler
+  metadata_queue_init(&metadata_items);
+  if ((config.metadata_enabled) && (config.get_coverart) && (config.cover_art_cache_directory))
+    coverart_cache_init(config.cover_art_cache_directory, config.cover_art_cache_size);
   int ret = pthread_create(&metadata_thread, NULL, metadata_thread_function, NULL);
   if (ret)
     debug(1, "Failed to create metadata thread!");
@@ -1266,6 +1272,10 @@ int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rts
   // If the rtsp_message is NULL and the pointer is also NULL, nothing further
   // is done.
 
+  // Ownership of the data passes to the queue with the item. If the item is dropped, the data is
+  // released here. Items are only dropped when the queue has no room for them -- if block is set,
+  // the caller first waits a little while for room to be made.
+
   metadata_package pack;
   pack.type = type;
   pack.code = code;
@@ -1274,11 +1284,21 @@ int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rts
   if (carrier)
     msg_retain(carrier);
   pack.carrier = carrier;
-  int rc = pc_queue_add_item(&metadata_queue, &pack, block);
-  if ((rc == EBUSY) && (carrier))
-    msg_free(carrier);
-  if (rc == EBUSY)
-    warn("Metadata queue is busy, dropping message of type 0x%08X, code 0x%08X.", type, code);
+  int rc;
+  if (block)
+    rc = metadata_queue_add_item_waiting(&metadata_items, &pack, metadata_queue_blocking_wait_ms);
+  else
+    rc = metadata_queue_add_item(&metadata_items, &pack);
+  if (rc == EBUSY) {
+    uint32_t drops = metadata_queue_count_drop(&metadata_items, code);
+    if (carrier)
+      msg_free(carrier);
+    else if (data)
+      free(data);
+    warn("Metadata queue is full, dropping message of type 0x%08X, code 0x%08X -- %u such "
+         "message(s) dropped so far.",
+         type, code, drops);
+  }
   return rc;
 }
 
@@ -1326,7 +1346,7 @@ static void handle_set_parameter(rtsp_conn_info *conn, rtsp_message *req, rtsp_m
 
   // debug_print_msg_headers(1,req);
 
-  char *ct = msg_get_header(req, "Content-Type");
+  char *ct = msg_get_indexed_header(req, rtsp_header_content_type);
 
   if (ct) {
 // debug(2, "SET_PARAMETER Content-Type:\"%s\".", ct);
@@ -1341,7 +1361,7 @@ static void handle_set_parameter(rtsp_conn_info *conn, rtsp_message *req, rtsp_m
     // picture item
     // get the rtptime
     char *p = NULL;
-    char *hdr = msg_get_header(req, "RTP-Info");
+    char *hdr = msg_get_indexed_header(req, rtsp_header_rtp_info);
 
     if (hdr) {
       p = strstr(hdr, "rtptime=");
@@ -1410,6 +1430,15 @@ static void handle_set_parameter(rtsp_conn_info *conn, rtsp_message *req, rtsp_m
   resp->respcode = 200;
 }
 
+// stop the player of a conversation and release the play lock if it holds it
+static void rtsp_release_player(rtsp_conn_info *conn) {
+  player_stop(conn);
+  if (playing_conn == conn) {
+    debug(3, "Unlocking play lock on RTSP conversation %d.", conn->connection_number);
+    release_play_lock();
+  }
+}
+
 static void handle_announce(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
   debug(3, "Connection %d: ANNOUNCE", conn->connection_number);
   int have_the_player = 0;
@@ -1435,19 +1464,21 @@ static void handle_announce(rtsp_conn_info *conn, rtsp_message *req, rtsp_messag
         debug(1, "ANNOUNCE asking to stop itself.");
       } else {
         playing_conn->stop = 1;
-        memory_barrier();
-        pthread_kill(playing_conn->thread, SIGUSR1);
         should_wait = 1;
       }
     }
 
     if (should_wait) {
-      usleep(1000000); // here, it is possible for other connections to come in and nab the player.
+      // the playing conversation's worker stops its player and releases the play lock
+      // when the event loop has it closed
+      rtsp_request_conversation_stop(playing_conn);
       debug(1, "Try to get the player now");
-    }
-    if (pthread_mutex_trylock(&play_lock) == 0)
+      if (wait_for_play_lock(RTSP_PLAY_LOCK_WAIT_SECONDS) == 0)
+        have_the_player = 1;
+    } else if (pthread_mutex_trylock(&play_lock) == 0) {
       have_the_player = 1;
-    else
+    }
+    if (have_the_player == 0)
       debug(1, "ANNOUNCE failed to get the player");
   }
 
@@ -1524,11 +1555,21 @@ static void handle_announce(rtsp_conn_info *conn, rtsp_message *req, rtsp_messag
       free(aeskey);
     }
     int i;
-    for (i = 0; i < sizeof(conn->stream.fmtp) / sizeof(conn->stream.fmtp[0]); i++)
-      conn->stream.fmtp[i] = atoi(strsep(&pfmtp, " \t"));
-    // here we should check the sanity ot the fmtp values
+    for (i = 0; i < sizeof(conn->stream.fmtp) / sizeof(conn->stream.fmtp[0]); i++) {
+      char *field = strsep(&pfmtp, " \t");
+      if (field == NULL) {
+        warn("ANNOUNCE on RTSP conversation %d has only %d FMTP parameters.",
+             conn->connection_number, i);
+        goto out;
+      }
+      conn->stream.fmtp[i] = atoi(field);
+    }
     // for (i = 0; i < sizeof(conn->stream.fmtp) / sizeof(conn->stream.fmtp[0]); i++)
     //  debug(1,"  fmtp[%2d] is: %10d",i,conn->stream.fmtp[i]);
+    if (player_check_stream_format(conn->stream.fmtp) != 0) {
+      resp->respcode = 415; // Unsupported Media Type
+      goto out;
+    }
 
     char *hdr = msg_get_header(req, "X-Apple-Client-Name");
     if (hdr) {
@@ -1556,26 +1597,28 @@ out:
   if (resp->respcode != 200 && resp->respcode != 453) {
     debug(1, "Error in handling ANNOUNCE on conversation thread %d. Unlocking the play lock.",
           conn->connection_number);
-    playing_conn = NULL;
-    pthread_mutex_unlock(&play_lock);
+    release_play_lock();
   }
 }
 
+// may_block marks the methods whose handling can wait -- for the play lock, the player, a
+// volume command or room in the metadata queue -- and which are passed to the workers
 static struct method_handler {
   char *method;
   void (*handler)(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp);
-} method_handlers[] = {{"OPTIONS", handle_options},
-                       {"ANNOUNCE", handle_announce},
-                       {"FLUSH", handle_flush},
-                       {"TEARDOWN", handle_teardown},
-                       {"SETUP", handle_setup},
-                       {"GET_PARAMETER", handle_get_parameter},
-                       {"SET_PARAMETER", handle_set_parameter},
-                       {"RECORD", handle_record},
-                       {NULL, NULL}};
+  int may_block;
+} method_handlers[] = {{"OPTIONS", handle_options, 0},
+                       {"ANNOUNCE", handle_announce, 1},
+                       {"FLUSH", handle_flush, 1},
+                       {"TEARDOWN", handle_teardown, 1},
+                       {"SETUP", handle_setup, 1},
+                       {"GET_PARAMETER", handle_get_parameter, 0},
+                       {"SET_PARAMETER", handle_set_parameter, 1},
+                       {"RECORD", handle_record, 1},
+                       {NULL, NULL, 0}};
 
 static void apple_challenge(int fd, rtsp_message *req, rtsp_message *resp) {
-  char *hdr = msg_get_header(req, "Apple-Challenge");
+  char *hdr = msg_get_indexed_header(req, rtsp_header_apple_challenge);
   if (!hdr)
     return;
 
@@ -1793,93 +1836,246 @@ authenticate:
   return 1;
 }
 
-static void *rtsp_conversation_thread_func(void *pconn) {
-  rtsp_conn_info *conn = pconn;
+static void rtsp_handle_request(rtsp_session *session, rtsp_message *req) {
+  rtsp_conn_info *conn = session->conn;
+  rtsp_message *resp;
+  char *hdr;
+  uint64_t time_received = get_absolute_time_in_fp();
+
+  debug(3, "RTSP conversation %d received an RTSP Packet of type \"%s\":", conn->connection_number,
+        req->method),
+      debug_print_msg_headers(3, req);
+  resp = msg_init();
+  resp->respcode = 400;
+
+  apple_challenge(conn->fd, req, resp);
+  hdr = msg_get_indexed_header(req, rtsp_header_cseq);
+  if (hdr)
+    msg_add_header(resp, "CSeq", hdr);
+  //      msg_add_header(resp, "Audio-Jack-Status", "connected; type=analog");
+  msg_add_header(resp, "Server", "AirTunes/105.1");
+
+  if ((conn->authorized == 1) || (rtsp_auth(&session->auth_nonce, req, resp)) == 0) {
+    conn->authorized = 1; // it must have been authorized or didn't need a password
+    struct method_handler *mh;
+    int method_selected = 0;
+    for (mh = method_handlers; mh->method; mh++) {
+      if (!strcmp(mh->method, req->method)) {
+        method_selected = 1;
+        mh->handler(conn, req, resp);
+        break;
+      }
+    }
+    if (method_selected == 0)
+      debug(1, "RTSP conversation %d: Unrecognised and unhandled rtsp request \"%s\".",
+            conn->connection_number, req->method);
+  }
+  debug(3, "RTSP conversation %d: RTSP Response:", conn->connection_number);
+  debug_print_msg_headers(3, resp);
+  if (conn->stop == 0)
+    msg_write_response(session, resp);
+
+  uint64_t handling_time = get_absolute_time_in_fp() - time_received;
+  debug(3, "RTSP conversation %d: %s handled in %.3f ms.", conn->connection_number, req->method,
+        fp_to_ms(handling_time));
+  if (strcmp(req->method, "ANNOUNCE") == 0) {
+    session->announce_time = time_received;
+    session->announce_handling_time = handling_time;
+    session->setup_handling_time = 0;
+  } else if (strcmp(req->method, "SETUP") == 0) {
+    session->setup_handling_time += handling_time;
+  } else if ((strcmp(req->method, "RECORD") == 0) && (session->announce_time)) {
+    debug(2,
+          "RTSP conversation %d: play session set up in %.3f ms from ANNOUNCE to the response to "
+          "RECORD. Handling ANNOUNCE took %.3f ms, SETUP %.3f ms and RECORD %.3f ms.",
+          conn->connection_number, fp_to_ms(get_absolute_time_in_fp() - session->announce_time),
+          fp_to_ms(session->announce_handling_time), fp_to_ms(session->setup_handling_time),
+          fp_to_ms(handling_time));
+    session->announce_time = 0;
+  }
+  msg_free(req);
+  msg_free(resp);
+}
+
+// send whatever output the conversation's connection couldn't take before
+static void rtsp_session_flush(rtsp_session *session) {
+  pthread_mutex_lock(&session->lock);
+  int failed = rtsp_session_write_pending(session);
+  pthread_mutex_unlock(&session->lock);
+  if (failed)
+    session->conn->stop = 1;
+}
 
-  rtp_initialise(conn);
+// is a request to be passed to a worker, or can it be handled on the event loop?
+static int rtsp_request_may_block(rtsp_message *req) {
+  // answering an Apple-Challenge means signing it with the private key
+  if (msg_get_indexed_header(req, rtsp_header_apple_challenge))
+    return 1;
+  struct method_handler *mh;
+  for (mh = method_handlers; mh->method; mh++)
+    if (!strcmp(mh->method, req->method))
+      return mh->may_block;
+  return 0;
+}
 
-  rtsp_message *req, *resp;
-  char *hdr, *auth_nonce = NULL;
+// add a session to the workers' queue, starting a worker if there's room for another.
+// rtsp_work_lock must be held.
+static void rtsp_schedule_session(rtsp_session *session) {
+  session->with_workers = 1;
+  session->used_workers = 1;
+  session->next_for_workers = NULL;
+  if (last_session_for_workers)
+    last_session_for_workers->next_for_workers = session;
+  else
+    sessions_for_workers = session;
+  last_session_for_workers = session;
+  if (workers_running < RTSP_MAX_WORKERS) {
+    pthread_t worker;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&worker, &attr, rtsp_worker, NULL) == 0)
+      workers_running++;
+    else if (workers_running == 0)
+      die("could not create an RTSP worker thread.");
+    else
+      debug(1, "could not create another RTSP worker thread; %d are running.", workers_running);
+    pthread_attr_destroy(&attr);
+  }
+}
 
-  enum rtsp_read_request_response reply;
+// pass a complete request to the workers, after any of the conversation's requests already there
+static void rtsp_session_queue_request(rtsp_session *session, rtsp_message *req) {
+  rtsp_request_item *item = malloc(sizeof(rtsp_request_item));
+  if (item == NULL)
+    die("could not queue a request of RTSP conversation %d.", session->conn->connection_number);
+  item->msg = req;
+  item->next = NULL;
+  if (session->last_request)
+    session->last_request->next = item;
+  else
+    session->requests = item;
+  session->last_request = item;
+  if (session->with_workers == 0)
+    rtsp_schedule_session(session);
+}
 
+// read whatever has arrived on a conversation's connection and handle the complete requests,
+// or pass them to the workers
+static void rtsp_session_service(rtsp_session *session) {
+  rtsp_conn_info *conn = session->conn;
+  rtsp_message *req;
+  enum rtsp_read_request_response reply = rtsp_session_fill(session);
+  if (reply == rtsp_read_request_response_bad_packet) {
+    debug(1, "rtsp_read_request error %d, packet ignored.", (int)reply);
+    rtsp_parser_reset(&session->parser);
+  } else if (reply != rtsp_read_request_response_ok) {
+    debug(3, "Request termination of RTSP conversation %d.", conn->connection_number);
+    conn->stop = 1;
+  }
+  // there may be more than one request waiting
   while (conn->stop == 0) {
-    reply = rtsp_read_request(conn, &req);
-    if (reply == rtsp_read_request_response_ok) {
-      debug(3, "RTSP thread %d received an RTSP Packet of type \"%s\":", conn->connection_number,
-            req->method),
-          debug_print_msg_headers(3, req);
-      resp = msg_init();
-      resp->respcode = 400;
-
-      apple_challenge(conn->fd, req, resp);
-      hdr = msg_get_header(req, "CSeq");
-      if (hdr)
-        msg_add_header(resp, "CSeq", hdr);
-      //      msg_add_header(resp, "Audio-Jack-Status", "connected; type=analog");
-      msg_add_header(resp, "Server", "AirTunes/105.1");
-
-      if ((conn->authorized == 1) || (rtsp_auth(&auth_nonce, req, resp)) == 0) {
-        conn->authorized = 1; // it must have been authorized or didn't need a password
-        struct method_handler *mh;
-        int method_selected = 0;
-        for (mh = method_handlers; mh->method; mh++) {
-          if (!strcmp(mh->method, req->method)) {
-            method_selected = 1;
-            mh->handler(conn, req, resp);
-            break;
-          }
-        }
-        if (method_selected == 0)
-          debug(1, "RTSP thread %d: Unrecognised and unhandled rtsp request \"%s\".",
-                conn->connection_number, req->method);
-      }
-      debug(3, "RTSP thread %d: RTSP Response:", conn->connection_number);
-      debug_print_msg_headers(3, resp);
-      fd_set writefds;
-      FD_ZERO(&writefds);
-      FD_SET(conn->fd, &writefds);
-      do {
-        memory_barrier();
-      } while (conn->stop == 0 &&
-               pselect(conn->fd + 1, NULL, &writefds, NULL, NULL, &pselect_sigset) <= 0);
-      if (conn->stop == 0) {
-        msg_write_response(conn->fd, resp);
-      }
-      msg_free(req);
-      msg_free(resp);
-    } else {
-      if ((reply == rtsp_read_request_response_immediate_shutdown_requested) ||
-          (reply == rtsp_read_request_response_channel_closed)) {
-        debug(3, "Synchronously terminate playing thread of RTSP conversation thread %d.",
-              conn->connection_number);
-        player_stop(conn);
-        debug(3, "Successful termination of playing thread of RTSP conversation thread %d.",
-              conn->connection_number);
-        debug(3, "Request termination of RTSP conversation thread %d.", conn->connection_number);
-        conn->stop = 1;
-      } else {
-        debug(1, "rtsp_read_request error %d, packet ignored.", (int)reply);
-      }
+    reply = rtsp_session_next_request(session, &req);
+    if (reply != rtsp_read_request_response_ok) {
+      debug(1, "rtsp_read_request error %d, packet ignored.", (int)reply);
+      break;
     }
+    if (req == NULL)
+      break;
+    pthread_mutex_lock(&rtsp_work_lock);
+    int pass_on = session->with_workers || rtsp_request_may_block(req);
+    if (pass_on)
+      rtsp_session_queue_request(session, req);
+    pthread_mutex_unlock(&rtsp_work_lock);
+    if (pass_on == 0)
+      rtsp_handle_request(session, req);
   }
+}
 
+static void rtsp_session_close(rtsp_session *session) {
+  rtsp_conn_info *conn = session->conn;
+  debug(3, "Synchronously terminate playing thread of RTSP conversation %d.",
+        conn->connection_number);
+  rtsp_release_player(conn);
+  debug(3, "Successful termination of playing thread of RTSP conversation %d.",
+        conn->connection_number);
+  player_volume_cancel(conn);
   if (conn->fd > 0)
     close(conn->fd);
-  if (auth_nonce)
-    free(auth_nonce);
   rtp_terminate(conn);
-  if (playing_conn == conn) {
-    debug(3, "Unlocking play lock on RTSP conversation thread %d.", conn->connection_number);
-    playing_conn = NULL;
-    pthread_mutex_unlock(&play_lock);
+  rtsp_parser_free(&session->parser);
+  free(session->outbuf);
+  if (session->auth_nonce)
+    free(session->auth_nonce);
+  pthread_mutex_destroy(&session->lock);
+  debug(1, "RTSP conversation %d terminated.", conn->connection_number);
+  free(conn);
+  free(session);
+}
+
+// Take sessions from the workers' queue and handle their requests in the order they arrived,
+// closing a session if the event loop has let go of it. Finish when the queue is empty.
+static void *rtsp_worker(__attribute__((unused)) void *arg) {
+  pthread_mutex_lock(&rtsp_work_lock);
+  rtsp_session *session;
+  while ((session = sessions_for_workers) != NULL) {
+    sessions_for_workers = session->next_for_workers;
+    if (sessions_for_workers == NULL)
+      last_session_for_workers = NULL;
+    rtsp_request_item *item;
+    while ((item = session->requests) != NULL) {
+      session->requests = item->next;
+      if (session->requests == NULL)
+        session->last_request = NULL;
+      pthread_mutex_unlock(&rtsp_work_lock);
+      if (session->conn->stop == 0)
+        rtsp_handle_request(session, item->msg);
+      else
+        msg_free(item->msg);
+      free(item);
+      pthread_mutex_lock(&rtsp_work_lock);
+    }
+    if (session->closing) {
+      pthread_mutex_unlock(&rtsp_work_lock);
+      rtsp_session_close(session);
+      pthread_mutex_lock(&rtsp_work_lock);
+    } else {
+      session->with_workers = 0;
+    }
   }
-  debug(1, "RTSP conversation thread %d terminated.", conn->connection_number);
-  //  please_shutdown = 0;
-  conn->running = 0;
+  workers_running--;
+  pthread_mutex_unlock(&rtsp_work_lock);
   return NULL;
 }
 
+// forget the conversations that have been asked to stop.
+// One that has never used a worker is closed here; the others are left to a worker to close,
+// since that may mean waiting for the player to stop.
+static void cleanup_sessions(void) {
+  int i;
+  for (i = 0; i < nsessions;) {
+    if (sessions[i]->conn->stop != 0) {
+      rtsp_session *session = sessions[i];
+      nsessions--;
+      if (nsessions)
+        sessions[i] = sessions[nsessions];
+      rtsp_unwatch_fd(session->conn->fd);
+      pthread_mutex_lock(&rtsp_work_lock);
+      int close_here = (session->with_workers == 0) && (session->used_workers == 0);
+      if (close_here == 0) {
+        session->closing = 1;
+        if (session->with_workers == 0)
+          rtsp_schedule_session(session);
+      }
+      pthread_mutex_unlock(&rtsp_work_lock);
+      if (close_here)
+        rtsp_session_close(session);
+    } else {
+      i++;
+    }
+  }
+}
+
 // this function is not thread safe.
 static const char *format_address(struct sockaddr *fsa) {
   static char string[INETx_ADDRSTRLEN];
@@ -1897,11 +2093,106 @@ static const char *format_address(struct sockaddr *fsa) {
   return inet_ntop(fsa->sa_family, addr, string, sizeof(string));
 }
 
+// accept a connection waiting on a listening socket and start a conversation on it.
+// Returns 0 if a connection was accepted, -1 if there was none.
+static int rtsp_accept_connection(int acceptfd, uint64_t ready_time) {
+  SOCKADDR remote;
+  socklen_t slen = sizeof(remote);
+  int fd = accept(acceptfd, (struct sockaddr *)&remote, &slen);
+  if (fd < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+      debug(1, "New RTSP connection on port %d not accepted:", config.port);
+      perror("failed to accept connection");
+    }
+    return -1;
+  } else {
+    rtsp_conn_info *conn = malloc(sizeof(rtsp_conn_info));
+    if (conn == 0)
+      die("Couldn't allocate memory for an rtsp_conn_info record.");
+    memset(conn, 0, sizeof(rtsp_conn_info));
+    conn->connection_number = RTSP_connection_index++;
+    conn->fd = fd;
+    memcpy(&conn->remote, &remote, sizeof(remote));
+
+    SOCKADDR *local_info = (SOCKADDR *)&conn->local;
+    socklen_t size_of_reply = sizeof(*local_info);
+    memset(local_info, 0, sizeof(SOCKADDR));
+    if (getsockname(conn->fd, (struct sockaddr *)local_info, &size_of_reply) == 0) {
+
+      // IPv4:
+      if (local_info->SAFAMILY == AF_INET) {
+        char ip4[INET_ADDRSTRLEN];        // space to hold the IPv4 string
+        char remote_ip4[INET_ADDRSTRLEN]; // space to hold the IPv4 string
+        struct sockaddr_in *sa = (struct sockaddr_in *)local_info;
+        inet_ntop(AF_INET, &(sa->sin_addr), ip4, INET_ADDRSTRLEN);
+        unsigned short int tport = ntohs(sa->sin_port);
+        sa = (struct sockaddr_in *)&conn->remote;
+        inet_ntop(AF_INET, &(sa->sin_addr), remote_ip4, INET_ADDRSTRLEN);
+        unsigned short int rport = ntohs(sa->sin_port);
+#ifdef CONFIG_METADATA
+        send_ssnc_metadata('clip', strdup(remote_ip4), strlen(remote_ip4), 0);
+        send_ssnc_metadata('svip', strdup(ip4), strlen(ip4), 0);
+#endif
+        debug(1, "New RTSP connection from %s:%u to self at %s:%u on conversation %d.",
+              remote_ip4, rport, ip4, tport, conn->connection_number);
+      }
+#ifdef AF_INET6
+      if (local_info->SAFAMILY == AF_INET6) {
+        // IPv6:
+
+        char ip6[INET6_ADDRSTRLEN];        // space to hold the IPv6 string
+        char remote_ip6[INET6_ADDRSTRLEN]; // space to hold the IPv6 string
+        struct sockaddr_in6 *sa6 =
+            (struct sockaddr_in6 *)local_info; // pretend this is loaded with something
+        inet_ntop(AF_INET6, &(sa6->sin6_addr), ip6, INET6_ADDRSTRLEN);
+        u_int16_t tport = ntohs(sa6->sin6_port);
+
+        sa6 = (struct sockaddr_in6 *)&conn->remote; // pretend this is loaded with something
+        inet_ntop(AF_INET6, &(sa6->sin6_addr), remote_ip6, INET6_ADDRSTRLEN);
+        u_int16_t rport = ntohs(sa6->sin6_port);
+#ifdef CONFIG_METADATA
+        send_ssnc_metadata('clip', strdup(remote_ip6), strlen(remote_ip6), 0);
+        send_ssnc_metadata('svip', strdup(ip6), strlen(ip6), 0);
+#endif
+        debug(1, "New RTSP connection from [%s]:%u to self at [%s]:%u on conversation %d.",
+              remote_ip6, rport, ip6, tport, conn->connection_number);
+      }
+#endif
+
+    } else {
+      debug(1, "Error figuring out Shairport Sync's own IP number.");
+    }
+    fcntl(conn->fd, F_SETFL, O_NONBLOCK);
+    rtp_initialise(conn);
+
+    rtsp_session *session = malloc(sizeof(rtsp_session));
+    if (session == NULL)
+      die("Couldn't allocate memory for an rtsp_session record.");
+    memset(session, 0, sizeof(rtsp_session));
+    session->conn = conn;
+    rtsp_parser_init(&session->parser);
+    pthread_mutex_init(&session->lock, NULL);
+    track_session(session);
+    rtsp_watch_fd(conn->fd);
+    sessions_accepted++;
+
+    pthread_mutex_lock(&rtsp_work_lock);
+    int workers = workers_running;
+    pthread_mutex_unlock(&rtsp_work_lock);
+    uint64_t accept_latency = get_absolute_time_in_fp() - ready_time;
+    debug(2, "RTSP conversation %d accepted %.3f ms after its connection was signalled, using "
+             "%zu bytes while idle. Open conversations: %d, peak: %d, accepted in total: %" PRIu64
+             ", RTSP workers running: %d.",
+          conn->connection_number, (1000.0 * accept_latency) / ((uint64_t)1 << 32),
+          sizeof(rtsp_conn_info) + sizeof(rtsp_session) + session->parser.buflen + 1, nsessions,
+          peak_nsessions, sessions_accepted, workers);
+  }
+  return 0;
+}
+
 void rtsp_listen_loop(void) {
   struct addrinfo hints, *info, *p;
   char portstr[6];
-  int *sockfd = NULL;
-  int nsock = 0;
   int i, ret;
 
   playing_conn = NULL; // the data structure representing the connection that has the player.
@@ -1967,6 +2258,8 @@ void rtsp_listen_loop(void) {
       continue;
     }
 
+    // the event loop accepts until there are no more connections waiting
+    fcntl(fd, F_SETFL, O_NONBLOCK);
     listen(fd, 5);
     nsock++;
     sockfd = realloc(sockfd, nsock * sizeof(int));
@@ -1980,124 +2273,92 @@ void rtsp_listen_loop(void) {
         "Shairport Sync running on this device?",
         config.port);
 
-  int maxfd = -1;
-  fd_set fds;
-  FD_ZERO(&fds);
-  for (i = 0; i < nsock; i++) {
-    if (sockfd[i] > maxfd)
-      maxfd = sockfd[i];
+  if (pipe(wake_pipe) != 0)
+    die("could not create the RTSP event loop's wakeup pipe.");
+  for (i = 0; i < 2; i++) {
+    fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK);
   }
 
+#ifdef HAVE_SYS_EPOLL_H
+  epoll_fd = epoll_create(RTSP_MAX_EVENTS); // the size is only a hint
+  if (epoll_fd == -1)
+    die("could not create the RTSP event loop: \"%s\".", strerror(errno));
+  fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+#endif
+  for (i = 0; i < nsock; i++)
+    rtsp_watch_fd(sockfd[i]);
+  rtsp_watch_fd(wake_pipe[0]);
+
   mdns_register();
 
   // printf("Listening for connections.");
   // shairport_startup_complete();
 
-  int acceptfd;
-  struct timeval tv;
+  int ready[RTSP_MAX_EVENTS];
   while (1) {
-    tv.tv_sec = 300;
-    tv.tv_usec = 0;
-
-    for (i = 0; i < nsock; i++)
-      FD_SET(sockfd[i], &fds);
+    // wake up once a second to check for stalled transfers if any request content is outstanding
+    int timeout_ms = -1;
+    for (i = 0; i < nsessions; i++)
+      if ((sessions[i]->parser.msg_size > 0) && (sessions[i]->stall_warning_sent == 0))
+        timeout_ms = 1000;
 
-    ret = select(maxfd + 1, &fds, 0, 0, &tv);
+    ret = rtsp_wait_for_events(ready, RTSP_MAX_EVENTS, timeout_ms);
     if (ret < 0) {
       if (errno == EINTR)
         continue;
       break;
     }
-
-    cleanup_threads();
-
-    acceptfd = -1;
-    for (i = 0; i < nsock; i++) {
-      if (FD_ISSET(sockfd[i], &fds)) {
-        acceptfd = sockfd[i];
-        break;
+    uint64_t time_now = get_absolute_time_in_fp();
+
+    int n;
+    for (n = 0; n < ret; n++) {
+      int fd = ready[n];
+      if (fd == wake_pipe[0]) {
+        char drain[16];
+        while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+          ;
+        continue;
+      }
+      int is_listener = 0;
+      for (i = 0; i < nsock; i++)
+        if (sockfd[i] == fd)
+          is_listener = 1;
+      if (is_listener) {
+        while (rtsp_accept_connection(fd, time_now) == 0)
+          ;
+      } else {
+        rtsp_session *session = session_for_fd(fd);
+        if (session && (session->conn->stop == 0)) {
+          if (session->watching_output)
+            rtsp_session_flush(session);
+          rtsp_session_service(session);
+        }
       }
     }
-    if (acceptfd < 0) // timeout
-      continue;
 
-    rtsp_conn_info *conn = malloc(sizeof(rtsp_conn_info));
-    if (conn == 0)
-      die("Couldn't allocate memory for an rtsp_conn_info record.");
-    memset(conn, 0, sizeof(rtsp_conn_info));
-    conn->connection_number = RTSP_connection_index++;
-    socklen_t slen = sizeof(conn->remote);
+    if (shutdown_requested) {
+      debug(1, "Request to shut down all rtsp conversations");
+      shutdown_requested = 0;
+      for (i = 0; i < nsessions; i++)
+        sessions[i]->conn->stop = 1;
+    }
 
-    conn->fd = accept(acceptfd, (struct sockaddr *)&conn->remote, &slen);
-    if (conn->fd < 0) {
-      debug(1, "New RTSP connection on port %d not accepted:", config.port);
-      perror("failed to accept connection");
-      free(conn);
-    } else {
-      SOCKADDR *local_info = (SOCKADDR *)&conn->local;
-      socklen_t size_of_reply = sizeof(*local_info);
-      memset(local_info, 0, sizeof(SOCKADDR));
-      if (getsockname(conn->fd, (struct sockaddr *)local_info, &size_of_reply) == 0) {
-
-        // IPv4:
-        if (local_info->SAFAMILY == AF_INET) {
-          char ip4[INET_ADDRSTRLEN];        // space to hold the IPv4 string
-          char remote_ip4[INET_ADDRSTRLEN]; // space to hold the IPv4 string
-          struct sockaddr_in *sa = (struct sockaddr_in *)local_info;
-          inet_ntop(AF_INET, &(sa->sin_addr), ip4, INET_ADDRSTRLEN);
-          unsigned short int tport = ntohs(sa->sin_port);
-          sa = (struct sockaddr_in *)&conn->remote;
-          inet_ntop(AF_INET, &(sa->sin_addr), remote_ip4, INET_ADDRSTRLEN);
-          unsigned short int rport = ntohs(sa->sin_port);
-#ifdef CONFIG_METADATA
-          send_ssnc_metadata('clip', strdup(remote_ip4), strlen(remote_ip4), 1);
-          send_ssnc_metadata('svip', strdup(ip4), strlen(ip4), 1);
-#endif
-          debug(1, "New RTSP connection from %s:%u to self at %s:%u on conversation thread %d.",
-                remote_ip4, rport, ip4, tport, conn->connection_number);
-        }
-#ifdef AF_INET6
-        if (local_info->SAFAMILY == AF_INET6) {
-          // IPv6:
-
-          char ip6[INET6_ADDRSTRLEN];        // space to hold the IPv6 string
-          char remote_ip6[INET6_ADDRSTRLEN]; // space to hold the IPv6 string
-          struct sockaddr_in6 *sa6 =
-              (struct sockaddr_in6 *)local_info; // pretend this is loaded with something
-          inet_ntop(AF_INET6, &(sa6->sin6_addr), ip6, INET6_ADDRSTRLEN);
-          u_int16_t tport = ntohs(sa6->sin6_port);
-
-          sa6 = (struct sockaddr_in6 *)&conn->remote; // pretend this is loaded with something
-          inet_ntop(AF_INET6, &(sa6->sin6_addr), remote_ip6, INET6_ADDRSTRLEN);
-          u_int16_t rport = ntohs(sa6->sin6_port);
-#ifdef CONFIG_METADATA
-          send_ssnc_metadata('clip', strdup(remote_ip6), strlen(remote_ip6), 1);
-          send_ssnc_metadata('svip', strdup(ip6), strlen(ip6), 1);
-#endif
-          debug(1, "New RTSP connection from [%s]:%u to self at [%s]:%u on conversation thread %d.",
-                remote_ip6, rport, ip6, tport, conn->connection_number);
-        }
-#endif
+    for (i = 0; i < nsessions; i++)
+      rtsp_session_check_for_stall(sessions[i], time_now);
 
-      } else {
-        debug(1, "Error figuring out Shairport Sync's own IP number.");
-      }
-      //      usleep(500000);
-      //      pthread_t rtsp_conversation_thread;
-      //      conn->thread = rtsp_conversation_thread;
-      //      conn->stop = 0; // record's memory has been zeroed
-      //      conn->authorized = 0; // record's memory has been zeroed
-      fcntl(conn->fd, F_SETFL, O_NONBLOCK);
-
-      ret = pthread_create(&conn->thread, NULL, rtsp_conversation_thread_func,
-                           conn); // also acts as a memory barrier
-      if (ret)
-        die("Failed to create RTSP receiver thread %d!", conn->connection_number);
-      debug(3, "Successfully created RTSP receiver thread %d.", conn->connection_number);
-      conn->running = 1; // this must happen before the thread is tracked
-      track_thread(conn);
+    cleanup_sessions();
+
+    // wait for a connection to become writable only while it has output waiting
+    for (i = 0; i < nsessions; i++) {
+      rtsp_session *session = sessions[i];
+      pthread_mutex_lock(&session->lock);
+      int pending = session->outlen != 0;
+      pthread_mutex_unlock(&session->lock);
+      if (pending != session->watching_output)
+        rtsp_watch_output(session, pending);
     }
   }
-  perror("select");
-  die("fell out of the RTSP select loop");
+  perror("RTSP event loop");
+  die("fell out of the RTSP event loop");
 }
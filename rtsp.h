@@ -9,6 +9,9 @@ void rtsp_listen_loop(void);
 // void rtsp_shutdown_stream(void);
 void rtsp_request_shutdown_stream(void);
 
+// ask a conversation to stop; safe to call from any thread
+void rtsp_request_conversation_stop(rtsp_conn_info *conn);
+
 // initialise the metadata stuff
 
 void metadata_init(void);
@@ -0,0 +1,316 @@
+/*
+ * RTSP message parsing. This file is part of Shairport Sync.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "common.h"
+#include "rtsp_parse.h"
+
+static struct {
+  char *name;
+  size_t length;
+} indexed_headers[rtsp_header_count] = {
+    {"CSeq", 4},          {"Content-Length", 14},  {"Content-Type", 12},
+    {"RTP-Info", 8},      {"Apple-Challenge", 15}, {"Active-Remote", 13}};
+
+void msg_retain(rtsp_message *msg) {
+  if (msg) {
+    __atomic_add_fetch(&msg->referenceCount, 1, __ATOMIC_RELAXED);
+  } else {
+    debug(1, "null rtsp_message pointer passed to retain");
+  }
+}
+
+rtsp_message *msg_init(void) {
+  rtsp_message *msg = malloc(sizeof(rtsp_message));
+  if (msg) {
+    int i;
+    memset(msg, 0, sizeof(rtsp_message));
+    for (i = 0; i < rtsp_header_count; i++)
+      msg->header_index[i] = -1;
+    msg->referenceCount = 1; // from now on, it must only be changed atomically
+  } else {
+    die("can not allocate memory for an rtsp_message.");
+  }
+  return msg;
+}
+
+static int header_id(const char *name, size_t length) {
+  int i;
+  for (i = 0; i < rtsp_header_count; i++)
+    if ((indexed_headers[i].length == length) && (strcasecmp(indexed_headers[i].name, name) == 0))
+      return i;
+  return -1;
+}
+
+void msg_add_header_slice(rtsp_message *msg, char *name, char *value, int owned) {
+  if (msg->nheaders == msg->headers_allocated) {
+    int n = msg->headers_allocated ? msg->headers_allocated * 2 : 16;
+    rtsp_header *headers = realloc(msg->headers, n * sizeof(rtsp_header));
+    if (headers == NULL)
+      die("could not allocate memory for the headers of an rtsp_message.");
+    msg->headers = headers;
+    msg->headers_allocated = n;
+  }
+  int id = header_id(name, strlen(name));
+  if ((id >= 0) && (msg->header_index[id] < 0))
+    msg->header_index[id] = msg->nheaders;
+  msg->headers[msg->nheaders].name = name;
+  msg->headers[msg->nheaders].value = value;
+  msg->headers[msg->nheaders].owned = owned;
+  msg->nheaders++;
+}
+
+int msg_add_header(rtsp_message *msg, char *name, char *value) {
+  msg_add_header_slice(msg, strdup(name), strdup(value), 1);
+  return 0;
+}
+
+char *msg_get_indexed_header(rtsp_message *msg, enum rtsp_header_id id) {
+  int i = msg->header_index[id];
+  if (i >= 0)
+    return msg->headers[i].value;
+  return NULL;
+}
+
+char *msg_get_header(rtsp_message *msg, char *name) {
+  int i;
+  for (i = 0; i < msg->nheaders; i++)
+    if (!strcasecmp(msg->headers[i].name, name))
+      return msg->headers[i].value;
+  return NULL;
+}
+
+void msg_free(rtsp_message *msg) {
+
+  if (msg) {
+    if (__atomic_sub_fetch(&msg->referenceCount, 1, __ATOMIC_ACQ_REL) == 0) {
+      int i;
+      for (i = 0; i < msg->nheaders; i++) {
+        if (msg->headers[i].owned) {
+          free(msg->headers[i].name);
+          free(msg->headers[i].value);
+        }
+      }
+      if (msg->headers)
+        free(msg->headers);
+      if (msg->storage)
+        free(msg->storage);
+      free(msg);
+    } // else {
+      // debug(1,"rtsp_message reference count non-zero:
+      // %d!",msg->referenceCount);
+      //}
+  } else {
+    debug(1, "null rtsp_message pointer passed to msg_free()");
+  }
+}
+
+rtsp_message *msg_parse_headers(char *block, ssize_t length) {
+  rtsp_message *msg = msg_init();
+  char *end = block + length;
+  char *line = block;
+  int first_line = 1;
+
+  while (line < end) {
+    char *eol = memchr(line, '\n', end - line);
+    if (eol == NULL)
+      eol = end - 1; // can't happen; the block always ends with a newline
+    *eol = 0;
+    if ((eol > line) && (eol[-1] == '\r'))
+      eol[-1] = 0;
+    char *next = eol + 1;
+
+    if (first_line) {
+      char *sp, *p;
+      first_line = 0;
+
+      p = strtok_r(line, " ", &sp);
+      if (!p)
+        goto fail;
+      strncpy(msg->method, p, sizeof(msg->method) - 1);
+
+      p = strtok_r(NULL, " ", &sp);
+      if (!p)
+        goto fail;
+
+      p = strtok_r(NULL, " ", &sp);
+      if (!p)
+        goto fail;
+      if (strcmp(p, "RTSP/1.0"))
+        goto fail;
+    } else if (*line) {
+      char *p = strchr(line, ':');
+      if (!p) {
+        warn("bad header: >>%s<<", line);
+        goto fail;
+      }
+      *p++ = 0;
+      while (*p == ' ' || *p == '\t')
+        p++;
+      msg_add_header_slice(msg, line, p, 0);
+      debug(3, "    %s: %s.", line, p);
+    }
+    line = next;
+  }
+  if (first_line == 0)
+    return msg;
+
+fail:
+  msg_free(msg);
+  return NULL;
+}
+
+void rtsp_parser_init(rtsp_parser *parser) {
+  memset(parser, 0, sizeof(rtsp_parser));
+  parser->msg_size = -1;
+  parser->buflen = RTSP_RECEIVE_BUFFER_SIZE;
+  parser->buf = malloc(parser->buflen + 1);
+  if (parser->buf == NULL)
+    die("could not allocate an RTSP receive buffer.");
+}
+
+void rtsp_parser_free(rtsp_parser *parser) {
+  if (parser->msg)
+    msg_free(parser->msg);
+  parser->msg = NULL;
+  free(parser->buf);
+  parser->buf = NULL;
+}
+
+void rtsp_parser_reset(rtsp_parser *parser) {
+  if (parser->msg)
+    msg_free(parser->msg);
+  parser->msg = NULL;
+  parser->msg_size = -1;
+  parser->header_length = 0;
+  parser->scan = 0;
+  parser->inbuf = 0;
+}
+
+ssize_t rtsp_parser_make_room(rtsp_parser *parser) {
+  if (parser->inbuf == parser->buflen) {
+    // only possible while looking for the end of the header block
+    if (parser->buflen >= RTSP_MAX_HEADER_BUFFER_SIZE)
+      return 0;
+    char *buf = realloc(parser->buf, parser->buflen * 2 + 1);
+    if (!buf)
+      die("could not enlarge an RTSP receive buffer.");
+    parser->buf = buf;
+    parser->buflen *= 2;
+  }
+  return parser->buflen - parser->inbuf;
+}
+
+// look for the blank line that ends the header block, resuming from where the last look ended.
+// Returns the length of the header block, including the blank line, or 0 if it isn't complete.
+static ssize_t rtsp_parser_find_end_of_headers(rtsp_parser *parser) {
+  char *buf = parser->buf;
+  while (parser->scan < parser->inbuf) {
+    char *nl = memchr(buf + parser->scan, '\n', parser->inbuf - parser->scan);
+    if (nl == NULL) {
+      parser->scan = parser->inbuf;
+      return 0;
+    }
+    ssize_t p = nl - buf;
+    if ((p + 1 < parser->inbuf) && (buf[p + 1] == '\n'))
+      return p + 2;
+    if ((p + 2 < parser->inbuf) && (buf[p + 1] == '\r') && (buf[p + 2] == '\n'))
+      return p + 3;
+    if ((p + 1 == parser->inbuf) || ((p + 2 == parser->inbuf) && (buf[p + 1] == '\r'))) {
+      // can't tell yet whether the next line is empty
+      parser->scan = p;
+      return 0;
+    }
+    parser->scan = p + 1;
+  }
+  return 0;
+}
+
+enum rtsp_read_request_response rtsp_parser_next_request(rtsp_parser *parser,
+                                                         rtsp_message **the_packet) {
+  *the_packet = NULL;
+  if (parser->msg == NULL) {
+    // skip any blank lines between requests, moving what follows them down just once
+    ssize_t blank = 0;
+    while ((parser->scan == 0) && (blank < parser->inbuf) &&
+           ((parser->buf[blank] == '\r') || (parser->buf[blank] == '\n')))
+      blank++;
+    if (blank) {
+      parser->inbuf -= blank;
+      memmove(parser->buf, parser->buf + blank, parser->inbuf);
+    }
+
+    ssize_t header_length = rtsp_parser_find_end_of_headers(parser);
+    if (header_length == 0)
+      return rtsp_read_request_response_ok;
+
+    rtsp_message *msg = msg_parse_headers(parser->buf, header_length);
+    if (msg == NULL) {
+      warn("no RTSP header received");
+      rtsp_parser_reset(parser);
+      return rtsp_read_request_response_bad_packet;
+    }
+    char *cl = msg_get_indexed_header(msg, rtsp_header_content_length);
+    int msg_size = cl ? atoi(cl) : 0;
+    if (msg_size < 0)
+      msg_size = 0;
+    debug(3, "%zd byte RTSP header block with %d headers parsed.", header_length, msg->nheaders);
+
+    if (header_length + msg_size > parser->buflen) {
+      // make room for the content in a new buffer, moving the headers' slices with it
+      char *buf = malloc(header_length + msg_size + 1);
+      if (buf == NULL) {
+        warn("too much content");
+        msg_free(msg);
+        rtsp_parser_reset(parser);
+        return rtsp_read_request_response_error;
+      }
+      memcpy(buf, parser->buf, parser->inbuf);
+      int i;
+      for (i = 0; i < msg->nheaders; i++) {
+        msg->headers[i].name = buf + (msg->headers[i].name - parser->buf);
+        msg->headers[i].value = buf + (msg->headers[i].value - parser->buf);
+      }
+      free(parser->buf);
+      parser->buf = buf;
+      parser->buflen = header_length + msg_size;
+    }
+
+    parser->msg = msg;
+    parser->msg_size = msg_size;
+    parser->header_length = header_length;
+  }
+
+  ssize_t request_length = parser->header_length + parser->msg_size;
+  if (parser->inbuf < request_length)
+    return rtsp_read_request_response_ok;
+
+  // the request is complete -- the message takes over the buffer its headers and content are in.
+  // Anything received beyond it belongs to the next request.
+  ssize_t leftover = parser->inbuf - request_length;
+  ssize_t buflen = leftover > RTSP_RECEIVE_BUFFER_SIZE ? leftover : RTSP_RECEIVE_BUFFER_SIZE;
+  char *buf = malloc(buflen + 1);
+  if (!buf)
+    die("could not allocate an RTSP receive buffer.");
+  if (leftover)
+    memcpy(buf, parser->buf + request_length, leftover);
+
+  rtsp_message *msg = parser->msg;
+  msg->storage = parser->buf;
+  msg->content = parser->buf + parser->header_length;
+  msg->contentlength = parser->msg_size;
+
+  parser->buf = buf;
+  parser->buflen = buflen;
+  parser->inbuf = leftover;
+  parser->scan = 0;
+  parser->msg = NULL;
+  parser->msg_size = -1;
+  parser->header_length = 0;
+  *the_packet = msg;
+  return rtsp_read_request_response_ok;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// RTSP messages, and the incremental parser that assembles requests from what a connection has
+// received so far. Bytes are read into the parser's buffer by its owner. The end of a request's
+// header block is looked for from where the last look ended, then the block is parsed in place,
+// leaving the message's headers pointing into the buffer. When the request's content has arrived
+// too, the message takes over the buffer and the parser starts a new one with whatever followed.
+
+// initial size of a parser's receive buffer and the most that will be
+// buffered while looking for the end of a header block
+#define RTSP_RECEIVE_BUFFER_SIZE 512
+#define RTSP_MAX_HEADER_BUFFER_SIZE 65536
+
+enum rtsp_read_request_response {
+  rtsp_read_request_response_ok,
+  rtsp_read_request_response_immediate_shutdown_requested,
+  rtsp_read_request_response_bad_packet,
+  rtsp_read_request_response_channel_closed,
+  rtsp_read_request_response_error
+};
+
+// headers that are looked up often are indexed when a message is parsed or built
+enum rtsp_header_id {
+  rtsp_header_cseq = 0,
+  rtsp_header_content_length,
+  rtsp_header_content_type,
+  rtsp_header_rtp_info,
+  rtsp_header_apple_challenge,
+  rtsp_header_active_remote,
+  rtsp_header_count
+};
+
+typedef struct {
+  char *name;
+  char *value;
+  int owned; // set if name and value were copied and must be freed
+} rtsp_header;
+
+typedef struct {
+  uint32_t referenceCount; // only changed atomically
+  int nheaders;
+  int headers_allocated;
+  rtsp_header *headers;
+  int header_index[rtsp_header_count]; // where the indexed headers are in headers[], or -1
+
+  // for requests, the receive buffer the headers and content point into
+  char *storage;
+
+  int contentlength;
+  char *content;
+
+  // for requests
+  char method[16];
+
+  // for responses
+  int respcode;
+} rtsp_message;
+
+rtsp_message *msg_init(void);
+void msg_retain(rtsp_message *msg);
+void msg_free(rtsp_message *msg);
+
+// add a header to a message without copying it -- the name and value must outlive the message
+void msg_add_header_slice(rtsp_message *msg, char *name, char *value, int owned);
+int msg_add_header(rtsp_message *msg, char *name, char *value);
+char *msg_get_indexed_header(rtsp_message *msg, enum rtsp_header_id id);
+char *msg_get_header(rtsp_message *msg, char *name);
+
+// parse a complete header block in place, leaving the message's headers pointing into it.
+// Lines may end in \r\n or \n. Returns NULL if the block is not a valid request.
+rtsp_message *msg_parse_headers(char *block, ssize_t length);
+
+typedef struct {
+  char *buf;             // the receive buffer
+  ssize_t buflen;        // its capacity
+  ssize_t inbuf;         // bytes waiting in it
+  ssize_t scan;          // where to resume looking for the end of the header block
+  rtsp_message *msg;     // the request whose content is awaited, if any
+  ssize_t header_length; // the length of its header block
+  int msg_size;          // its content length, or -1 while headers are being read
+} rtsp_parser;
+
+void rtsp_parser_init(rtsp_parser *parser);
+void rtsp_parser_free(rtsp_parser *parser);
+
+// discard the partly-received request and anything else that has been buffered
+void rtsp_parser_reset(rtsp_parser *parser);
+
+// make sure there's room in the buffer for more to be received at buf + inbuf.
+// Returns the room, or 0 if the buffer is full of an overlong header block.
+ssize_t rtsp_parser_make_room(rtsp_parser *parser);
+
+// assemble a request from what has been received so far.
+// *the_packet is left NULL if more data is needed to complete it.
+enum rtsp_read_request_response rtsp_parser_next_request(rtsp_parser *parser,
+                                                         rtsp_message **the_packet);
@@ -71,7 +71,9 @@
 #include "mpris-service.h"
 #endif
 
+#include "capture.h"
 #include "common.h"
+#include "dsp.h"
 #include "mdns.h"
 #include "rtp.h"
 #include "rtsp.h"
@@ -322,6 +324,8 @@ void usage(char *progname) {
          "password.\n");
   printf("    --logOutputLevel        log the output level setting -- useful for setting maximum "
          "volume.\n");
+  printf("    --replay=FILE           replay a session recorded in FILE, log the results and "
+         "exit.\n");
 #ifdef CONFIG_METADATA
   printf("    --metadata-pipename=PIPE send metadata to PIPE, e.g. "
          "--metadata-pipename=/tmp/shairport-sync-metadata.\n");
@@ -373,6 +377,7 @@ int parse_options(int argc, char **argv) {
       {"timeout", 't', POPT_ARG_INT, &config.timeout, 't', NULL},
       {"password", 0, POPT_ARG_STRING, &config.password, 0, NULL},
       {"tolerance", 'z', POPT_ARG_INT, &fTolerance, 0, NULL},
+      {"replay", 0, POPT_ARG_STRING, &config.replay_file, 0, NULL},
 #ifdef CONFIG_METADATA
       {"metadata-pipename", 'M', POPT_ARG_STRING, &config.metadata_pipename, 'M', NULL},
       {"get-coverart", 'g', POPT_ARG_NONE, &config.get_coverart, 'g', NULL},
@@ -442,6 +447,16 @@ int parse_options(int argc, char **argv) {
   config.tolerance = 1.0 * fTolerance / 44100;
   config.audio_backend_silent_lead_in_time = -1.0; // flag to indicate it has not been set
   config.airplay_volume = -18.0; // if no volume is ever set, default to initial default value if nothing else comes in first.
+  config.volume_ramp_time = 0.02;
+  config.volume_update_interval = 0.05;
+  config.cmd_timeout = 0.0; // wait for as long as it takes
+  config.dither = DT_high_pass;
+  config.output_idle_timeout = 0.0;
+  config.adaptive_latency_minimum = 0.25;
+  config.adaptive_latency_margin = 0.05;
+  int stage;
+  for (stage = 0; stage < DSP_stage_count; stage++)
+    config.dsp_stage_order[stage] = stage;
   
   config_setting_t *setting;
   const char *str = 0;
@@ -587,6 +602,37 @@ int parse_options(int argc, char **argv) {
       if (config_lookup_float(config.cfg, "general.resync_threshold_in_seconds", &dvalue))
         config.resyncthreshold = dvalue;
 
+      /* Get the optional file to record sessions in. */
+      if (config_lookup_string(config.cfg, "general.capture_file", &str))
+        config.capture_file = (char *)str;
+
+      /* Get the adaptive latency settings. */
+      if (config_lookup_string(config.cfg, "general.adaptive_latency", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.adaptive_latency = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.adaptive_latency = 1;
+        else
+          die("Invalid adaptive_latency option choice \"%s\". It should be \"yes\" or \"no\"",
+              str);
+      }
+
+      if (config_lookup_float(config.cfg, "general.adaptive_latency_minimum_in_seconds", &dvalue)) {
+        if (dvalue < 0.0)
+          die("Invalid value \"%f\" for general.adaptive_latency_minimum_in_seconds. It must not "
+              "be negative.",
+              dvalue);
+        config.adaptive_latency_minimum = dvalue;
+      }
+
+      if (config_lookup_float(config.cfg, "general.adaptive_latency_margin_in_seconds", &dvalue)) {
+        if (dvalue < 0.0)
+          die("Invalid value \"%f\" for general.adaptive_latency_margin_in_seconds. It must not "
+              "be negative.",
+              dvalue);
+        config.adaptive_latency_margin = dvalue;
+      }
+
       /* Get the verbosity setting. */
       if (config_lookup_int(config.cfg, "general.log_verbosity", &value)) {
         if ((value >= 0) && (value <= 3))
@@ -614,10 +660,40 @@ int parse_options(int argc, char **argv) {
         config.volume_max_db_set = 1;
       }
 
+      /* Get the optional volume_ramp_time_in_seconds setting. */
+      if (config_lookup_float(config.cfg, "general.volume_ramp_time_in_seconds", &dvalue)) {
+        if ((dvalue < 0.0) || (dvalue > 1.0))
+          die("Invalid value \"%f\" for general.volume_ramp_time_in_seconds. It should be between 0.0 "
+              "and 1.0 seconds.",
+              dvalue);
+        config.volume_ramp_time = dvalue;
+      }
+
       if (config_lookup_string(config.cfg, "general.run_this_when_volume_is_set", &str)) {
         config.cmd_set_volume = (char *)str;
       }
 
+      if (config_lookup_string(config.cfg, "general.run_this_when_volume_is_set_persistently",
+                               &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.cmd_set_volume_persistent = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.cmd_set_volume_persistent = 1;
+        else
+          die("Invalid run_this_when_volume_is_set_persistently option choice \"%s\". It should be "
+              "\"yes\" or \"no\".",
+              str);
+      }
+
+      /* Get the optional volume_update_interval_in_seconds setting. */
+      if (config_lookup_float(config.cfg, "general.volume_update_interval_in_seconds", &dvalue)) {
+        if ((dvalue < 0.0) || (dvalue > 1.0))
+          die("Invalid value \"%f\" for general.volume_update_interval_in_seconds. It should be "
+              "between 0.0 and 1.0 seconds.",
+              dvalue);
+        config.volume_update_interval = dvalue;
+      }
+
       /* Get the playback_mode setting */
       if (config_lookup_string(config.cfg, "general.playback_mode", &str)) {
         if (strcasecmp(str, "stereo") == 0)
@@ -635,6 +711,25 @@ int parse_options(int argc, char **argv) {
               "\"reverse stereo\", \"both left\", \"both right\"");
       }
 
+      /* Get the dither setting */
+      if (config_lookup_string(config.cfg, "general.dither", &str)) {
+        int type = dither_type_from_name(str);
+        if (type < 0)
+          die("Invalid dither choice \"%s\". It should be \"flat\", \"high_pass\" (default) or "
+              "\"shaped\".",
+              str);
+        config.dither = type;
+      }
+
+      /* Get the optional output_idle_timeout_in_seconds setting. */
+      if (config_lookup_float(config.cfg, "general.output_idle_timeout_in_seconds", &dvalue)) {
+        if (dvalue < 0.0)
+          die("Invalid value \"%f\" for general.output_idle_timeout_in_seconds. It must not be "
+              "negative.",
+              dvalue);
+        config.output_idle_timeout = dvalue;
+      }
+
       /* Get the interface to listen on, if specified Default is all interfaces */
       /* we keep the interface name and the index */
 
@@ -742,6 +837,29 @@ int parse_options(int argc, char **argv) {
         config.metadata_pipename = (char *)str;
       }
 
+      if (config_lookup_string(config.cfg, "metadata.pipe_format", &str)) {
+        if (strcasecmp(str, "xml") == 0)
+          config.metadata_pipe_format = MPF_xml;
+        else if (strcasecmp(str, "binary") == 0)
+          config.metadata_pipe_format = MPF_binary;
+        else
+          die("Invalid metadata pipe_format option choice \"%s\". It should be \"xml\" or "
+              "\"binary\"",
+              str);
+      }
+
+      if (config_lookup_string(config.cfg, "metadata.cover_art_cache_directory", &str)) {
+        config.cover_art_cache_directory = (char *)str;
+      }
+
+      if (config_lookup_int(config.cfg, "metadata.cover_art_cache_size", &value)) {
+        if (value < 0)
+          die("Invalid metadata cover_art_cache_size option choice \"%d\". It should be 0 or a "
+              "positive number of megabytes",
+              value);
+        config.cover_art_cache_size = (size_t)value * 1024 * 1024;
+      }
+
       if (config_lookup_string(config.cfg, "metadata.socket_address", &str)) {
         config.metadata_sockaddr = (char *)str;
       }
@@ -773,6 +891,16 @@ int parse_options(int argc, char **argv) {
               "\"yes\" or \"no\"");
       }
 
+      /* Get the optional wait_for_completion_timeout_in_seconds setting. */
+      if (config_lookup_float(config.cfg, "sessioncontrol.wait_for_completion_timeout_in_seconds",
+                              &dvalue)) {
+        if (dvalue < 0.0)
+          die("Invalid value \"%f\" for sessioncontrol.wait_for_completion_timeout_in_seconds. It "
+              "must not be negative.",
+              dvalue);
+        config.cmd_timeout = dvalue;
+      }
+
       if (config_lookup_string(config.cfg, "sessioncontrol.before_play_begins_returns_output",
                                &str)) {
         if (strcasecmp(str, "no") == 0)
@@ -828,11 +956,35 @@ int parse_options(int argc, char **argv) {
           die("dsp.convolution_max_length must be within 1 and 200000");
       }
 
-      if (config_lookup_string(config.cfg, "dsp.convolution_ir_file", &str)) {
-        config.convolution_ir_file = str;
-        convolver_init(config.convolution_ir_file, config.convolution_max_length);
+      if (config_lookup_string(config.cfg, "dsp.convolution_engine", &str)) {
+        if (strcasecmp(str, "auto") == 0)
+          config.convolution_engine = CE_auto;
+        else if (strcasecmp(str, "uniform") == 0)
+          config.convolution_engine = CE_uniform;
+        else if (strcasecmp(str, "two_stage") == 0)
+          config.convolution_engine = CE_two_stage;
+        else
+          die("Invalid dsp.convolution_engine \"%s\". It should be \"auto\", \"uniform\" or "
+              "\"two_stage\"",
+              str);
+      }
+
+      if (config_lookup_string(config.cfg, "dsp.convolution_parallel", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.convolution_parallel = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.convolution_parallel = 1;
+        else
+          die("Invalid dsp.convolution_parallel. It should be \"yes\" or \"no\"");
       }
 
+      if (config_lookup_string(config.cfg, "dsp.convolution_cache_directory", &str))
+        config.convolution_cache_directory = str;
+
+      // the impulse response is loaded once the output rate is known
+      if (config_lookup_string(config.cfg, "dsp.convolution_ir_file", &str))
+        config.convolution_ir_file = str;
+
       if (config.convolution && config.convolution_ir_file == NULL) {
         die("Convolution enabled but no convolution_ir_file provided");
       }
@@ -856,6 +1008,66 @@ int parse_options(int argc, char **argv) {
               dvalue);
       }
 
+      setting = config_lookup(config.cfg, "dsp.stage_order");
+      if (setting) {
+        // the stages named are put first, in the order given, followed by any others in their
+        // default order
+        int used[DSP_stage_count] = {0};
+        int count = config_setting_length(setting);
+        int i, j, n = 0;
+        for (i = 0; i < count; i++) {
+          const char *name = config_setting_get_string_elem(setting, i);
+          int stage = name ? dsp_stage_from_name(name) : -1;
+          if (stage < 0)
+            die("Invalid stage \"%s\" in dsp.stage_order. It should be \"mode\", "
+                "\"convolution\", \"parametric_eq\", \"volume\", \"loudness\" or "
+                "\"drift_correction\".",
+                name ? name : "");
+          if (used[stage])
+            die("The stage \"%s\" appears more than once in dsp.stage_order.", name);
+          used[stage] = 1;
+          config.dsp_stage_order[n++] = stage;
+        }
+        for (j = 0; j < DSP_stage_count; j++)
+          if (used[j] == 0)
+            config.dsp_stage_order[n++] = j;
+      }
+
+      setting = config_lookup(config.cfg, "dsp.parametric_eq");
+      if (setting) {
+        int count = config_setting_length(setting);
+        if (count > BIQUAD_MAX_SECTIONS)
+          die("Invalid dsp.parametric_eq. It can have at most %d sections.", BIQUAD_MAX_SECTIONS);
+        int i;
+        for (i = 0; i < count; i++) {
+          config_setting_t *section_setting = config_setting_get_elem(setting, i);
+          parametric_eq_section *section = &config.parametric_eq[i];
+          if (config_setting_lookup_string(section_setting, "type", &str) == 0)
+            die("Section %d of dsp.parametric_eq has no type.", i + 1);
+          section->type = biquad_type_from_name(str);
+          if ((int)section->type < 0)
+            die("Invalid type \"%s\" in section %d of dsp.parametric_eq. It should be \"peaking\", "
+                "\"low_shelf\", \"high_shelf\", \"low_pass\" or \"high_pass\".",
+                str, i + 1);
+          if ((config_setting_lookup_float(section_setting, "frequency", &section->frequency) == 0) ||
+              (section->frequency < 10.0) || (section->frequency > 22000.0))
+            die("Section %d of dsp.parametric_eq needs a frequency between 10 and 22000 Hz.", i + 1);
+          section->q = 0.707;
+          if ((config_setting_lookup_float(section_setting, "q", &section->q)) &&
+              ((section->q < 0.1) || (section->q > 20.0)))
+            die("Invalid q \"%f\" in section %d of dsp.parametric_eq. It should be between 0.1 and "
+                "20.",
+                section->q, i + 1);
+          section->gain_db = 0.0;
+          if ((config_setting_lookup_float(section_setting, "gain", &section->gain_db)) &&
+              ((section->gain_db < -30.0) || (section->gain_db > 20.0)))
+            die("Invalid gain \"%f\" in section %d of dsp.parametric_eq. It should be between -30 "
+                "and +20 dB.",
+                section->gain_db, i + 1);
+        }
+        config.parametric_eq_section_count = count;
+      }
+
       if (config.loudness == 1 && config_lookup_string(config.cfg, "alsa.mixer_control_name", &str))
         die("Loudness activated but hardware volume is active. You must remove "
             "\"alsa.mixer_control_name\" to use the loudness filter.");
@@ -1156,6 +1368,9 @@ int main(int argc, char **argv) {
   config.udp_port_range = 100;
   config.output_format = SPS_FORMAT_S16; // default
   config.output_rate = 44100;            // default
+#ifdef CONFIG_METADATA
+  config.cover_art_cache_size = 16 * 1024 * 1024; // 16 MB
+#endif
   config.decoders_supported =
       1 << decoder_hammerton; // David Hammerton's decoder supported by default
 #ifdef HAVE_APPLE_ALAC
@@ -1166,10 +1381,6 @@ int main(int argc, char **argv) {
 
   r64init(0);
 
-  // initialise the randomw number array
-
-  r64arrayinit();
-
   /* Check if we are called with -V or --version parameter */
   if (argc >= 2 && ((strcmp(argv[1], "-V") == 0) || (strcmp(argv[1], "--version") == 0))) {
     print_version();
@@ -1253,6 +1464,10 @@ int main(int argc, char **argv) {
     return ret < 0 ? 1 : 0;
   }
 
+  /* Replay a recorded session, if asked to, and exit. */
+  if (config.replay_file)
+    return capture_replay(config.replay_file) == 0 ? 0 : 1;
+
   /* If we are going to daemonise, check that the daemon is not running already.*/
   if ((config.daemonise) && ((pid = daemon_pid_file_is_running()) >= 0)) {
     daemon_log(LOG_ERR, "Daemon already running on PID file %u", pid);
@@ -1354,6 +1569,13 @@ int main(int argc, char **argv) {
   }
   config.output->init(argc - audio_arg, argv + audio_arg);
 
+#ifdef CONFIG_CONVOLUTION
+  if (config.convolution_ir_file)
+    convolver_init(config.convolution_ir_file, config.output_rate, config.convolution_max_length,
+                   config.convolution_engine, config.convolution_gain, config.convolution_parallel,
+                   config.convolution_cache_directory);
+#endif
+
   // daemon_log(LOG_NOTICE, "startup");
 
   switch (endianness) {
@@ -1447,6 +1669,7 @@ int main(int argc, char **argv) {
   debug(1, "on-start action is \"%s\".", config.cmd_start);
   debug(1, "on-stop action is \"%s\".", config.cmd_stop);
   debug(1, "wait-cmd status is %d.", config.cmd_blocking);
+  debug(1, "wait_for_completion_timeout_in_seconds is %f.", config.cmd_timeout);
   debug(1, "on-start returns output is %d.", config.cmd_start_returns_output);
   debug(1, "mdns backend \"%s\".", config.mdns_name);
   debug(2, "userSuppliedLatency is %d.", config.userSuppliedLatency);
@@ -1464,8 +1687,17 @@ int main(int argc, char **argv) {
     debug(1, "volume_max_db is %d.", config.volume_max_db);
   else
     debug(1, "volume_max_db is not set");
+  debug(1, "volume_ramp_time_in_seconds is %f.", config.volume_ramp_time);
+  debug(1, "volume_update_interval_in_seconds is %f.", config.volume_update_interval);
+  debug(1, "run_this_when_volume_is_set_persistently is %d.", config.cmd_set_volume_persistent);
   debug(1, "playback_mode is %d (0-stereo, 1-mono, 1-reverse_stereo, 2-both_left, 3-both_right).",
         config.playback_mode);
+  debug(1, "dither is %d (0-flat, 1-high_pass, 2-shaped).", config.dither);
+  debug(1, "output_idle_timeout_in_seconds is %f.", config.output_idle_timeout);
+  debug(1, "adaptive_latency is %d.", config.adaptive_latency);
+  debug(1, "capture_file is \"%s\".", config.capture_file ? config.capture_file : "");
+  debug(1, "adaptive_latency_minimum_in_seconds is %f.", config.adaptive_latency_minimum);
+  debug(1, "adaptive_latency_margin_in_seconds is %f.", config.adaptive_latency_margin);
   debug(1, "disable_synchronization is %d.", config.no_sync);
   debug(1, "use_mmap_if_available is %d.", config.no_mmap ? 0 : 1);
   debug(1, "output_rate is %d.", config.output_rate);
@@ -1498,6 +1730,10 @@ int main(int argc, char **argv) {
 #ifdef CONFIG_METADATA
   debug(1, "metadata enabled is %d.", config.metadata_enabled);
   debug(1, "metadata pipename is \"%s\".", config.metadata_pipename);
+  debug(1, "metadata pipe format is %s.",
+        config.metadata_pipe_format == MPF_binary ? "binary" : "xml");
+  debug(1, "cover art cache directory is \"%s\".", config.cover_art_cache_directory);
+  debug(1, "cover art cache size is %zu bytes.", config.cover_art_cache_size);
   debug(1, "metadata socket address is \"%s\" port %d.", config.metadata_sockaddr,
         config.metadata_sockport);
   debug(1, "metadata socket packet size is \"%d\".", config.metadata_sockmsglength);
@@ -1509,9 +1745,19 @@ int main(int argc, char **argv) {
   debug(1, "convolution IR file is \"%s\"", config.convolution_ir_file);
   debug(1, "convolution max length %d", config.convolution_max_length);
   debug(1, "convolution gain is %f", config.convolution_gain);
+  debug(1, "convolution engine is %s",
+        config.convolution_engine == CE_uniform
+            ? "uniform"
+            : config.convolution_engine == CE_two_stage ? "two_stage" : "auto");
+  debug(1, "convolution parallel is %d", config.convolution_parallel);
+  debug(1, "convolution cache directory is \"%s\"", config.convolution_cache_directory);
 #endif
   debug(1, "loudness is %d.", config.loudness);
   debug(1, "loudness reference level is %f", config.loudness_reference_volume_db);
+  debug(1, "parametric equaliser has %d section(s)", config.parametric_eq_section_count);
+  int stage;
+  for (stage = 0; stage < DSP_stage_count; stage++)
+    debug(1, "DSP stage %d is \"%s\"", stage + 1, dsp_stage_name(config.dsp_stage_order[stage]));
 
   uint8_t ap_md5[16];
 
@@ -1536,6 +1782,7 @@ int main(int argc, char **argv) {
   md5_finish(&tctx, ap_md5);
 #endif
   memcpy(config.hw_addr, ap_md5, sizeof(config.hw_addr));
+  rsa_load_key(); // once, rather than for each session
 #ifdef CONFIG_METADATA
   metadata_init(); // create the metadata pipe if necessary
 #endif